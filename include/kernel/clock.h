@@ -0,0 +1,26 @@
+#ifndef KERNEL_CLOCK_H
+#define KERNEL_CLOCK_H
+
+#include "../libc/stdint.h"
+
+/*
+ * Monotonic nanosecond clock read from the TSC.  The TSC rate is
+ * measured once at boot against PIT channel 2, which can be polled
+ * without an interrupt; without a rate clock_now_ns() counts whole ticks.
+ */
+
+/* Calibrate the TSC; called from timer_init() */
+void clock_init(void);
+int clock_ready(void);
+
+/* Nanoseconds since clock_init() */
+uint64_t clock_now_ns(void);
+uint32_t clock_tsc_khz(void);
+
+/* Busy-wait 'us' microseconds (at most 50000) on PIT channel 2, for calibrations */
+void clock_pit_wait(uint32_t us);
+
+/* 64-by-32-bit division without libgcc; for setup paths, not hot ones */
+uint64_t clock_div64(uint64_t dividend, uint32_t divisor);
+
+#endif
@@ -0,0 +1,75 @@
+#ifndef KERNEL_CLOCKEVENT_H
+#define KERNEL_CLOCKEVENT_H
+
+#include "../libc/stdint.h"
+
+/*
+ * Clock event devices: per-CPU timer interrupt sources.
+ *
+ * Each CPU uses the best-rated device registered on it.  A periodic
+ * device (the PIT) just delivers TIMER_HZ ticks.  A one-shot device (the
+ * local APIC timer) is programmed for each next event instead: the next
+ * tick while the CPU has work, or, once it idles with nothing due, the
+ * earliest pending timer, so an idle CPU is not woken every tick
+ * (tickless idle).  The BSP also runs hrtimers from its interrupt and
+ * keeps timer_get_ticks() in step with the TSC clock.
+ */
+
+#define CLOCK_EVT_FEAT_PERIODIC 0x01
+#define CLOCK_EVT_FEAT_ONESHOT  0x02
+
+#define CLOCK_EVT_MODE_SHUTDOWN 0
+#define CLOCK_EVT_MODE_PERIODIC 1
+#define CLOCK_EVT_MODE_ONESHOT  2
+
+/* Longest a CPU with the tick stopped sleeps without an event */
+#define CLOCKEVENT_NOHZ_MAX_NS 1000000000ULL
+
+struct clock_event_device {
+    const char *name;
+    int rating;                     /* Higher is preferred */
+    uint32_t features;              /* CLOCK_EVT_FEAT_* */
+    uint64_t min_delta_ns;
+    uint64_t max_delta_ns;
+
+    /* Operate on the calling CPU's instance of the device */
+    void (*set_next_event)(uint64_t delta_ns);
+    void (*set_periodic)(void);
+    void (*shutdown)(void);
+};
+
+struct clockevent_cpu_stats {
+    const char *device;             /* NULL if the CPU has none */
+    int mode;                       /* CLOCK_EVT_MODE_* */
+    int tick_stopped;
+    uint32_t events;                /* Interrupts taken */
+    uint32_t idle_entries;
+    uint32_t nohz_entries;          /* Idle entries that stopped the tick */
+};
+
+/* Offer a device to the calling CPU; kept if it outrates the current one */
+int clockevent_register(struct clock_event_device *dev);
+
+/* Interrupt from the calling CPU's device */
+void clockevent_interrupt(void);
+
+/* Reprogram the calling CPU's next event; also the kick IPI's handler */
+void clockevent_reprogram(void);
+
+/* Bracket a halt in the idle loop; interrupts off */
+void clockevent_idle_enter(void);
+void clockevent_idle_exit(void);
+
+/* Whether the calling CPU has a device to wake it from hlt */
+int clockevent_can_halt(void);
+
+/* An hrtimer was armed; make sure the BSP's next event is not too late */
+void clockevent_timers_changed(void);
+
+/* Stop the tick on idle CPUs (the default) or keep it running */
+void clockevent_set_nohz(int enabled);
+int clockevent_nohz_enabled(void);
+
+int clockevent_get_stats(int cpu, struct clockevent_cpu_stats *stats);
+
+#endif
@@ -39,10 +39,17 @@ typedef struct {
     uint32_t sg_list_id;            /* Unique SG list ID */
     dma_sg_entry_t *entries;        /* Array of SG entries */
     int entry_count;                /* Number of entries */
+    int capacity;                   /* Allocated entries; grows on demand */
     uint32_t total_length;          /* Total DMA length */
     uint32_t device_id;             /* Associated device ID */
 } dma_sg_list_t;
 
+/* Device limits applied when building SG lists */
+typedef struct {
+    uint32_t max_segment_size;      /* Largest single entry, 0 = unlimited */
+    uint32_t segment_boundary;      /* Power of two; no entry crosses it, 0 = none */
+} dma_sg_limits_t;
+
 /* DMA statistics */
 typedef struct {
     uint32_t total_buffers_allocated;
@@ -51,8 +58,41 @@ typedef struct {
     uint32_t bytes_dma_allocated;
     uint32_t coherent_allocations;
     uint32_t non_coherent_allocations;
+    
+    /* Totals over all DMA pools */
+    uint32_t pools_active;
+    uint32_t pool_allocs;
+    uint32_t pool_frees;
+    uint32_t pool_failures;
+    uint32_t pool_chunks;           /* Contiguous pmem chunks backing pools */
+    uint32_t pool_bytes_reserved;   /* Bytes of pmem held by pools */
+    
+    /* dma_sg_map: pages walked vs. segments produced after merging */
+    uint32_t sg_map_requests;
+    uint32_t sg_map_pages;
+    uint32_t sg_map_segments;
+    uint32_t sg_segments_per_request_x100;
 } dma_stats_t;
 
+/* DMA pool: fixed-size, aligned blocks that never cross 'boundary' */
+#define DMA_MAX_POOLS 16
+
+typedef struct dma_pool dma_pool_t;
+
+/* Per-pool statistics */
+typedef struct {
+    const char *name;
+    uint32_t block_size;
+    uint32_t align;
+    uint32_t boundary;
+    uint32_t chunks;
+    uint32_t blocks_total;
+    uint32_t blocks_in_use;
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t failures;
+} dma_pool_stats_t;
+
 /* DMA API */
 void dma_init(void);
 
@@ -74,6 +114,19 @@ int dma_sg_free(uint32_t sg_list_id);
 int dma_sg_add_entry(uint32_t sg_list_id, uint32_t phys_addr, uint32_t length);
 dma_sg_list_t *dma_sg_get(uint32_t sg_list_id);
 
+/* Build an SG list for a kernel buffer, merging physically adjacent
+   pages and splitting at the device limits (limits may be NULL) */
+dma_sg_list_t *dma_sg_map(const void *buffer, uint32_t length, const dma_sg_limits_t *limits,
+                          uint32_t device_id);
+
+/* DMA pools.  align and boundary must be powers of two (0 = none);
+   dma_pool_alloc returns the kernel address and stores the bus address. */
+dma_pool_t *dma_pool_create(const char *name, uint32_t size, uint32_t align, uint32_t boundary);
+int dma_pool_destroy(dma_pool_t *pool);
+void *dma_pool_alloc(dma_pool_t *pool, uint32_t *phys_addr);
+void dma_pool_free(dma_pool_t *pool, void *vaddr);
+int dma_pool_get_stats(int index, dma_pool_stats_t *out);
+
 /* Statistics and diagnostics */
 dma_stats_t *dma_get_stats(void);
 
@@ -8,14 +8,36 @@
 #define FUTEX_REQUEUE   2
 #define FUTEX_CMP_REQUEUE 3
 
+/*
+ * Flags for every operation.  Private futexes are matched by address
+ * within the caller's address space; shared ones (in shared memory) by
+ * physical address, so tasks mapping the page anywhere meet.
+ */
+#define FUTEX_PRIVATE   0x00
+#define FUTEX_SHARED    0x80
+
 /* Futex operation result codes */
 #define FUTEX_OK        0
 #define FUTEX_TIMEOUT   -1
 #define FUTEX_INVAL     -2
+#define FUTEX_AGAIN     -3          /* Value already differed from expected */
+
+struct futex_stats {
+    uint32_t waits;                 /* Waiters that blocked */
+    uint32_t wakeups;               /* Waiters woken by futex_wake/requeue */
+    uint32_t requeued;
+    uint32_t timeouts;
+    uint32_t value_changed;         /* futex_wait returned FUTEX_AGAIN */
+};
+
+/* Futex syscall - atomic wait/wake on userspace address; timeout_us 0 waits forever */
+int futex_wait(uint32_t *futex_addr, uint32_t expected_val, uint32_t timeout_us, uint32_t flags);
+int futex_wake(uint32_t *futex_addr, uint32_t num_waiters, uint32_t flags);
+
+/* Wake num_wake waiters on addr1 and move up to num_requeue more to addr2 */
+int futex_requeue(uint32_t *futex_addr1, uint32_t *futex_addr2, uint32_t num_wake,
+                  uint32_t num_requeue, uint32_t flags);
 
-/* Futex syscall - atomic wait/wake on userspace address */
-int futex_wait(uint32_t *futex_addr, uint32_t expected_val, uint32_t timeout_ms);
-int futex_wake(uint32_t *futex_addr, uint32_t num_waiters);
-int futex_requeue(uint32_t *futex_addr1, uint32_t *futex_addr2, uint32_t num_wake, uint32_t num_requeue);
+void futex_get_stats(struct futex_stats *stats);
 
 #endif /* KERNEL_FUTEX_H */
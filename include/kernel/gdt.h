@@ -39,6 +39,9 @@ struct gdt_ptr {
 /* Initialize GDT and load it into CPU */
 void gdt_init(void);
 
+/* Load the already-built GDT on another CPU */
+void gdt_reload(void);
+
 /* Load GDT into CPU (in assembly) */
 extern void gdt_load(struct gdt_ptr *ptr);
 
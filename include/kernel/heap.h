@@ -3,8 +3,22 @@
 
 #include "../libc/stdint.h"
 
+/* Kernel heap statistics (bytes unless noted) */
+typedef struct {
+    uint32_t heap_size;             /* Bytes in all heap pools */
+    uint32_t live_bytes;            /* Payload bytes currently allocated */
+    uint32_t free_bytes;
+    uint32_t free_blocks;
+    uint32_t largest_free;
+    uint32_t fragmentation_pct;     /* 100 - largest_free * 100 / free_bytes */
+    uint32_t pools;                 /* Initial pool plus grown pools */
+    uint32_t allocs;
+    uint32_t frees;
+} heap_stats_t;
+
 void heap_init(void);
 void *kmalloc(uint32_t size);
 void kfree(void *ptr);
+void heap_get_stats(heap_stats_t *stats);
 
 #endif
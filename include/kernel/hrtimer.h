@@ -0,0 +1,49 @@
+#ifndef KERNEL_HRTIMER_H
+#define KERNEL_HRTIMER_H
+
+#include "../libc/stdint.h"
+
+/*
+ * High-resolution timers on the nanosecond clock.  Each armed timer
+ * programs the BSP's clock event device for its own expiry, so it fires
+ * within the device's resolution rather than on the next 10 ms tick.
+ * Pending timers are kept sorted; there are only ever a few (one per
+ * thread or task waiting with a timeout).
+ */
+struct hrtimer {
+    struct hrtimer *next;
+    uint64_t expires;               /* Absolute clock_now_ns() */
+    void (*fn)(void *arg);
+    void *arg;
+    int pending;
+};
+
+struct hrtimer_stats {
+    uint32_t armed;
+    uint32_t fired;
+    uint32_t cancelled;
+    uint32_t pending;
+    uint64_t late_ns;               /* Sum of (fire time - expiry) */
+    uint32_t max_late_ns;
+};
+
+void hrtimer_init(struct hrtimer *timer, void (*fn)(void *), void *arg);
+
+/* Arm or re-arm a timer; fn runs from the clock event interrupt on the BSP */
+void hrtimer_start(struct hrtimer *timer, uint64_t expires);
+
+/*
+ * Disarm a timer, waiting for its callback if it is running on another
+ * CPU.  Returns 1 if it was still pending.  Not callable from the
+ * timer's own callback.
+ */
+int hrtimer_cancel(struct hrtimer *timer);
+
+/* Earliest pending expiry; -1 if nothing is armed */
+int hrtimer_next_expiry(uint64_t *expires);
+
+/* Run every timer due by 'now'; called from the BSP's clock event handler */
+void hrtimer_run(uint64_t now);
+void hrtimer_get_stats(struct hrtimer_stats *stats);
+
+#endif
@@ -53,6 +53,9 @@ struct idt_ptr {
 /* Initialize IDT and load it */
 void idt_init(void);
 
+/* Load the already-built IDT on another CPU */
+void idt_reload(void);
+
 /* Load IDT into CPU (in assembly) */
 extern void idt_load(struct idt_ptr *ptr);
 
@@ -0,0 +1,36 @@
+#ifndef KERNEL_IOAPIC_H
+#define KERNEL_IOAPIC_H
+
+#include "../libc/stdint.h"
+
+/*
+ * I/O APIC.  There are no ACPI tables to read, so the chip is probed at
+ * its architectural address.  Pins 0-15 carry the ISA IRQs, which stay
+ * on the 8259 PIC, and are left masked; ioapic_route_gsi() gives a pin
+ * above them (PCI INTx on most chipsets) its own irq_mgr line.
+ */
+#define IOAPIC_DEFAULT_BASE 0xFEC00000
+
+/* Register indices, through IOREGSEL/IOWIN */
+#define IOAPIC_REG_ID       0x00
+#define IOAPIC_REG_VERSION  0x01
+#define IOAPIC_REG_REDTBL   0x10    /* Two registers per pin */
+
+/* Redirection entry, low word */
+#define IOAPIC_RTE_ACTIVE_LOW 0x00002000
+#define IOAPIC_RTE_LEVEL      0x00008000
+#define IOAPIC_RTE_MASKED     0x00010000
+
+/* Probe and mask every pin; -1 without a local APIC or I/O APIC */
+int ioapic_init(void);
+int ioapic_available(void);
+int ioapic_pin_count(void);
+
+/*
+ * Route pin 'gsi' to a new irq_mgr line delivered to the BSP, masked
+ * until a handler is registered.  PCI INTx is level-triggered, active
+ * low.  Returns the line, or -1.
+ */
+int ioapic_route_gsi(uint32_t gsi, int level, int active_low);
+
+#endif
@@ -7,8 +7,9 @@
    register INT 0x80 for syscalls, then enable hardware interrupts (sti). */
 void irq_init(void);
 
-/* Called from the IRQ common assembly stub with the IRQ line number (0-15).
-   Dispatches to the correct C handler, then sends PIC EOI. */
+/* Called from the IRQ common assembly stub with the IRQ line number (0-63)
+   or a local APIC vector.  Dispatches to the correct C handler, then sends
+   EOI through the line's irq_chip or to the APIC. */
 void irq_dispatch(uint32_t irq_num);
 
 #endif /* KERNEL_IRQ_H */
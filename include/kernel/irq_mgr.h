@@ -6,6 +6,29 @@
 /* Maximum handlers per IRQ */
 #define MAX_HANDLERS_PER_IRQ 4
 
+/*
+ * Interrupt lines.  Line n arrives on IDT vector IRQ_VECTOR_BASE + n.
+ * Lines 0-15 are the legacy ISA IRQs on the 8259 PIC; the rest are
+ * handed out by irq_alloc_line() to IOAPIC pins and MSI/MSI-X vectors,
+ * so a device can have a line per queue instead of sharing one.
+ */
+#define IRQ_VECTOR_BASE  32
+#define IRQ_LEGACY_LINES 16
+#define IRQ_MAX_LINES    64     /* Vectors 32-95 */
+
+/*
+ * Interrupt controller operations for a line, called with the line's
+ * number.  eoi runs after the handlers; set_affinity retargets the line
+ * at a local APIC and may be NULL where delivery is fixed (the PIC).
+ */
+struct irq_chip {
+    const char *name;
+    void (*mask)(uint32_t irq);
+    void (*unmask)(uint32_t irq);
+    void (*eoi)(uint32_t irq);
+    int (*set_affinity)(uint32_t irq, uint32_t apic_id);
+};
+
 /* IRQ handler function type */
 typedef int (*irq_handler_t)(uint32_t irq, void *dev_data);
 
@@ -24,15 +47,36 @@ typedef struct {
     uint32_t device_id;
     irq_priority_t priority;
     int active;
+    uint32_t max_cycles;        /* Longest call */
+    uint32_t over_budget;       /* Calls longer than the handler budget */
 } irq_handler_entry_t;
 
-/* IRQ statistics */
+#define IRQ_HIST_BUCKETS 32     /* Bucket n counts [2^n, 2^(n+1)) cycles */
+
+/* Default handler budget, see irq_set_budget_us() */
+#define IRQ_BUDGET_US 50
+
+/*
+ * IRQ statistics.  Each interrupt is stamped with the TSC as
+ * irq_dispatch() enters, around every handler call and at EOI.  Entry
+ * latency is entry to handler start, so it includes any handler ahead
+ * on a shared line; the entry-to-EOI time is how long the line stays
+ * blocked.
+ */
 typedef struct {
     uint32_t irq_num;
     uint32_t total_interrupts;
     uint32_t handled_count;
     uint32_t missed_count;
     uint32_t handler_count;
+    uint64_t run_cycles;        /* TSC cycles spent in hard-IRQ handlers */
+    uint32_t max_cycles;        /* Longest single interrupt */
+    uint32_t max_latency;
+    uint64_t eoi_cycles;        /* Entry to EOI, summed */
+    uint32_t max_eoi_cycles;
+    uint32_t over_budget;       /* Handler calls over the budget */
+    uint32_t latency_hist[IRQ_HIST_BUCKETS];
+    uint32_t duration_hist[IRQ_HIST_BUCKETS];   /* Per handler call */
 } irq_stats_t;
 
 /* IRQ management API */
@@ -51,8 +95,105 @@ irq_handler_t irq_get_handler(uint32_t irq, uint32_t device_id);
 int irq_enable(uint32_t irq);
 int irq_disable(uint32_t irq);
 
+/* Claim a free line above the legacy ones for 'chip'; -1 when all are taken */
+int irq_alloc_line(const struct irq_chip *chip, void *chip_data);
+void irq_free_line(uint32_t irq);
+void *irq_get_chip_data(uint32_t irq);
+const char *irq_get_chip_name(uint32_t irq);
+
+/* Acknowledge the line's controller; called by irq_dispatch() */
+void irq_eoi(uint32_t irq);
+
+/* Deliver the line to a CPU; -1 if its controller cannot steer it */
+int irq_set_affinity(uint32_t irq, int cpu);
+int irq_get_affinity(uint32_t irq);
+
 /* Statistics */
 irq_stats_t *irq_get_stats(uint32_t irq);
 int irq_get_handler_count(uint32_t irq);
 
+/* Count an interrupt irq_dispatch() handled itself, run from 'start' to 'end' (TSC) */
+void irq_account(uint32_t irq, uint64_t start, uint64_t end);
+
+/* Stamp the EOI of the interrupt being handled on this CPU */
+void irq_account_eoi(uint32_t irq);
+
+/* Handler calls longer than this are counted and reported once per handler */
+int irq_set_budget_us(uint32_t us);
+uint32_t irq_get_budget_us(void);
+
+/*
+ * Bottom halves.  A hard-IRQ handler does the minimum, then raises a
+ * softirq vector for the rest.  Raised vectors are pending per CPU and
+ * run when the outermost interrupt exits, with interrupts enabled, in
+ * vector order.  If they keep re-raising past SOFTIRQ_MAX_RESTART rounds
+ * or SOFTIRQ_BUDGET_MS, the remainder goes to that CPU's ksoftirqd
+ * thread so interrupt exit stays short.  Handlers must not sleep.
+ */
+enum {
+    SOFTIRQ_NET_RX = 0,
+    SOFTIRQ_BLOCK,              /* Block I/O completion */
+    SOFTIRQ_TASKLET,
+    SOFTIRQ_SCHED,              /* Scheduler tick */
+    NR_SOFTIRQS
+};
+
+#define SOFTIRQ_MAX_RESTART 10
+#define SOFTIRQ_BUDGET_MS   2
+
+typedef void (*softirq_action_t)(void);
+
+typedef struct {
+    uint32_t raised;
+    uint32_t runs;
+    uint64_t run_cycles;
+    uint32_t max_cycles;
+} softirq_stats_t;
+
+typedef struct {
+    uint32_t pending;           /* Vector bitmap */
+    uint32_t deferrals;         /* Rounds handed to ksoftirqd */
+    uint32_t ksoftirqd_runs;
+    int ksoftirqd_id;           /* Thread id, 0 if not started */
+} softirq_cpu_stats_t;
+
+/* Start each online CPU's ksoftirqd; vectors work before this, unbudgeted */
+void softirq_init(void);
+int softirq_register(int nr, softirq_action_t action);
+
+/* Mark a vector pending on the calling CPU */
+void softirq_raise(int nr);
+
+/* Bracket hard-IRQ handling; irq_enter() stamps the entry, irq_exit() runs pending softirqs */
+void irq_enter(void);
+void irq_exit(void);
+
+/* In a hard IRQ or a softirq handler on this CPU */
+int irq_in_interrupt(void);
+
+/* Vector stats are summed over CPUs */
+int softirq_get_stats(int nr, softirq_stats_t *stats);
+int softirq_get_cpu_stats(int cpu, softirq_cpu_stats_t *stats);
+
+/*
+ * Tasklets: deferred functions on SOFTIRQ_TASKLET.  A tasklet runs on
+ * the CPU that scheduled it, never on two CPUs at once, and once per
+ * schedule however often it was scheduled before it ran.
+ */
+#define TASKLET_STATE_SCHED 0x1
+#define TASKLET_STATE_RUN   0x2
+
+struct tasklet {
+    struct tasklet *next;
+    void (*fn)(void *arg);
+    void *arg;
+    volatile uint32_t state;    /* TASKLET_STATE_* */
+};
+
+void tasklet_init(struct tasklet *t, void (*fn)(void *), void *arg);
+void tasklet_schedule(struct tasklet *t);
+
+/* Wait until a tasklet is neither pending nor running; not from softirq */
+void tasklet_kill(struct tasklet *t);
+
 #endif /* KERNEL_IRQ_MGR_H */
@@ -18,6 +18,20 @@ struct multiboot_info {
     uint32_t mmap_addr;
 };
 
+/* multiboot_info.flags bits */
+#define MULTIBOOT_INFO_MEMORY  0x001
+#define MULTIBOOT_INFO_MEM_MAP 0x040
+
+/* Memory map entry; 'size' does not count itself */
+struct multiboot_mmap_entry {
+    uint32_t size;
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+} __attribute__((packed));
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
 /* Early kernel initialization */
 void kernel_main(struct multiboot_info *mbi, uint32_t magic);
 
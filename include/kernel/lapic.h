@@ -0,0 +1,57 @@
+#ifndef KERNEL_LAPIC_H
+#define KERNEL_LAPIC_H
+
+#include "../libc/stdint.h"
+
+/* Local APIC register offsets */
+#define LAPIC_ID        0x020
+#define LAPIC_VERSION   0x030
+#define LAPIC_TPR       0x080
+#define LAPIC_EOI       0x0B0
+#define LAPIC_SVR       0x0F0
+#define LAPIC_ESR       0x280
+#define LAPIC_ICR_LOW   0x300
+#define LAPIC_ICR_HIGH  0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SPURIOUS_VECTOR 0xFF
+#define LAPIC_TIMER_VECTOR    0xEF
+#define LAPIC_KICK_VECTOR     0xEE  /* IPI: reprogram the timer, end a halt */
+
+#define LAPIC_LVT_MASKED 0x00010000
+
+/* ICR fields */
+#define LAPIC_ICR_INIT          0x00000500
+#define LAPIC_ICR_STARTUP       0x00000600
+#define LAPIC_ICR_PENDING       0x00001000
+#define LAPIC_ICR_ASSERT        0x00004000
+#define LAPIC_ICR_LEVEL         0x00008000
+#define LAPIC_ICR_ALL_BUT_SELF  0x000C0000
+
+/* Detect and enable the local APIC of the calling CPU; -1 if absent */
+int lapic_init(void);
+/* Enable an AP's local APIC (after lapic_init has run on the BSP) */
+void lapic_enable(void);
+int lapic_available(void);
+
+uint32_t lapic_id(void);
+void lapic_eoi(void);
+uint32_t lapic_read(uint32_t reg);
+void lapic_write(uint32_t reg, uint32_t value);
+
+/* Send an interprocessor interrupt; icr_low holds mode and vector */
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low);
+
+/*
+ * Calibrate (on the BSP) and register the calling CPU's APIC timer as
+ * its one-shot clock event device.  -1 without an APIC or TSC clock.
+ */
+int lapic_timer_init(void);
+
+/* Busy-wait using the PIT-independent port 0x80 delay (~1 us each) */
+void lapic_udelay(uint32_t us);
+
+#endif
@@ -2,6 +2,7 @@
 #define KERNEL_NETDEV_H
 
 #include "../libc/stdint.h"
+#include "sync.h"
 
 #define MAX_NETDEVS 4
 #define MTU 1500
@@ -43,6 +44,7 @@ struct netdev {
     ipv4_addr_t ip_addr;
     ipv4_addr_t gateway;
     ipv4_addr_t netmask;
+    seqlock_t addr_lock;    /* ip_addr, gateway and netmask change together */
     uint32_t mtu;
     uint32_t flags;  /* IFF_UP, IFF_LOOPBACK, etc */
     struct netdev_ops *ops;
@@ -54,14 +56,27 @@ struct netdev {
 #define IFF_LOOPBACK  0x02
 #define IFF_RUNNING   0x04
 
-/* Register/unregister network devices */
+/* Initialize the device layer and its object caches */
+void netdev_init(void);
+
+/* Allocate/free a zeroed device structure */
+struct netdev *netdev_alloc(void);
+void netdev_free(struct netdev *dev);
+
+/* Register/unregister network devices; a device may be freed once unregister returns */
 int netdev_register(struct netdev *dev);
 void netdev_unregister(struct netdev *dev);
 
-/* Get device by ID or name */
+/* Get device by ID or name; lock-free, the result is valid until the caller sleeps */
 struct netdev *netdev_get(uint32_t dev_id);
 struct netdev *netdev_get_by_name(const char *name);
 
+/* Read or replace a device's address, netmask and gateway as one record */
+void netdev_get_ipv4(struct netdev *dev, ipv4_addr_t *ip, ipv4_addr_t *netmask,
+                     ipv4_addr_t *gateway);
+void netdev_set_ipv4(struct netdev *dev, const ipv4_addr_t *ip,
+                     const ipv4_addr_t *netmask, const ipv4_addr_t *gateway);
+
 /* Packet operations */
 struct net_packet *netdev_alloc_packet(void);
 void netdev_free_packet(struct net_packet *pkt);
@@ -20,16 +20,79 @@ uint32_t *get_page_directory(void);
 void map_page(uint32_t virt, uint32_t phys, int flags);
 void unmap_page(uint32_t virt);
 
+/* Identity-map device registers uncached into the kernel address space */
+int paging_map_mmio(uint32_t phys, uint32_t size);
+
+/* Physical address behind a kernel virtual address, 0 if unmapped */
+uint32_t paging_kernel_virt_to_phys(uint32_t virt);
+
 /* Per-task memory protection */
 int paging_init_task(uint32_t task_id);
 int paging_map_page(uint32_t task_id, uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags);
 int paging_unmap_page(uint32_t task_id, uint32_t virtual_addr);
+int paging_map_range(uint32_t task_id, uint32_t virtual_addr, uint32_t physical_addr,
+                     uint32_t size, uint32_t flags);
 uint32_t paging_get_page_directory(uint32_t task_id);
+
+/* Physical address behind virt in a task's address space, 0 if unmapped */
+uint32_t paging_virt_to_phys(uint32_t task_id, uint32_t virt);
 int paging_cleanup_task(uint32_t task_id);
 
-/* Shared memory regions */
-int paging_create_shared_region(uint32_t task_id, uint32_t address, uint32_t size, uint32_t flags);
-int paging_attach_shared_region(uint32_t task_id, int region_id);
+/* Tear down task_id's space and give it the one built under staging_id */
+int paging_replace_task(uint32_t task_id, uint32_t staging_id);
+
+/* Copy-on-write fork and fault handling */
+struct paging_stats {
+    uint32_t forks;
+    uint32_t pages_shared;          /* PTEs shared copy-on-write by forks */
+    uint32_t cow_faults;
+    uint32_t cow_copies;            /* Faults that copied a frame */
+    uint32_t cow_reuses;            /* Faults where the writer was the last sharer */
+    uint32_t image_pages;           /* Pages covered by file-backed areas */
+    uint32_t demand_faults;         /* Pages actually faulted in */
+    uint32_t image_faults;          /* ... of which lie in a file-backed area */
+    uint32_t demand_zero_fills;     /* ... of which had no file data (BSS, stack) */
+};
+
+int paging_fork_task(uint32_t parent_id, uint32_t child_id);
+
+/*
+ * Demand paging: fill() copies 'size' bytes at 'offset' of the backing
+ * object.  Every area holding ctx also holds a reference on it, taken
+ * with get() and dropped with put() when the area goes away, so the
+ * object outlives all mappings (forked copies included).
+ */
+typedef int (*paging_fill_t)(void *ctx, uint32_t offset, void *buffer, uint32_t size);
+
+struct paging_backing {
+    paging_fill_t fill;
+    void (*get)(void *ctx);
+    void (*put)(void *ctx);
+};
+
+/* Map [start, start+size) lazily; the first file_size bytes come from the
+   backing object (NULL for anonymous memory) */
+int paging_add_vma(uint32_t task_id, uint32_t start, uint32_t size, uint32_t flags,
+                   const struct paging_backing *backing, void *ctx,
+                   uint32_t file_offset, uint32_t file_size);
+
+/* Lowest address a task may map; below it is the kernel's identity map */
+uint32_t paging_user_base(void);
+
+int paging_handle_fault(uint32_t task_id, uint32_t fault_addr, uint32_t error_code);
+void paging_get_stats(struct paging_stats *stats);
+
+/*
+ * Shared memory regions: refcounted frames mapped at any page-aligned
+ * address.  Only the creating task may destroy a region; mappings that
+ * are still attached keep their frames until detached.
+ */
+int paging_create_shared_region(uint32_t task_id, uint32_t size, uint32_t flags);
+int paging_attach_shared_region(uint32_t task_id, int region_id, uint32_t address);
 int paging_detach_shared_region(uint32_t task_id, int region_id);
+int paging_destroy_shared_region(uint32_t task_id, int region_id);
+
+/* Kernel view of one page of a region (frames are identity-mapped) */
+void *paging_shared_region_page(int region_id, uint32_t index);
 
 #endif
@@ -20,6 +20,7 @@
 #define PCI_REG_BAR3            0x1C
 #define PCI_REG_BAR4            0x20
 #define PCI_REG_BAR5            0x24
+#define PCI_REG_CAP_PTR         0x34
 #define PCI_REG_IRQ_LINE        0x3C
 #define PCI_REG_IRQ_PIN         0x3D
 
@@ -27,7 +28,43 @@
 #define PCI_CMD_IO_SPACE        0x0001
 #define PCI_CMD_MEMORY_SPACE    0x0002
 #define PCI_CMD_BUS_MASTER      0x0004
-#define PCI_CMD_INTERRUPT       0x0400
+#define PCI_CMD_INTERRUPT       0x0400  /* INTx disable */
+
+/* PCI Status Register Flags */
+#define PCI_STATUS_CAP_LIST     0x0010
+
+/* Capability IDs */
+#define PCI_CAP_ID_MSI          0x05
+#define PCI_CAP_ID_MSIX         0x11
+
+/* MSI capability: control word, then address and data */
+#define PCI_MSI_FLAGS           0x02
+#define PCI_MSI_FLAGS_ENABLE    0x0001
+#define PCI_MSI_FLAGS_QMASK     0x000E  /* Vectors the device asks for, log2 */
+#define PCI_MSI_FLAGS_QSIZE     0x0070  /* Vectors enabled, log2 */
+#define PCI_MSI_FLAGS_64BIT     0x0080
+#define PCI_MSI_FLAGS_MASKBIT   0x0100  /* Per-vector masking */
+#define PCI_MSI_ADDRESS_LO      0x04
+#define PCI_MSI_ADDRESS_HI      0x08    /* 64-bit capability only */
+
+/* MSI-X capability: control word, then where the vector table lives */
+#define PCI_MSIX_FLAGS          0x02
+#define PCI_MSIX_FLAGS_QSIZE    0x07FF  /* Table entries minus one */
+#define PCI_MSIX_FLAGS_MASKALL  0x4000
+#define PCI_MSIX_FLAGS_ENABLE   0x8000
+#define PCI_MSIX_TABLE          0x04
+#define PCI_MSIX_TABLE_BIR      0x00000007
+#define PCI_MSIX_ENTRY_SIZE     16
+#define PCI_MSIX_ENTRY_CTRL_MASKBIT 0x00000001
+
+/* Message address: the local APIC of the destination CPU */
+#define PCI_MSI_ADDRESS_BASE    0xFEE00000
+
+/* How a device's interrupts are delivered */
+#define PCI_IRQ_NONE            0
+#define PCI_IRQ_INTX            1
+#define PCI_IRQ_MSI             2
+#define PCI_IRQ_MSIX            3
 
 /* PCI Header Types */
 #define PCI_HEADER_DEVICE       0x00
@@ -68,6 +105,12 @@ typedef struct {
     uint32_t slot;              /* Slot number */
     uint32_t function;          /* Function number */
     uint32_t pci_device_id;     /* Unique PCI device ID */
+    uint8_t msi_cap;            /* Capability offsets, 0 if absent */
+    uint8_t msix_cap;
+    uint16_t msix_size;         /* MSI-X table entries */
+    volatile uint32_t *msix_table;  /* Mapped once MSI-X is enabled */
+    uint8_t irq_mode;           /* PCI_IRQ_* */
+    uint8_t nr_irqs;            /* irq_mgr lines owned by the device */
 } pci_device_t;
 
 /* PCI Bus Structure */
@@ -100,4 +143,27 @@ void pci_disable_device(pci_device_t *dev);
 uint32_t pci_get_bar_address(pci_device_t *dev, int bar_num);
 uint32_t pci_get_bar_size(pci_device_t *dev, int bar_num);
 
+/* Offset of capability 'cap_id' in configuration space, or 0 */
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t cap_id);
+
+/*
+ * Message-signalled interrupts.  Each vector gets its own irq_mgr line,
+ * delivered to the BSP until irq_set_affinity() moves it, and masked
+ * until a handler is registered; INTx is turned off while they are on.
+ * pci_enable_msix() fills irqs[0..nvec-1], one line per table entry
+ * (per virtqueue, say).  MSI is limited to a single vector here.
+ * Both need the local APIC and return -1 without it.
+ */
+int pci_enable_msi(pci_device_t *dev);
+int pci_enable_msix(pci_device_t *dev, int *irqs, int nvec);
+void pci_disable_msi(pci_device_t *dev);
+
+/*
+ * Best interrupts the device offers for up to 'max' vectors: MSI-X,
+ * else one MSI vector, else its legacy INTx line (shared, on the PIC).
+ * Fills irqs[] and returns how many, or -1 if the device has no
+ * interrupt.  dev->irq_mode records which was chosen.
+ */
+int pci_alloc_irq_vectors(pci_device_t *dev, int *irqs, int max);
+
 #endif /* KERNEL_PCI_H */
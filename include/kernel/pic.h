@@ -2,10 +2,13 @@
 #define KERNEL_PIC_H
 
 #include "../libc/stdint.h"
+#include "irq_mgr.h"
 
 void pic_init(void);
 void pic_send_eoi(uint8_t irq);
 void pic_disable_irq(uint8_t irq);
 void pic_enable_irq(uint8_t irq);
 
+extern const struct irq_chip pic_chip;
+
 #endif
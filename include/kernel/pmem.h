@@ -6,27 +6,49 @@
 /* Page size in bytes */
 #define PAGE_SIZE 4096
 
-/* Bitmap-based physical memory allocator */
+/* Buddy physical memory allocator: blocks of 2^order pages, order < PMEM_MAX_ORDER */
+#define PMEM_MAX_ORDER 11
 
-/* Initialize physical memory manager */
+struct multiboot_info;
+
+/* Initialize physical memory manager for one flat range [0, total_memory_bytes) */
 void pmem_init(uint32_t total_memory_bytes);
 
+/* Initialize physical memory manager from the bootloader's memory map */
+void pmem_init_mmap(struct multiboot_info *mbi);
+
 /* Allocate a single physical page */
 uint32_t pmem_alloc_page(void);
 
 /* Free a single physical page */
 void pmem_free_page(uint32_t page_addr);
 
-/* Allocate consecutive pages */
+/*
+ * Allocate consecutive pages.  Up to 2^(PMEM_MAX_ORDER-1) pages (4 MB)
+ * come from the buddy lists; larger runs are found by scanning for
+ * adjacent free 4 MB blocks, which fragmentation can defeat.
+ */
 uint32_t pmem_alloc_pages(int num_pages);
 
-/* Free consecutive pages */
+/* Free consecutive pages (drops one reference from each frame) */
 void pmem_free_pages(uint32_t page_addr, int num_pages);
 
+/* Take another reference to an allocated frame; returns the new count or -1 */
+int pmem_page_ref(uint32_t page_addr);
+
+/* Current reference count of a frame, 0 if it is not allocated */
+int pmem_page_refcount(uint32_t page_addr);
+
 /* Get the number of free pages */
 uint32_t pmem_get_free_pages(void);
 
 /* Get total number of pages */
 uint32_t pmem_get_total_pages(void);
 
+/* Get one past the highest managed page frame number */
+uint32_t pmem_get_max_pfn(void);
+
+/* Get the number of free blocks of the given order */
+uint32_t pmem_get_free_blocks(int order);
+
 #endif /* KERNEL_PMEM_H */
@@ -0,0 +1,62 @@
+#ifndef KERNEL_RCU_H
+#define KERNEL_RCU_H
+
+#include "../libc/stdint.h"
+
+/*
+ * Read-copy-update for read-mostly tables.
+ *
+ * Kernel threads are never preempted, so a reader cannot be switched out
+ * mid-lookup and rcu_read_lock() only has to keep the compiler from
+ * moving loads out of the section.  Readers must not sleep inside one.
+ * A CPU passes a quiescent state whenever it switches threads or idles;
+ * once every online CPU has done so after an object was unpublished, no
+ * reader can still hold it and it may be freed.
+ */
+
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+struct rcu_stats {
+    uint32_t grace_periods;
+    uint32_t callbacks_queued;
+    uint32_t callbacks_invoked;
+    uint32_t synchronize_calls;
+    uint32_t last_gp_ticks;     /* Length of the most recent grace period */
+    uint32_t max_gp_ticks;
+};
+
+static inline void rcu_read_lock(void)
+{
+    __asm__ volatile("" : : : "memory");
+}
+
+static inline void rcu_read_unlock(void)
+{
+    __asm__ volatile("" : : : "memory");
+}
+
+/* Publish a pointer once the object behind it is initialized (x86 keeps stores in order) */
+#define rcu_assign_pointer(p, v) \
+    do { __asm__ volatile("" : : : "memory"); (p) = (v); } while (0)
+
+/* Load an RCU-protected pointer exactly once */
+#define rcu_dereference(p) (*(__typeof__(p) volatile *)&(p))
+
+/* Start the grace-period thread; callbacks queued earlier run at once */
+void rcu_init(void);
+
+/* Report a quiescent state for this CPU; called at context switch and idle */
+void rcu_note_qs(void);
+
+/* Run func(head) after a grace period, from the grace-period thread */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+
+/* Wait for a full grace period; must be called from a thread that may sleep */
+void synchronize_rcu(void);
+
+void rcu_get_stats(struct rcu_stats *stats);
+
+#endif /* KERNEL_RCU_H */
@@ -21,6 +21,10 @@ typedef struct {
     uint32_t gpu_utilization_pct;    /* Estimated GPU utilization */
     uint32_t inference_model_id;
     sched_hint_t scheduling_hint;
+    /* Optional CPU reservation: runtime_us every period_us, 0 for none */
+    uint32_t runtime_us;
+    uint32_t deadline_us;
+    uint32_t period_us;
 } gpu_sched_context_t;
 
 /* Memory Pressure Levels */
@@ -0,0 +1,55 @@
+#ifndef KERNEL_SCHED_TRACE_H
+#define KERNEL_SCHED_TRACE_H
+
+#include "../libc/stdint.h"
+
+struct task;
+
+/*
+ * Scheduler tracepoints.  Each CPU records its own events into a ring
+ * that only it writes, so tracing takes no lock; readers copy the ring
+ * and drop whatever was overwritten while they looked.  The same hooks
+ * charge each task's run, wait (ready but not running) and sleep time.
+ */
+typedef enum {
+    SCHED_TRACE_WAKEUP = 1,         /* task became runnable */
+    SCHED_TRACE_SWITCH,             /* task switched out for arg (0 = idle) */
+    SCHED_TRACE_MIGRATE,            /* task pulled here from CPU arg */
+    SCHED_TRACE_BLOCK               /* task went to sleep */
+} sched_trace_type_t;
+
+#define SCHED_TRACE_RING_SIZE 256   /* Records per CPU, power of two */
+#define SCHED_TRACE_HIST_BUCKETS 32 /* Bucket n counts [2^n, 2^(n+1)) cycles */
+
+struct sched_trace_record {
+    uint64_t tsc;
+    uint32_t task;                  /* Task id, 0 for none */
+    uint32_t arg;
+    uint8_t type;                   /* sched_trace_type_t */
+    uint8_t cpu;
+    uint16_t reserved;
+};
+
+/* Totals over all CPUs */
+struct sched_trace_summary {
+    uint32_t wakeups;
+    uint32_t switches;
+    uint32_t migrations;
+    uint32_t blocks;
+    uint32_t latency_hist[SCHED_TRACE_HIST_BUCKETS];   /* Ready to running */
+    uint32_t switch_hist[SCHED_TRACE_HIST_BUCKETS];    /* Cost of a reschedule */
+};
+
+/* Tracepoints */
+void sched_trace_wakeup(struct task *task);
+void sched_trace_block(struct task *task);
+void sched_trace_switch(struct task *prev, struct task *next);
+void sched_trace_migrate(struct task *task, int from_cpu);
+void sched_trace_switch_cost(uint32_t cycles);
+
+/* Copy up to 'max' of a CPU's most recent records, oldest first */
+int sched_trace_read(int cpu, struct sched_trace_record *records, int max);
+
+void sched_trace_get_summary(struct sched_trace_summary *summary);
+
+#endif /* KERNEL_SCHED_TRACE_H */
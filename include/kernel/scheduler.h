@@ -3,8 +3,142 @@
 
 #include "task.h"
 
+struct cpu;
+
+/* Priority levels; task->priority is clamped into [0, SCHED_PRIO_LEVELS) */
+#define SCHED_PRIO_LEVELS 32
+#define SCHED_QUANTUM_TICKS 10
+#define SCHED_TICK_US 10000
+
+/*
+ * Scheduling classes, highest precedence first: DEADLINE tasks run
+ * earliest-deadline-first within their admitted reservation, PRIO tasks
+ * by strict priority, and FAIR tasks share what is left in proportion
+ * to a weight derived from priority.
+ */
+#define SCHED_CLASS_PRIO 0
+#define SCHED_CLASS_FAIR 1
+#define SCHED_CLASS_DEADLINE 2
+
+/* Fair-class tunables (microseconds) */
+#define SCHED_FAIR_LATENCY_US 60000
+#define SCHED_FAIR_MIN_GRANULARITY_US 10000
+#define SCHED_FAIR_MAX_LATENCY_US 100000
+
+/* Deadline-class limits; bandwidth is runtime/period in 1/1024 units */
+#define SCHED_DL_BW_UNIT 1024
+#define SCHED_DL_BW_LIMIT 972           /* ~95% of each CPU */
+#define SCHED_DL_MAX_RUNTIME_US 1000000
+#define SCHED_DL_MAX_PERIOD_US 10000000
+
+/* CPU affinity masks: bit n allows CPU n */
+#define SCHED_CPUMASK_ALL 0xFFFFFFFFu
+
+/*
+ * Placement policies, chosen directly or from a resource-scheduler hint.
+ * A waking task goes back to the CPU it last ran on, where its cache is
+ * warm, unless that CPU's load exceeds the least-loaded allowed CPU's by
+ * the policy's threshold; an idle CPU steals only past the same margin.
+ * LATENCY tasks instead take any idle CPU rather than wait behind others.
+ */
+#define SCHED_PLACE_DEFAULT 0
+#define SCHED_PLACE_LATENCY 1
+#define SCHED_PLACE_THROUGHPUT 2
+#define SCHED_MIGRATE_IMBALANCE 2       /* Default threshold, in runnable tasks */
+
+/* Binary min-heap of tasks; each task remembers its slot in heap_index */
+struct task_heap {
+    struct task *slot[MAX_TASKS];
+    uint32_t count;
+};
+
+/*
+ * Per-CPU run queue.  PRIO tasks sit on per-priority FIFOs; bit n of
+ * 'bitmap' is set while level n is non-empty, so the highest runnable
+ * level is one bit scan away.  FAIR tasks sit in a heap ordered by
+ * vruntime and DEADLINE tasks in one ordered by absolute deadline.
+ */
+struct run_queue {
+    uint32_t bitmap;
+    struct task *head[SCHED_PRIO_LEVELS];
+    struct task *tail[SCHED_PRIO_LEVELS];
+    uint32_t nr_running;
+    
+    struct task_heap fair;
+    uint32_t fair_weight;           /* Sum of queued fair weights */
+    uint64_t min_vruntime;          /* Monotonic floor for placing tasks */
+    
+    struct task_heap dl;
+};
+
+/* Deadline-class admission and telemetry counters */
+struct sched_place_stats {
+    uint32_t wake_prev;             /* Woke on the CPU it last ran on */
+    uint32_t wake_idle;             /* Moved to an idle CPU (LATENCY) */
+    uint32_t wake_balanced;         /* Moved to the least-loaded CPU */
+    uint32_t affinity_moves;        /* Moved because its mask excluded its CPU */
+    uint32_t steal_skipped;         /* Steal candidates held back by mask or threshold */
+};
+
+struct sched_dl_stats {
+    uint32_t admitted;
+    uint32_t rejected;              /* Failed admission control */
+    uint32_t active;                /* Tasks holding a reservation */
+    uint32_t total_bw;              /* Sum of reserved bandwidth */
+    uint32_t bw_limit;
+    uint32_t misses;                /* Jobs that reached their deadline unfinished */
+    uint32_t throttles;             /* Runtime exhausted before the period ended */
+    uint32_t replenishments;
+};
+
+void run_queue_init(struct run_queue *rq);
+void run_queue_enqueue(struct run_queue *rq, struct task *task);
+void run_queue_dequeue(struct run_queue *rq, struct task *task);
+/* Remove and return the next task: earliest deadline, then highest
+   priority level, then smallest vruntime */
+struct task *run_queue_pop(struct run_queue *rq);
+
 void scheduler_init(void);
+/* Take the next task off this CPU's run queue, stealing from the
+   busiest CPU when it is empty (NULL if none is ready) */
 struct task *scheduler_pick_next(void);
 void scheduler_tick(void);
+/* Charge the task leaving this CPU for the time it ran */
+void scheduler_put_prev(struct task *prev);
+/* Called by an idle CPU: pick (or steal) a task if nothing is running */
+void scheduler_idle(void);
+/* Whether a CPU needs its periodic tick (tasks to run, steal or replenish) */
+int scheduler_needs_tick(struct cpu *cpu);
+
+/* Make a task runnable / take it off the run queue */
+void scheduler_enqueue(struct task *task);
+void scheduler_dequeue(struct task *task);
+/* Make a new or sleeping task runnable on the CPU its placement picks */
+void scheduler_wakeup(struct task *task);
+
+/* CPU for a waking task: its last one unless the policy says otherwise */
+int scheduler_select_cpu(struct task *task);
+/* Restrict a task to the CPUs in 'mask' (offline CPUs are ignored) */
+int scheduler_set_affinity(struct task *task, uint32_t mask);
+int scheduler_set_placement(struct task *task, int policy);
+void scheduler_get_place_stats(struct sched_place_stats *stats);
+
+/* Move a task to the PRIO or FAIR class (dropping any reservation) */
+int scheduler_set_class(struct task *task, int sched_class);
+/* Fair-class target latency and minimum slice, in microseconds */
+int scheduler_set_fair_params(uint32_t latency_us, uint32_t min_granularity_us);
+/* Load weight for a priority (1024 at priority 15) */
+uint32_t scheduler_weight(int priority);
+
+/*
+ * Reserve 'runtime_us' of CPU every 'period_us', due 'deadline_us' after
+ * each period starts, and move the task to the DEADLINE class.  Fails
+ * if the reservation would overcommit the CPUs.
+ */
+int scheduler_set_deadline(struct task *task, uint32_t runtime_us, uint32_t deadline_us,
+                           uint32_t period_us);
+/* Current job is done: sleep until the next period */
+void scheduler_yield_deadline(struct task *task);
+void scheduler_get_dl_stats(struct sched_dl_stats *stats);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef KERNEL_SLAB_H
+#define KERNEL_SLAB_H
+
+#include "../libc/stdint.h"
+
+#define KMEM_MAX_CACHES 32
+#define KMEM_MAX_SLAB_ORDER 3       /* Largest slab is 2^3 pages */
+
+/* Object constructor, run once per object when its slab is created */
+typedef void (*kmem_ctor_t)(void *obj);
+
+typedef struct kmem_cache kmem_cache_t;
+
+/* Per-cache statistics */
+typedef struct {
+    const char *name;
+    uint32_t object_size;
+    uint32_t objects_per_slab;
+    uint32_t slab_pages;
+    uint32_t slabs;                 /* Slabs currently owned by the cache */
+    uint32_t active_objects;
+    uint32_t hits;                  /* Allocations served from an existing slab */
+    uint32_t misses;                /* Allocations that needed a new slab */
+    uint32_t frees;
+    uint32_t failures;
+} kmem_cache_stats_t;
+
+/* Create a cache of fixed-size objects; align of 0 means word alignment */
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                                kmem_ctor_t ctor);
+
+/* Destroy a cache.  Fails (-1) while objects are still allocated. */
+int kmem_cache_destroy(kmem_cache_t *cache);
+
+/* Allocate/free one object.  Objects from a cache with a constructor
+   must be returned in their constructed state. */
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+
+/* Statistics: index runs over live caches, 0 .. KMEM_MAX_CACHES-1 */
+int kmem_cache_get_stats(int index, kmem_cache_stats_t *out);
+
+#endif /* KERNEL_SLAB_H */
@@ -0,0 +1,57 @@
+#ifndef KERNEL_SMP_H
+#define KERNEL_SMP_H
+
+#include "../libc/stdint.h"
+#include "spinlock.h"
+#include "scheduler.h"
+
+#define SMP_MAX_CPUS 16
+
+/* Per-CPU state; index 0 is the bootstrap processor */
+struct cpu {
+    uint32_t index;
+    uint32_t apic_id;
+    volatile int online;
+    
+    struct task *current;
+    struct run_queue rq;
+    spinlock_t rq_lock;
+    
+    /* Scheduler accounting */
+    uint32_t last_tick;             /* Last global tick seen by the idle loop */
+    uint32_t idle_ticks;
+    uint32_t busy_ticks;
+    uint32_t steals;                /* Tasks pulled from other CPUs */
+    
+    /* Kernel threads on this CPU, under the thread lock (thread.c) */
+    struct thread *thread;          /* Running thread */
+    struct thread *idle_thread;
+    struct thread *thread_head;     /* Ready FIFO */
+    struct thread *thread_tail;
+    uint32_t thread_switches;
+    uint32_t idle_halts;
+    volatile int halted;            /* Committed to hlt; wakers must smp_kick() */
+    
+    /* One pending cross-CPU call, run by the target's idle loop */
+    void (*volatile work)(void *);
+    void *volatile work_arg;
+};
+
+/* Start every AP through the local APIC; safe to call without one */
+void smp_init(void);
+
+int smp_cpu_count(void);
+struct cpu *smp_cpu(int index);
+struct cpu *smp_this_cpu(void);
+
+/* Run fn(arg) on another CPU; smp_wait returns once it has finished */
+int smp_call(int cpu, void (*fn)(void *), void *arg);
+void smp_wait(int cpu);
+
+/* Interrupt another CPU out of hlt and have it reprogram its timer */
+void smp_kick(int cpu);
+
+/* C entry point for APs, called from the startup trampoline */
+void smp_ap_main(void);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef KERNEL_SPINLOCK_H
+#define KERNEL_SPINLOCK_H
+
+#include "../libc/stdint.h"
+
+/* Test-and-test-and-set spinlock for short critical sections across CPUs */
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+#define EFLAGS_IF 0x200
+
+static inline void spin_lock_init(spinlock_t *lock)
+{
+    lock->locked = 0;
+}
+
+static inline void spin_lock(spinlock_t *lock)
+{
+    while (__sync_lock_test_and_set(&lock->locked, 1)) {
+        while (lock->locked) {
+            __asm__ volatile("pause");
+        }
+    }
+}
+
+static inline int spin_trylock(spinlock_t *lock)
+{
+    return __sync_lock_test_and_set(&lock->locked, 1) == 0;
+}
+
+static inline void spin_unlock(spinlock_t *lock)
+{
+    __sync_lock_release(&lock->locked);
+}
+
+/* Disable interrupts on this CPU, returning the previous EFLAGS */
+static inline uint32_t irq_save(void)
+{
+    uint32_t flags;
+    __asm__ volatile("pushfl; popl %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags)
+{
+    if (flags & EFLAGS_IF) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
+
+/* Variants that also keep interrupts off on this CPU while held */
+static inline uint32_t spin_lock_irqsave(spinlock_t *lock)
+{
+    uint32_t flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+static inline void spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags)
+{
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+#endif
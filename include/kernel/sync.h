@@ -2,12 +2,34 @@
 #define KERNEL_SYNC_H
 
 #include "../libc/stdint.h"
+#include "spinlock.h"
+
+struct thread;
+struct mutex_waiter;
+
+/* Per-mutex contention statistics */
+struct mutex_stats {
+    uint32_t acquisitions;
+    uint32_t contended;         /* Fast path failed */
+    uint32_t spin_acquired;     /* ... but spinning on a running owner won */
+    uint32_t sleeps;            /* ... and the thread had to park */
+    uint32_t pi_boosts;         /* Owner priority raised on our behalf */
+    uint32_t max_waiters;
+    uint64_t wait_cycles;       /* TSC cycles spent in the slow path */
+};
+
+#define MUTEX_WAITERS 0x80000000u   /* Lock word flag: unlock must take the slow path */
 
 /* Mutex state */
-typedef struct {
-    uint32_t lock;              /* 0=unlocked, != 0=owner thread ID */
+typedef struct mutex {
+    volatile uint32_t lock;     /* 0=unlocked, else owner thread ID | MUTEX_WAITERS */
     uint32_t count;             /* Recursion count */
     uint32_t waiter_count;      /* Threads waiting on this mutex */
+    struct thread *volatile owner;
+    struct mutex_waiter *waiters;   /* Highest priority first, under the PI lock */
+    struct mutex *held_next;    /* Owner's list of mutexes with waiters */
+    int on_held_list;
+    struct mutex_stats stats;
 } mutex_t;
 
 /* Semaphore state */
@@ -22,20 +44,103 @@ typedef struct {
     mutex_t *mutex;             /* Associated mutex */
 } cond_t;
 
-/* Reader-writer lock */
+/*
+ * Reader-writer lock.  Readers count themselves on their own CPU's cache
+ * line, so concurrent readers never write a shared line.  A writer raises
+ * 'writer', which turns new readers away, then waits for the per-CPU
+ * counts to drain (writer preference).
+ */
+#define RWLOCK_CPU_SLOTS 16         /* SMP_MAX_CPUS */
+
+struct rwlock_cpu {
+    volatile int32_t readers;       /* Entries minus exits on this CPU */
+    uint32_t acquisitions;
+} __attribute__((aligned(64)));
+
+struct rwlock_waiter;
+
+struct rwlock_stats {
+    uint32_t read_acquisitions;
+    uint32_t write_acquisitions;
+    uint32_t reader_backoffs;       /* Reader arrived while a writer was in */
+    uint32_t reader_sleeps;
+    uint64_t writer_wait_cycles;    /* TSC cycles spent draining readers */
+};
+
 typedef struct {
-    uint32_t readers;           /* Number of active readers */
-    uint32_t writers;           /* Number of active writers */
-    uint32_t write_waiters;     /* Threads waiting to write */
-    mutex_t lock;               /* Protects this structure */
+    struct rwlock_cpu cpu[RWLOCK_CPU_SLOTS];
+    volatile uint32_t writer;       /* Set while a writer holds or drains */
+    mutex_t write_lock;             /* Serializes writers */
+    spinlock_t wait_lock;           /* Protects read_waiters */
+    struct rwlock_waiter *read_waiters;
+    struct rwlock_stats stats;      /* Write side; read counts live per CPU */
 } rwlock_t;
 
+/*
+ * Sequence lock for small records that are read far more often than
+ * written.  Readers take no lock: they retry if the sequence was odd or
+ * changed while they copied.  Writers must not sleep while holding it.
+ *
+ *     do {
+ *         seq = read_seqbegin(&sl);
+ *         copy = record;
+ *     } while (read_seqretry(&sl, seq));
+ */
+typedef struct {
+    volatile uint32_t sequence;     /* Odd while a write is in progress */
+    spinlock_t lock;                /* Serializes writers */
+} seqlock_t;
+
+#define SEQLOCK_INIT { 0, SPINLOCK_INIT }
+
+static inline void seqlock_init(seqlock_t *sl)
+{
+    sl->sequence = 0;
+    spin_lock_init(&sl->lock);
+}
+
+static inline uint32_t read_seqbegin(const seqlock_t *sl)
+{
+    uint32_t seq;
+    while ((seq = sl->sequence) & 1) {
+        __asm__ volatile("pause");
+    }
+    __asm__ volatile("" : : : "memory");    /* x86 keeps loads in order */
+    return seq;
+}
+
+static inline int read_seqretry(const seqlock_t *sl, uint32_t start)
+{
+    __asm__ volatile("" : : : "memory");
+    return sl->sequence != start;
+}
+
+/* Interrupts stay off so a reader in an IRQ on this CPU cannot spin on us */
+static inline uint32_t write_seqlock(seqlock_t *sl)
+{
+    uint32_t flags = spin_lock_irqsave(&sl->lock);
+    sl->sequence++;
+    __asm__ volatile("" : : : "memory");    /* ... and stores in order */
+    return flags;
+}
+
+static inline void write_sequnlock(seqlock_t *sl, uint32_t flags)
+{
+    __asm__ volatile("" : : : "memory");
+    sl->sequence++;
+    spin_unlock_irqrestore(&sl->lock, flags);
+}
+
 /* Mutex operations */
 int mutex_init(mutex_t *mutex);
 int mutex_lock(mutex_t *mutex);
 int mutex_trylock(mutex_t *mutex);
 int mutex_unlock(mutex_t *mutex);
 int mutex_destroy(mutex_t *mutex);
+void mutex_get_stats(mutex_t *mutex, struct mutex_stats *stats);
+
+/* Recompute a thread's inherited priority after its base priority changed */
+void mutex_pi_update(struct thread *thread);
 
 /* Semaphore operations */
 int semaphore_init(semaphore_t *sem, uint32_t initial_value);
@@ -57,6 +162,7 @@ int rwlock_read_unlock(rwlock_t *rwlock);
 int rwlock_write_lock(rwlock_t *rwlock);
 int rwlock_write_unlock(rwlock_t *rwlock);
 int rwlock_destroy(rwlock_t *rwlock);
+void rwlock_get_stats(rwlock_t *rwlock, struct rwlock_stats *stats);
 
 /* Barrier (for synchronizing multiple threads) */
 typedef struct {
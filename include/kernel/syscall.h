@@ -36,6 +36,18 @@ struct sockaddr {
 #define SYSCALL_FUTEX_WAIT  25
 #define SYSCALL_FUTEX_WAKE  26
 #define SYSCALL_FUTEX_REQUEUE 27
+#define SYSCALL_SHM_CREATE  28
+#define SYSCALL_SHM_ATTACH  29
+#define SYSCALL_SHM_DETACH  30
+#define SYSCALL_SHM_DESTROY 31
+#define SYSCALL_SCHED_SETCLASS 32
+#define SYSCALL_SCHED_SETAFFINITY 33
+#define SYSCALL_SCHED_GETAFFINITY 34
+#define SYSCALL_SCHED_SETHINT 35
+
+/* What an affinity call's id names; id 0 is the caller itself */
+#define SCHED_AFFINITY_TASK   0
+#define SCHED_AFFINITY_THREAD 1
 
 struct syscall_args {
     uint32_t eax, ebx, ecx, edx, esi, edi;
@@ -50,6 +62,14 @@ int32_t sys_unlink(const char *path);
 int32_t sys_lseek(int fd, int32_t offset, int whence);
 int32_t sys_exec(const char *filename, char *const argv[]);
 int32_t sys_signal(int signum, uint32_t handler);
+int32_t sys_shm_create(uint32_t size, uint32_t flags);
+int32_t sys_shm_attach(int shm_id, uint32_t address);
+int32_t sys_shm_detach(int shm_id);
+int32_t sys_shm_destroy(int shm_id);
+int32_t sys_sched_setclass(int sched_class);
+int32_t sys_sched_setaffinity(int which, uint32_t id, uint32_t mask);
+int32_t sys_sched_getaffinity(int which, uint32_t id);
+int32_t sys_sched_sethint(int hint);
 
 void syscall_init(void);
 int32_t syscall_dispatch(uint32_t num, struct syscall_args *args);
@@ -2,6 +2,7 @@
 #define KERNEL_TASK_H
 
 #include "../libc/stdint.h"
+#include "hrtimer.h"
 
 #define MAX_TASKS 32
 #define TASK_STACK_SIZE 4096
@@ -55,6 +56,44 @@ struct task {
     int priority;
     int ticks_remaining;
     
+    /* Run queue linkage (see scheduler.h) */
+    int cpu;                 /* CPU whose run queue holds this task */
+    uint32_t cpus_allowed;   /* Affinity mask */
+    int placement;           /* SCHED_PLACE_* */
+    uint32_t nr_migrations;
+    struct task *rq_next;
+    struct task *rq_prev;
+    int on_rq;
+    
+    /* Scheduling class and fair-class state */
+    int sched_class;         /* SCHED_CLASS_* */
+    uint64_t vruntime;       /* Run time in us, scaled by 1024 / weight */
+    uint32_t slice_exec_us;  /* Run time since it was last picked */
+    int heap_index;          /* Slot in the run queue's fair or deadline heap */
+    
+    /* Deadline-class reservation (microseconds) */
+    uint32_t dl_runtime;
+    uint32_t dl_deadline;
+    uint32_t dl_period;
+    uint32_t dl_bw;          /* runtime/period in 1/1024 */
+    int32_t dl_remaining;    /* Runtime left in the current period */
+    uint64_t dl_exec_start;  /* When it was last charged for running */
+    uint64_t dl_abs_deadline;
+    uint64_t dl_period_end;  /* When the budget is next replenished */
+    int dl_throttled;        /* Budget spent or job done; waits for replenishment */
+    uint32_t dl_misses;
+    struct task *dl_next;    /* Deadline task list */
+    
+    struct hrtimer sleep_timer;  /* Wakes the task from task_sleep() */
+    
+    /* Scheduler trace accounting in TSC cycles (sched_trace.c) */
+    int trace_phase;
+    uint64_t trace_stamp;    /* Last run/wait/sleep transition */
+    uint64_t run_cycles;
+    uint64_t wait_cycles;    /* Ready but not running */
+    uint64_t sleep_cycles;
+    uint32_t nr_switches;
+    
     /* File descriptors */
     struct file_descriptor fd_table[MAX_FD_PER_TASK];
     
@@ -76,5 +115,6 @@ void task_yield(void);
 void task_sleep(uint32_t ms);
 int task_get_count(void);
 struct task *task_get(int index);
+struct task *task_find(uint32_t id);
 
 #endif
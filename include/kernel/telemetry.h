@@ -14,7 +14,8 @@ typedef enum {
     TELEM_EVENT_THERMAL_SPIKE,
     TELEM_EVENT_TASK_MIGRATE,
     TELEM_EVENT_RESOURCE_CONTENTION,
-    TELEM_EVENT_THERMAL_THROTTLE
+    TELEM_EVENT_THERMAL_THROTTLE,
+    TELEM_EVENT_DEADLINE_MISS          /* data_u32: lateness in us */
 } telem_event_type_t;
 
 /* Telemetry metric types */
@@ -70,6 +71,7 @@ typedef struct {
     uint32_t memory_pressure_events;
     uint32_t task_migrations;
     uint32_t power_draw_mw;            /* milliwatts */
+    uint32_t deadline_misses;          /* DEADLINE-class jobs that overran */
     uint64_t uptime_seconds;
 } telem_aggregates_t;
 
@@ -3,10 +3,18 @@
 
 #include "../libc/stdint.h"
 #include "task.h"
+#include "spinlock.h"
+#include "hrtimer.h"
 
 #define MAX_THREADS_PER_TASK 16
 #define THREAD_STACK_SIZE 4096
 
+/* Thread priorities share the task scale: higher runs first */
+#define THREAD_PRIO_MAX 31
+#define THREAD_DEFAULT_PRIORITY 15
+
+struct mutex;
+
 /* Thread states */
 typedef enum {
     THREAD_CREATED = 0,
@@ -50,10 +58,30 @@ struct thread {
     /* Synchronization */
     uint32_t join_waiter_id;    /* Thread waiting on join */
     uint32_t refcount;          /* Reference count for cleanup */
+    
+    /* Scheduling: a thread runs on the CPU that created it, or where its mask sends it */
+    int cpu;
+    uint32_t cpus_allowed;
+    struct thread *next;        /* CPU ready queue */
+    struct hrtimer wait_timer;  /* Timeout of a parked thread */
+    int timed_out;
+    
+    /* Priority; 'priority' is base_priority or a boost inherited via mutexes */
+    int base_priority;
+    int priority;
+    struct mutex *blocked_on;   /* Mutex this thread is parked on */
+    struct mutex *held_mutexes; /* Owned mutexes that have waiters */
 };
 
+/* Initialize the thread subsystem */
+void thread_init(void);
+
+/* Adopt the calling AP's own code as its boot thread */
+void thread_cpu_init(void);
+
 /* Thread management operations */
 int thread_create(struct task *task, void (*entry)(void *), void *arg);
+int kthread_create(void (*entry)(void *), void *arg, int priority);
 int thread_join(int thread_id, int *exit_code);
 int thread_exit(int exit_code);
 
@@ -62,6 +90,34 @@ int thread_self(void);
 int thread_get_id(int thread_id);
 struct thread *thread_get(int thread_id);
 void thread_sleep_ms(uint32_t ms);
+void thread_sleep_us(uint32_t us);
+
+/* Give the CPU to the next ready thread, if any */
+void thread_yield(void);
+
+/* Run ready threads, or halt until the next interrupt if there are none */
+void thread_idle(void);
+
+/*
+ * Block the calling thread until thread_unpark() or until timeout_us
+ * microseconds pass (0 waits forever).  Call with interrupts off and
+ * 'held' locked (or NULL): it is released once the thread is marked
+ * blocked, so a waker that takes 'held' cannot miss it.  Interrupts are
+ * restored from 'flags' on return.  Returns 0 when unparked, -1 on
+ * timeout.
+ */
+int thread_park(spinlock_t *held, uint32_t flags, uint32_t timeout_us);
+int thread_unpark(struct thread *thread);
+struct thread *thread_current(void);
+
+/* Change a thread's base priority; inherited boosts are kept */
+int thread_set_priority(struct thread *thread, int priority);
+
+/* Pin a thread to a set of CPUs (bit n = CPU n); it migrates if its CPU is excluded */
+int thread_set_affinity(struct thread *thread, uint32_t mask);
+
+/* Set the effective priority and reorder the ready queue (mutex PI only) */
+void thread_set_effective_priority(struct thread *thread, int priority);
 
 /* Thread-local storage */
 void *thread_get_tls(int slot);
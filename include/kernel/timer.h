@@ -1,8 +1,37 @@
 #ifndef KERNEL_TIMER_H
 #define KERNEL_TIMER_H
 
+#include "../libc/stdint.h"
+
+#define TIMER_HZ 100
+#define TIMER_TICK_NS (1000000000u / TIMER_HZ)
+
 void timer_init(void);
+/* IRQ0 */
+void timer_pit_interrupt(void);
+/* Advance the tick and raise the scheduler softirq; BSP only */
 void timer_interrupt(void);
 int timer_get_ticks(void);
 
+/* Count ticks from the TSC clock once the BSP's timer is one-shot */
+void timer_use_clock(void);
+/* Clock time of the next tick boundary */
+uint64_t timer_next_tick_ns(void);
+
+/* CPU timestamp counter, for cycle-level measurements */
+static inline uint64_t timer_rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+/* Log2 histogram bucket of a cycle count: n counts [2^n, 2^(n+1)), and
+   the last of 'nbuckets' also takes everything above it */
+static inline int timer_cycles_bucket(uint32_t cycles, int nbuckets)
+{
+    int bucket = cycles ? 31 - __builtin_clz(cycles) : 0;
+    return bucket < nbuckets ? bucket : nbuckets - 1;
+}
+
 #endif
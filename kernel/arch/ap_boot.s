@@ -0,0 +1,85 @@
+/*
+ * ap_boot.s -- application processor startup trampoline
+ *
+ * smp_init() copies [ap_trampoline_start, ap_trampoline_end) to
+ * AP_TRAMPOLINE_BASE (below 1 MB, page aligned) and fills in the
+ * parameter block before sending INIT-SIPI-SIPI.  Each AP starts here in
+ * real mode at AP_TRAMPOLINE_BASE:0, so every address is computed
+ * relative to the copy, not the link address.
+ *
+ * The AP switches to protected mode with a flat GDT, loads the BSP's
+ * CR4 and CR3, enables paging, claims a stack by atomically advancing
+ * ap_stack_next and calls the C entry point (smp_ap_main), which never
+ * returns.  APs beyond the last stack halt.
+ */
+
+.set AP_TRAMPOLINE_BASE, 0x8000
+
+.section .text
+.global ap_trampoline_start
+.global ap_trampoline_end
+.global ap_trampoline_params
+
+.code16
+ap_trampoline_start:
+    cli
+    cld
+    xorw %ax, %ax
+    movw %ax, %ds
+    lgdtl (ap_gdt_ptr - ap_trampoline_start + AP_TRAMPOLINE_BASE)
+
+    movl %cr0, %eax
+    orl $1, %eax                    /* CR0.PE */
+    movl %eax, %cr0
+    ljmpl $0x08, $(ap_protected - ap_trampoline_start + AP_TRAMPOLINE_BASE)
+
+.code32
+ap_protected:
+    movw $0x10, %ax
+    movw %ax, %ds
+    movw %ax, %es
+    movw %ax, %fs
+    movw %ax, %gs
+    movw %ax, %ss
+
+    movl (ap_cr4 - ap_trampoline_start + AP_TRAMPOLINE_BASE), %eax
+    movl %eax, %cr4
+    movl (ap_cr3 - ap_trampoline_start + AP_TRAMPOLINE_BASE), %eax
+    movl %eax, %cr3
+    movl %cr0, %eax
+    orl $0x80000000, %eax           /* CR0.PG */
+    movl %eax, %cr0
+
+    /* Claim a stack: old value of ap_stack_next is this AP's stack top */
+    movl (ap_stack_size - ap_trampoline_start + AP_TRAMPOLINE_BASE), %eax
+    lock xaddl %eax, (ap_stack_next - ap_trampoline_start + AP_TRAMPOLINE_BASE)
+    cmpl (ap_stack_limit - ap_trampoline_start + AP_TRAMPOLINE_BASE), %eax
+    ja 1f                           /* More APs than stacks: park this one */
+    movl %eax, %esp
+
+    movl (ap_entry - ap_trampoline_start + AP_TRAMPOLINE_BASE), %eax
+    call *%eax
+
+1:  cli
+    hlt
+    jmp 1b
+
+.align 8
+ap_gdt:
+    .quad 0x0000000000000000
+    .quad 0x00CF9A000000FFFF        /* 0x08: flat 32-bit code */
+    .quad 0x00CF92000000FFFF        /* 0x10: flat 32-bit data */
+ap_gdt_ptr:
+    .word ap_gdt_ptr - ap_gdt - 1
+    .long (ap_gdt - ap_trampoline_start + AP_TRAMPOLINE_BASE)
+
+/* Parameter block; layout matches struct ap_boot_params in smp.c */
+.align 4
+ap_trampoline_params:
+ap_cr3:         .long 0
+ap_cr4:         .long 0
+ap_entry:       .long 0
+ap_stack_next:  .long 0
+ap_stack_size:  .long 0
+ap_stack_limit: .long 0
+ap_trampoline_end:
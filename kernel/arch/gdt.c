@@ -56,3 +56,9 @@ void gdt_init(void)
     gdt_load(&gdt_ptr);
     serial_puts("GDT loaded successfully\n");
 }
+
+/* Load the shared GDT on an application processor */
+void gdt_reload(void)
+{
+    gdt_load(&gdt_ptr);
+}
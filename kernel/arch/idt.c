@@ -1,5 +1,7 @@
 #include "../../include/kernel/idt.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/task.h"
+#include "../../include/kernel/paging.h"
 
 /* Global IDT */
 static struct idt_entry idt[256];
@@ -69,6 +71,16 @@ static void print_hex(uint32_t num)
 /* Default exception handler */
 void exception_handler(uint32_t exception_num, uint32_t error_code)
 {
+    /* Copy-on-write faults are resolved and the access retried */
+    if (exception_num == EXC_PAGE_FAULT) {
+        struct task *task = task_get_current();
+        uint32_t cr2;
+        __asm__ volatile("mov %%cr2, %0" : "=r"(cr2));
+        if (task && paging_handle_fault(task->id, cr2, error_code) == 0) {
+            return;
+        }
+    }
+
     serial_puts("\n=== EXCEPTION OCCURRED ===");
     serial_puts("\nException Number: ");
     print_hex(exception_num);
@@ -181,6 +193,12 @@ void idt_init(void)
     serial_puts("IDT initialized and loaded (256 entries, 32 exceptions)\n");
 }
 
+/* Load the shared IDT on an application processor */
+void idt_reload(void)
+{
+    idt_load(&idt_ptr);
+}
+
 /* Register a custom handler for a specific interrupt/exception */
 void idt_set_handler(uint8_t num, uint32_t handler, uint8_t type_attr)
 {
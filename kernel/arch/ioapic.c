@@ -0,0 +1,140 @@
+#include "../../include/kernel/ioapic.h"
+#include "../../include/kernel/irq_mgr.h"
+#include "../../include/kernel/lapic.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/spinlock.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/serial.h"
+
+#define IOAPIC_MAX_PINS 240
+#define LEGACY_PINS     16
+
+static volatile uint32_t *ioapic_base = 0;
+static int ioapic_pins;
+static spinlock_t ioapic_lock = SPINLOCK_INIT;   /* IOREGSEL and IOWIN go together */
+
+/* The line each routed pin was given, -1 if none */
+static int16_t pin_irq[IOAPIC_MAX_PINS];
+
+static uint32_t ioapic_read(uint32_t reg)
+{
+    ioapic_base[0] = reg;
+    return ioapic_base[4];
+}
+
+static void ioapic_write(uint32_t reg, uint32_t value)
+{
+    ioapic_base[0] = reg;
+    ioapic_base[4] = value;
+}
+
+static inline uint32_t pin_of(uint32_t irq)
+{
+    return (uint32_t)(uintptr_t)irq_get_chip_data(irq);
+}
+
+static void ioapic_set_mask(uint32_t irq, int masked)
+{
+    uint32_t reg = IOAPIC_REG_REDTBL + 2 * pin_of(irq);
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    uint32_t low = ioapic_read(reg);
+    low = masked ? low | IOAPIC_RTE_MASKED : low & ~IOAPIC_RTE_MASKED;
+    ioapic_write(reg, low);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+}
+
+static void ioapic_mask(uint32_t irq)
+{
+    ioapic_set_mask(irq, 1);
+}
+
+static void ioapic_unmask(uint32_t irq)
+{
+    ioapic_set_mask(irq, 0);
+}
+
+/* A level-triggered pin is re-armed by the EOI the local APIC broadcasts */
+static void ioapic_eoi(uint32_t irq)
+{
+    (void)irq;
+    lapic_eoi();
+}
+
+static int ioapic_set_affinity(uint32_t irq, uint32_t apic_id)
+{
+    uint32_t reg = IOAPIC_REG_REDTBL + 2 * pin_of(irq);
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(reg + 1, apic_id << 24);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+    return 0;
+}
+
+static const struct irq_chip ioapic_chip = {
+    .name = "ioapic",
+    .mask = ioapic_mask,
+    .unmask = ioapic_unmask,
+    .eoi = ioapic_eoi,
+    .set_affinity = ioapic_set_affinity,
+};
+
+int ioapic_init(void)
+{
+    if (!lapic_available()) return -1;
+    if (paging_map_mmio(IOAPIC_DEFAULT_BASE, PAGE_SIZE) != 0) return -1;
+    ioapic_base = (volatile uint32_t *)IOAPIC_DEFAULT_BASE;
+
+    /* Nothing decodes the address without a chip: reads float to all ones */
+    uint32_t version = ioapic_read(IOAPIC_REG_VERSION);
+    if (version == 0xFFFFFFFF) {
+        ioapic_base = 0;
+        serial_puts("[ioapic] Not present\n");
+        return -1;
+    }
+    ioapic_pins = (int)((version >> 16) & 0xFF) + 1;
+    if (ioapic_pins > IOAPIC_MAX_PINS) ioapic_pins = IOAPIC_MAX_PINS;
+
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    for (int pin = 0; pin < ioapic_pins; pin++) {
+        ioapic_write(IOAPIC_REG_REDTBL + 2 * pin, IOAPIC_RTE_MASKED);
+        ioapic_write(IOAPIC_REG_REDTBL + 2 * pin + 1, 0);
+        pin_irq[pin] = -1;
+    }
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+
+    serial_printf("[ioapic] Base %x, id %d, %d pins\n", IOAPIC_DEFAULT_BASE,
+                  (int)(ioapic_read(IOAPIC_REG_ID) >> 24) & 0xF, ioapic_pins);
+    return 0;
+}
+
+int ioapic_available(void)
+{
+    return ioapic_base != 0;
+}
+
+int ioapic_pin_count(void)
+{
+    return ioapic_pins;
+}
+
+int ioapic_route_gsi(uint32_t gsi, int level, int active_low)
+{
+    if (!ioapic_base || gsi < LEGACY_PINS || gsi >= (uint32_t)ioapic_pins) return -1;
+    if (pin_irq[gsi] >= 0) return pin_irq[gsi];
+
+    int irq = irq_alloc_line(&ioapic_chip, (void *)(uintptr_t)gsi);
+    if (irq < 0) return -1;
+    pin_irq[gsi] = (int16_t)irq;
+
+    uint32_t low = IOAPIC_RTE_MASKED | (IRQ_VECTOR_BASE + (uint32_t)irq);
+    if (level) low |= IOAPIC_RTE_LEVEL;
+    if (active_low) low |= IOAPIC_RTE_ACTIVE_LOW;
+
+    uint32_t flags = spin_lock_irqsave(&ioapic_lock);
+    ioapic_write(IOAPIC_REG_REDTBL + 2 * gsi + 1, smp_cpu(0)->apic_id << 24);
+    ioapic_write(IOAPIC_REG_REDTBL + 2 * gsi, low);
+    spin_unlock_irqrestore(&ioapic_lock, flags);
+
+    serial_printf("[ioapic] GSI %d -> IRQ %d (vector %d)\n", (int)gsi, irq,
+                  IRQ_VECTOR_BASE + irq);
+    return irq;
+}
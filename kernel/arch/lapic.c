@@ -0,0 +1,176 @@
+#include "../../include/kernel/lapic.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/clockevent.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/spinlock.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/serial.h"
+
+#define IA32_APIC_BASE_MSR 0x1B
+#define APIC_BASE_ENABLE   0x800
+#define SVR_ENABLE         0x100
+
+#define TIMER_PERIODIC     0x20000      /* LVT timer mode bit; clear for one-shot */
+#define TIMER_DIVIDE_16    0x3
+#define TIMER_CALIBRATE_US 10000
+
+static volatile uint32_t *lapic_base = 0;
+
+/* APIC timer rate, measured once on the BSP; every CPU shares the bus clock */
+static uint32_t timer_count_mult;       /* Counts per ns, << 32 */
+static uint32_t timer_tick_count;       /* Counts per TIMER_HZ tick */
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+    __asm__ volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static int cpu_has_apic(void)
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 9) & 1;
+}
+
+uint32_t lapic_read(uint32_t reg)
+{
+    return lapic_base[reg / 4];
+}
+
+void lapic_write(uint32_t reg, uint32_t value)
+{
+    lapic_base[reg / 4] = value;
+    (void)lapic_base[LAPIC_ID / 4];     /* Wait for the write to land */
+}
+
+int lapic_available(void)
+{
+    return lapic_base != 0;
+}
+
+void lapic_enable(void)
+{
+    if (!lapic_base) return;
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_SVR, SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+}
+
+int lapic_init(void)
+{
+    if (!cpu_has_apic()) {
+        serial_puts("[lapic] No local APIC\n");
+        return -1;
+    }
+    
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(IA32_APIC_BASE_MSR));
+    uint32_t phys = lo & 0xFFFFF000;
+    if (!(lo & APIC_BASE_ENABLE)) {
+        lo |= APIC_BASE_ENABLE;
+        __asm__ volatile("wrmsr" : : "a"(lo), "d"(hi), "c"(IA32_APIC_BASE_MSR));
+    }
+    
+    if (paging_map_mmio(phys, PAGE_SIZE) != 0) {
+        serial_puts("[lapic] Cannot map registers\n");
+        return -1;
+    }
+    lapic_base = (volatile uint32_t *)phys;
+    lapic_enable();
+    
+    serial_printf("[lapic] Base 0x%x, BSP id %u, version 0x%x\n",
+                  phys, lapic_id(), lapic_read(LAPIC_VERSION) & 0xFF);
+    return 0;
+}
+
+uint32_t lapic_id(void)
+{
+    if (!lapic_base) return 0;
+    return lapic_read(LAPIC_ID) >> 24;
+}
+
+void lapic_eoi(void)
+{
+    if (lapic_base) lapic_write(LAPIC_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint32_t icr_low)
+{
+    if (!lapic_base) return;
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR_LOW, icr_low);
+    while (lapic_read(LAPIC_ICR_LOW) & LAPIC_ICR_PENDING) {
+        __asm__ volatile("pause");
+    }
+}
+
+void lapic_udelay(uint32_t us)
+{
+    while (us--) outb(0x80, 0);
+}
+
+static void lapic_timer_set_next_event(uint64_t delta_ns)
+{
+    uint32_t count = (uint32_t)((delta_ns * timer_count_mult) >> 32);
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, count ? count : 1);
+}
+
+static void lapic_timer_set_periodic(void)
+{
+    lapic_write(LAPIC_LVT_TIMER, TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_TIMER_INITIAL, timer_tick_count);
+}
+
+static void lapic_timer_shutdown(void)
+{
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+}
+
+static struct clock_event_device lapic_clockevent = {
+    .name = "lapic",
+    .rating = 300,
+    .features = CLOCK_EVT_FEAT_ONESHOT | CLOCK_EVT_FEAT_PERIODIC,
+    .min_delta_ns = 1000,
+    .set_next_event = lapic_timer_set_next_event,
+    .set_periodic = lapic_timer_set_periodic,
+    .shutdown = lapic_timer_shutdown,
+};
+
+static int lapic_timer_calibrate(void)
+{
+    /* Count down from the top across a window timed by PIT channel 2 */
+    uint32_t flags = irq_save();
+    lapic_write(LAPIC_LVT_TIMER, LAPIC_LVT_MASKED);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xFFFFFFFF);
+    clock_pit_wait(TIMER_CALIBRATE_US);
+    uint32_t counted = 0xFFFFFFFF - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    irq_restore(flags);
+    
+    if (counted < TIMER_CALIBRATE_US) {
+        serial_puts("[lapic] Timer calibration failed\n");
+        return -1;
+    }
+    
+    timer_count_mult = (uint32_t)clock_div64((uint64_t)counted << 32, TIMER_CALIBRATE_US * 1000);
+    timer_tick_count = (uint32_t)clock_div64((uint64_t)counted * (TIMER_TICK_NS / 1000),
+                                             TIMER_CALIBRATE_US);
+    
+    /* Longest one-shot the 32-bit count holds, kept short enough not to overflow above */
+    uint64_t max_ns = clock_div64(0xFFFFFFFFull << 32, timer_count_mult);
+    lapic_clockevent.max_delta_ns = max_ns < 2 * CLOCKEVENT_NOHZ_MAX_NS ? max_ns
+                                                                       : 2 * CLOCKEVENT_NOHZ_MAX_NS;
+    
+    serial_printf("[lapic] Timer %d counts per tick\n", (int)timer_tick_count);
+    return 0;
+}
+
+int lapic_timer_init(void)
+{
+    if (!lapic_base) return -1;
+    
+    lapic_write(LAPIC_TIMER_DIVIDE, TIMER_DIVIDE_16);
+    if (!timer_count_mult && lapic_timer_calibrate() != 0) return -1;
+    return clockevent_register(&lapic_clockevent);
+}
@@ -0,0 +1,201 @@
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/lapic.h"
+#include "../../include/kernel/gdt.h"
+#include "../../include/kernel/idt.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/pmem.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/thread.h"
+#include "../../include/kernel/serial.h"
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Symmetric multiprocessing bring-up.
+ *
+ * The BSP copies the real-mode trampoline (ap_boot.s) below 1 MB and
+ * broadcasts INIT-SIPI-SIPI to every other CPU.  Each AP takes the next
+ * free struct cpu, records its APIC id so smp_this_cpu() can find it,
+ * and then sits in an idle loop: it runs cross-CPU calls, follows the
+ * global tick for scheduling and, with nothing of its own to run, steals
+ * from the busiest run queue (see scheduler.c).  That loop is the AP's
+ * boot thread; kernel threads created on the AP run when it idles.
+ * With its APIC timer running, an idle AP halts between events; anyone
+ * handing it work while it is halted sends a kick IPI.
+ */
+
+#define AP_TRAMPOLINE_BASE 0x8000       /* Must match ap_boot.s */
+#define AP_STACK_PAGES 2
+#define AP_STARTUP_WAIT_US 100000
+
+/* Filled into the copied trampoline; layout matches ap_boot.s */
+struct ap_boot_params {
+    uint32_t cr3;
+    uint32_t cr4;
+    uint32_t entry;
+    uint32_t stack_next;
+    uint32_t stack_size;
+    uint32_t stack_limit;
+};
+
+extern uint8_t ap_trampoline_start[];
+extern uint8_t ap_trampoline_end[];
+extern uint8_t ap_trampoline_params[];
+
+static struct cpu cpus[SMP_MAX_CPUS];
+static volatile int cpu_count = 1;
+static uint8_t apic_to_cpu[256];
+
+struct cpu *smp_cpu(int index)
+{
+    if (index < 0 || index >= SMP_MAX_CPUS) return NULL;
+    return &cpus[index];
+}
+
+struct cpu *smp_this_cpu(void)
+{
+    if (!lapic_available()) return &cpus[0];
+    return &cpus[apic_to_cpu[lapic_id() & 0xFF]];
+}
+
+int smp_cpu_count(void)
+{
+    return cpu_count < SMP_MAX_CPUS ? cpu_count : SMP_MAX_CPUS;
+}
+
+int smp_call(int index, void (*fn)(void *), void *arg)
+{
+    struct cpu *cpu = smp_cpu(index);
+    if (!cpu || !cpu->online || !fn) return -1;
+    
+    if (cpu == smp_this_cpu()) {
+        fn(arg);
+        return 0;
+    }
+    if (cpu->work) return -1;
+    
+    cpu->work_arg = arg;
+    __sync_synchronize();
+    cpu->work = fn;
+    __sync_synchronize();
+    if (cpu->halted) smp_kick(index);
+    return 0;
+}
+
+void smp_wait(int index)
+{
+    struct cpu *cpu = smp_cpu(index);
+    if (!cpu) return;
+    while (cpu->work) {
+        __asm__ volatile("pause");
+    }
+}
+
+void smp_kick(int index)
+{
+    struct cpu *cpu = smp_cpu(index);
+    if (!cpu || !cpu->online || !lapic_available() || cpu == smp_this_cpu()) return;
+    lapic_send_ipi(cpu->apic_id, LAPIC_ICR_ASSERT | LAPIC_KICK_VECTOR);
+}
+
+void smp_ap_main(void)
+{
+    gdt_reload();
+    idt_reload();
+    lapic_enable();
+    
+    int index = __sync_fetch_and_add(&cpu_count, 1);
+    if (index >= SMP_MAX_CPUS) {
+        for (;;) __asm__ volatile("cli; hlt");
+    }
+    
+    struct cpu *cpu = &cpus[index];
+    cpu->index = (uint32_t)index;
+    cpu->apic_id = lapic_id();
+    apic_to_cpu[cpu->apic_id & 0xFF] = (uint8_t)index;
+    cpu->last_tick = (uint32_t)timer_get_ticks();
+    thread_cpu_init();
+    __sync_synchronize();
+    cpu->online = 1;
+    lapic_timer_init();
+    
+    for (;;) {
+        void (*fn)(void *) = cpu->work;
+        if (fn) {
+            fn(cpu->work_arg);
+            __sync_synchronize();
+            cpu->work = NULL;
+            continue;
+        }
+        
+        uint32_t now = (uint32_t)timer_get_ticks();
+        if (now != cpu->last_tick) {
+            /* A tickless halt may have slept through several ticks */
+            uint32_t elapsed = now - cpu->last_tick;
+            cpu->last_tick = now;
+            if (cpu->current) {
+                cpu->busy_ticks += elapsed;
+                scheduler_tick();
+            } else {
+                cpu->idle_ticks += elapsed;
+                scheduler_idle();
+            }
+        }
+        thread_idle();
+    }
+}
+
+void smp_init(void)
+{
+    cpus[0].index = 0;
+    cpus[0].online = 1;
+    
+    if (lapic_init() != 0) {
+        serial_puts("[smp] No local APIC, running on one CPU\n");
+        return;
+    }
+    cpus[0].apic_id = lapic_id();
+    apic_to_cpu[cpus[0].apic_id & 0xFF] = 0;
+    lapic_timer_init();
+    
+    uint32_t stack_size = AP_STACK_PAGES * PAGE_SIZE;
+    uint32_t stacks = pmem_alloc_pages((SMP_MAX_CPUS - 1) * AP_STACK_PAGES);
+    if (!stacks) {
+        serial_puts("[smp] Cannot allocate AP stacks\n");
+        return;
+    }
+    
+    uint32_t size = (uint32_t)(ap_trampoline_end - ap_trampoline_start);
+    memcpy((void *)AP_TRAMPOLINE_BASE, ap_trampoline_start, size);
+    
+    struct ap_boot_params *params = (struct ap_boot_params *)
+        (AP_TRAMPOLINE_BASE + (uint32_t)(ap_trampoline_params - ap_trampoline_start));
+    uint32_t cr4;
+    __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+    params->cr3 = (uint32_t)get_page_directory();
+    params->cr4 = cr4;
+    params->entry = (uint32_t)smp_ap_main;
+    params->stack_size = stack_size;
+    params->stack_next = stacks + stack_size;
+    params->stack_limit = stacks + (SMP_MAX_CPUS - 1) * stack_size;
+    
+    /* INIT, wait 10 ms, then two STARTUPs pointing at the trampoline page */
+    lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_ASSERT | LAPIC_ICR_INIT);
+    lapic_udelay(10000);
+    for (int i = 0; i < 2; i++) {
+        lapic_send_ipi(0, LAPIC_ICR_ALL_BUT_SELF | LAPIC_ICR_ASSERT | LAPIC_ICR_STARTUP |
+                          (AP_TRAMPOLINE_BASE >> 12));
+        lapic_udelay(200);
+    }
+    lapic_udelay(AP_STARTUP_WAIT_US);
+    
+    /* Every AP that took a slot finishes coming online */
+    int n = smp_cpu_count();
+    for (int i = 1; i < n; i++) {
+        while (!cpus[i].online) {
+            __asm__ volatile("pause");
+        }
+    }
+    
+    serial_printf("[smp] %d CPU(s) online\n", n);
+}
@@ -1,22 +1,51 @@
 #include "../../include/kernel/device.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/heap.h"
+#include "../../include/kernel/rcu.h"
+#include "../../include/kernel/smp.h"
 #include <stddef.h>
 #include <string.h>
 
 #define MAX_DEVICES 128
 
+/*
+ * Registry slots point at heap entries published with RCU, so lookups
+ * take no lock.  Register and unregister serialize on registry_lock; an
+ * unregistered entry is freed only after a grace period, so a pointer
+ * returned by a lookup stays valid until the caller next sleeps.
+ * Lookup counters are kept per CPU to keep readers off shared lines.
+ */
 typedef struct {
+    struct rcu_head rcu;         /* First, so the RCU callback can cast back */
     device_t device;
-    int in_use;
 } device_entry_t;
 
-static device_entry_t device_registry[MAX_DEVICES];
+struct device_lookup_counts {
+    uint32_t by_id;
+    uint32_t by_name;
+    uint32_t failures;
+} __attribute__((aligned(64)));
+
+static device_entry_t *device_registry[MAX_DEVICES];
+static struct device_lookup_counts lookup_counts[SMP_MAX_CPUS];
 static device_stats_t device_stats = {0};
 static uint32_t next_device_id = 1;
+static spinlock_t registry_lock = SPINLOCK_INIT;
+
+static inline struct device_lookup_counts *this_cpu_counts(void)
+{
+    return &lookup_counts[smp_this_cpu()->index];
+}
+
+static void device_entry_free(struct rcu_head *head)
+{
+    kfree((device_entry_t *)head);
+}
 
 void device_init(void)
 {
     memset(device_registry, 0, sizeof(device_registry));
+    memset(lookup_counts, 0, sizeof(lookup_counts));
     memset(&device_stats, 0, sizeof(device_stats));
     next_device_id = 1;
     
@@ -29,31 +58,39 @@ int device_register(const char *name, device_class_t device_class, void *driver_
         return -1;
     }
     
+    device_entry_t *entry = (device_entry_t *)kmalloc(sizeof(device_entry_t));
+    if (!entry) return -1;
+    memset(entry, 0, sizeof(device_entry_t));
+    
+    uint32_t flags = spin_lock_irqsave(&registry_lock);
+    
     /* Find free entry */
     int free_idx = -1;
     for (int i = 0; i < MAX_DEVICES; i++) {
-        if (!device_registry[i].in_use) {
+        if (!device_registry[i]) {
             free_idx = i;
             break;
         }
     }
     
     if (free_idx < 0) {
+        spin_unlock_irqrestore(&registry_lock, flags);
+        kfree(entry);
         serial_puts("[device] Registry full\n");
         return -1;
     }
     
-    /* Initialize device */
-    device_entry_t *entry = &device_registry[free_idx];
+    /* Initialize device before readers can see it */
     entry->device.id = next_device_id++;
     entry->device.name = name;
     entry->device.device_class = device_class;
     entry->device.state = DEVICE_REGISTERED;
     entry->device.driver_data = driver_data;
     entry->device.flags = 0;
-    entry->in_use = 1;
+    rcu_assign_pointer(device_registry[free_idx], entry);
     
     device_stats.total_registered++;
+    spin_unlock_irqrestore(&registry_lock, flags);
     
     serial_printf("[device] Registered device %d: %s (class %d)\n", 
                   entry->device.id, name, device_class);
@@ -65,54 +102,68 @@ int device_unregister(uint32_t device_id)
 {
     if (device_id == 0) return -1;
     
+    device_entry_t *entry = NULL;
+    uint32_t flags = spin_lock_irqsave(&registry_lock);
     for (int i = 0; i < MAX_DEVICES; i++) {
-        if (device_registry[i].in_use && device_registry[i].device.id == device_id) {
-            device_registry[i].device.state = DEVICE_REMOVED;
-            device_registry[i].in_use = 0;
-            
-            serial_printf("[device] Unregistered device %d\n", device_id);
-            return 0;
+        if (device_registry[i] && device_registry[i]->device.id == device_id) {
+            entry = device_registry[i];
+            entry->device.state = DEVICE_REMOVED;
+            rcu_assign_pointer(device_registry[i], NULL);
+            break;
         }
     }
+    spin_unlock_irqrestore(&registry_lock, flags);
     
-    return -1;
+    if (!entry) return -1;
+    
+    call_rcu(&entry->rcu, device_entry_free);
+    serial_printf("[device] Unregistered device %d\n", device_id);
+    return 0;
 }
 
 device_t *device_get_by_id(uint32_t device_id)
 {
+    struct device_lookup_counts *counts = this_cpu_counts();
     if (device_id == 0) {
-        device_stats.lookup_failures++;
+        counts->failures++;
         return NULL;
     }
     
+    rcu_read_lock();
     for (int i = 0; i < MAX_DEVICES; i++) {
-        if (device_registry[i].in_use && device_registry[i].device.id == device_id) {
-            device_stats.lookups_by_id++;
-            return &device_registry[i].device;
+        device_entry_t *entry = rcu_dereference(device_registry[i]);
+        if (entry && entry->device.id == device_id) {
+            rcu_read_unlock();
+            counts->by_id++;
+            return &entry->device;
         }
     }
+    rcu_read_unlock();
     
-    device_stats.lookup_failures++;
+    counts->failures++;
     return NULL;
 }
 
 device_t *device_get_by_name(const char *name)
 {
+    struct device_lookup_counts *counts = this_cpu_counts();
     if (!name) {
-        device_stats.lookup_failures++;
+        counts->failures++;
         return NULL;
     }
     
+    rcu_read_lock();
     for (int i = 0; i < MAX_DEVICES; i++) {
-        if (device_registry[i].in_use && device_registry[i].device.name) {
-            if (strcmp(device_registry[i].device.name, name) == 0) {
-                device_stats.lookups_by_name++;
-                return &device_registry[i].device;
-            }
+        device_entry_t *entry = rcu_dereference(device_registry[i]);
+        if (entry && entry->device.name && strcmp(entry->device.name, name) == 0) {
+            rcu_read_unlock();
+            counts->by_name++;
+            return &entry->device;
         }
     }
+    rcu_read_unlock();
     
-    device_stats.lookup_failures++;
+    counts->failures++;
     return NULL;
 }
 
@@ -140,17 +191,21 @@ device_t *device_get_by_class(device_class_t device_class, int index)
     }
     
     int count = 0;
+    device_t *found = NULL;
+    rcu_read_lock();
     for (int i = 0; i < MAX_DEVICES; i++) {
-        if (device_registry[i].in_use && 
-            device_registry[i].device.device_class == device_class) {
+        device_entry_t *entry = rcu_dereference(device_registry[i]);
+        if (entry && entry->device.device_class == device_class) {
             if (count == index) {
-                return &device_registry[i].device;
+                found = &entry->device;
+                break;
             }
             count++;
         }
     }
+    rcu_read_unlock();
     
-    return NULL;
+    return found;
 }
 
 int device_count_by_class(device_class_t device_class)
@@ -158,17 +213,27 @@ int device_count_by_class(device_class_t device_class)
     if (device_class < 1 || device_class > 5) return -1;
     
     int count = 0;
+    rcu_read_lock();
     for (int i = 0; i < MAX_DEVICES; i++) {
-        if (device_registry[i].in_use && 
-            device_registry[i].device.device_class == device_class) {
+        device_entry_t *entry = rcu_dereference(device_registry[i]);
+        if (entry && entry->device.device_class == device_class) {
             count++;
         }
     }
+    rcu_read_unlock();
     
     return count;
 }
 
 device_stats_t *device_get_stats(void)
 {
+    device_stats.lookups_by_id = 0;
+    device_stats.lookups_by_name = 0;
+    device_stats.lookup_failures = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        device_stats.lookups_by_id += lookup_counts[i].by_id;
+        device_stats.lookups_by_name += lookup_counts[i].by_name;
+        device_stats.lookup_failures += lookup_counts[i].failures;
+    }
     return &device_stats;
 }
@@ -2,8 +2,19 @@
 #include "../../include/kernel/console.h"
 #include "../../include/kernel/keyboard.h"
 #include "../../include/kernel/task.h"
+#include "../../include/kernel/thread.h"
+#include "../../include/kernel/sched_trace.h"
+#include "../../include/kernel/smp.h"
 #include "../../include/kernel/timer.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/clockevent.h"
+#include "../../include/kernel/hrtimer.h"
+#include "../../include/kernel/irq_mgr.h"
 #include "../../include/kernel/pmem.h"
+#include "../../include/kernel/heap.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/slab.h"
+#include "../../include/kernel/dma.h"
 #include "../../include/kernel/vga.h"
 #include "../fs/vfs.h"
 #include <string.h>
@@ -71,6 +82,18 @@ static int streq(const char *a, const char *b)
     return strcmp(a, b) == 0;
 }
 
+/* Decimal argument; -1 if it is not one */
+static int parse_uint(const char *s)
+{
+    if (!*s) return -1;
+    int n = 0;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9' || n > 100000000) return -1;
+        n = n * 10 + (*s - '0');
+    }
+    return n;
+}
+
 static int parse_args(char *cmd, char *argv[])
 {
     int argc = 0;
@@ -104,6 +127,14 @@ static void cmd_help(void)
     console_puts("  ps        List tasks\n");
     console_puts("  uptime    Show system uptime\n");
     console_puts("  mem       Show memory statistics\n");
+    console_puts("  buddyinfo Free blocks and fragmentation per order\n");
+    console_puts("  slabinfo  Object cache statistics\n");
+    console_puts("  heapstat  Kernel heap usage and fragmentation\n");
+    console_puts("  dmastat   DMA buffers, pools and scatter-gather merging\n");
+    console_puts("  schedstat Task run/wait/sleep time, latency histogram [trace]\n");
+    console_puts("  timerstat Clock devices, timer IRQs and idle wakeups [nohz on|off]\n");
+    console_puts("  softirqs  Deferred interrupt work per vector and ksoftirqd\n");
+    console_puts("  irqtop    Costliest IRQ lines, live [<irq> | budget <us>]\n");
     console_puts("  version   Print NexusOS version\n");
     console_puts("  reboot    Reboot the system\n");
     console_puts("\nFiles:\n");
@@ -192,6 +223,334 @@ static void cmd_mem(void)
     console_printf("  Total : %u KB (%u pages)\n", total_pages * 4, total_pages);
     console_printf("  Used  : %u KB (%u pages)\n", used_pages  * 4, used_pages);
     console_printf("  Free  : %u KB (%u pages)\n", free_pages  * 4, free_pages);
+
+    struct paging_stats ps;
+    paging_get_stats(&ps);
+    console_printf("Copy-on-write:\n");
+    console_printf("  Forks : %u (%u pages shared)\n", ps.forks, ps.pages_shared);
+    console_printf("  Faults: %u (%u copied, %u reused)\n",
+                   ps.cow_faults, ps.cow_copies, ps.cow_reuses);
+    console_printf("Demand paging:\n");
+    console_printf("  Paged in: %u of %u image pages, %u faults (%u zero-filled)\n",
+                   ps.image_faults, ps.image_pages, ps.demand_faults, ps.demand_zero_fills);
+}
+
+static void cmd_buddyinfo(void)
+{
+    uint32_t free_pages = pmem_get_free_pages();
+
+    /*
+     * Fragmentation for order k is the share of free memory sitting in
+     * blocks too small to satisfy an order-k request.
+     */
+    console_puts("ORDER  BLOCKS  FREE_KB  FRAG%\n");
+    uint32_t usable = free_pages;
+    for (int order = 0; order < PMEM_MAX_ORDER; order++) {
+        uint32_t blocks = pmem_get_free_blocks(order);
+        uint32_t frag = free_pages ? ((free_pages - usable) * 100) / free_pages : 0;
+        console_printf("%d\t%u\t%u\t%u\n", order, blocks,
+                       (blocks << order) * 4, frag);
+        usable -= blocks << order;
+    }
+    console_printf("Free: %u pages\n", free_pages);
+}
+
+static void cmd_dmastat(void)
+{
+    dma_stats_t *st = dma_get_stats();
+    console_printf("Buffers: %u allocated, %u freed, %u KB (%u coherent, %u non-coherent)\n",
+                   st->total_buffers_allocated, st->total_buffers_freed,
+                   st->bytes_dma_allocated / 1024, st->coherent_allocations,
+                   st->non_coherent_allocations);
+    console_printf("SG map : %u requests, %u pages -> %u segments (%u.%u%u per request)\n",
+                   st->sg_map_requests, st->sg_map_pages, st->sg_map_segments,
+                   st->sg_segments_per_request_x100 / 100,
+                   (st->sg_segments_per_request_x100 / 10) % 10,
+                   st->sg_segments_per_request_x100 % 10);
+
+    dma_pool_stats_t ps;
+    console_puts("POOL        SIZE  ALIGN  CHUNKS  IN_USE  TOTAL  FAILS\n");
+    for (int i = 0; i < DMA_MAX_POOLS; i++) {
+        if (dma_pool_get_stats(i, &ps) != 0) continue;
+        console_printf("%s\t%u\t%u\t%u\t%u\t%u\t%u\n", ps.name, ps.block_size, ps.align,
+                       ps.chunks, ps.blocks_in_use, ps.blocks_total, ps.failures);
+    }
+}
+
+static void cmd_slabinfo(void)
+{
+    kmem_cache_stats_t st;
+    console_puts("CACHE       SIZE  ACTIVE  SLABS  HITS  MISSES  FREES\n");
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (kmem_cache_get_stats(i, &st) != 0) continue;
+        console_printf("%s\t%u\t%u\t%u\t%u\t%u\t%u\n", st.name, st.object_size,
+                       st.active_objects, st.slabs, st.hits, st.misses, st.frees);
+    }
+}
+
+static void cmd_heapstat(void)
+{
+    heap_stats_t st;
+    heap_get_stats(&st);
+
+    console_printf("  Heap    : %u KB in %u pools\n", st.heap_size / 1024, st.pools);
+    console_printf("  Live    : %u bytes\n", st.live_bytes);
+    console_printf("  Free    : %u bytes in %u blocks\n", st.free_bytes, st.free_blocks);
+    console_printf("  Largest : %u bytes\n", st.largest_free);
+    console_printf("  Frag    : %u%%\n", st.fragmentation_pct);
+    console_printf("  Allocs  : %u  Frees: %u\n", st.allocs, st.frees);
+}
+
+/* Nonzero buckets of a log2 cycle histogram, with bars scaled to the peak */
+static void print_histogram(const char *title, const uint32_t *hist, int nbuckets)
+{
+    uint32_t peak = 0;
+    for (int b = 0; b < nbuckets; b++) {
+        if (hist[b] > peak) peak = hist[b];
+    }
+    console_printf("%s\n", title);
+    if (!peak) {
+        console_puts("  (no samples)\n");
+        return;
+    }
+    for (int b = 0; b < nbuckets; b++) {
+        if (!hist[b]) continue;
+        console_printf("  >=2^%d\t%u\t", b, hist[b]);
+        uint32_t bar = (hist[b] * 30 + peak - 1) / peak;
+        for (uint32_t i = 0; i < bar; i++) console_putchar('#');
+        console_putchar('\n');
+    }
+}
+
+static const char *trace_type_name(uint8_t type)
+{
+    switch (type) {
+    case SCHED_TRACE_WAKEUP:  return "wakeup ";
+    case SCHED_TRACE_SWITCH:  return "switch ";
+    case SCHED_TRACE_MIGRATE: return "migrate";
+    case SCHED_TRACE_BLOCK:   return "block  ";
+    default:                  return "?      ";
+    }
+}
+
+/* Last few tracepoints of every online CPU */
+static void schedstat_trace(void)
+{
+    static struct sched_trace_record records[16];
+    for (int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        int n = sched_trace_read(cpu, records, 16);
+        console_printf("CPU %d:\n", cpu);
+        for (int i = 0; i < n; i++) {
+            console_printf("  %x %s task %u arg %u\n", (uint32_t)records[i].tsc,
+                           trace_type_name(records[i].type), records[i].task, records[i].arg);
+        }
+    }
+}
+
+static void cmd_schedstat(int argc, char *argv[])
+{
+    if (argc > 1 && strcmp(argv[1], "trace") == 0) {
+        schedstat_trace();
+        return;
+    }
+    
+    /* Times in units of 2^20 cycles, to stay clear of 64-bit division */
+    console_puts("PID  STATE    RUN(Mc)  WAIT(Mc) SLEEP(Mc) SWITCHES CPU MIGR  MASK\n");
+    for (int i = 0; i < task_get_count(); i++) {
+        struct task *t = task_get(i);
+        if (!t) continue;
+        console_printf("%d\t%s\t%u\t %u\t  %u\t    %u\t     %d   %u\t  %x\n", t->id,
+                       state_name(t->state), (uint32_t)(t->run_cycles >> 20),
+                       (uint32_t)(t->wait_cycles >> 20), (uint32_t)(t->sleep_cycles >> 20),
+                       t->nr_switches, t->cpu, t->nr_migrations,
+                       t->cpus_allowed & ((1u << SMP_MAX_CPUS) - 1));
+    }
+    
+    static struct sched_trace_summary summary;
+    sched_trace_get_summary(&summary);
+    console_printf("\nwakeups %u  switches %u  migrations %u  blocks %u\n",
+                   summary.wakeups, summary.switches, summary.migrations, summary.blocks);
+    
+    struct sched_place_stats place;
+    scheduler_get_place_stats(&place);
+    console_printf("placement: prev %u  idle %u  balanced %u  affinity %u  steal-skips %u\n",
+                   place.wake_prev, place.wake_idle, place.wake_balanced,
+                   place.affinity_moves, place.steal_skipped);
+    print_histogram("Wakeup-to-run latency (cycles):", summary.latency_hist,
+                    SCHED_TRACE_HIST_BUCKETS);
+    print_histogram("Reschedule cost (cycles):", summary.switch_hist,
+                    SCHED_TRACE_HIST_BUCKETS);
+}
+
+static const char *clockevent_mode_name(int mode)
+{
+    switch (mode) {
+    case CLOCK_EVT_MODE_PERIODIC: return "periodic";
+    case CLOCK_EVT_MODE_ONESHOT:  return "one-shot";
+    default:                      return "off     ";
+    }
+}
+
+/* Timer interrupts and idle halts per CPU, counted over one second */
+static void cmd_timerstat(int argc, char *argv[])
+{
+    if (argc > 2 && strcmp(argv[1], "nohz") == 0) {
+        clockevent_set_nohz(strcmp(argv[2], "on") == 0);
+        console_printf("Tickless idle %s\n", clockevent_nohz_enabled() ? "on" : "off");
+        return;
+    }
+    
+    static struct clockevent_cpu_stats before[SMP_MAX_CPUS];
+    static uint32_t halts[SMP_MAX_CPUS];
+    int n = smp_cpu_count();
+    for (int i = 0; i < n; i++) {
+        clockevent_get_stats(i, &before[i]);
+        halts[i] = smp_cpu(i)->idle_halts;
+    }
+    thread_sleep_ms(1000);
+    
+    console_printf("Clock: TSC %u kHz, tickless idle %s\n", clock_tsc_khz(),
+                   clockevent_nohz_enabled() ? "on" : "off");
+    console_puts("CPU  DEVICE  MODE      IRQ/s  HALT/s  NOHZ/s\n");
+    for (int i = 0; i < n; i++) {
+        struct clockevent_cpu_stats st;
+        if (clockevent_get_stats(i, &st) != 0) continue;
+        console_printf("%d\t%s\t%s  %u\t%u\t%u\n", i, st.device ? st.device : "none",
+                       clockevent_mode_name(st.mode), st.events - before[i].events,
+                       smp_cpu(i)->idle_halts - halts[i], st.nohz_entries - before[i].nohz_entries);
+    }
+    
+    struct hrtimer_stats hr;
+    hrtimer_get_stats(&hr);
+    uint32_t avg = hr.fired ? (uint32_t)clock_div64(hr.late_ns, hr.fired) : 0;
+    console_printf("\nhrtimers: %u armed, %u fired, %u pending; late avg %u ns, max %u ns\n",
+                   hr.armed, hr.fired, hr.pending, avg, hr.max_late_ns);
+}
+
+static const char *softirq_names[NR_SOFTIRQS] = {
+    "NET_RX", "BLOCK", "TASKLET", "SCHED"
+};
+
+/* Softirq vectors, cycles in units of 2^10 */
+static void cmd_softirqs(void)
+{
+    console_puts("VECTOR   RAISED   RUNS     RUN(Kc)  MAX(c)\n");
+    for (int i = 0; i < NR_SOFTIRQS; i++) {
+        softirq_stats_t st;
+        if (softirq_get_stats(i, &st) != 0) continue;
+        console_printf("%s\t %u\t  %u\t   %u\t    %u\n", softirq_names[i], st.raised, st.runs,
+                       (uint32_t)(st.run_cycles >> 10), st.max_cycles);
+    }
+    
+    console_puts("\nCPU  PENDING  DEFERRED  KSOFTIRQD  RUNS\n");
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        softirq_cpu_stats_t cs;
+        if (softirq_get_cpu_stats(i, &cs) != 0) continue;
+        console_printf("%d    %x\t     %u\t       %d\t  %u\n", i, cs.pending, cs.deferrals,
+                       cs.ksoftirqd_id, cs.ksoftirqd_runs);
+    }
+}
+
+#define IRQTOP_LINES  IRQ_MAX_LINES
+#define IRQTOP_ROUNDS 10
+
+/* Smallest bucket holding 99% of the samples */
+static int hist_p99(const uint32_t *hist, uint32_t samples)
+{
+    uint32_t seen = 0;
+    for (int b = 0; b < IRQ_HIST_BUCKETS; b++) {
+        seen += hist[b];
+        if ((uint64_t)seen * 100 >= (uint64_t)samples * 99) return b;
+    }
+    return IRQ_HIST_BUCKETS - 1;
+}
+
+static void irqtop_line(int irq)
+{
+    irq_stats_t *st = irq_get_stats((uint32_t)irq);
+    if (!st) {
+        console_puts("irqtop: no such IRQ line\n");
+        return;
+    }
+    uint32_t avg_eoi = st->total_interrupts ?
+        (uint32_t)clock_div64(st->eoi_cycles, st->total_interrupts) : 0;
+    const char *chip = irq_get_chip_name((uint32_t)irq);
+    console_printf("IRQ %d (vector %d, %s, CPU %d): %u interrupts, %u missed, %u handlers, "
+                   "%u over budget\n", irq, IRQ_VECTOR_BASE + irq, chip ? chip : "free",
+                   irq_get_affinity((uint32_t)irq), st->total_interrupts, st->missed_count,
+                   st->handler_count, st->over_budget);
+    console_printf("max handler %u c, max latency %u c, entry-to-EOI avg %u c, max %u c\n",
+                   st->max_cycles, st->max_latency, avg_eoi, st->max_eoi_cycles);
+    print_histogram("Entry latency (cycles):", st->latency_hist, IRQ_HIST_BUCKETS);
+    print_histogram("Handler duration (cycles):", st->duration_hist, IRQ_HIST_BUCKETS);
+}
+
+/*
+ * Lines ranked by handler time over the last second, refreshed until a
+ * key is pressed.  Counters are cumulative, so each round diffs a copy.
+ */
+static void cmd_irqtop(int argc, char *argv[])
+{
+    if (argc > 2 && streq(argv[1], "budget")) {
+        int us = parse_uint(argv[2]);
+        if (us <= 0 || irq_set_budget_us((uint32_t)us) != 0) {
+            console_puts("usage: irqtop budget <us>\n");
+            return;
+        }
+        console_printf("IRQ handler budget %u us\n", irq_get_budget_us());
+        return;
+    }
+    if (argc > 1) {
+        irqtop_line(parse_uint(argv[1]));
+        return;
+    }
+    
+    static irq_stats_t prev[IRQTOP_LINES];
+    for (int i = 0; i < IRQTOP_LINES; i++) prev[i] = *irq_get_stats((uint32_t)i);
+    
+    for (int round = 0; round < IRQTOP_ROUNDS && !keyboard_has_input(); round++) {
+        thread_sleep_ms(1000);
+        
+        static uint32_t hist[IRQTOP_LINES][IRQ_HIST_BUCKETS];
+        uint32_t cycles[IRQTOP_LINES];
+        int order[IRQTOP_LINES];
+        int shown = 0;
+        for (int i = 0; i < IRQTOP_LINES; i++) {
+            irq_stats_t *st = irq_get_stats((uint32_t)i);
+            cycles[i] = (uint32_t)(st->run_cycles - prev[i].run_cycles);
+            for (int b = 0; b < IRQ_HIST_BUCKETS; b++) {
+                hist[i][b] = st->duration_hist[b] - prev[i].duration_hist[b];
+            }
+            if (st->total_interrupts == prev[i].total_interrupts) continue;
+            
+            /* Insertion sort, costliest first */
+            int pos = shown++;
+            while (pos > 0 && cycles[order[pos - 1]] < cycles[i]) {
+                order[pos] = order[pos - 1];
+                pos--;
+            }
+            order[pos] = i;
+        }
+        
+        vga_clear();
+        console_printf("irqtop: budget %u us, round %d/%d, any key stops\n",
+                       irq_get_budget_us(), round + 1, IRQTOP_ROUNDS);
+        console_puts("IRQ  INT/s   CYC/s     AVG(c)  P99(c)  MAX(c)    OVER\n");
+        for (int k = 0; k < shown; k++) {
+            int i = order[k];
+            irq_stats_t *st = irq_get_stats((uint32_t)i);
+            uint32_t ints = st->total_interrupts - prev[i].total_interrupts;
+            uint32_t calls = 0;
+            for (int b = 0; b < IRQ_HIST_BUCKETS; b++) calls += hist[i][b];
+            console_printf("%d    %u\t   %u\t     %u\t     <2^%d\t     %u\t       %u\n", i, ints,
+                           cycles[i], calls ? cycles[i] / calls : 0,
+                           hist_p99(hist[i], calls) + 1, st->max_cycles,
+                           st->over_budget - prev[i].over_budget);
+        }
+        if (!shown) console_puts("(no interrupts)\n");
+        for (int i = 0; i < IRQTOP_LINES; i++) prev[i] = *irq_get_stats((uint32_t)i);
+    }
+    if (keyboard_has_input()) keyboard_getchar();
 }
 
 static void cmd_version(void)
@@ -415,6 +774,14 @@ static void dispatch(char *line)
     else if (streq(argv[0], "ps"))      cmd_ps();
     else if (streq(argv[0], "uptime"))  cmd_uptime();
     else if (streq(argv[0], "mem"))     cmd_mem();
+    else if (streq(argv[0], "buddyinfo")) cmd_buddyinfo();
+    else if (streq(argv[0], "slabinfo"))  cmd_slabinfo();
+    else if (streq(argv[0], "heapstat"))  cmd_heapstat();
+    else if (streq(argv[0], "dmastat"))   cmd_dmastat();
+    else if (streq(argv[0], "schedstat")) cmd_schedstat(argc, argv);
+    else if (streq(argv[0], "timerstat")) cmd_timerstat(argc, argv);
+    else if (streq(argv[0], "softirqs")) cmd_softirqs();
+    else if (streq(argv[0], "irqtop"))  cmd_irqtop(argc, argv);
     else if (streq(argv[0], "version")) cmd_version();
     else if (streq(argv[0], "reboot"))  cmd_reboot();
     /* File commands */
@@ -459,7 +826,7 @@ void kshell_run(void)
     console_puts("nexus> ");
 
     while (1) {
-        __asm__ volatile("hlt");
+        thread_idle();
 
         while (keyboard_has_input()) {
             int ch = keyboard_getchar();
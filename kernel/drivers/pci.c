@@ -1,5 +1,10 @@
 #include "../../include/kernel/pci.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/irq_mgr.h"
+#include "../../include/kernel/lapic.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/spinlock.h"
+#include "../../include/kernel/paging.h"
 #include <string.h>
 
 /* PCI Configuration Space Access I/O Ports (Type 1) */
@@ -11,6 +16,16 @@
 static pci_device_t pci_devices[MAX_PCI_DEVICES];
 static int pci_device_count_total = 0;
 
+/* One per message-signalled line: the device and MSI-X entry behind it */
+struct pci_msi_desc {
+    pci_device_t *dev;              /* NULL if free */
+    uint16_t entry;                 /* MSI-X table index; 0 for MSI */
+    int16_t irq;
+};
+
+static struct pci_msi_desc msi_descs[IRQ_MAX_LINES - IRQ_LEGACY_LINES];
+static spinlock_t msi_lock = SPINLOCK_INIT;
+
 /* I/O port operations */
 static inline void outl(uint16_t port, uint32_t val)
 {
@@ -137,13 +152,21 @@ int pci_enumerate(void)
             dev->irq_line = pci_config_read8(0, slot, func, PCI_REG_IRQ_LINE);
             dev->irq_pin = pci_config_read8(0, slot, func, PCI_REG_IRQ_PIN);
             
+            /* Message-signalled interrupt capabilities */
+            dev->msi_cap = pci_find_capability(dev, PCI_CAP_ID_MSI);
+            dev->msix_cap = pci_find_capability(dev, PCI_CAP_ID_MSIX);
+            if (dev->msix_cap) {
+                uint16_t ctrl = pci_config_read16(0, slot, func, dev->msix_cap + PCI_MSIX_FLAGS);
+                dev->msix_size = (ctrl & PCI_MSIX_FLAGS_QSIZE) + 1;
+            }
+            
             /* Read BARs (Base Address Registers) */
             for (int i = 0; i < 6; i++) {
                 uint32_t bar_offset = PCI_REG_BAR0 + (i * 4);
                 dev->bars[i] = pci_config_read32(0, slot, func, bar_offset);
             }
             
-            serial_printf("[pci] Found device: %04X:%04X (slot=%d, func=%d, class=%02X)\n",
+            serial_printf("[pci] Found device: %x:%x (slot=%d, func=%d, class=%x)\n",
                           vendor_id, dev->device_id, slot, func, dev->class_code);
             
             found++;
@@ -209,7 +232,7 @@ void pci_enable_device(pci_device_t *dev)
     uint16_t command = dev->command | PCI_CMD_IO_SPACE | PCI_CMD_MEMORY_SPACE | PCI_CMD_BUS_MASTER;
     pci_config_write16(dev->bus, dev->slot, dev->function, PCI_REG_COMMAND, command);
     
-    serial_printf("[pci] Enabled device %04X:%04X\n", dev->vendor_id, dev->device_id);
+    serial_printf("[pci] Enabled device %x:%x\n", dev->vendor_id, dev->device_id);
 }
 
 void pci_disable_device(pci_device_t *dev)
@@ -220,7 +243,7 @@ void pci_disable_device(pci_device_t *dev)
     uint16_t command = dev->command & ~(PCI_CMD_IO_SPACE | PCI_CMD_MEMORY_SPACE);
     pci_config_write16(dev->bus, dev->slot, dev->function, PCI_REG_COMMAND, command);
     
-    serial_printf("[pci] Disabled device %04X:%04X\n", dev->vendor_id, dev->device_id);
+    serial_printf("[pci] Disabled device %x:%x\n", dev->vendor_id, dev->device_id);
 }
 
 uint32_t pci_get_bar_address(pci_device_t *dev, int bar_num)
@@ -265,3 +288,278 @@ uint32_t pci_get_bar_size(pci_device_t *dev, int bar_num)
         return (~(size_mask & 0xFFFFFFF0)) + 1;
     }
 }
+
+uint8_t pci_find_capability(pci_device_t *dev, uint8_t cap_id)
+{
+    if (!dev) return 0;
+    
+    uint16_t status = pci_config_read16(dev->bus, dev->slot, dev->function, PCI_REG_STATUS);
+    if (!(status & PCI_STATUS_CAP_LIST)) return 0;
+    
+    /* The list lives above the header; bound the walk against a looped list */
+    uint8_t ptr = pci_config_read8(dev->bus, dev->slot, dev->function, PCI_REG_CAP_PTR) & 0xFC;
+    for (int ttl = 48; ptr >= 0x40 && ttl > 0; ttl--) {
+        if (pci_config_read8(dev->bus, dev->slot, dev->function, ptr) == cap_id) return ptr;
+        ptr = pci_config_read8(dev->bus, dev->slot, dev->function, ptr + 1) & 0xFC;
+    }
+    return 0;
+}
+
+static void pci_set_intx(pci_device_t *dev, int enable)
+{
+    uint16_t command = pci_config_read16(dev->bus, dev->slot, dev->function, PCI_REG_COMMAND);
+    command = enable ? command & ~PCI_CMD_INTERRUPT : command | PCI_CMD_INTERRUPT;
+    pci_config_write16(dev->bus, dev->slot, dev->function, PCI_REG_COMMAND, command);
+}
+
+/* Fixed delivery, edge-triggered, physical destination */
+static inline uint32_t msi_address(uint32_t apic_id)
+{
+    return PCI_MSI_ADDRESS_BASE | (apic_id << 12);
+}
+
+static inline uint32_t msi_data(uint32_t irq)
+{
+    return IRQ_VECTOR_BASE + irq;
+}
+
+static inline volatile uint32_t *msix_entry(pci_device_t *dev, uint32_t entry)
+{
+    return dev->msix_table + entry * (PCI_MSIX_ENTRY_SIZE / 4);
+}
+
+/* Per-vector mask register of an MSI capability, 0 if it has none */
+static uint32_t msi_mask_reg(pci_device_t *dev)
+{
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->slot, dev->function,
+                                      dev->msi_cap + PCI_MSI_FLAGS);
+    if (!(ctrl & PCI_MSI_FLAGS_MASKBIT)) return 0;
+    return dev->msi_cap + ((ctrl & PCI_MSI_FLAGS_64BIT) ? 0x10 : 0x0C);
+}
+
+static void msi_set_mask(uint32_t irq, int masked)
+{
+    struct pci_msi_desc *desc = irq_get_chip_data(irq);
+    if (!desc || !desc->dev) return;
+    pci_device_t *dev = desc->dev;
+    
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        volatile uint32_t *entry = msix_entry(dev, desc->entry);
+        uint32_t ctrl = entry[3];
+        entry[3] = masked ? ctrl | PCI_MSIX_ENTRY_CTRL_MASKBIT
+                          : ctrl & ~PCI_MSIX_ENTRY_CTRL_MASKBIT;
+        return;
+    }
+    
+    /* Without per-vector masking an MSI source cannot be held off at the device */
+    uint32_t reg = msi_mask_reg(dev);
+    if (reg) pci_config_write32(dev->bus, dev->slot, dev->function, reg, masked ? 1 : 0);
+}
+
+static void msi_mask(uint32_t irq)
+{
+    msi_set_mask(irq, 1);
+}
+
+static void msi_unmask(uint32_t irq)
+{
+    msi_set_mask(irq, 0);
+}
+
+static void msi_eoi(uint32_t irq)
+{
+    (void)irq;
+    lapic_eoi();
+}
+
+static int msi_set_affinity(uint32_t irq, uint32_t apic_id)
+{
+    struct pci_msi_desc *desc = irq_get_chip_data(irq);
+    if (!desc || !desc->dev) return -1;
+    pci_device_t *dev = desc->dev;
+    
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        /* Hold the entry off while its address is half-written */
+        volatile uint32_t *entry = msix_entry(dev, desc->entry);
+        uint32_t ctrl = entry[3];
+        entry[3] = ctrl | PCI_MSIX_ENTRY_CTRL_MASKBIT;
+        entry[0] = msi_address(apic_id);
+        entry[3] = ctrl;
+    } else {
+        pci_config_write32(dev->bus, dev->slot, dev->function,
+                           dev->msi_cap + PCI_MSI_ADDRESS_LO, msi_address(apic_id));
+    }
+    return 0;
+}
+
+static const struct irq_chip msi_chip = {
+    .name = "msi",
+    .mask = msi_mask,
+    .unmask = msi_unmask,
+    .eoi = msi_eoi,
+    .set_affinity = msi_set_affinity,
+};
+
+/* A line for 'entry' of the device, or -1 */
+static int msi_alloc(pci_device_t *dev, uint16_t entry)
+{
+    struct pci_msi_desc *desc = NULL;
+    uint32_t flags = spin_lock_irqsave(&msi_lock);
+    for (int i = 0; i < IRQ_MAX_LINES - IRQ_LEGACY_LINES; i++) {
+        if (!msi_descs[i].dev) {
+            desc = &msi_descs[i];
+            desc->dev = dev;
+            desc->entry = entry;
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&msi_lock, flags);
+    if (!desc) return -1;
+    
+    int irq = irq_alloc_line(&msi_chip, desc);
+    if (irq < 0) {
+        desc->dev = NULL;
+        return -1;
+    }
+    desc->irq = (int16_t)irq;
+    return irq;
+}
+
+/* Give back every line of the device; they are masked on the way out */
+static void msi_free_all(pci_device_t *dev)
+{
+    for (int i = 0; i < IRQ_MAX_LINES - IRQ_LEGACY_LINES; i++) {
+        if (msi_descs[i].dev != dev) continue;
+        irq_free_line((uint32_t)msi_descs[i].irq);
+        msi_descs[i].dev = NULL;
+    }
+    dev->nr_irqs = 0;
+}
+
+int pci_enable_msi(pci_device_t *dev)
+{
+    if (!dev || !dev->msi_cap || dev->irq_mode >= PCI_IRQ_MSI || !lapic_available()) return -1;
+    
+    int irq = msi_alloc(dev, 0);
+    if (irq < 0) return -1;
+    dev->irq_mode = PCI_IRQ_MSI;
+    dev->nr_irqs = 1;
+    
+    uint32_t cap = dev->msi_cap;
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->slot, dev->function, cap + PCI_MSI_FLAGS);
+    uint32_t data_reg = cap + ((ctrl & PCI_MSI_FLAGS_64BIT) ? 0x0C : 0x08);
+    
+    pci_config_write32(dev->bus, dev->slot, dev->function, cap + PCI_MSI_ADDRESS_LO,
+                       msi_address(smp_cpu(0)->apic_id));
+    if (ctrl & PCI_MSI_FLAGS_64BIT) {
+        pci_config_write32(dev->bus, dev->slot, dev->function, cap + PCI_MSI_ADDRESS_HI, 0);
+    }
+    pci_config_write16(dev->bus, dev->slot, dev->function, data_reg, (uint16_t)msi_data(irq));
+    msi_mask(irq);
+    
+    /* One vector: leave the multiple-message enable field at zero */
+    ctrl = (ctrl & ~PCI_MSI_FLAGS_QSIZE) | PCI_MSI_FLAGS_ENABLE;
+    pci_config_write16(dev->bus, dev->slot, dev->function, cap + PCI_MSI_FLAGS, ctrl);
+    pci_set_intx(dev, 0);
+    
+    serial_printf("[pci] %x: MSI on IRQ %d\n", dev->pci_device_id, irq);
+    return irq;
+}
+
+int pci_enable_msix(pci_device_t *dev, int *irqs, int nvec)
+{
+    if (!dev || !dev->msix_cap || !irqs || nvec < 1 || nvec > dev->msix_size) return -1;
+    if (dev->irq_mode >= PCI_IRQ_MSI || !lapic_available()) return -1;
+    
+    /* The vector table sits in one of the device's memory BARs */
+    uint32_t cap = dev->msix_cap;
+    uint32_t table = pci_config_read32(dev->bus, dev->slot, dev->function, cap + PCI_MSIX_TABLE);
+    int bir = (int)(table & PCI_MSIX_TABLE_BIR);
+    if (bir > 5 || (dev->bars[bir] & PCI_BAR_IO)) return -1;
+    uint32_t base = pci_get_bar_address(dev, bir);
+    if (!base) return -1;
+    
+    uint32_t phys = base + (table & ~PCI_MSIX_TABLE_BIR);
+    if (paging_map_mmio(phys, (uint32_t)dev->msix_size * PCI_MSIX_ENTRY_SIZE) != 0) return -1;
+    dev->msix_table = (volatile uint32_t *)phys;
+    
+    /* Program the table with the whole function masked */
+    uint16_t ctrl = pci_config_read16(dev->bus, dev->slot, dev->function, cap + PCI_MSIX_FLAGS);
+    pci_config_write16(dev->bus, dev->slot, dev->function, cap + PCI_MSIX_FLAGS,
+                       ctrl | PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL);
+    dev->irq_mode = PCI_IRQ_MSIX;
+    
+    uint32_t address = msi_address(smp_cpu(0)->apic_id);
+    for (int i = 0; i < nvec; i++) {
+        int irq = msi_alloc(dev, (uint16_t)i);
+        if (irq < 0) {
+            pci_disable_msi(dev);
+            return -1;
+        }
+        volatile uint32_t *entry = msix_entry(dev, (uint32_t)i);
+        entry[3] = PCI_MSIX_ENTRY_CTRL_MASKBIT;
+        entry[0] = address;
+        entry[1] = 0;
+        entry[2] = msi_data((uint32_t)irq);
+        irqs[i] = irq;
+        dev->nr_irqs++;
+    }
+    
+    /* Entries stay masked until their handlers are registered */
+    pci_config_write16(dev->bus, dev->slot, dev->function, cap + PCI_MSIX_FLAGS,
+                       (ctrl & ~PCI_MSIX_FLAGS_MASKALL) | PCI_MSIX_FLAGS_ENABLE);
+    pci_set_intx(dev, 0);
+    
+    serial_printf("[pci] %x: MSI-X, %d of %d vectors from IRQ %d\n", dev->pci_device_id,
+                  nvec, (int)dev->msix_size, irqs[0]);
+    return 0;
+}
+
+void pci_disable_msi(pci_device_t *dev)
+{
+    if (!dev) return;
+    
+    if (dev->irq_mode == PCI_IRQ_MSIX) {
+        msi_free_all(dev);
+        uint32_t reg = dev->msix_cap + PCI_MSIX_FLAGS;
+        uint16_t ctrl = pci_config_read16(dev->bus, dev->slot, dev->function, reg);
+        ctrl &= ~(PCI_MSIX_FLAGS_ENABLE | PCI_MSIX_FLAGS_MASKALL);
+        pci_config_write16(dev->bus, dev->slot, dev->function, reg, ctrl);
+    } else if (dev->irq_mode == PCI_IRQ_MSI) {
+        msi_free_all(dev);
+        uint32_t reg = dev->msi_cap + PCI_MSI_FLAGS;
+        uint16_t ctrl = pci_config_read16(dev->bus, dev->slot, dev->function, reg);
+        pci_config_write16(dev->bus, dev->slot, dev->function, reg, ctrl & ~PCI_MSI_FLAGS_ENABLE);
+    } else {
+        return;
+    }
+    
+    dev->irq_mode = PCI_IRQ_NONE;
+    pci_set_intx(dev, 1);
+}
+
+int pci_alloc_irq_vectors(pci_device_t *dev, int *irqs, int max)
+{
+    if (!dev || !irqs || max < 1) return -1;
+    
+    if (dev->msix_cap) {
+        int nvec = max < dev->msix_size ? max : dev->msix_size;
+        if (pci_enable_msix(dev, irqs, nvec) == 0) return nvec;
+    }
+    if (dev->msi_cap) {
+        int irq = pci_enable_msi(dev);
+        if (irq >= 0) {
+            irqs[0] = irq;
+            return 1;
+        }
+    }
+    
+    /* Legacy INTx: the line firmware routed through the PIC, shared */
+    if (dev->irq_pin && dev->irq_line < IRQ_LEGACY_LINES) {
+        irqs[0] = dev->irq_line;
+        dev->irq_mode = PCI_IRQ_INTX;
+        dev->nr_irqs = 1;
+        return 1;
+    }
+    return -1;
+}
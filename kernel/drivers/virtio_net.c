@@ -1,7 +1,6 @@
 #include "../../include/kernel/netdev.h"
 #include "../../include/kernel/packet.h"
 #include "../../include/kernel/serial.h"
-#include "../../include/kernel/heap.h"
 #include <string.h>
 
 /* Virtio device configuration - QEMU standard */
@@ -67,7 +66,7 @@ int virtio_net_register(uint32_t io_base, const uint8_t *mac_addr)
     if (dev_id < 0) return -1;
 
     /* Create network device structure */
-    struct netdev *netdev = kmalloc(sizeof(struct netdev));
+    struct netdev *netdev = netdev_alloc();
     if (!netdev) return -1;
 
     netdev->dev_id = dev_id;
@@ -85,22 +84,10 @@ int virtio_net_register(uint32_t io_base, const uint8_t *mac_addr)
     }
 
     /* Default IP (would be configured via DHCP or static config) */
-    netdev->ip_addr.addr[0] = 192;
-    netdev->ip_addr.addr[1] = 168;
-    netdev->ip_addr.addr[2] = 1;
-    netdev->ip_addr.addr[3] = 100 + dev_id;
-
-    /* Network mask: 255.255.255.0 */
-    netdev->netmask.addr[0] = 255;
-    netdev->netmask.addr[1] = 255;
-    netdev->netmask.addr[2] = 255;
-    netdev->netmask.addr[3] = 0;
-
-    /* Default gateway */
-    netdev->gateway.addr[0] = 192;
-    netdev->gateway.addr[1] = 168;
-    netdev->gateway.addr[2] = 1;
-    netdev->gateway.addr[3] = 1;
+    ipv4_addr_t ip = {{192, 168, 1, (uint8_t)(100 + dev_id)}};
+    ipv4_addr_t netmask = {{255, 255, 255, 0}};
+    ipv4_addr_t gateway = {{192, 168, 1, 1}};
+    netdev_set_ipv4(netdev, &ip, &netmask, &gateway);
 
     netdev->mtu = 1500;
     netdev->flags = IFF_UP | IFF_RUNNING;
@@ -1,5 +1,7 @@
 #include "elf.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/paging.h"
+#include "../fs/vfs.h"
 #include <string.h>
 
 #define ELF_MAGIC 0x464C457F
@@ -39,6 +41,11 @@ typedef struct {
 } __attribute__((packed)) elf_program_header_t;
 
 #define PT_LOAD 1
+#define PF_W 0x2
+
+#define ELF_MAX_PHDRS 16
+#define ELF_STACK_TOP 0xC0000000
+#define ELF_STACK_PAGES 16
 
 int elf_validate(void *elf_data) {
     if (!elf_data) return -1;
@@ -128,3 +135,95 @@ int elf_execute(void *elf_data, uint32_t max_size) {
     
     return result;
 }
+
+/* Page-in callback: read part of the executable straight from its file */
+static int elf_fill(void *ctx, uint32_t offset, void *buffer, uint32_t size)
+{
+    int n = ramfs_read((ramfs_node_t *)ctx, buffer, offset, size);
+    return (n == (int)size) ? 0 : -1;
+}
+
+/* Every area backed by the file pins it, so it cannot change or go away */
+static void elf_get(void *ctx)
+{
+    ramfs_pin((ramfs_node_t *)ctx);
+}
+
+static void elf_put(void *ctx)
+{
+    ramfs_unpin((ramfs_node_t *)ctx);
+}
+
+static const struct paging_backing elf_backing = {
+    .fill = elf_fill,
+    .get = elf_get,
+    .put = elf_put,
+};
+
+/*
+ * Demand-paged exec.  Only the ELF and program headers are read here;
+ * each PT_LOAD segment becomes a lazily filled area of the task's
+ * address space backed by the file, with its BSS tail zero-filled on
+ * first touch.  A zero-filled stack area is added below ELF_STACK_TOP.
+ */
+int elf_map(uint32_t task_id, const char *path, uint32_t *entry, uint32_t *stack_top)
+{
+    if (!path || !entry) return -1;
+
+    ramfs_node_t *node = vfs_resolve(path);
+    if (!node || node->type != RAMFS_FILE) return -1;
+
+    elf_header_t header;
+    if (ramfs_read(node, &header, 0, sizeof(header)) != (int)sizeof(header)) return -1;
+    if (elf_validate(&header) != 0) return -1;
+
+    if (header.e_phnum > ELF_MAX_PHDRS ||
+        header.e_phentsize != sizeof(elf_program_header_t)) {
+        serial_puts("ERROR: Unsupported ELF program headers\n");
+        return -1;
+    }
+
+    elf_program_header_t pheaders[ELF_MAX_PHDRS];
+    uint32_t ph_bytes = header.e_phnum * sizeof(elf_program_header_t);
+    if (ramfs_read(node, pheaders, header.e_phoff, ph_bytes) != (int)ph_bytes) {
+        serial_puts("ERROR: ELF corrupted\n");
+        return -1;
+    }
+
+    /* Segments must sit between the kernel's identity map and the stack */
+    uint32_t stack_size = ELF_STACK_PAGES * PAGE_SIZE;
+    uint32_t user_base = paging_user_base();
+    uint32_t user_limit = ELF_STACK_TOP - stack_size;
+
+    for (int i = 0; i < header.e_phnum; i++) {
+        elf_program_header_t *ph = &pheaders[i];
+        if (ph->p_type != PT_LOAD || ph->p_memsz == 0) continue;
+
+        if (ph->p_filesz > ph->p_memsz || ph->p_filesz > node->size ||
+            ph->p_offset > node->size - ph->p_filesz) {
+            serial_puts("ERROR: ELF segment corrupted\n");
+            return -1;
+        }
+        if (ph->p_vaddr < user_base || ph->p_vaddr > user_limit ||
+            ph->p_memsz > user_limit - ph->p_vaddr) {
+            serial_puts("ERROR: ELF segment outside user space\n");
+            return -1;
+        }
+
+        uint32_t flags = PAGING_USER;
+        if (ph->p_flags & PF_W) flags |= PAGING_WRITE;
+        if (paging_add_vma(task_id, ph->p_vaddr, ph->p_memsz, flags,
+                           &elf_backing, node, ph->p_offset, ph->p_filesz) != 0) {
+            return -1;
+        }
+    }
+
+    if (paging_add_vma(task_id, ELF_STACK_TOP - stack_size, stack_size,
+                       PAGING_USER | PAGING_WRITE, NULL, NULL, 0, 0) != 0) {
+        return -1;
+    }
+
+    *entry = header.e_entry;
+    if (stack_top) *stack_top = ELF_STACK_TOP;
+    return 0;
+}
@@ -8,4 +8,7 @@ uint32_t elf_get_entry(void *elf_data);
 int elf_load(void *elf_data, uint32_t max_size);
 int elf_execute(void *elf_data, uint32_t max_size);
 
+/* Map an executable into a task's address space, paged in on demand */
+int elf_map(uint32_t task_id, const char *path, uint32_t *entry, uint32_t *stack_top);
+
 #endif
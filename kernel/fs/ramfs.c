@@ -212,6 +212,7 @@ int ramfs_read(ramfs_node_t *node, void *buffer, uint32_t offset, uint32_t max_s
 int ramfs_write(ramfs_node_t *node, const void *buffer, uint32_t offset, uint32_t size)
 {
     if (!node || node->type != RAMFS_FILE || !buffer) return -1;
+    if (node->map_count) return -1;
 
     uint32_t end = offset + size;
     if (end > RAMFS_MAX_FILE_SIZE) return -1;
@@ -245,6 +246,7 @@ int ramfs_truncate(ramfs_node_t *node, uint32_t new_size)
 {
     if (!node || node->type != RAMFS_FILE) return -1;
     if (new_size > RAMFS_MAX_FILE_SIZE) return -1;
+    if (node->map_count) return -1;
 
     if (new_size == 0) {
         if (node->data) {
@@ -272,12 +274,24 @@ int ramfs_remove(ramfs_node_t *node)
     if (node == root_node) return -1;
     /* Cannot remove non-empty directory */
     if (node->type == RAMFS_DIR && node->child_count > 0) return -1;
+    /* Cannot remove a file a program is running from */
+    if (node->map_count) return -1;
 
     detach_child(node);
     free_node(node);
     return 0;
 }
 
+void ramfs_pin(ramfs_node_t *node)
+{
+    __sync_fetch_and_add(&node->map_count, 1);
+}
+
+void ramfs_unpin(ramfs_node_t *node)
+{
+    __sync_fetch_and_sub(&node->map_count, 1);
+}
+
 int ramfs_get_path(ramfs_node_t *node, char *buf, uint32_t buflen)
 {
     if (!node || !buf || buflen == 0) return -1;
@@ -20,6 +20,7 @@ typedef struct ramfs_node {
     struct ramfs_node *parent;
     struct ramfs_node *children[RAMFS_MAX_CHILDREN];
     uint32_t child_count;
+    uint32_t map_count;                     /* executable mappings of a file */
 } ramfs_node_t;
 
 /* Initialize the ramfs and create the root node "/" */
@@ -51,6 +52,11 @@ int ramfs_truncate(ramfs_node_t *node, uint32_t new_size);
 /* Remove a node (file or empty directory).  Returns 0 on success. */
 int ramfs_remove(ramfs_node_t *node);
 
+/* Pin a file while a program image maps it: it cannot be written,
+   truncated or removed until every pin is dropped. */
+void ramfs_pin(ramfs_node_t *node);
+void ramfs_unpin(ramfs_node_t *node);
+
 /* Build the full path string for a node into 'buf' (max 'buflen' chars). */
 int ramfs_get_path(ramfs_node_t *node, char *buf, uint32_t buflen);
 
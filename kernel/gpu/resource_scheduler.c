@@ -1,6 +1,7 @@
 #include "../../include/kernel/resource_scheduler.h"
 #include "../../include/kernel/gpu.h"
 #include "../../include/kernel/pmem.h"
+#include "../../include/kernel/scheduler.h"
 #include "../../include/kernel/serial.h"
 #include <string.h>
 
@@ -24,6 +25,16 @@ static task_hint_entry_t task_hints[MAX_TASK_HINTS];
 static system_resources_t system_resources = {0};
 static sched_stats_t sched_stats = {0};
 static int power_saving_enabled = 0;
+
+/* CPU placement each hint implies, indexed by sched_hint_t */
+static const int hint_placement[] = {
+    SCHED_PLACE_DEFAULT,        /* NONE */
+    SCHED_PLACE_THROUGHPUT,     /* GPU_INTENSIVE */
+    SCHED_PLACE_THROUGHPUT,     /* MEMORY_INTENSIVE: keep the cache warm */
+    SCHED_PLACE_LATENCY,        /* IO_INTENSIVE: run as soon as I/O completes */
+    SCHED_PLACE_THROUGHPUT,     /* CPU_INTENSIVE */
+    SCHED_PLACE_LATENCY,        /* LATENCY_CRITICAL */
+};
 static uint32_t thermal_level = 0;
 
 void resource_scheduler_init(void)
@@ -60,6 +71,15 @@ int sched_register_gpu_task(uint32_t task_id, gpu_sched_context_t *context)
     
     if (free_idx < 0) return -1;
     
+    /* Feeding a device on time needs a CPU reservation the EDF class can honour */
+    if (context->period_us) {
+        uint32_t deadline_us = context->deadline_us ? context->deadline_us : context->period_us;
+        if (scheduler_set_deadline(task_find(task_id), context->runtime_us, deadline_us,
+                                   context->period_us) != 0) {
+            return -1;
+        }
+    }
+    
     gpu_task_entry_t *entry = &gpu_tasks[free_idx];
     memcpy(&entry->context, context, sizeof(gpu_sched_context_t));
     entry->in_use = 1;
@@ -81,6 +101,9 @@ int sched_unregister_gpu_task(uint32_t task_id)
         if (gpu_tasks[i].in_use && gpu_tasks[i].context.task_id == task_id) {
             system_resources.available_memory += gpu_tasks[i].context.estimated_gpu_memory;
             system_resources.active_gpu_tasks--;
+            if (gpu_tasks[i].context.period_us) {
+                scheduler_set_class(task_find(task_id), SCHED_CLASS_PRIO);
+            }
             gpu_tasks[i].in_use = 0;
             
             return 0;
@@ -138,6 +161,9 @@ int sched_set_task_hint(uint32_t task_id, sched_hint_t hint)
 {
     if (task_id == 0 || hint < 0 || hint > 5) return -1;
     
+    struct task *task = task_find(task_id);
+    if (task) scheduler_set_placement(task, hint_placement[hint]);
+    
     /* Find or create hint entry */
     int free_idx = -1;
     for (int i = 0; i < MAX_TASK_HINTS; i++) {
@@ -1,5 +1,6 @@
 #include "../../include/kernel/telemetry.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/sched_trace.h"
 #include <string.h>
 
 #define MAX_EVENTS 512
@@ -72,6 +73,8 @@ int telemetry_log_event(telem_event_type_t type, uint32_t task_id,
         aggregates.thermal_events_count++;
     } else if (type == TELEM_EVENT_TASK_MIGRATE) {
         aggregates.task_migrations++;
+    } else if (type == TELEM_EVENT_DEADLINE_MISS) {
+        aggregates.deadline_misses++;
     }
     
     return 0;
@@ -210,6 +213,57 @@ int telemetry_query_metrics(telem_metric_type_t metric, telem_metric_t *metrics,
     return 0;
 }
 
+/* Append the decimal digits of value at buffer + written */
+static int append_u32(char *buffer, int written, uint32_t value)
+{
+    char digits[10];
+    int n = 0;
+    do {
+        digits[n++] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    while (n > 0) buffer[written++] = digits[--n];
+    return written;
+}
+
+/*
+ * Scheduler trace totals and the wakeup latency histogram, as
+ * "S:switches W:wakeups G:migrations B:blocks" and
+ * "L:" followed by bucket counts up to the highest nonzero bucket
+ * (bucket n covers [2^n, 2^(n+1)) cycles).  Stops early if the buffer
+ * runs out.
+ */
+static int export_sched_trace(char *buffer, int written, int size)
+{
+    static struct sched_trace_summary summary;
+    sched_trace_get_summary(&summary);
+    
+    /* Each field needs at most a 3-byte tag, 10 digits and a separator */
+    const char *tags[4] = { "S:", " W:", " G:", " B:" };
+    uint32_t values[4] = { summary.switches, summary.wakeups,
+                           summary.migrations, summary.blocks };
+    for (int i = 0; i < 4; i++) {
+        if (written + 15 >= size) return written;
+        int len = (int)strlen(tags[i]);
+        memcpy(buffer + written, tags[i], (uint32_t)len);
+        written = append_u32(buffer, written + len, values[i]);
+    }
+    buffer[written++] = '\n';
+    
+    int top = SCHED_TRACE_HIST_BUCKETS - 1;
+    while (top > 0 && summary.latency_hist[top] == 0) top--;
+    if (written + 3 >= size) return written;
+    memcpy(buffer + written, "L:", 2);
+    written += 2;
+    for (int b = 0; b <= top; b++) {
+        if (written + 12 >= size) return written;
+        if (b) buffer[written++] = ',';
+        written = append_u32(buffer, written, summary.latency_hist[b]);
+    }
+    buffer[written++] = '\n';
+    return written;
+}
+
 int telemetry_export_snapshot(char *buffer, uint32_t buffer_size)
 {
     if (!buffer || buffer_size < 128) return -1;
@@ -223,52 +277,20 @@ int telemetry_export_snapshot(char *buffer, uint32_t buffer_size)
     memcpy(buffer, "=== Telemetry ===\n", 18);
     written = 18;
     
-    /* Events line */
+    /* Events, metrics and scheduler deadline misses */
     memcpy(buffer + written, "E:", 2);
     written += 2;
-    /* Convert event count to string (simplified) */
-    uint32_t ec = event_buffer.event_count;
-    int digits = 0;
-    if (ec == 0) {
-        buffer[written++] = '0';
-    } else {
-        uint32_t temp_ec = ec;
-        while (temp_ec) {
-            temp_ec /= 10;
-            digits++;
-        }
-        uint32_t div = 1;
-        for (int i = 1; i < digits; i++) div *= 10;
-        while (div > 0 && ec > 0) {
-            buffer[written++] = '0' + (ec / div);
-            ec %= div;
-            div /= 10;
-        }
-    }
-    buffer[written++] = ' ';
-    buffer[written++] = 'M';
-    buffer[written++] = ':';
-    
-    uint32_t mc = metric_buffer.metric_count;
-    if (mc == 0) {
-        buffer[written++] = '0';
-    } else {
-        uint32_t temp_mc = mc;
-        int m_digits = 0;
-        while (temp_mc) {
-            temp_mc /= 10;
-            m_digits++;
-        }
-        uint32_t m_div = 1;
-        for (int i = 1; i < m_digits; i++) m_div *= 10;
-        while (m_div > 0 && mc > 0) {
-            buffer[written++] = '0' + (mc / m_div);
-            mc %= m_div;
-            m_div /= 10;
-        }
-    }
+    written = append_u32(buffer, written, event_buffer.event_count);
+    memcpy(buffer + written, " M:", 3);
+    written += 3;
+    written = append_u32(buffer, written, metric_buffer.metric_count);
+    memcpy(buffer + written, " D:", 3);
+    written += 3;
+    written = append_u32(buffer, written, aggregates.deadline_misses);
     buffer[written++] = '\n';
     
+    written = export_sched_trace(buffer, written, (int)buffer_size);
+    
     if (written < (int)buffer_size) {
         buffer[written] = '\0';
     }
@@ -0,0 +1,119 @@
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/spinlock.h"
+#include "../../include/kernel/serial.h"
+
+/*
+ * TSC clocksource.
+ *
+ * Cycles convert to nanoseconds as (cycles * ns_mult) >> CLOCK_SHIFT.
+ * The 64-bit cycle count is split into words so each partial product
+ * fits in 64 bits: the high word's term is exact after a shift of
+ * 32 - CLOCK_SHIFT, and reading the clock never divides.
+ */
+
+#define PIT_CHANNEL2 0x42
+#define PIT_CMD      0x43
+#define PIT_GATE     0x61   /* Bit 0 gates channel 2, bit 1 drives the speaker */
+#define PIT_OUT2     0x20   /* Channel 2 output, readable at PIT_GATE */
+#define PIT_BASE_HZ  1193182
+
+#define CLOCK_SHIFT 22
+#define CLOCK_CALIBRATE_US 10000
+#define CLOCK_CALIBRATE_RUNS 3
+
+static uint32_t tsc_khz;
+static uint32_t ns_mult;
+static uint64_t boot_tsc;
+
+static inline void outb(uint16_t port, uint8_t val)
+{
+    __asm__ volatile("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port)
+{
+    uint8_t val;
+    __asm__ volatile("inb %1, %0" : "=a"(val) : "Nd"(port));
+    return val;
+}
+
+uint64_t clock_div64(uint64_t dividend, uint32_t divisor)
+{
+    if (!divisor) return 0;
+
+    uint64_t quotient = 0;
+    uint64_t rem = 0;
+    for (int bit = 63; bit >= 0; bit--) {
+        rem = (rem << 1) | ((dividend >> bit) & 1);
+        if (rem >= divisor) {
+            rem -= divisor;
+            quotient |= (uint64_t)1 << bit;
+        }
+    }
+    return quotient;
+}
+
+void clock_pit_wait(uint32_t us)
+{
+    if (us > 50000) us = 50000;
+    uint32_t count = (uint32_t)clock_div64((uint64_t)PIT_BASE_HZ * us, 1000000);
+    if (count == 0) count = 1;
+
+    /* Gate channel 2 on with the speaker off, then mode 0: OUT rises at zero */
+    outb(PIT_GATE, (uint8_t)((inb(PIT_GATE) & ~0x02) | 0x01));
+    outb(PIT_CMD, 0xB0);
+    outb(PIT_CHANNEL2, (uint8_t)(count & 0xFF));
+    outb(PIT_CHANNEL2, (uint8_t)((count >> 8) & 0xFF));
+
+    while (!(inb(PIT_GATE) & PIT_OUT2)) {
+        __asm__ volatile("pause");
+    }
+}
+
+void clock_init(void)
+{
+    /* Keep the fastest of a few runs: a slow one was interrupted or emulated */
+    uint64_t best = 0;
+    uint32_t flags = irq_save();
+    for (int i = 0; i < CLOCK_CALIBRATE_RUNS; i++) {
+        uint64_t start = timer_rdtsc();
+        clock_pit_wait(CLOCK_CALIBRATE_US);
+        uint64_t cycles = timer_rdtsc() - start;
+        if (best == 0 || cycles < best) best = cycles;
+    }
+    irq_restore(flags);
+
+    tsc_khz = (uint32_t)clock_div64(best, CLOCK_CALIBRATE_US / 1000);
+    if (tsc_khz < 1000) {
+        serial_puts("[clock] TSC calibration failed\n");
+        tsc_khz = 0;
+        return;
+    }
+    ns_mult = (uint32_t)clock_div64((uint64_t)1000000 << CLOCK_SHIFT, tsc_khz);
+    boot_tsc = timer_rdtsc();
+
+    serial_printf("[clock] TSC %d kHz\n", (int)tsc_khz);
+}
+
+int clock_ready(void)
+{
+    return tsc_khz != 0;
+}
+
+uint32_t clock_tsc_khz(void)
+{
+    return tsc_khz;
+}
+
+uint64_t clock_now_ns(void)
+{
+    /* Without a TSC rate, time advances in whole ticks */
+    if (!tsc_khz) return (uint64_t)(uint32_t)timer_get_ticks() * TIMER_TICK_NS;
+
+    uint64_t cycles = timer_rdtsc() - boot_tsc;
+    uint32_t hi = (uint32_t)(cycles >> 32);
+    uint32_t lo = (uint32_t)cycles;
+    return (((uint64_t)hi * ns_mult) << (32 - CLOCK_SHIFT)) +
+           (((uint64_t)lo * ns_mult) >> CLOCK_SHIFT);
+}
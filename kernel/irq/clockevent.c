@@ -0,0 +1,183 @@
+#include "../../include/kernel/clockevent.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/hrtimer.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/scheduler.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/serial.h"
+#include <stddef.h>
+
+/*
+ * Per-CPU clock event state.  Everything here is touched by its own CPU
+ * with interrupts off, except tick_stopped, which other CPUs read to
+ * decide whether arming a timer must kick the BSP out of a long halt.
+ */
+struct clockevent_cpu {
+    struct clock_event_device *dev;
+    int mode;
+    int idle;                       /* Between idle_enter and idle_exit */
+    volatile int tick_stopped;
+    uint32_t events;
+    uint32_t idle_entries;
+    uint32_t nohz_entries;
+} __attribute__((aligned(64)));
+
+static struct clockevent_cpu ce_cpus[SMP_MAX_CPUS];
+static volatile int nohz_enabled = 1;
+
+/*
+ * Program the next event of a one-shot device; interrupts off.  With
+ * work to do the CPU wants the next tick.  Idle with nothing to run, it
+ * sleeps until the earliest timer instead, capped so a lost wakeup
+ * cannot stall it for good.  Only the BSP runs timers.
+ */
+static void ce_program_next(struct cpu *cpu, struct clockevent_cpu *ce)
+{
+    if (!ce->dev || ce->mode != CLOCK_EVT_MODE_ONESHOT) return;
+
+    uint64_t now = clock_now_ns();
+    uint64_t next = timer_next_tick_ns();
+    int stop = ce->idle && nohz_enabled && !scheduler_needs_tick(cpu);
+
+    if (stop) next = now + CLOCKEVENT_NOHZ_MAX_NS;
+    uint64_t expires;
+    if (cpu->index == 0 && hrtimer_next_expiry(&expires) == 0 && expires < next) {
+        next = expires;
+    }
+
+    if (stop && !ce->tick_stopped) ce->nohz_entries++;
+    ce->tick_stopped = stop;
+
+    uint64_t delta = next > now ? next - now : 0;
+    if (delta < ce->dev->min_delta_ns) delta = ce->dev->min_delta_ns;
+    if (delta > ce->dev->max_delta_ns) delta = ce->dev->max_delta_ns;
+    ce->dev->set_next_event(delta);
+}
+
+int clockevent_register(struct clock_event_device *dev)
+{
+    if (!dev) return -1;
+
+    uint32_t flags = irq_save();
+    struct cpu *cpu = smp_this_cpu();
+    struct clockevent_cpu *ce = &ce_cpus[cpu->index];
+    if (ce->dev && ce->dev->rating >= dev->rating) {
+        irq_restore(flags);
+        return -1;
+    }
+
+    /* One-shot operation keeps time from the TSC clock */
+    int oneshot = (dev->features & CLOCK_EVT_FEAT_ONESHOT) && clock_ready();
+    if (!oneshot && !(dev->features & CLOCK_EVT_FEAT_PERIODIC)) {
+        irq_restore(flags);
+        return -1;
+    }
+
+    if (ce->dev) ce->dev->shutdown();
+    ce->dev = dev;
+    ce->tick_stopped = 0;
+    if (oneshot) {
+        ce->mode = CLOCK_EVT_MODE_ONESHOT;
+        if (cpu->index == 0) timer_use_clock();
+        ce_program_next(cpu, ce);
+    } else {
+        ce->mode = CLOCK_EVT_MODE_PERIODIC;
+        dev->set_periodic();
+    }
+    irq_restore(flags);
+
+    serial_printf("[clockevent] CPU %d: %s, %s\n", (int)cpu->index, dev->name,
+                  oneshot ? "one-shot" : "periodic");
+    return 0;
+}
+
+void clockevent_interrupt(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    struct clockevent_cpu *ce = &ce_cpus[cpu->index];
+    ce->events++;
+
+    if (cpu->index == 0) {
+        timer_interrupt();
+        hrtimer_run(clock_now_ns());
+    }
+    ce_program_next(cpu, ce);
+}
+
+void clockevent_reprogram(void)
+{
+    uint32_t flags = irq_save();
+    struct cpu *cpu = smp_this_cpu();
+    ce_program_next(cpu, &ce_cpus[cpu->index]);
+    irq_restore(flags);
+}
+
+void clockevent_idle_enter(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    struct clockevent_cpu *ce = &ce_cpus[cpu->index];
+    ce->idle = 1;
+    ce->idle_entries++;
+    ce_program_next(cpu, ce);
+}
+
+void clockevent_idle_exit(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    struct clockevent_cpu *ce = &ce_cpus[cpu->index];
+    ce->idle = 0;
+
+    /* Restart the tick if idle stopped it */
+    if (ce->tick_stopped) ce_program_next(cpu, ce);
+}
+
+int clockevent_can_halt(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+
+    /* The BSP always has the PIT to fall back on */
+    return cpu->index == 0 || ce_cpus[cpu->index].dev != NULL;
+}
+
+void clockevent_timers_changed(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    if (cpu->index == 0) {
+        clockevent_reprogram();
+        return;
+    }
+
+    /* Even a ticking BSP could fire the timer up to a tick late */
+    struct clockevent_cpu *bsp = &ce_cpus[0];
+    if (bsp->mode == CLOCK_EVT_MODE_ONESHOT) smp_kick(0);
+}
+
+void clockevent_set_nohz(int enabled)
+{
+    nohz_enabled = enabled ? 1 : 0;
+
+    /* Halted CPUs re-evaluate their next event */
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (smp_cpu(i)->online && ce_cpus[i].mode == CLOCK_EVT_MODE_ONESHOT) smp_kick(i);
+    }
+    clockevent_reprogram();
+}
+
+int clockevent_nohz_enabled(void)
+{
+    return nohz_enabled;
+}
+
+int clockevent_get_stats(int cpu, struct clockevent_cpu_stats *stats)
+{
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS || !stats || !smp_cpu(cpu)->online) return -1;
+
+    struct clockevent_cpu *ce = &ce_cpus[cpu];
+    stats->device = ce->dev ? ce->dev->name : NULL;
+    stats->mode = ce->mode;
+    stats->tick_stopped = ce->tick_stopped;
+    stats->events = ce->events;
+    stats->idle_entries = ce->idle_entries;
+    stats->nohz_entries = ce->nohz_entries;
+    return 0;
+}
@@ -0,0 +1,123 @@
+#include "../../include/kernel/hrtimer.h"
+#include "../../include/kernel/clockevent.h"
+#include "../../include/kernel/spinlock.h"
+#include <stddef.h>
+
+static spinlock_t hrtimer_lock = SPINLOCK_INIT;
+static struct hrtimer *hrtimer_head;        /* Sorted by expiry */
+static struct hrtimer *volatile hrtimer_running;
+static struct hrtimer_stats hrtimer_stats;
+
+/* hrtimer_lock held */
+static void hrtimer_unlink(struct hrtimer *timer)
+{
+    for (struct hrtimer **link = &hrtimer_head; *link; link = &(*link)->next) {
+        if (*link == timer) {
+            *link = timer->next;
+            break;
+        }
+    }
+    timer->next = NULL;
+    timer->pending = 0;
+}
+
+void hrtimer_init(struct hrtimer *timer, void (*fn)(void *), void *arg)
+{
+    timer->next = NULL;
+    timer->expires = 0;
+    timer->fn = fn;
+    timer->arg = arg;
+    timer->pending = 0;
+}
+
+void hrtimer_start(struct hrtimer *timer, uint64_t expires)
+{
+    if (!timer || !timer->fn) return;
+
+    uint32_t flags = spin_lock_irqsave(&hrtimer_lock);
+    if (timer->pending) {
+        hrtimer_unlink(timer);
+    } else {
+        hrtimer_stats.pending++;
+    }
+
+    /* Behind every timer due at the same time, so equal expiries stay FIFO */
+    struct hrtimer **link = &hrtimer_head;
+    while (*link && (*link)->expires <= expires) {
+        link = &(*link)->next;
+    }
+    timer->expires = expires;
+    timer->next = *link;
+    timer->pending = 1;
+    *link = timer;
+    hrtimer_stats.armed++;
+    int first = hrtimer_head == timer;
+    spin_unlock_irqrestore(&hrtimer_lock, flags);
+
+    /* A new earliest expiry must reach the BSP's clock event device */
+    if (first) clockevent_timers_changed();
+}
+
+int hrtimer_cancel(struct hrtimer *timer)
+{
+    if (!timer) return 0;
+
+    int pending = 0;
+    uint32_t flags = spin_lock_irqsave(&hrtimer_lock);
+    if (timer->pending) {
+        hrtimer_unlink(timer);
+        hrtimer_stats.pending--;
+        hrtimer_stats.cancelled++;
+        pending = 1;
+    }
+    spin_unlock_irqrestore(&hrtimer_lock, flags);
+
+    while (hrtimer_running == timer) {
+        __asm__ volatile("pause");
+    }
+    return pending;
+}
+
+int hrtimer_next_expiry(uint64_t *expires)
+{
+    int found = -1;
+    uint32_t flags = spin_lock_irqsave(&hrtimer_lock);
+    if (hrtimer_head) {
+        *expires = hrtimer_head->expires;
+        found = 0;
+    }
+    spin_unlock_irqrestore(&hrtimer_lock, flags);
+    return found;
+}
+
+void hrtimer_run(uint64_t now)
+{
+    uint32_t flags = spin_lock_irqsave(&hrtimer_lock);
+    struct hrtimer *timer;
+    while ((timer = hrtimer_head) != NULL && timer->expires <= now) {
+        hrtimer_unlink(timer);
+        hrtimer_stats.pending--;
+        hrtimer_stats.fired++;
+
+        uint64_t late = now - timer->expires;
+        uint32_t late32 = late > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)late;
+        hrtimer_stats.late_ns += late32;
+        if (late32 > hrtimer_stats.max_late_ns) hrtimer_stats.max_late_ns = late32;
+
+        /* Callbacks run unlocked so they can re-arm timers */
+        hrtimer_running = timer;
+        spin_unlock(&hrtimer_lock);
+        timer->fn(timer->arg);
+        spin_lock(&hrtimer_lock);
+        hrtimer_running = NULL;
+    }
+    spin_unlock_irqrestore(&hrtimer_lock, flags);
+}
+
+void hrtimer_get_stats(struct hrtimer_stats *stats)
+{
+    if (!stats) return;
+    uint32_t flags = spin_lock_irqsave(&hrtimer_lock);
+    *stats = hrtimer_stats;
+    spin_unlock_irqrestore(&hrtimer_lock, flags);
+}
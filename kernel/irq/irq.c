@@ -2,7 +2,11 @@
 #include "../../include/kernel/idt.h"
 #include "../../include/kernel/pic.h"
 #include "../../include/kernel/timer.h"
+#include "../../include/kernel/lapic.h"
+#include "../../include/kernel/clockevent.h"
+#include "../../include/kernel/smp.h"
 #include "../../include/kernel/keyboard.h"
+#include "../../include/kernel/irq_mgr.h"
 
 /* Assembly stubs defined in kernel/syscall/stubs.s */
 extern void irq0(void);
@@ -21,6 +25,10 @@ extern void irq12(void);
 extern void irq13(void);
 extern void irq14(void);
 extern void irq15(void);
+extern const uint32_t irq_dyn_stubs[IRQ_MAX_LINES - IRQ_LEGACY_LINES];
+extern void irq_lapic_timer(void);
+extern void irq_lapic_kick(void);
+extern void irq_lapic_spurious(void);
 extern void syscall_int80(void);
 
 void irq_init(void)
@@ -45,6 +53,17 @@ void irq_init(void)
     idt_set_handler(46, (uint32_t)irq14, IDT_INTERRUPT_GATE);
     idt_set_handler(47, (uint32_t)irq15, IDT_INTERRUPT_GATE);
 
+    /* Lines allocated later for the IOAPIC and MSI: INT 48-95 */
+    for (int n = IRQ_LEGACY_LINES; n < IRQ_MAX_LINES; n++) {
+        idt_set_handler(IRQ_VECTOR_BASE + n, irq_dyn_stubs[n - IRQ_LEGACY_LINES],
+                        IDT_INTERRUPT_GATE);
+    }
+
+    /* Local APIC timer, kick IPI and spurious vector, shared by every CPU's IDT */
+    idt_set_handler(LAPIC_TIMER_VECTOR, (uint32_t)irq_lapic_timer, IDT_INTERRUPT_GATE);
+    idt_set_handler(LAPIC_KICK_VECTOR, (uint32_t)irq_lapic_kick, IDT_INTERRUPT_GATE);
+    idt_set_handler(LAPIC_SPURIOUS_VECTOR, (uint32_t)irq_lapic_spurious, IDT_INTERRUPT_GATE);
+
     /* INT 0x80 syscall gate — kernel-privilege only for now */
     idt_set_handler(0x80, (uint32_t)syscall_int80, IDT_TRAP_GATE);
 
@@ -54,14 +73,39 @@ void irq_init(void)
 
 void irq_dispatch(uint32_t irq_num)
 {
+    /* Out of any halt; RCU must see that before a handler reads (rcu.c) */
+    struct cpu *cpu = smp_this_cpu();
+    if (cpu->halted) {
+        cpu->halted = 0;
+        __sync_synchronize();
+    }
+    irq_enter();
+
+    /* Local APIC sources are acknowledged at the APIC, not the PIC */
+    if (irq_num == LAPIC_TIMER_VECTOR || irq_num == LAPIC_KICK_VECTOR) {
+        if (irq_num == LAPIC_TIMER_VECTOR) {
+            clockevent_interrupt();
+        } else {
+            clockevent_reprogram();
+        }
+        lapic_eoi();
+        irq_exit();
+        return;
+    }
+
+    /* The timer and keyboard are wired in directly; other lines go through irq_mgr */
+    uint64_t start = timer_rdtsc();
     switch (irq_num) {
-    case 0:  timer_interrupt();    break;
+    case 0:  timer_pit_interrupt(); break;
     case 1:  keyboard_interrupt(); break;
-    /* IRQ 2-15: no handler yet; EOI is still sent below so the PIC
-       does not get stuck.  Add case entries as drivers are added. */
-    default: break;
+    default: irq_dispatch_handlers(irq_num); break;
     }
+    if (irq_num < 2) irq_account(irq_num, start, timer_rdtsc());
+
+    /* End-Of-Interrupt through the line's chip: the PIC, or the local APIC */
+    irq_eoi(irq_num);
+    irq_account_eoi(irq_num);
 
-    /* Send End-Of-Interrupt to the PIC so it can accept the next IRQ */
-    pic_send_eoi((uint8_t)irq_num);
+    /* Deferred work runs with the line acknowledged and interrupts on */
+    irq_exit();
 }
@@ -1,26 +1,114 @@
 #include "../../include/kernel/irq_mgr.h"
 #include "../../include/kernel/pic.h"
+#include "../../include/kernel/lapic.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/thread.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/spinlock.h"
 #include <string.h>
 
-#define MAX_IRQS 16
-
 typedef struct {
     irq_handler_entry_t handlers[MAX_HANDLERS_PER_IRQ];
     irq_stats_t stats;
     int enabled;
+    const struct irq_chip *chip;    /* NULL while the line is unallocated */
+    void *chip_data;
+    int cpu;                        /* Delivery target */
 } irq_line_t;
 
-static irq_line_t irq_lines[MAX_IRQS];
+static irq_line_t irq_lines[IRQ_MAX_LINES];
+static spinlock_t irq_alloc_lock = SPINLOCK_INIT;
+
+/*
+ * Per-CPU bottom-half state.  Only its own CPU touches it, with
+ * interrupts off except while a handler runs.
+ */
+struct softirq_cpu {
+    volatile uint32_t pending;
+    int irq_depth;                  /* Nested hard IRQs */
+    uint64_t entry_tsc;             /* Entry stamp of the hard IRQ being handled */
+    int in_softirq;
+    struct tasklet *tasklet_head;
+    struct tasklet **tasklet_tail;
+    struct thread *ksoftirqd;
+    uint32_t deferrals;
+    uint32_t ksoftirqd_runs;
+    softirq_stats_t stats[NR_SOFTIRQS];
+} __attribute__((aligned(64)));
+
+static struct softirq_cpu softirq_cpus[SMP_MAX_CPUS];
+static softirq_action_t softirq_vec[NR_SOFTIRQS];
+static uint64_t softirq_budget;     /* Cycles per round, 0 until softirq_init() */
+
+static uint32_t irq_budget_us = IRQ_BUDGET_US;
+static uint32_t irq_budget_cycles;  /* 0 while the TSC rate is unknown */
+
+static void tasklet_action(void);
+
+static inline struct softirq_cpu *this_softirq_cpu(void)
+{
+    return &softirq_cpus[smp_this_cpu()->index];
+}
+
+static uint32_t cycles_to_us(uint32_t cycles)
+{
+    uint32_t khz = clock_tsc_khz();
+    return khz ? (uint32_t)clock_div64((uint64_t)cycles * 1000, khz) : 0;
+}
+
+static void irq_budget_update(void)
+{
+    uint32_t khz = clock_tsc_khz();
+    irq_budget_cycles = khz ? (uint32_t)clock_div64((uint64_t)khz * irq_budget_us, 1000) : 0;
+}
+
+/* One handler call; 'entry' is NULL for lines irq_dispatch() handles itself */
+static void irq_record_call(uint32_t irq, irq_handler_entry_t *entry, uint64_t start, uint64_t end)
+{
+    irq_stats_t *stats = &irq_lines[irq].stats;
+    uint32_t cycles = (uint32_t)(end - start);
+    stats->run_cycles += cycles;
+    stats->duration_hist[timer_cycles_bucket(cycles, IRQ_HIST_BUCKETS)]++;
+    if (entry && cycles > entry->max_cycles) entry->max_cycles = cycles;
+    
+    if (!irq_budget_cycles || cycles <= irq_budget_cycles) return;
+    stats->over_budget++;
+    int first = entry ? entry->over_budget++ == 0 : stats->over_budget == 1;
+    if (first) {
+        serial_printf("[irq_mgr] IRQ %d handler (device %d) took %d us, budget %d us\n",
+                      irq, entry ? (int)entry->device_id : -1, (int)cycles_to_us(cycles),
+                      (int)irq_budget_us);
+    }
+}
+
+/* The whole interrupt, from the entry stamp through its last handler */
+static void irq_record_interrupt(uint32_t irq, uint64_t first_start, uint64_t end)
+{
+    irq_stats_t *stats = &irq_lines[irq].stats;
+    uint64_t entry = this_softirq_cpu()->entry_tsc;
+    uint32_t latency = first_start > entry ? (uint32_t)(first_start - entry) : 0;
+    stats->latency_hist[timer_cycles_bucket(latency, IRQ_HIST_BUCKETS)]++;
+    if (latency > stats->max_latency) stats->max_latency = latency;
+    
+    uint32_t cycles = (uint32_t)(end - first_start);
+    if (cycles > stats->max_cycles) stats->max_cycles = cycles;
+}
 
 void irq_mgr_init(void)
 {
     memset(irq_lines, 0, sizeof(irq_lines));
     
-    for (int i = 0; i < MAX_IRQS; i++) {
+    for (int i = 0; i < IRQ_MAX_LINES; i++) {
         irq_lines[i].stats.irq_num = i;
         irq_lines[i].enabled = 1;
+        if (i < IRQ_LEGACY_LINES) irq_lines[i].chip = &pic_chip;
     }
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        softirq_cpus[i].tasklet_tail = &softirq_cpus[i].tasklet_head;
+    }
+    softirq_vec[SOFTIRQ_TASKLET] = tasklet_action;
     
     serial_puts("[irq_mgr] Interrupt manager initialized\n");
 }
@@ -28,11 +116,12 @@ void irq_mgr_init(void)
 int irq_register_handler(uint32_t irq, irq_handler_t handler, void *dev_data,
                          uint32_t device_id, irq_priority_t priority)
 {
-    if (irq >= MAX_IRQS || !handler || priority < 1 || priority > 4) {
+    if (irq >= IRQ_MAX_LINES || !handler || priority < 1 || priority > 4) {
         return -1;
     }
     
     irq_line_t *line = &irq_lines[irq];
+    if (!line->chip) return -1;
     
     /* Find free handler slot */
     int free_slot = -1;
@@ -55,21 +144,23 @@ int irq_register_handler(uint32_t irq, irq_handler_t handler, void *dev_data,
     entry->device_id = device_id;
     entry->priority = priority;
     entry->active = 1;
+    entry->max_cycles = 0;
+    entry->over_budget = 0;
     
     line->stats.handler_count++;
     
     serial_printf("[irq_mgr] Registered handler for IRQ %d (device %d, priority %d)\n",
                   irq, device_id, priority);
     
-    /* Enable IRQ at PIC */
-    pic_enable_irq((uint8_t)irq);
+    /* Unmask the line at its controller */
+    if (line->chip->unmask) line->chip->unmask(irq);
     
     return 0;
 }
 
 int irq_unregister_handler(uint32_t irq, uint32_t device_id)
 {
-    if (irq >= MAX_IRQS) return -1;
+    if (irq >= IRQ_MAX_LINES) return -1;
     
     irq_line_t *line = &irq_lines[irq];
     
@@ -82,8 +173,8 @@ int irq_unregister_handler(uint32_t irq, uint32_t device_id)
                           irq, device_id);
             
             /* Disable IRQ if no handlers left */
-            if (line->stats.handler_count == 0) {
-                pic_disable_irq((uint8_t)irq);
+            if (line->stats.handler_count == 0 && line->chip && line->chip->mask) {
+                line->chip->mask(irq);
             }
             
             return 0;
@@ -107,7 +198,7 @@ static int __attribute__((unused)) compare_priority(const void *a, const void *b
 
 int irq_dispatch_handlers(uint32_t irq)
 {
-    if (irq >= MAX_IRQS) return -1;
+    if (irq >= IRQ_MAX_LINES) return -1;
     
     irq_line_t *line = &irq_lines[irq];
     line->stats.total_interrupts++;
@@ -116,12 +207,17 @@ int irq_dispatch_handlers(uint32_t irq)
     irq_handler_entry_t temp[MAX_HANDLERS_PER_IRQ];
     memcpy(temp, line->handlers, sizeof(temp));
     
+    uint64_t start = timer_rdtsc();
+    uint64_t end = start;
     int handled = 0;
     for (int i = 0; i < MAX_HANDLERS_PER_IRQ; i++) {
         if (!temp[i].active) continue;
         
         if (temp[i].handler) {
+            uint64_t call = timer_rdtsc();
             int ret = temp[i].handler(irq, temp[i].dev_data);
+            end = timer_rdtsc();
+            irq_record_call(irq, &line->handlers[i], call, end);
             if (ret == 0) {
                 handled = 1;
                 break;  /* Handler consumed interrupt */
@@ -135,12 +231,55 @@ int irq_dispatch_handlers(uint32_t irq)
         line->stats.missed_count++;
     }
     
+    irq_record_interrupt(irq, start, end);
+    
     return handled ? 0 : -1;
 }
 
+void irq_account(uint32_t irq, uint64_t start, uint64_t end)
+{
+    if (irq >= IRQ_MAX_LINES) return;
+    
+    irq_stats_t *stats = &irq_lines[irq].stats;
+    stats->total_interrupts++;
+    stats->handled_count++;
+    irq_record_call(irq, NULL, start, end);
+    irq_record_interrupt(irq, start, end);
+}
+
+void irq_account_eoi(uint32_t irq)
+{
+    if (irq >= IRQ_MAX_LINES) return;
+    
+    irq_stats_t *stats = &irq_lines[irq].stats;
+    uint32_t cycles = (uint32_t)(timer_rdtsc() - this_softirq_cpu()->entry_tsc);
+    stats->eoi_cycles += cycles;
+    if (cycles > stats->max_eoi_cycles) stats->max_eoi_cycles = cycles;
+}
+
+int irq_set_budget_us(uint32_t us)
+{
+    if (us == 0) return -1;
+    irq_budget_us = us;
+    irq_budget_update();
+    
+    /* Report each handler again against the new budget */
+    for (int i = 0; i < IRQ_MAX_LINES; i++) {
+        for (int j = 0; j < MAX_HANDLERS_PER_IRQ; j++) {
+            irq_lines[i].handlers[j].over_budget = 0;
+        }
+    }
+    return 0;
+}
+
+uint32_t irq_get_budget_us(void)
+{
+    return irq_budget_us;
+}
+
 irq_handler_t irq_get_handler(uint32_t irq, uint32_t device_id)
 {
-    if (irq >= MAX_IRQS) return NULL;
+    if (irq >= IRQ_MAX_LINES) return NULL;
     
     irq_line_t *line = &irq_lines[irq];
     
@@ -155,34 +294,343 @@ irq_handler_t irq_get_handler(uint32_t irq, uint32_t device_id)
 
 int irq_enable(uint32_t irq)
 {
-    if (irq >= MAX_IRQS) return -1;
+    if (irq >= IRQ_MAX_LINES || !irq_lines[irq].chip) return -1;
     
     irq_lines[irq].enabled = 1;
-    pic_enable_irq((uint8_t)irq);
+    if (irq_lines[irq].chip->unmask) irq_lines[irq].chip->unmask(irq);
     
     return 0;
 }
 
 int irq_disable(uint32_t irq)
 {
-    if (irq >= MAX_IRQS) return -1;
+    if (irq >= IRQ_MAX_LINES || !irq_lines[irq].chip) return -1;
     
     irq_lines[irq].enabled = 0;
-    pic_disable_irq((uint8_t)irq);
+    if (irq_lines[irq].chip->mask) irq_lines[irq].chip->mask(irq);
     
     return 0;
 }
 
+int irq_alloc_line(const struct irq_chip *chip, void *chip_data)
+{
+    if (!chip) return -1;
+    
+    int irq = -1;
+    uint32_t flags = spin_lock_irqsave(&irq_alloc_lock);
+    for (int i = IRQ_LEGACY_LINES; i < IRQ_MAX_LINES; i++) {
+        irq_line_t *line = &irq_lines[i];
+        if (line->chip) continue;
+        
+        /* Fresh handlers and counters for the new owner */
+        memset(line, 0, sizeof(*line));
+        line->stats.irq_num = i;
+        line->enabled = 1;
+        line->chip = chip;
+        line->chip_data = chip_data;
+        irq = i;
+        break;
+    }
+    spin_unlock_irqrestore(&irq_alloc_lock, flags);
+    
+    if (irq < 0) serial_puts("[irq_mgr] Out of interrupt lines\n");
+    return irq;
+}
+
+void irq_free_line(uint32_t irq)
+{
+    if (irq < IRQ_LEGACY_LINES || irq >= IRQ_MAX_LINES) return;
+    
+    irq_line_t *line = &irq_lines[irq];
+    uint32_t flags = spin_lock_irqsave(&irq_alloc_lock);
+    if (line->chip) {
+        if (line->chip->mask) line->chip->mask(irq);
+        for (int i = 0; i < MAX_HANDLERS_PER_IRQ; i++) {
+            line->handlers[i].active = 0;
+        }
+        line->stats.handler_count = 0;
+        line->chip = NULL;
+        line->chip_data = NULL;
+    }
+    spin_unlock_irqrestore(&irq_alloc_lock, flags);
+}
+
+void *irq_get_chip_data(uint32_t irq)
+{
+    if (irq >= IRQ_MAX_LINES) return NULL;
+    return irq_lines[irq].chip_data;
+}
+
+const char *irq_get_chip_name(uint32_t irq)
+{
+    if (irq >= IRQ_MAX_LINES || !irq_lines[irq].chip) return NULL;
+    return irq_lines[irq].chip->name;
+}
+
+void irq_eoi(uint32_t irq)
+{
+    const struct irq_chip *chip = irq < IRQ_MAX_LINES ? irq_lines[irq].chip : NULL;
+    if (chip) {
+        if (chip->eoi) chip->eoi(irq);
+    } else if (irq >= IRQ_LEGACY_LINES) {
+        /* A vector with no owner still holds the local APIC's in-service bit */
+        lapic_eoi();
+    }
+}
+
+int irq_set_affinity(uint32_t irq, int cpu)
+{
+    if (irq >= IRQ_MAX_LINES || cpu < 0 || cpu >= SMP_MAX_CPUS) return -1;
+    
+    irq_line_t *line = &irq_lines[irq];
+    if (!line->chip || !line->chip->set_affinity || !smp_cpu(cpu)->online) return -1;
+    if (line->chip->set_affinity(irq, smp_cpu(cpu)->apic_id) != 0) return -1;
+    line->cpu = cpu;
+    return 0;
+}
+
+int irq_get_affinity(uint32_t irq)
+{
+    if (irq >= IRQ_MAX_LINES) return -1;
+    return irq_lines[irq].cpu;
+}
+
 irq_stats_t *irq_get_stats(uint32_t irq)
 {
-    if (irq >= MAX_IRQS) return NULL;
+    if (irq >= IRQ_MAX_LINES) return NULL;
     
     return &irq_lines[irq].stats;
 }
 
 int irq_get_handler_count(uint32_t irq)
 {
-    if (irq >= MAX_IRQS) return -1;
+    if (irq >= IRQ_MAX_LINES) return -1;
     
     return irq_lines[irq].stats.handler_count;
 }
+
+/* Interrupts off */
+static void wakeup_ksoftirqd(struct softirq_cpu *sc)
+{
+    if (sc->ksoftirqd) thread_unpark(sc->ksoftirqd);
+}
+
+/*
+ * Run pending vectors until none are left or the round runs out of
+ * restarts or budget; interrupts off on entry and on return, on while a
+ * handler runs.  A hard IRQ that lands meanwhile only adds pending bits.
+ */
+static void softirq_process(struct softirq_cpu *sc)
+{
+    uint64_t start = timer_rdtsc();
+    int restarts = SOFTIRQ_MAX_RESTART;
+    uint32_t pending;
+    
+    sc->in_softirq = 1;
+    while ((pending = sc->pending) != 0) {
+        sc->pending = 0;
+        __asm__ volatile("sti" : : : "memory");
+        while (pending) {
+            int nr = __builtin_ctz(pending);
+            pending &= pending - 1;
+            if (!softirq_vec[nr]) continue;
+            
+            uint64_t t0 = timer_rdtsc();
+            softirq_vec[nr]();
+            uint32_t cycles = (uint32_t)(timer_rdtsc() - t0);
+            
+            softirq_stats_t *st = &sc->stats[nr];
+            st->runs++;
+            st->run_cycles += cycles;
+            if (cycles > st->max_cycles) st->max_cycles = cycles;
+        }
+        __asm__ volatile("cli" : : : "memory");
+        
+        if (--restarts == 0) break;
+        if (softirq_budget && timer_rdtsc() - start > softirq_budget) break;
+    }
+    sc->in_softirq = 0;
+    
+    if (sc->pending && sc->ksoftirqd) {
+        sc->deferrals++;
+        wakeup_ksoftirqd(sc);
+    }
+}
+
+/* Drains whatever interrupt exits left behind, a budgeted round at a time */
+static void ksoftirqd_loop(void *arg)
+{
+    struct softirq_cpu *sc = (struct softirq_cpu *)arg;
+    
+    for (;;) {
+        uint32_t flags = irq_save();
+        if (!sc->pending) {
+            thread_park(NULL, flags, 0);
+            continue;
+        }
+        sc->ksoftirqd_runs++;
+        softirq_process(sc);
+        irq_restore(flags);
+        thread_yield();
+    }
+}
+
+void softirq_init(void)
+{
+    uint32_t khz = clock_tsc_khz();
+    softirq_budget = (uint64_t)khz * SOFTIRQ_BUDGET_MS;
+    irq_budget_update();
+    
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        if (!smp_cpu(i)->online) continue;
+        struct softirq_cpu *sc = &softirq_cpus[i];
+        int id = kthread_create(ksoftirqd_loop, sc, THREAD_DEFAULT_PRIORITY);
+        struct thread *thread = id > 0 ? thread_get(id) : NULL;
+        if (!thread) {
+            serial_printf("[softirq] No ksoftirqd for CPU %d\n", i);
+            continue;
+        }
+        /* Created here on the BSP; each one serves its own CPU */
+        thread_set_affinity(thread, 1u << i);
+        
+        uint32_t flags = irq_save();
+        sc->ksoftirqd = thread;
+        irq_restore(flags);
+    }
+    serial_printf("[softirq] %d vectors, budget %d ms\n", NR_SOFTIRQS, SOFTIRQ_BUDGET_MS);
+}
+
+int softirq_register(int nr, softirq_action_t action)
+{
+    if (nr < 0 || nr >= NR_SOFTIRQS || !action) return -1;
+    softirq_vec[nr] = action;
+    return 0;
+}
+
+void softirq_raise(int nr)
+{
+    if (nr < 0 || nr >= NR_SOFTIRQS) return;
+    
+    uint32_t flags = irq_save();
+    struct softirq_cpu *sc = this_softirq_cpu();
+    sc->pending |= 1u << nr;
+    sc->stats[nr].raised++;
+    
+    /* Raised from thread context, nothing runs it until the next interrupt */
+    if (!sc->irq_depth && !sc->in_softirq) wakeup_ksoftirqd(sc);
+    irq_restore(flags);
+}
+
+void irq_enter(void)
+{
+    struct softirq_cpu *sc = this_softirq_cpu();
+    sc->entry_tsc = timer_rdtsc();
+    sc->irq_depth++;
+}
+
+void irq_exit(void)
+{
+    struct softirq_cpu *sc = this_softirq_cpu();
+    if (--sc->irq_depth == 0 && !sc->in_softirq && sc->pending) {
+        softirq_process(sc);
+    }
+}
+
+int irq_in_interrupt(void)
+{
+    uint32_t flags = irq_save();
+    struct softirq_cpu *sc = this_softirq_cpu();
+    int in = sc->irq_depth || sc->in_softirq;
+    irq_restore(flags);
+    return in;
+}
+
+int softirq_get_stats(int nr, softirq_stats_t *stats)
+{
+    if (nr < 0 || nr >= NR_SOFTIRQS || !stats) return -1;
+    
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        const softirq_stats_t *st = &softirq_cpus[i].stats[nr];
+        stats->raised += st->raised;
+        stats->runs += st->runs;
+        stats->run_cycles += st->run_cycles;
+        if (st->max_cycles > stats->max_cycles) stats->max_cycles = st->max_cycles;
+    }
+    return 0;
+}
+
+int softirq_get_cpu_stats(int cpu, softirq_cpu_stats_t *stats)
+{
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS || !stats || !smp_cpu(cpu)->online) return -1;
+    
+    struct softirq_cpu *sc = &softirq_cpus[cpu];
+    stats->pending = sc->pending;
+    stats->deferrals = sc->deferrals;
+    stats->ksoftirqd_runs = sc->ksoftirqd_runs;
+    stats->ksoftirqd_id = sc->ksoftirqd ? (int)sc->ksoftirqd->id : 0;
+    return 0;
+}
+
+void tasklet_init(struct tasklet *t, void (*fn)(void *), void *arg)
+{
+    t->next = NULL;
+    t->fn = fn;
+    t->arg = arg;
+    t->state = 0;
+}
+
+/* Interrupts off */
+static void tasklet_queue(struct softirq_cpu *sc, struct tasklet *t)
+{
+    t->next = NULL;
+    *sc->tasklet_tail = t;
+    sc->tasklet_tail = &t->next;
+}
+
+void tasklet_schedule(struct tasklet *t)
+{
+    if (!t || !t->fn) return;
+    if (__sync_fetch_and_or(&t->state, TASKLET_STATE_SCHED) & TASKLET_STATE_SCHED) return;
+    
+    uint32_t flags = irq_save();
+    tasklet_queue(this_softirq_cpu(), t);
+    softirq_raise(SOFTIRQ_TASKLET);
+    irq_restore(flags);
+}
+
+static void tasklet_action(void)
+{
+    uint32_t flags = irq_save();
+    struct softirq_cpu *sc = this_softirq_cpu();
+    struct tasklet *list = sc->tasklet_head;
+    sc->tasklet_head = NULL;
+    sc->tasklet_tail = &sc->tasklet_head;
+    irq_restore(flags);
+    
+    while (list) {
+        struct tasklet *t = list;
+        list = t->next;
+        
+        /* Still running on the CPU it was last scheduled on; retry later */
+        if (__sync_fetch_and_or(&t->state, TASKLET_STATE_RUN) & TASKLET_STATE_RUN) {
+            flags = irq_save();
+            tasklet_queue(sc, t);
+            sc->pending |= 1u << SOFTIRQ_TASKLET;
+            irq_restore(flags);
+            continue;
+        }
+        __sync_fetch_and_and(&t->state, ~TASKLET_STATE_SCHED);
+        t->fn(t->arg);
+        __sync_fetch_and_and(&t->state, ~TASKLET_STATE_RUN);
+    }
+}
+
+void tasklet_kill(struct tasklet *t)
+{
+    if (!t) return;
+    while (t->state & (TASKLET_STATE_SCHED | TASKLET_STATE_RUN)) {
+        thread_yield();
+        __asm__ volatile("pause");
+    }
+}
@@ -54,3 +54,26 @@ void pic_enable_irq(uint8_t irq)
     uint8_t val = inb(port) & ~(1 << (irq % 8));
     outb(port, val);
 }
+
+static void pic_chip_mask(uint32_t irq)
+{
+    pic_disable_irq((uint8_t)irq);
+}
+
+static void pic_chip_unmask(uint32_t irq)
+{
+    pic_enable_irq((uint8_t)irq);
+}
+
+static void pic_chip_eoi(uint32_t irq)
+{
+    pic_send_eoi((uint8_t)irq);
+}
+
+/* Legacy lines 0-15; the PIC always interrupts the BSP, so no set_affinity */
+const struct irq_chip pic_chip = {
+    .name = "pic",
+    .mask = pic_chip_mask,
+    .unmask = pic_chip_unmask,
+    .eoi = pic_chip_eoi,
+};
@@ -1,19 +1,35 @@
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/clockevent.h"
+#include "../../include/kernel/spinlock.h"
 #include "../../include/kernel/pic.h"
+#include "../../include/kernel/irq_mgr.h"
 #include "../../include/kernel/scheduler.h"
 #include "../../include/kernel/serial.h"
 
 #define PIT_CHANNEL0 0x40   /* PIT channel 0 data port       */
 #define PIT_CMD      0x43   /* PIT mode/command register     */
-#define PIT_HZ       100    /* Desired timer frequency in Hz */
+#define PIT_HZ       TIMER_HZ /* Desired timer frequency in Hz */
 
 static volatile int ticks = 0;
+static uint32_t ticks_run = 0;          /* Last tick the BSP's handler acted on */
+
+/*
+ * Once the BSP runs a one-shot device, interrupts no longer arrive once
+ * per tick, so ticks are counted from the TSC clock instead: tick n
+ * falls at next_tick_ns + (n - ticks - 1) * TIMER_TICK_NS, and whoever
+ * reads the tick count first after a boundary advances it.
+ */
+static int ticks_from_clock = 0;
+static uint64_t next_tick_ns;
+static spinlock_t tick_lock = SPINLOCK_INIT;
 
 static inline void outb(uint16_t port, uint8_t val)
 {
     __asm__ volatile("outb %0, %1" : : "a"(val), "Nd"(port));
 }
 
-void timer_init(void)
+static void pit_set_periodic(void)
 {
     /*
      * Program PIT channel 0 in mode 3 (square wave), binary counting:
@@ -30,19 +46,100 @@ void timer_init(void)
     outb(PIT_CMD,     0x36);
     outb(PIT_CHANNEL0, (uint8_t)( divisor       & 0xFF));  /* LSB */
     outb(PIT_CHANNEL0, (uint8_t)((divisor >> 8) & 0xFF));  /* MSB */
-
     pic_enable_irq(0);
+}
+
+static void pit_set_next_event(uint64_t delta_ns)
+{
+    (void)delta_ns;     /* Periodic only; never selected for one-shot use */
+}
+
+static void pit_shutdown(void)
+{
+    pic_disable_irq(0);
+}
+
+static struct clock_event_device pit_clockevent = {
+    .name = "pit",
+    .rating = 100,
+    .features = CLOCK_EVT_FEAT_PERIODIC,
+    .min_delta_ns = TIMER_TICK_NS,
+    .max_delta_ns = TIMER_TICK_NS,
+    .set_next_event = pit_set_next_event,
+    .set_periodic = pit_set_periodic,
+    .shutdown = pit_shutdown,
+};
+
+/* Tick work runs as a softirq, after the interrupt has been acknowledged */
+static void sched_softirq(void)
+{
+    scheduler_tick();
+}
+
+void timer_init(void)
+{
+    softirq_register(SOFTIRQ_SCHED, sched_softirq);
+    clock_init();
+    clockevent_register(&pit_clockevent);
     serial_puts("[OK] PIT timer (100 Hz, IRQ0)\n");
 }
 
+/* Advance the tick count to the clock */
+static void ticks_update(void)
+{
+    uint32_t flags = spin_lock_irqsave(&tick_lock);
+    uint64_t now = clock_now_ns();
+    while (now >= next_tick_ns) {
+        ticks++;
+        next_tick_ns += TIMER_TICK_NS;
+    }
+    spin_unlock_irqrestore(&tick_lock, flags);
+}
+
+void timer_use_clock(void)
+{
+    uint32_t flags = spin_lock_irqsave(&tick_lock);
+    if (!ticks_from_clock) {
+        next_tick_ns = clock_now_ns() + TIMER_TICK_NS;
+        ticks_from_clock = 1;
+    }
+    spin_unlock_irqrestore(&tick_lock, flags);
+}
+
+void timer_pit_interrupt(void)
+{
+    /* A PIT interrupt still in flight when the LAPIC took over is dropped */
+    if (!ticks_from_clock) clockevent_interrupt();
+}
+
 void timer_interrupt(void)
 {
-    ticks++;
-    scheduler_tick();
+    if (ticks_from_clock) {
+        ticks_update();
+    } else {
+        ticks++;
+    }
+
+    /* An hrtimer event between ticks has no tick work */
+    uint32_t now = (uint32_t)ticks;
+    if (now == ticks_run) return;
+    ticks_run = now;
+
+    softirq_raise(SOFTIRQ_SCHED);
     /* EOI is sent by irq_dispatch() after this function returns */
 }
 
 int timer_get_ticks(void)
 {
+    if (ticks_from_clock) ticks_update();
     return ticks;
 }
+
+uint64_t timer_next_tick_ns(void)
+{
+    if (!ticks_from_clock) return 0;
+    uint32_t flags = spin_lock_irqsave(&tick_lock);
+    uint64_t next = next_tick_ns;
+    spin_unlock_irqrestore(&tick_lock, flags);
+    return next;
+}
@@ -7,10 +7,12 @@
 #include "../include/kernel/paging.h"
 #include "../include/kernel/pic.h"
 #include "../include/kernel/irq.h"
+#include "../include/kernel/irq_mgr.h"
 #include "../include/kernel/console.h"
 #include "../include/kernel/keyboard.h"
 #include "../include/kernel/kshell.h"
 #include "../include/kernel/task.h"
+#include "../include/kernel/thread.h"
 #include "../include/kernel/scheduler.h"
 #include "../include/kernel/timer.h"
 #include "../include/kernel/syscall.h"
@@ -28,6 +30,11 @@
 #include "../include/kernel/udp.h"
 #include "../include/kernel/tcp.h"
 #include "../include/kernel/device.h"
+#include "../include/kernel/dma.h"
+#include "../include/kernel/smp.h"
+#include "../include/kernel/ioapic.h"
+#include "../include/kernel/pci.h"
+#include "../include/kernel/rcu.h"
 #include "../include/kernel/model_serving.h"
 #include "../include/kernel/autoscale.h"
 #include "../include/kernel/pipeline.h"
@@ -41,34 +48,40 @@
 /* Initialize network stack */
 static void network_init(void)
 {
+    netdev_init();
+
     /* Create loopback device for testing */
-    struct netdev loopback;
-    loopback.dev_id = 0;
-    loopback.name[0] = 'l';
-    loopback.name[1] = 'o';
-    loopback.name[2] = '0';
-    loopback.name[3] = '\0';
+    struct netdev *loopback = netdev_alloc();
+    if (!loopback) {
+        serial_puts("[FAIL] Loopback device allocation\n");
+        return;
+    }
+    loopback->dev_id = 0;
+    loopback->name[0] = 'l';
+    loopback->name[1] = 'o';
+    loopback->name[2] = '0';
+    loopback->name[3] = '\0';
     
     /* Loopback address: 127.0.0.1 */
-    loopback.ip_addr.addr[0] = 127;
-    loopback.ip_addr.addr[1] = 0;
-    loopback.ip_addr.addr[2] = 0;
-    loopback.ip_addr.addr[3] = 1;
+    loopback->ip_addr.addr[0] = 127;
+    loopback->ip_addr.addr[1] = 0;
+    loopback->ip_addr.addr[2] = 0;
+    loopback->ip_addr.addr[3] = 1;
     
     /* Loopback MAC (dummy) */
-    loopback.mac_addr.addr[0] = 0x00;
-    loopback.mac_addr.addr[1] = 0x00;
-    loopback.mac_addr.addr[2] = 0x00;
-    loopback.mac_addr.addr[3] = 0x00;
-    loopback.mac_addr.addr[4] = 0x00;
-    loopback.mac_addr.addr[5] = 0x01;
+    loopback->mac_addr.addr[0] = 0x00;
+    loopback->mac_addr.addr[1] = 0x00;
+    loopback->mac_addr.addr[2] = 0x00;
+    loopback->mac_addr.addr[3] = 0x00;
+    loopback->mac_addr.addr[4] = 0x00;
+    loopback->mac_addr.addr[5] = 0x01;
     
-    loopback.mtu = 65535;
-    loopback.flags = IFF_UP | IFF_LOOPBACK | IFF_RUNNING;
-    loopback.ops = NULL;
-    loopback.priv = NULL;
+    loopback->mtu = 65535;
+    loopback->flags = IFF_UP | IFF_LOOPBACK | IFF_RUNNING;
+    loopback->ops = NULL;
+    loopback->priv = NULL;
     
-    if (netdev_register(&loopback) == 0) {
+    if (netdev_register(loopback) == 0) {
         serial_puts("[OK] Loopback device registered (127.0.0.1)\n");
     }
     
@@ -77,8 +90,7 @@ static void network_init(void)
     serial_puts("[OK] UDP protocol initialized\n");
 }
 
-void kernel_main(struct multiboot_info *mbi __attribute__((unused)),
-                 uint32_t magic __attribute__((unused)))
+void kernel_main(struct multiboot_info *mbi, uint32_t magic)
 {
     /* --- Stage 1: Serial-only (VGA not ready yet) --- */
     serial_init();
@@ -87,7 +99,13 @@ void kernel_main(struct multiboot_info *mbi __attribute__((unused)),
     gdt_init();
     idt_init();
 
-    pmem_init(128 * 1024 * 1024);
+    if (magic == MULTIBOOT_MAGIC && (mbi->flags & MULTIBOOT_INFO_MEM_MAP)) {
+        pmem_init_mmap(mbi);
+    } else if (magic == MULTIBOOT_MAGIC && (mbi->flags & MULTIBOOT_INFO_MEMORY)) {
+        pmem_init((mbi->mem_upper + 1024) * 1024);
+    } else {
+        pmem_init(128 * 1024 * 1024);
+    }
     serial_puts("[OK] Physical memory manager\n");
 
     heap_init();
@@ -98,6 +116,7 @@ void kernel_main(struct multiboot_info *mbi __attribute__((unused)),
     serial_puts("[OK] Paging enabled\n");
 
     pic_init();
+    irq_mgr_init();
     irq_init();          /* Wire IRQ 0-15 + INT 0x80 into IDT; enables interrupts */
     serial_puts("[OK] PIC + IRQ vectors\n");
 
@@ -107,12 +126,24 @@ void kernel_main(struct multiboot_info *mbi __attribute__((unused)),
     console_puts("[OK] Console (VGA + keyboard)\n");
 
     task_init();
+    thread_init();
     scheduler_init();
     timer_init();
     console_puts("[OK] Task manager and scheduler\n");
 
+    smp_init();
+    rcu_init();
+    softirq_init();
+    console_puts("[OK] SMP (per-CPU run queues, RCU, softirqs)\n");
+
+    /* Needs the local APIC up; lines past the 16 ISA ones come from here and MSI */
+    if (ioapic_init() == 0) console_puts("[OK] I/O APIC\n");
+    pci_init();
+    pci_enumerate();
+
     device_init();
-    console_puts("[OK] Device registry\n");
+    dma_init();
+    console_puts("[OK] Device registry and DMA\n");
 
     network_init();
     console_puts("[OK] Network stack\n");
@@ -1,33 +1,76 @@
 #include "../../include/kernel/dma.h"
 #include "../../include/kernel/serial.h"
 #include "../../include/kernel/heap.h"
+#include "../../include/kernel/pmem.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/spinlock.h"
 #include <string.h>
 
 #define MAX_DMA_BUFFERS 64
-#define MAX_SG_LISTS 32
-#define MAX_SG_ENTRIES_PER_LIST 16
+#define DMA_SG_INITIAL_ENTRIES 8
+#define DMA_POOL_MAX_CHUNK_PAGES (1 << (PMEM_MAX_ORDER - 1))
+#define DMA_POOL_CHUNK_TARGET_PAGES 16  /* Upper bound when sizing for 8 blocks */
+
+/*
+ * DMA pool.  Blocks are carved from naturally aligned chunks of
+ * contiguous pmem pages (buddy blocks are aligned to their size), laid
+ * out so that none straddles a 'boundary' multiple.  Free blocks are
+ * chained through their first word, so alloc and free are a list
+ * push/pop.  Chunks stay with the pool until it is destroyed.
+ *
+ * Each pool's lock covers its free list, chunks and stats; dma_lock
+ * covers the pool table and is taken first.  The pool_* totals in
+ * dma_stats are bumped atomically so alloc and free need only the pool.
+ */
+struct dma_pool_chunk {
+    uint32_t base;
+    struct dma_pool_chunk *next;
+};
+
+struct dma_pool {
+    const char *name;
+    uint32_t size;
+    uint32_t stride;
+    uint32_t boundary;
+    uint32_t chunk_pages;
+    void *free_list;
+    struct dma_pool_chunk *chunks;
+    dma_pool_stats_t stats;
+    spinlock_t lock;
+    int in_use;
+};
 
 typedef struct {
     dma_buffer_t buffer;
     int in_use;
 } dma_buffer_entry_t;
 
-typedef struct {
+typedef struct dma_sg_list_entry {
     dma_sg_list_t sg_list;
-    int in_use;
+    struct dma_sg_list_entry *next;
 } dma_sg_list_entry_t;
 
 static dma_buffer_entry_t dma_buffers[MAX_DMA_BUFFERS];
-static dma_sg_list_entry_t dma_sg_lists[MAX_SG_LISTS];
+static dma_sg_list_entry_t *dma_sg_lists = NULL;
 static dma_stats_t dma_stats = {0};
 static uint32_t next_buffer_id = 1;
 static uint32_t next_sg_list_id = 1;
+static struct dma_pool dma_pools[DMA_MAX_POOLS];
+
+/* Buffer and pool tables, the SG list chain, the ids and dma_stats */
+static spinlock_t dma_lock = SPINLOCK_INIT;
+
+static inline void dma_stat_add(uint32_t *counter, uint32_t n)
+{
+    __sync_fetch_and_add(counter, n);
+}
 
 void dma_init(void)
 {
     memset(dma_buffers, 0, sizeof(dma_buffers));
-    memset(dma_sg_lists, 0, sizeof(dma_sg_lists));
+    dma_sg_lists = NULL;
     memset(&dma_stats, 0, sizeof(dma_stats));
+    memset(dma_pools, 0, sizeof(dma_pools));
     next_buffer_id = 1;
     next_sg_list_id = 1;
     
@@ -40,7 +83,15 @@ dma_buffer_t *dma_buffer_alloc(uint32_t size, dma_coherency_t coherency, uint32_
         return NULL;
     }
     
+    /* Allocate memory (simplified: assume physical = virtual) */
+    void *virt_addr = kmalloc(size);
+    if (!virt_addr) {
+        serial_puts("[dma] Failed to allocate DMA buffer memory\n");
+        return NULL;
+    }
+    
     /* Find free buffer slot */
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
     int free_idx = -1;
     for (int i = 0; i < MAX_DMA_BUFFERS; i++) {
         if (!dma_buffers[i].in_use) {
@@ -50,17 +101,12 @@ dma_buffer_t *dma_buffer_alloc(uint32_t size, dma_coherency_t coherency, uint32_
     }
     
     if (free_idx < 0) {
+        spin_unlock_irqrestore(&dma_lock, flags);
+        kfree(virt_addr);
         serial_puts("[dma] DMA buffer table full\n");
         return NULL;
     }
     
-    /* Allocate memory (simplified: assume physical = virtual) */
-    void *virt_addr = kmalloc(size);
-    if (!virt_addr) {
-        serial_puts("[dma] Failed to allocate DMA buffer memory\n");
-        return NULL;
-    }
-    
     /* Initialize buffer */
     dma_buffer_entry_t *entry = &dma_buffers[free_idx];
     entry->buffer.buffer_id = next_buffer_id++;
@@ -81,9 +127,7 @@ dma_buffer_t *dma_buffer_alloc(uint32_t size, dma_coherency_t coherency, uint32_
     entry->in_use = 1;
     dma_stats.total_buffers_allocated++;
     dma_stats.bytes_dma_allocated += size;
-    
-    serial_printf("[dma] Allocated DMA buffer %d (size=%d, device=%d)\n",
-                  entry->buffer.buffer_id, size, device_id);
+    spin_unlock_irqrestore(&dma_lock, flags);
     
     return &entry->buffer;
 }
@@ -92,20 +136,20 @@ int dma_buffer_free(uint32_t buffer_id)
 {
     if (buffer_id == 0) return -1;
     
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
     for (int i = 0; i < MAX_DMA_BUFFERS; i++) {
         if (dma_buffers[i].in_use && dma_buffers[i].buffer.buffer_id == buffer_id) {
-            dma_buffer_t *buf = &dma_buffers[i].buffer;
-            
-            /* Free the allocated memory */
-            kfree((void *)buf->virtual_addr);
-            
+            void *virt_addr = (void *)dma_buffers[i].buffer.virtual_addr;
             dma_buffers[i].in_use = 0;
             dma_stats.total_buffers_freed++;
+            spin_unlock_irqrestore(&dma_lock, flags);
             
-            serial_printf("[dma] Freed DMA buffer %d\n", buffer_id);
+            /* Free the allocated memory */
+            kfree(virt_addr);
             return 0;
         }
     }
+    spin_unlock_irqrestore(&dma_lock, flags);
     
     return -1;
 }
@@ -168,49 +212,60 @@ int dma_buffer_invalidate(uint32_t buffer_id)
     return 0;
 }
 
+/* Make room for at least one more entry, doubling the array */
+static int sg_reserve(dma_sg_list_t *sg)
+{
+    if (sg->entry_count < sg->capacity) return 0;
+
+    int capacity = sg->capacity ? sg->capacity * 2 : DMA_SG_INITIAL_ENTRIES;
+    dma_sg_entry_t *entries = (dma_sg_entry_t *)kmalloc(sizeof(dma_sg_entry_t) * capacity);
+    if (!entries) return -1;
+
+    if (sg->entries) {
+        memcpy(entries, sg->entries, sizeof(dma_sg_entry_t) * sg->entry_count);
+        kfree(sg->entries);
+    }
+    sg->entries = entries;
+    sg->capacity = capacity;
+    return 0;
+}
+
 dma_sg_list_t *dma_sg_alloc(int entry_count, uint32_t device_id)
 {
-    if (entry_count <= 0 || entry_count > MAX_SG_ENTRIES_PER_LIST) {
+    if (entry_count <= 0) {
         return NULL;
     }
     
-    /* Find free SG list slot */
-    int free_idx = -1;
-    for (int i = 0; i < MAX_SG_LISTS; i++) {
-        if (!dma_sg_lists[i].in_use) {
-            free_idx = i;
-            break;
-        }
-    }
-    
-    if (free_idx < 0) {
-        serial_puts("[dma] DMA SG list table full\n");
+    dma_sg_list_entry_t *sg_entry = (dma_sg_list_entry_t *)kmalloc(sizeof(dma_sg_list_entry_t));
+    if (!sg_entry) {
+        serial_puts("[dma] Failed to allocate SG list\n");
         return NULL;
     }
     
-    /* Allocate SG entries array */
+    /* Allocate SG entries array; it grows on demand */
     dma_sg_entry_t *entries = (dma_sg_entry_t *)kmalloc(
         sizeof(dma_sg_entry_t) * entry_count);
     if (!entries) {
         serial_puts("[dma] Failed to allocate SG entries\n");
+        kfree(sg_entry);
         return NULL;
     }
     
     memset(entries, 0, sizeof(dma_sg_entry_t) * entry_count);
     
     /* Initialize SG list */
-    dma_sg_list_entry_t *sg_entry = &dma_sg_lists[free_idx];
-    sg_entry->sg_list.sg_list_id = next_sg_list_id++;
     sg_entry->sg_list.entries = entries;
     sg_entry->sg_list.entry_count = 0;
+    sg_entry->sg_list.capacity = entry_count;
     sg_entry->sg_list.total_length = 0;
     sg_entry->sg_list.device_id = device_id;
-    sg_entry->in_use = 1;
     
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    sg_entry->sg_list.sg_list_id = next_sg_list_id++;
+    sg_entry->next = dma_sg_lists;
+    dma_sg_lists = sg_entry;
     dma_stats.sg_lists_created++;
-    
-    serial_printf("[dma] Allocated SG list %d (capacity=%d, device=%d)\n",
-                  sg_entry->sg_list.sg_list_id, entry_count, device_id);
+    spin_unlock_irqrestore(&dma_lock, flags);
     
     return &sg_entry->sg_list;
 }
@@ -219,17 +274,77 @@ int dma_sg_free(uint32_t sg_list_id)
 {
     if (sg_list_id == 0) return -1;
     
-    for (int i = 0; i < MAX_SG_LISTS; i++) {
-        if (dma_sg_lists[i].in_use && dma_sg_lists[i].sg_list.sg_list_id == sg_list_id) {
-            kfree(dma_sg_lists[i].sg_list.entries);
-            dma_sg_lists[i].in_use = 0;
-            
-            serial_printf("[dma] Freed SG list %d\n", sg_list_id);
-            return 0;
-        }
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    dma_sg_list_entry_t **link = &dma_sg_lists;
+    while (*link && (*link)->sg_list.sg_list_id != sg_list_id) {
+        link = &(*link)->next;
+    }
+    if (!*link) {
+        spin_unlock_irqrestore(&dma_lock, flags);
+        return -1;
     }
     
-    return -1;
+    dma_sg_list_entry_t *sg_entry = *link;
+    *link = sg_entry->next;
+    spin_unlock_irqrestore(&dma_lock, flags);
+    
+    kfree(sg_entry->sg_list.entries);
+    kfree(sg_entry);
+    return 0;
+}
+
+/*
+ * Append [phys, phys+length) to a list, extending the last entry when
+ * the range continues it physically and virtually, and starting new
+ * entries wherever the device's segment size or boundary would be
+ * exceeded.
+ */
+static int sg_append(dma_sg_list_t *sg, uint32_t phys, uint32_t virt, uint32_t length,
+                     const dma_sg_limits_t *limits)
+{
+    uint32_t max_seg = (limits && limits->max_segment_size) ? limits->max_segment_size : 0xFFFFFFFF;
+    uint32_t boundary = limits ? limits->segment_boundary : 0;
+    
+    while (length > 0) {
+        dma_sg_entry_t *last = sg->entry_count ? &sg->entries[sg->entry_count - 1] : NULL;
+        uint32_t piece;
+        
+        if (last && last->physical_addr + last->length == phys &&
+            last->virtual_addr + last->length == virt) {
+            /* Room left in the last segment */
+            piece = max_seg - last->length;
+            if (boundary) {
+                uint32_t to_boundary = boundary - ((phys - 1) & (boundary - 1)) - 1;
+                if (to_boundary < piece) piece = to_boundary;
+            }
+            if (piece > 0) {
+                if (piece > length) piece = length;
+                last->length += piece;
+                goto advance;
+            }
+        }
+        
+        if (sg_reserve(sg) != 0) return -1;
+        piece = max_seg;
+        if (boundary) {
+            uint32_t to_boundary = boundary - (phys & (boundary - 1));
+            if (to_boundary < piece) piece = to_boundary;
+        }
+        if (piece > length) piece = length;
+        
+        last = &sg->entries[sg->entry_count++];
+        last->physical_addr = phys;
+        last->virtual_addr = virt;
+        last->length = piece;
+        last->flags = 0;
+        
+advance:
+        sg->total_length += piece;
+        phys += piece;
+        virt += piece;
+        length -= piece;
+    }
+    return 0;
 }
 
 int dma_sg_add_entry(uint32_t sg_list_id, uint32_t phys_addr, uint32_t length)
@@ -239,35 +354,256 @@ int dma_sg_add_entry(uint32_t sg_list_id, uint32_t phys_addr, uint32_t length)
     dma_sg_list_t *sg = dma_sg_get(sg_list_id);
     if (!sg) return -1;
     
-    /* Check if we have space for another entry */
-    if (sg->entry_count >= MAX_SG_ENTRIES_PER_LIST) {
+    if (sg_append(sg, phys_addr, phys_addr, length, NULL) != 0) {
         return -1;
     }
+    return sg->entry_count - 1;
+}
+
+dma_sg_list_t *dma_sg_map(const void *buffer, uint32_t length, const dma_sg_limits_t *limits,
+                          uint32_t device_id)
+{
+    if (!buffer || length == 0) return NULL;
+    if (limits && limits->segment_boundary &&
+        (limits->segment_boundary & (limits->segment_boundary - 1))) {
+        return NULL;
+    }
     
-    /* Add entry */
-    dma_sg_entry_t *entry = &sg->entries[sg->entry_count];
-    entry->physical_addr = phys_addr;
-    entry->virtual_addr = phys_addr;  /* Simplified */
-    entry->length = length;
-    entry->flags = 0;
-    
-    sg->entry_count++;
-    sg->total_length += length;
+    dma_sg_list_t *sg = dma_sg_alloc(DMA_SG_INITIAL_ENTRIES, device_id);
+    if (!sg) return NULL;
+    
+    /* Translate page by page; physically adjacent pages merge */
+    uint32_t virt = (uint32_t)buffer;
+    uint32_t remaining = length;
+    uint32_t pages = 0;
+    while (remaining > 0) {
+        uint32_t piece = PAGE_SIZE - (virt & (PAGE_SIZE - 1));
+        if (piece > remaining) piece = remaining;
+        
+        uint32_t phys = paging_kernel_virt_to_phys(virt);
+        if (!phys || sg_append(sg, phys, virt, piece, limits) != 0) {
+            dma_sg_free(sg->sg_list_id);
+            return NULL;
+        }
+        virt += piece;
+        remaining -= piece;
+        pages++;
+    }
     
-    return sg->entry_count - 1;
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    dma_stats.sg_map_requests++;
+    dma_stats.sg_map_pages += pages;
+    dma_stats.sg_map_segments += (uint32_t)sg->entry_count;
+    dma_stats.sg_segments_per_request_x100 =
+        (dma_stats.sg_map_segments * 100) / dma_stats.sg_map_requests;
+    spin_unlock_irqrestore(&dma_lock, flags);
+    return sg;
 }
 
 dma_sg_list_t *dma_sg_get(uint32_t sg_list_id)
 {
     if (sg_list_id == 0) return NULL;
     
-    for (int i = 0; i < MAX_SG_LISTS; i++) {
-        if (dma_sg_lists[i].in_use && dma_sg_lists[i].sg_list.sg_list_id == sg_list_id) {
-            return &dma_sg_lists[i].sg_list;
+    dma_sg_list_t *found = NULL;
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    for (dma_sg_list_entry_t *e = dma_sg_lists; e; e = e->next) {
+        if (e->sg_list.sg_list_id == sg_list_id) {
+            found = &e->sg_list;
+            break;
         }
     }
+    spin_unlock_irqrestore(&dma_lock, flags);
     
-    return NULL;
+    return found;
+}
+
+static inline int is_pow2(uint32_t x)
+{
+    return x && !(x & (x - 1));
+}
+
+dma_pool_t *dma_pool_create(const char *name, uint32_t size, uint32_t align, uint32_t boundary)
+{
+    if (size == 0) return NULL;
+    if (align == 0) align = sizeof(void *);
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (!is_pow2(align) || (boundary && !is_pow2(boundary))) return NULL;
+
+    uint32_t stride = (size + align - 1) & ~(align - 1);
+    if (boundary && stride > boundary) return NULL;
+
+    /* Chunk: power-of-two pages, aligned as required, room for about
+       eight blocks but no more than DMA_POOL_CHUNK_TARGET_PAGES unless a
+       single block needs it */
+    uint32_t pages = 1;
+    while (pages < DMA_POOL_CHUNK_TARGET_PAGES && pages * PAGE_SIZE < stride * 8) pages <<= 1;
+    while (pages * PAGE_SIZE < stride || pages * PAGE_SIZE < align) {
+        if (pages >= DMA_POOL_MAX_CHUNK_PAGES) return NULL;
+        pages <<= 1;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    struct dma_pool *pool = NULL;
+    for (int i = 0; i < DMA_MAX_POOLS; i++) {
+        if (!dma_pools[i].in_use) {
+            pool = &dma_pools[i];
+            break;
+        }
+    }
+    if (!pool) {
+        spin_unlock_irqrestore(&dma_lock, flags);
+        serial_puts("[dma] DMA pool table full\n");
+        return NULL;
+    }
+
+    memset(pool, 0, sizeof(*pool));
+    spin_lock_init(&pool->lock);
+    pool->name = name;
+    pool->size = size;
+    pool->stride = stride;
+    pool->boundary = boundary;
+    pool->chunk_pages = pages;
+    pool->stats.name = name;
+    pool->stats.block_size = size;
+    pool->stats.align = align;
+    pool->stats.boundary = boundary;
+    pool->in_use = 1;
+    dma_stats.pools_active++;
+    spin_unlock_irqrestore(&dma_lock, flags);
+
+    serial_printf("[dma] Pool %s: %u-byte blocks, align %u, boundary %u, %u-page chunks\n",
+                  name, size, align, boundary, pages);
+    return pool;
+}
+
+/* Add a chunk of contiguous pages to the pool's free list; pool locked */
+static int dma_pool_grow(struct dma_pool *pool)
+{
+    struct dma_pool_chunk *chunk = (struct dma_pool_chunk *)kmalloc(sizeof(struct dma_pool_chunk));
+    if (!chunk) return -1;
+
+    uint32_t base = pmem_alloc_pages((int)pool->chunk_pages);
+    if (!base) {
+        kfree(chunk);
+        return -1;
+    }
+
+    uint32_t bytes = pool->chunk_pages * PAGE_SIZE;
+    chunk->base = base;
+    chunk->next = pool->chunks;
+    pool->chunks = chunk;
+
+    uint32_t count = 0;
+    uint32_t off = 0;
+    while (off + pool->size <= bytes) {
+        if (pool->boundary &&
+            off / pool->boundary != (off + pool->size - 1) / pool->boundary) {
+            off = (off / pool->boundary + 1) * pool->boundary;
+            continue;
+        }
+        void *block = (void *)(base + off);
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+        count++;
+        off += pool->stride;
+    }
+
+    pool->stats.chunks++;
+    pool->stats.blocks_total += count;
+    dma_stat_add(&dma_stats.pool_chunks, 1);
+    dma_stat_add(&dma_stats.pool_bytes_reserved, bytes);
+    return 0;
+}
+
+int dma_pool_destroy(dma_pool_t *pool)
+{
+    if (!pool) return -1;
+
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    spin_lock(&pool->lock);
+    if (!pool->in_use || pool->stats.blocks_in_use) {
+        spin_unlock(&pool->lock);
+        spin_unlock_irqrestore(&dma_lock, flags);
+        return -1;
+    }
+    struct dma_pool_chunk *chunk = pool->chunks;
+    pool->chunks = NULL;
+    pool->free_list = NULL;
+    pool->in_use = 0;
+    spin_unlock(&pool->lock);
+
+    while (chunk) {
+        struct dma_pool_chunk *next = chunk->next;
+        pmem_free_pages(chunk->base, (int)pool->chunk_pages);
+        kfree(chunk);
+        dma_stat_add(&dma_stats.pool_chunks, (uint32_t)-1);
+        dma_stat_add(&dma_stats.pool_bytes_reserved, -(pool->chunk_pages * PAGE_SIZE));
+        chunk = next;
+    }
+
+    dma_stats.pools_active--;
+    spin_unlock_irqrestore(&dma_lock, flags);
+    return 0;
+}
+
+void *dma_pool_alloc(dma_pool_t *pool, uint32_t *phys_addr)
+{
+    if (!pool) return NULL;
+
+    uint32_t flags = spin_lock_irqsave(&pool->lock);
+    if (!pool->in_use) {
+        spin_unlock_irqrestore(&pool->lock, flags);
+        return NULL;
+    }
+    if (!pool->free_list && dma_pool_grow(pool) != 0) {
+        pool->stats.failures++;
+        spin_unlock_irqrestore(&pool->lock, flags);
+        dma_stat_add(&dma_stats.pool_failures, 1);
+        return NULL;
+    }
+
+    void *block = pool->free_list;
+    pool->free_list = *(void **)block;
+
+    pool->stats.blocks_in_use++;
+    pool->stats.allocs++;
+    spin_unlock_irqrestore(&pool->lock, flags);
+    dma_stat_add(&dma_stats.pool_allocs, 1);
+
+    /* Pool memory is identity-mapped pmem, so bus == kernel address */
+    if (phys_addr) *phys_addr = (uint32_t)block;
+    return block;
+}
+
+void dma_pool_free(dma_pool_t *pool, void *vaddr)
+{
+    if (!pool || !vaddr) return;
+
+    uint32_t flags = spin_lock_irqsave(&pool->lock);
+    *(void **)vaddr = pool->free_list;
+    pool->free_list = vaddr;
+
+    pool->stats.blocks_in_use--;
+    pool->stats.frees++;
+    spin_unlock_irqrestore(&pool->lock, flags);
+    dma_stat_add(&dma_stats.pool_frees, 1);
+}
+
+int dma_pool_get_stats(int index, dma_pool_stats_t *out)
+{
+    if (index < 0 || index >= DMA_MAX_POOLS || !out) return -1;
+
+    struct dma_pool *pool = &dma_pools[index];
+    int ret = -1;
+    uint32_t flags = spin_lock_irqsave(&dma_lock);
+    if (pool->in_use) {
+        spin_lock(&pool->lock);
+        *out = pool->stats;
+        spin_unlock(&pool->lock);
+        ret = 0;
+    }
+    spin_unlock_irqrestore(&dma_lock, flags);
+    return ret;
 }
 
 dma_stats_t *dma_get_stats(void)
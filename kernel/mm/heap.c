@@ -1,72 +1,344 @@
 #include "../../include/kernel/heap.h"
 #include "../../include/kernel/pmem.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/spinlock.h"
 #include <stddef.h>
 
 #define HEAP_START 0x10000
 #define HEAP_MAX_SIZE (256 * PAGE_SIZE)
+#define HEAP_GROW_MIN (16 * PAGE_SIZE)
 
-struct allocation_header {
-    uint32_t size;
-    int free;
-    struct allocation_header *next;
+/*
+ * Two-level segregated fit (TLSF) heap.
+ *
+ * Free blocks are binned by size class: the first level is the power of
+ * two, the second splits each power of two into SL_COUNT linear steps.
+ * Two bitmaps record which bins are non-empty, so finding a block that
+ * is large enough is a pair of find-first-set operations and both
+ * kmalloc and kfree are O(1).
+ *
+ * Every block header carries a pointer to the physically previous block
+ * (the boundary tag), so kfree merges with the neighbour on either side.
+ * Each pool ends with a zero-size used sentinel that stops merging.  When
+ * no bin can satisfy a request the heap grows by a new pool taken from
+ * pmem_alloc_pages; grown pools that become entirely free are returned.
+ */
+
+#define ALIGN_SHIFT 3
+#define ALIGN_SIZE (1u << ALIGN_SHIFT)
+#define SL_SHIFT 4
+#define SL_COUNT (1u << SL_SHIFT)
+#define FL_SHIFT (SL_SHIFT + ALIGN_SHIFT)
+#define FL_MAX 28
+#define FL_COUNT (FL_MAX - FL_SHIFT + 1)
+#define SMALL_BLOCK_SIZE (1u << FL_SHIFT)
+
+#define BLOCK_FREE 0x1
+#define BLOCK_SIZE_MASK (~(ALIGN_SIZE - 1))
+
+struct block_header {
+    struct block_header *prev_phys;     /* Boundary tag; NULL for a pool's first block */
+    uint32_t size;                      /* Payload size | BLOCK_FREE */
+    /* Only valid while the block is free (they overlay the payload) */
+    struct block_header *next_free;
+    struct block_header *prev_free;
 };
 
-static struct allocation_header *heap_start = NULL;
+#define BLOCK_OVERHEAD (2 * sizeof(uint32_t))     /* prev_phys + size */
+#define BLOCK_MIN_SIZE (sizeof(struct block_header) - BLOCK_OVERHEAD)
+/* A pool's free block must stay below 1 << FL_MAX to have a bin, and a
+   request must round up (mapping_search) to no more than the last class */
+#define POOL_MAX_SIZE (1u << FL_MAX)
+#define BLOCK_MAX_SIZE (POOL_MAX_SIZE - (1u << (FL_MAX - 1 - SL_SHIFT)))
+
+/* Bins, bitmaps and counters; kmalloc/kfree run on every CPU and in IRQs */
+static spinlock_t heap_lock = SPINLOCK_INIT;
+
+static uint32_t fl_bitmap = 0;
+static uint32_t sl_bitmap[FL_COUNT];
+static struct block_header *blocks[FL_COUNT][SL_COUNT];
+
+static uint32_t heap_size = 0;
 static uint32_t heap_used = 0;
+static uint32_t heap_pools = 0;
+static uint32_t heap_allocs = 0;
+static uint32_t heap_frees = 0;
+
+static inline int fls32(uint32_t x)
+{
+    return x ? 31 - __builtin_clz(x) : -1;
+}
+
+static inline int ffs32(uint32_t x)
+{
+    return x ? __builtin_ctz(x) : -1;
+}
+
+static inline uint32_t block_size(struct block_header *b)
+{
+    return b->size & BLOCK_SIZE_MASK;
+}
+
+static inline int block_is_free(struct block_header *b)
+{
+    return b->size & BLOCK_FREE;
+}
+
+static inline void *block_payload(struct block_header *b)
+{
+    return (void *)((uint32_t)b + BLOCK_OVERHEAD);
+}
+
+static inline struct block_header *block_from_payload(void *ptr)
+{
+    return (struct block_header *)((uint32_t)ptr - BLOCK_OVERHEAD);
+}
+
+static inline struct block_header *block_next(struct block_header *b)
+{
+    return (struct block_header *)((uint32_t)block_payload(b) + block_size(b));
+}
+
+static void mapping_insert(uint32_t size, int *fl, int *sl)
+{
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = (int)(size / (SMALL_BLOCK_SIZE / SL_COUNT));
+    } else {
+        int f = fls32(size);
+        *sl = (int)(size >> (f - SL_SHIFT)) ^ (int)SL_COUNT;
+        *fl = f - (FL_SHIFT - 1);
+    }
+}
+
+/* Like mapping_insert, but rounds up so any block in the bin fits */
+static void mapping_search(uint32_t size, int *fl, int *sl)
+{
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += (1u << (fls32(size) - SL_SHIFT)) - 1;
+    }
+    mapping_insert(size, fl, sl);
+}
+
+static void free_list_insert(struct block_header *b)
+{
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+
+    b->prev_free = NULL;
+    b->next_free = blocks[fl][sl];
+    if (b->next_free) b->next_free->prev_free = b;
+    blocks[fl][sl] = b;
+
+    fl_bitmap |= 1u << fl;
+    sl_bitmap[fl] |= 1u << sl;
+}
+
+static void free_list_remove(struct block_header *b)
+{
+    int fl, sl;
+    mapping_insert(block_size(b), &fl, &sl);
+
+    if (b->prev_free) b->prev_free->next_free = b->next_free;
+    else blocks[fl][sl] = b->next_free;
+    if (b->next_free) b->next_free->prev_free = b->prev_free;
+
+    if (!blocks[fl][sl]) {
+        sl_bitmap[fl] &= ~(1u << sl);
+        if (!sl_bitmap[fl]) fl_bitmap &= ~(1u << fl);
+    }
+}
+
+static struct block_header *find_suitable_block(uint32_t size)
+{
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT) return NULL;
+
+    uint32_t sl_map = sl_bitmap[fl] & (~0u << sl);
+    if (!sl_map) {
+        uint32_t fl_map = (fl + 1 < 32) ? fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (!fl_map) return NULL;
+        fl = ffs32(fl_map);
+        sl_map = sl_bitmap[fl];
+    }
+    sl = ffs32(sl_map);
+    return blocks[fl][sl];
+}
+
+/* Split off the tail of a used block beyond 'size' as a new free block */
+static void block_trim(struct block_header *b, uint32_t size)
+{
+    uint32_t total = block_size(b);
+    if (total < size + sizeof(struct block_header)) return;
+
+    struct block_header *rest = (struct block_header *)((uint32_t)block_payload(b) + size);
+    rest->prev_phys = b;
+    rest->size = (total - size - BLOCK_OVERHEAD) | BLOCK_FREE;
+    block_next(rest)->prev_phys = rest;
+    b->size = size | (b->size & BLOCK_FREE);
+    free_list_insert(rest);
+}
+
+/* Merge a free block with free physical neighbours on both sides */
+static struct block_header *block_coalesce(struct block_header *b)
+{
+    struct block_header *prev = b->prev_phys;
+    if (prev && block_is_free(prev)) {
+        free_list_remove(prev);
+        prev->size = (block_size(prev) + BLOCK_OVERHEAD + block_size(b)) | BLOCK_FREE;
+        block_next(prev)->prev_phys = prev;
+        b = prev;
+    }
+
+    struct block_header *next = block_next(b);
+    if (block_is_free(next)) {
+        free_list_remove(next);
+        b->size = (block_size(b) + BLOCK_OVERHEAD + block_size(next)) | BLOCK_FREE;
+        block_next(b)->prev_phys = b;
+    }
+    return b;
+}
+
+/* Turn [base, base+bytes) into one free block followed by a sentinel */
+static void heap_add_pool(uint32_t base, uint32_t bytes)
+{
+    struct block_header *b = (struct block_header *)base;
+    b->prev_phys = NULL;
+    b->size = (bytes - 2 * BLOCK_OVERHEAD) | BLOCK_FREE;
+
+    struct block_header *sentinel = block_next(b);
+    sentinel->prev_phys = b;
+    sentinel->size = 0;
+
+    free_list_insert(b);
+    heap_size += bytes;
+    heap_pools++;
+}
+
+static int heap_grow(uint32_t size)
+{
+    int fl, sl;
+    mapping_search(size, &fl, &sl);
+    if (fl >= FL_COUNT) return -1;
+
+    /* Round up to the start of the class mapping_search looks in */
+    if (size >= SMALL_BLOCK_SIZE) {
+        uint32_t step = 1u << (fls32(size) - SL_SHIFT);
+        size = (size + step - 1) & ~(step - 1);
+    }
+    uint32_t bytes = size + 2 * BLOCK_OVERHEAD;
+    if (bytes < HEAP_GROW_MIN) bytes = HEAP_GROW_MIN;
+    if (bytes > POOL_MAX_SIZE) return -1;
+    uint32_t pages = (bytes + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    uint32_t base = pmem_alloc_pages((int)pages);
+    if (!base) return -1;
+
+    heap_add_pool(base, pages * PAGE_SIZE);
+    return 0;
+}
 
 void heap_init(void)
 {
-    heap_start = (struct allocation_header *)HEAP_START;
-    heap_start->size = HEAP_MAX_SIZE - sizeof(struct allocation_header);
-    heap_start->free = 1;
-    heap_start->next = NULL;
+    fl_bitmap = 0;
+    for (int i = 0; i < FL_COUNT; i++) {
+        sl_bitmap[i] = 0;
+        for (int j = 0; j < (int)SL_COUNT; j++) {
+            blocks[i][j] = NULL;
+        }
+    }
+    heap_size = 0;
     heap_used = 0;
+    heap_pools = 0;
+
+    heap_add_pool(HEAP_START, HEAP_MAX_SIZE);
     serial_puts("Kernel heap initialized\n");
 }
 
 void *kmalloc(uint32_t size)
 {
-    if (size == 0) return NULL;
-    
-    size += sizeof(struct allocation_header);
-    struct allocation_header *block = heap_start;
-    
-    while (block) {
-        if (block->free && block->size >= size) {
-            block->free = 0;
-            
-            if (block->size > size + sizeof(struct allocation_header)) {
-                struct allocation_header *new_block = 
-                    (struct allocation_header *)((uint32_t)block + size);
-                new_block->size = block->size - size;
-                new_block->free = 1;
-                new_block->next = block->next;
-                block->next = new_block;
-                block->size = size;
-            }
-            
-            heap_used += size;
-            return (void *)((uint32_t)block + sizeof(struct allocation_header));
-        }
-        block = block->next;
+    if (size == 0 || size > BLOCK_MAX_SIZE) return NULL;
+
+    size = (size + ALIGN_SIZE - 1) & BLOCK_SIZE_MASK;
+    if (size < BLOCK_MIN_SIZE) size = BLOCK_MIN_SIZE;
+
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    struct block_header *b = find_suitable_block(size);
+    if (!b && heap_grow(size) == 0) b = find_suitable_block(size);
+    if (!b) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return NULL;
     }
-    
-    return NULL;
+
+    free_list_remove(b);
+    b->size &= ~BLOCK_FREE;
+    block_trim(b, size);
+
+    heap_used += block_size(b);
+    heap_allocs++;
+    spin_unlock_irqrestore(&heap_lock, flags);
+    return block_payload(b);
 }
 
 void kfree(void *ptr)
 {
     if (!ptr) return;
-    
-    struct allocation_header *block = 
-        (struct allocation_header *)((uint32_t)ptr - sizeof(struct allocation_header));
-    
-    block->free = 1;
-    heap_used -= block->size;
-    
-    if (block->next && block->next->free) {
-        block->size += block->next->size;
-        block->next = block->next->next;
+
+    struct block_header *b = block_from_payload(ptr);
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    if (block_is_free(b)) {
+        spin_unlock_irqrestore(&heap_lock, flags);
+        return;
     }
+
+    heap_used -= block_size(b);
+    heap_frees++;
+    b->size |= BLOCK_FREE;
+    b = block_coalesce(b);
+
+    /* Give a grown pool back to pmem once it is entirely free */
+    uint32_t base = (uint32_t)b;
+    if (!b->prev_phys && base != HEAP_START && block_next(b)->size == 0) {
+        uint32_t bytes = block_size(b) + 2 * BLOCK_OVERHEAD;
+        heap_size -= bytes;
+        heap_pools--;
+        spin_unlock_irqrestore(&heap_lock, flags);
+        pmem_free_pages(base, (int)(bytes / PAGE_SIZE));
+        return;
+    }
+
+    free_list_insert(b);
+    spin_unlock_irqrestore(&heap_lock, flags);
+}
+
+void heap_get_stats(heap_stats_t *stats)
+{
+    if (!stats) return;
+
+    uint32_t free_bytes = 0;
+    uint32_t largest = 0;
+    uint32_t free_blocks = 0;
+    uint32_t flags = spin_lock_irqsave(&heap_lock);
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        if (!(fl_bitmap & (1u << fl))) continue;
+        for (int sl = 0; sl < (int)SL_COUNT; sl++) {
+            for (struct block_header *b = blocks[fl][sl]; b; b = b->next_free) {
+                free_bytes += block_size(b);
+                free_blocks++;
+                if (block_size(b) > largest) largest = block_size(b);
+            }
+        }
+    }
+
+    stats->heap_size = heap_size;
+    stats->live_bytes = heap_used;
+    stats->free_bytes = free_bytes;
+    stats->free_blocks = free_blocks;
+    stats->largest_free = largest;
+    stats->fragmentation_pct = free_bytes ? 100 - (largest * 100) / free_bytes : 0;
+    stats->pools = heap_pools;
+    stats->allocs = heap_allocs;
+    stats->frees = heap_frees;
+    spin_unlock_irqrestore(&heap_lock, flags);
 }
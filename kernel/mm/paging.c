@@ -1,15 +1,50 @@
 #include "../../include/kernel/paging.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/slab.h"
 #include "../../include/kernel/heap.h"
 #include <string.h>
 
 #define PAGE_PRESENT 0x001
 #define PAGE_WRITABLE 0x002
 #define PAGE_USER 0x004
+#define PAGE_WRITETHROUGH 0x008
+#define PAGE_NOCACHE 0x010
+#define PAGE_LARGE 0x080            /* PDE maps a 4 MB page (needs CR4.PSE) */
+#define LARGE_PAGE_SIZE (PAGE_SIZE * PAGE_TABLE_ENTRIES)
+#define CR4_PSE 0x10
 
 static uint32_t page_directory[PAGE_DIR_ENTRIES] __attribute__((aligned(4096)));
 static uint32_t page_tables[4][PAGE_TABLE_ENTRIES] __attribute__((aligned(4096)));
 
+/* Page-aligned 4 KB objects for per-task page directories and tables */
+static kmem_cache_t *pgtable_cache = NULL;
+
+static void paging_tasks_init(void);
+
+/* CPU supports 4 MB pages; set once in paging_init */
+static int pse_enabled = 0;
+
+static int cpu_has_pse(void)
+{
+    uint32_t eax = 1, ebx, ecx, edx;
+    __asm__ volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx >> 3) & 1;
+}
+
+/*
+ * Replace a 4 MB PDE with an equivalent page table so that a single
+ * 4 KB page inside it can be changed.
+ */
+static void split_large_page(uint32_t *pde, uint32_t *table)
+{
+    uint32_t base = *pde & ~(LARGE_PAGE_SIZE - 1);
+    uint32_t flags = *pde & 0xFFF & ~PAGE_LARGE;
+    for (int i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+        table[i] = (base + i * PAGE_SIZE) | flags;
+    }
+    *pde = (uint32_t)table | flags | PAGE_PRESENT;
+}
+
 void paging_init(void)
 {
     for (int i = 0; i < PAGE_DIR_ENTRIES; i++) {
@@ -33,6 +68,38 @@ void paging_init(void)
         }
     }
     
+    pse_enabled = cpu_has_pse();
+    if (pse_enabled) {
+        uint32_t cr4;
+        __asm__ volatile("mov %%cr4, %0" : "=r"(cr4));
+        __asm__ volatile("mov %0, %%cr4" : : "r"(cr4 | CR4_PSE));
+    }
+    
+    /* Identity-map the rest of physical memory so every frame pmem
+       hands out is reachable by the kernel, with 4 MB pages when the
+       CPU has them.  Paging is still off, so any new tables can be
+       filled through their physical address. */
+    uint32_t dir_limit = (pmem_get_max_pfn() + PAGE_TABLE_ENTRIES - 1) / PAGE_TABLE_ENTRIES;
+    for (uint32_t d = 4; d < dir_limit && d < PAGE_DIR_ENTRIES; d++) {
+        if (pse_enabled) {
+            page_directory[d] = (d * LARGE_PAGE_SIZE) | PAGE_LARGE | PAGE_PRESENT | PAGE_WRITABLE;
+            continue;
+        }
+        uint32_t *table = (uint32_t *)pmem_alloc_page();
+        if (!table) {
+            serial_printf("Paging: identity map stops at %u MB\n", d * 4);
+            break;
+        }
+        for (int i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+            uint32_t addr = (d * PAGE_TABLE_ENTRIES + i) * PAGE_SIZE;
+            table[i] = addr | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+        page_directory[d] = (uint32_t)table | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    
+    pgtable_cache = kmem_cache_create("pgtable", PAGE_SIZE, PAGE_SIZE, NULL);
+    paging_tasks_init();
+    
     serial_puts("Paging structures initialized\n");
 }
 
@@ -51,69 +118,199 @@ uint32_t *get_page_directory(void)
     return page_directory;
 }
 
+/* Kernel page table covering virt, splitting a 4 MB page if needed */
+static uint32_t *kernel_table(uint32_t virt)
+{
+    uint32_t dir_idx = virt / LARGE_PAGE_SIZE;
+    if (!(page_directory[dir_idx] & PAGE_PRESENT)) return NULL;
+    
+    if (page_directory[dir_idx] & PAGE_LARGE) {
+        uint32_t *table = (uint32_t *)pmem_alloc_page();
+        if (!table) return NULL;
+        split_large_page(&page_directory[dir_idx], table);
+    }
+    return (uint32_t *)(page_directory[dir_idx] & ~0xFFF);
+}
+
 void map_page(uint32_t virt, uint32_t phys, int flags)
 {
-    uint32_t dir_idx = virt / (PAGE_TABLE_ENTRIES * PAGE_SIZE);
-    uint32_t table_idx = (virt / PAGE_SIZE) % PAGE_TABLE_ENTRIES;
-    if (dir_idx < 4 && table_idx < PAGE_TABLE_ENTRIES) {
-        page_tables[dir_idx][table_idx] = phys | flags | PAGE_PRESENT;
+    uint32_t *table = kernel_table(virt);
+    if (table) {
+        table[(virt / PAGE_SIZE) % PAGE_TABLE_ENTRIES] = phys | flags | PAGE_PRESENT;
     }
 }
 
 void unmap_page(uint32_t virt)
 {
-    uint32_t dir_idx = virt / (PAGE_TABLE_ENTRIES * PAGE_SIZE);
-    uint32_t table_idx = (virt / PAGE_SIZE) % PAGE_TABLE_ENTRIES;
-    if (dir_idx < 4 && table_idx < PAGE_TABLE_ENTRIES) {
-        page_tables[dir_idx][table_idx] = 0;
+    uint32_t *table = kernel_table(virt);
+    if (table) {
+        table[(virt / PAGE_SIZE) % PAGE_TABLE_ENTRIES] = 0;
     }
 }
 
+int paging_map_mmio(uint32_t phys, uint32_t size)
+{
+    uint32_t start = phys & ~(PAGE_SIZE - 1);
+    uint32_t end = phys + size;
+    
+    for (uint32_t addr = start; addr < end && addr >= start; addr += PAGE_SIZE) {
+        uint32_t *pde = &page_directory[addr / LARGE_PAGE_SIZE];
+        if (!(*pde & PAGE_PRESENT)) {
+            uint32_t *table = (uint32_t *)pmem_alloc_page();
+            if (!table) return -1;
+            memset(table, 0, PAGE_SIZE);
+            *pde = (uint32_t)table | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+        map_page(addr, addr, PAGE_WRITABLE | PAGE_NOCACHE | PAGE_WRITETHROUGH);
+        __asm__ volatile("invlpg (%0)" : : "r"(addr) : "memory");
+    }
+    return 0;
+}
+
+uint32_t paging_kernel_virt_to_phys(uint32_t virt)
+{
+    uint32_t pde = page_directory[virt / LARGE_PAGE_SIZE];
+    if (!(pde & PAGE_PRESENT)) return 0;
+    if (pde & PAGE_LARGE) {
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
+    
+    uint32_t pte = ((uint32_t *)(pde & ~0xFFF))[(virt / PAGE_SIZE) % PAGE_TABLE_ENTRIES];
+    if (!(pte & PAGE_PRESENT)) return 0;
+    return (pte & ~0xFFF) | (virt & (PAGE_SIZE - 1));
+}
+
 /* Per-task memory protection structures */
-#define MAX_PAGING_TASKS 64
-#define MAX_SHARED_REGIONS 32
+#define PAGING_HASH_BITS 6
+#define PAGING_HASH_SIZE (1 << PAGING_HASH_BITS)
+#define MAX_VMAS_PER_TASK 8
 #define PAGE_TABLES_PER_DIR 1024
 #define PTE_PRESENT 0x1
 #define PTE_WRITE 0x2
 #define PTE_USER 0x4
 #define PTE_ACCESSED 0x20
 #define PTE_DIRTY 0x40
+#define PTE_REF 0x200           /* Software: this mapping holds a frame reference */
+#define PTE_COW 0x400           /* Software: copy the frame on the next write */
+#define PTE_SHARED 0x800        /* Software: shared-memory page, never copy-on-write */
+#define PTE_FRAME(pte) ((pte) & ~0xFFF)
+
+/* Page-fault error code bits */
+#define PF_PRESENT 0x1
+#define PF_WRITE 0x2
 
-struct shared_region {
+static struct paging_stats cow_stats;
+
+/*
+ * Shared-memory object.  The object holds one reference to each of its
+ * frames; every attachment maps them at an address the task picks and
+ * each of those PTEs holds its own reference, so destroying the object
+ * only frees frames once the last task has detached.
+ */
+struct shm_object {
+    int id;
+    uint32_t creator;           /* Only this task may destroy the region */
+    uint32_t npages;
+    uint32_t *frames;
+    uint32_t flags;
+    uint32_t attach_count;
+    int destroyed;
+    struct shm_object *next;
+};
+
+struct shm_attachment {
+    struct shm_object *obj;
     uint32_t address;
-    uint32_t size;
-    uint32_t owner_task_id;
-    uint32_t share_count;
-    uint32_t permissions;
+    struct shm_attachment *next;
+};
+
+/*
+ * A demand-paged range of a task's address space.  Pages are left
+ * not-present until first touched; the fault handler then fills them
+ * from [file_offset, file_offset + file_size) of the backing object and
+ * zero-fills the rest, so BSS and anonymous memory cost nothing until
+ * used.
+ */
+struct vm_area {
+    uint32_t start;
+    uint32_t end;
+    uint32_t flags;             /* PAGING_WRITE / PAGING_USER */
+    const struct paging_backing *backing;   /* NULL for anonymous memory */
+    void *ctx;
+    uint32_t file_offset;
+    uint32_t file_size;
 };
 
 struct task_paging {
     uint32_t task_id;
     uint32_t *page_directory;
     uint32_t page_dir_physical;
-    struct shared_region *shared_pages[32];
-    int shared_page_count;
+    struct shm_attachment *attachments;
+    struct vm_area vmas[MAX_VMAS_PER_TASK];
+    int vma_count;
+    struct task_paging *hash_next;
 };
 
-static struct shared_region shared_regions[MAX_SHARED_REGIONS];
-static int shared_region_count = 0;
-static struct task_paging task_paging[MAX_PAGING_TASKS];
-static int paging_task_count = 0;
+/* References an area holds on its backing object */
+static void vma_get(struct vm_area *vma)
+{
+    if (vma->backing && vma->backing->get) vma->backing->get(vma->ctx);
+}
+
+static void vma_put(struct vm_area *vma)
+{
+    if (vma->backing && vma->backing->put) vma->backing->put(vma->ctx);
+}
+
+static struct shm_object *shm_objects = NULL;
+static int shm_next_id = 1;
+/*
+ * Address spaces are hashed by task id (multiplicative hash into
+ * PAGING_HASH_SIZE chained buckets), so every map/unmap/fault finds its
+ * task in O(1) and teardown just unlinks one entry.
+ */
+static struct task_paging *paging_hash[PAGING_HASH_SIZE];
+static kmem_cache_t *task_paging_cache = NULL;
+
+static inline uint32_t paging_hash_index(uint32_t task_id)
+{
+    return (task_id * 2654435761u) >> (32 - PAGING_HASH_BITS);
+}
+
+static struct task_paging *paging_find_task(uint32_t task_id)
+{
+    struct task_paging *tp = paging_hash[paging_hash_index(task_id)];
+    while (tp && tp->task_id != task_id) {
+        tp = tp->hash_next;
+    }
+    return tp;
+}
+
+static void paging_tasks_init(void)
+{
+    for (int i = 0; i < PAGING_HASH_SIZE; i++) {
+        paging_hash[i] = NULL;
+    }
+    task_paging_cache = kmem_cache_create("task_paging", sizeof(struct task_paging), 0, NULL);
+}
 
 int paging_init_task(uint32_t task_id)
 {
-    if (paging_task_count >= MAX_PAGING_TASKS) {
+    if (!task_paging_cache || paging_find_task(task_id)) {
         return -1;
     }
     
-    struct task_paging *tp = &task_paging[paging_task_count++];
+    struct task_paging *tp = (struct task_paging *)kmem_cache_alloc(task_paging_cache);
+    if (!tp) return -1;
+    
     tp->task_id = task_id;
-    tp->shared_page_count = 0;
+    tp->attachments = NULL;
+    tp->vma_count = 0;
     
     /* Allocate page directory (4KB for 1024 entries) */
-    tp->page_directory = (uint32_t *)kmalloc(4096);
+    tp->page_directory = (uint32_t *)kmem_cache_alloc(pgtable_cache);
     if (!tp->page_directory) {
-        paging_task_count--;
+        kmem_cache_free(task_paging_cache, tp);
         return -1;
     }
     
@@ -123,18 +320,73 @@ int paging_init_task(uint32_t task_id)
     /* Physical address would be set during actual paging setup */
     tp->page_dir_physical = (uint32_t)tp->page_directory;
     
+    uint32_t bucket = paging_hash_index(task_id);
+    tp->hash_next = paging_hash[bucket];
+    paging_hash[bucket] = tp;
+    
     serial_printf("[paging] Initialized page tables for task %d\n", task_id);
     return 0;
 }
 
-static struct task_paging *paging_find_task(uint32_t task_id)
+/*
+ * Page table entry for virt, optionally creating the page table.  A
+ * 4 MB page has no entries: lookups fail, and with 'create' it is split
+ * into a page table first.
+ */
+static uint32_t *pte_lookup(struct task_paging *tp, uint32_t virt, int create)
 {
-    for (int i = 0; i < paging_task_count; i++) {
-        if (task_paging[i].task_id == task_id) {
-            return &task_paging[i];
+    uint32_t pdi = virt / (PAGE_SIZE * PAGE_TABLES_PER_DIR);
+    uint32_t pti = (virt / PAGE_SIZE) % PAGE_TABLES_PER_DIR;
+    uint32_t pde = tp->page_directory[pdi];
+    
+    if (!(pde & PTE_PRESENT) || (pde & PAGE_LARGE)) {
+        if (!create) return NULL;
+        uint32_t *page_table = (uint32_t *)kmem_cache_alloc(pgtable_cache);
+        if (!page_table) return NULL;
+        
+        if (pde & PAGE_LARGE) {
+            split_large_page(&tp->page_directory[pdi], page_table);
+        } else {
+            memset(page_table, 0, 4096);
+            tp->page_directory[pdi] = ((uint32_t)page_table | PTE_PRESENT | PTE_WRITE | PTE_USER);
         }
     }
-    return NULL;
+    
+    uint32_t *page_table = (uint32_t *)(tp->page_directory[pdi] & ~0xFFF);
+    return &page_table[pti];
+}
+
+/* Is anything mapped at virt, either a 4 KB page or a 4 MB page? */
+static int page_mapped(struct task_paging *tp, uint32_t virt)
+{
+    uint32_t pde = tp->page_directory[virt / LARGE_PAGE_SIZE];
+    if (!(pde & PTE_PRESENT)) return 0;
+    if (pde & PAGE_LARGE) return 1;
+    return (((uint32_t *)(pde & ~0xFFF))[(virt / PAGE_SIZE) % PAGE_TABLE_ENTRIES] & PTE_PRESENT) != 0;
+}
+
+uint32_t paging_virt_to_phys(uint32_t task_id, uint32_t virt)
+{
+    struct task_paging *tp = paging_find_task(task_id);
+    if (!tp) return paging_kernel_virt_to_phys(virt);
+    
+    uint32_t pde = tp->page_directory[virt / LARGE_PAGE_SIZE];
+    if (!(pde & PTE_PRESENT)) return 0;
+    if (pde & PAGE_LARGE) {
+        return (pde & ~(LARGE_PAGE_SIZE - 1)) | (virt & (LARGE_PAGE_SIZE - 1));
+    }
+    uint32_t *pte = pte_lookup(tp, virt, 0);
+    if (!pte || !(*pte & PTE_PRESENT)) return 0;
+    return PTE_FRAME(*pte) | (virt & (PAGE_SIZE - 1));
+}
+
+static inline void flush_tlb_page(uint32_t *page_directory, uint32_t virt)
+{
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (cr3 == (uint32_t)page_directory) {
+        __asm__ volatile("invlpg (%0)" : : "r"(virt) : "memory");
+    }
 }
 
 int paging_map_page(uint32_t task_id, uint32_t virtual_addr, uint32_t physical_addr, uint32_t flags)
@@ -148,27 +400,19 @@ int paging_map_page(uint32_t task_id, uint32_t virtual_addr, uint32_t physical_a
     virtual_addr &= ~(PAGE_SIZE - 1);
     physical_addr &= ~(PAGE_SIZE - 1);
     
-    uint32_t pdi = virtual_addr / (PAGE_SIZE * PAGE_TABLES_PER_DIR);
-    uint32_t pti = (virtual_addr / PAGE_SIZE) % PAGE_TABLES_PER_DIR;
-    
-    /* Ensure page directory entry exists */
-    if (tp->page_directory[pdi] == 0) {
-        uint32_t *page_table = (uint32_t *)kmalloc(4096);
-        if (!page_table) return -1;
-        
-        memset(page_table, 0, 4096);
-        tp->page_directory[pdi] = ((uint32_t)page_table | PTE_PRESENT | PTE_WRITE | PTE_USER);
-    }
-    
-    /* Get page table */
-    uint32_t *page_table = (uint32_t *)(tp->page_directory[pdi] & ~0xFFF);
+    uint32_t *entry = pte_lookup(tp, virtual_addr, 1);
+    if (!entry) return -1;
     
     /* Set page table entry */
     uint32_t pte = physical_addr | PTE_PRESENT;
     if (flags & PAGING_WRITE) pte |= PTE_WRITE;
     if (flags & PAGING_USER) pte |= PTE_USER;
     
-    page_table[pti] = pte;
+    /* Replacing a copy-on-write mapping drops its frame reference */
+    if (*entry & PTE_REF) {
+        pmem_free_page(PTE_FRAME(*entry));
+    }
+    *entry = pte;
     
     return 0;
 }
@@ -182,128 +426,552 @@ int paging_unmap_page(uint32_t task_id, uint32_t virtual_addr)
     
     virtual_addr &= ~(PAGE_SIZE - 1);
     
-    uint32_t pdi = virtual_addr / (PAGE_SIZE * PAGE_TABLES_PER_DIR);
-    uint32_t pti = (virtual_addr / PAGE_SIZE) % PAGE_TABLES_PER_DIR;
+    if (!(tp->page_directory[virtual_addr / LARGE_PAGE_SIZE] & PTE_PRESENT)) return -1;
     
-    if (tp->page_directory[pdi] == 0) return -1;
-    
-    uint32_t *page_table = (uint32_t *)(tp->page_directory[pdi] & ~0xFFF);
-    page_table[pti] = 0;
+    uint32_t *entry = pte_lookup(tp, virtual_addr, 1);
+    if (!entry) return -1;
     
-    return 0;
-}
-
-int paging_create_shared_region(uint32_t task_id, uint32_t address, uint32_t size, uint32_t flags)
-{
-    if (!address || !size || shared_region_count >= MAX_SHARED_REGIONS) {
-        return -1;
+    if (*entry & PTE_REF) {
+        pmem_free_page(PTE_FRAME(*entry));
     }
+    *entry = 0;
     
-    struct shared_region *region = &shared_regions[shared_region_count++];
-    region->address = address & ~(PAGE_SIZE - 1);
-    region->size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-    region->owner_task_id = task_id;
-    region->share_count = 1;
-    region->permissions = flags;
-    
-    serial_printf("[paging] Created shared region at 0x%x size %d for task %d\n", 
-                  region->address, region->size, task_id);
-    
-    return shared_region_count - 1;
+    return 0;
 }
 
-int paging_attach_shared_region(uint32_t task_id, int region_id)
+/*
+ * Map [virtual_addr, virtual_addr + size) to the physically contiguous
+ * range at physical_addr.  Whole 4 MB stretches whose virtual and
+ * physical addresses are both 4 MB aligned become single PSE entries
+ * when the CPU supports them; everything else is written a page table
+ * at a time.  The caller keeps ownership of the frames.
+ */
+int paging_map_range(uint32_t task_id, uint32_t virtual_addr, uint32_t physical_addr,
+                     uint32_t size, uint32_t flags)
 {
-    if (region_id < 0 || region_id >= shared_region_count) return -1;
+    if (!virtual_addr || !size) return -1;
+    if ((virtual_addr | physical_addr) & (PAGE_SIZE - 1)) return -1;
     
     struct task_paging *tp = paging_find_task(task_id);
     if (!tp) return -1;
     
-    struct shared_region *region = &shared_regions[region_id];
+    uint32_t pte_flags = PTE_PRESENT;
+    if (flags & PAGING_WRITE) pte_flags |= PTE_WRITE;
+    if (flags & PAGING_USER) pte_flags |= PTE_USER;
     
-    /* Add region to task's shared pages */
-    if (tp->shared_page_count >= 32) return -1;
+    uint32_t va = virtual_addr;
+    uint32_t pa = physical_addr;
+    uint32_t end = virtual_addr + ((size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    if (end <= virtual_addr) return -1;
     
-    tp->shared_pages[tp->shared_page_count++] = region;
-    region->share_count++;
-    
-    /* Map pages into task's address space */
-    for (uint32_t addr = region->address; addr < region->address + region->size; addr += PAGE_SIZE) {
-        paging_map_page(task_id, addr, addr, region->permissions);
+    while (va < end) {
+        uint32_t pdi = va / LARGE_PAGE_SIZE;
+        
+        if (pse_enabled && !((va | pa) & (LARGE_PAGE_SIZE - 1)) &&
+            end - va >= LARGE_PAGE_SIZE && !(tp->page_directory[pdi] & PTE_PRESENT)) {
+            tp->page_directory[pdi] = pa | pte_flags | PAGE_LARGE;
+            flush_tlb_page(tp->page_directory, va);
+            va += LARGE_PAGE_SIZE;
+            pa += LARGE_PAGE_SIZE;
+            continue;
+        }
+        
+        /* Fill the rest of this page table in one pass */
+        uint32_t *entry = pte_lookup(tp, va, 1);
+        if (!entry) return -1;
+        uint32_t table_end = (pdi + 1) * LARGE_PAGE_SIZE;
+        if (table_end == 0 || table_end > end) table_end = end;
+        
+        for (; va < table_end; va += PAGE_SIZE, pa += PAGE_SIZE, entry++) {
+            if (*entry & PTE_REF) pmem_free_page(PTE_FRAME(*entry));
+            *entry = pa | pte_flags;
+            flush_tlb_page(tp->page_directory, va);
+        }
     }
     
     return 0;
 }
 
+static struct shm_object *shm_find(int region_id)
+{
+    for (struct shm_object *obj = shm_objects; obj; obj = obj->next) {
+        if (obj->id == region_id) return obj;
+    }
+    return NULL;
+}
+
+static void shm_release(struct shm_object *obj)
+{
+    kfree(obj->frames);
+    kfree(obj);
+}
+
+int paging_create_shared_region(uint32_t task_id, uint32_t size, uint32_t flags)
+{
+    if (!size) return -1;
+
+    struct shm_object *obj = (struct shm_object *)kmalloc(sizeof(struct shm_object));
+    if (!obj) return -1;
+
+    obj->npages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    obj->frames = (uint32_t *)kmalloc(obj->npages * sizeof(uint32_t));
+    if (!obj->frames) {
+        kfree(obj);
+        return -1;
+    }
+
+    for (uint32_t i = 0; i < obj->npages; i++) {
+        obj->frames[i] = pmem_alloc_page();
+        if (!obj->frames[i]) {
+            while (i > 0) pmem_free_page(obj->frames[--i]);
+            shm_release(obj);
+            return -1;
+        }
+        memset((void *)obj->frames[i], 0, PAGE_SIZE);
+    }
+
+    obj->id = shm_next_id++;
+    obj->creator = task_id;
+    obj->flags = flags;
+    obj->attach_count = 0;
+    obj->destroyed = 0;
+    obj->next = shm_objects;
+    shm_objects = obj;
+
+    serial_printf("[paging] Task %d created shared region %d (%u pages)\n",
+                  task_id, obj->id, obj->npages);
+    return obj->id;
+}
+
+int paging_attach_shared_region(uint32_t task_id, int region_id, uint32_t address)
+{
+    if (!address || (address & (PAGE_SIZE - 1))) return -1;
+
+    struct task_paging *tp = paging_find_task(task_id);
+    struct shm_object *obj = shm_find(region_id);
+    if (!tp || !obj) return -1;
+
+    uint32_t end = address + obj->npages * PAGE_SIZE;
+    if (end <= address) return -1;
+
+    /* Refuse to map over anything already present */
+    for (uint32_t va = address; va < end; va += PAGE_SIZE) {
+        if (page_mapped(tp, va)) return -1;
+    }
+
+    struct shm_attachment *att = (struct shm_attachment *)kmalloc(sizeof(struct shm_attachment));
+    if (!att) return -1;
+
+    uint32_t pte_flags = PTE_PRESENT | PTE_REF | PTE_SHARED;
+    if (obj->flags & PAGING_WRITE) pte_flags |= PTE_WRITE;
+    if (obj->flags & PAGING_USER) pte_flags |= PTE_USER;
+
+    for (uint32_t i = 0; i < obj->npages; i++) {
+        uint32_t *entry = pte_lookup(tp, address + i * PAGE_SIZE, 1);
+        if (!entry) {
+            while (i > 0) paging_unmap_page(task_id, address + --i * PAGE_SIZE);
+            kfree(att);
+            return -1;
+        }
+        pmem_page_ref(obj->frames[i]);
+        *entry = obj->frames[i] | pte_flags;
+    }
+
+    att->obj = obj;
+    att->address = address;
+    att->next = tp->attachments;
+    tp->attachments = att;
+    obj->attach_count++;
+    return 0;
+}
+
+static void shm_detach(struct task_paging *tp, struct shm_attachment *att)
+{
+    struct shm_object *obj = att->obj;
+    for (uint32_t i = 0; i < obj->npages; i++) {
+        uint32_t va = att->address + i * PAGE_SIZE;
+        paging_unmap_page(tp->task_id, va);
+        flush_tlb_page(tp->page_directory, va);
+    }
+
+    obj->attach_count--;
+    if (obj->destroyed && obj->attach_count == 0) {
+        shm_release(obj);
+    }
+    kfree(att);
+}
+
 int paging_detach_shared_region(uint32_t task_id, int region_id)
 {
-    if (region_id < 0 || region_id >= shared_region_count) return -1;
-    
     struct task_paging *tp = paging_find_task(task_id);
     if (!tp) return -1;
-    
-    struct shared_region *region = &shared_regions[region_id];
-    
-    /* Unmap pages */
-    for (uint32_t addr = region->address; addr < region->address + region->size; addr += PAGE_SIZE) {
-        paging_unmap_page(task_id, addr);
+
+    struct shm_attachment **link = &tp->attachments;
+    while (*link && (*link)->obj->id != region_id) {
+        link = &(*link)->next;
     }
-    
-    /* Remove from shared pages list */
-    for (int i = 0; i < tp->shared_page_count; i++) {
-        if (tp->shared_pages[i] == region) {
-            for (int j = i; j < tp->shared_page_count - 1; j++) {
-                tp->shared_pages[j] = tp->shared_pages[j + 1];
-            }
-            tp->shared_page_count--;
-            break;
-        }
+    if (!*link) return -1;
+
+    struct shm_attachment *att = *link;
+    *link = att->next;
+    shm_detach(tp, att);
+    return 0;
+}
+
+int paging_destroy_shared_region(uint32_t task_id, int region_id)
+{
+    struct shm_object **link = &shm_objects;
+    while (*link && (*link)->id != region_id) {
+        link = &(*link)->next;
+    }
+    if (!*link || (*link)->creator != task_id) return -1;
+
+    struct shm_object *obj = *link;
+    *link = obj->next;
+
+    /* Mapped frames stay alive through their PTE references */
+    for (uint32_t i = 0; i < obj->npages; i++) {
+        pmem_free_page(obj->frames[i]);
+    }
+    obj->destroyed = 1;
+    if (obj->attach_count == 0) {
+        shm_release(obj);
     }
-    
-    region->share_count--;
-    
     return 0;
 }
 
+void *paging_shared_region_page(int region_id, uint32_t index)
+{
+    struct shm_object *obj = shm_find(region_id);
+    if (!obj || index >= obj->npages) return NULL;
+    return (void *)obj->frames[index];
+}
+
 int paging_cleanup_task(uint32_t task_id)
 {
     struct task_paging *tp = paging_find_task(task_id);
     if (!tp) return -1;
     
     /* Detach all shared regions */
-    while (tp->shared_page_count > 0) {
-        paging_detach_shared_region(task_id, 
-            shared_regions[shared_region_count - 1].owner_task_id);
+    while (tp->attachments) {
+        struct shm_attachment *att = tp->attachments;
+        tp->attachments = att->next;
+        shm_detach(tp, att);
+    }
+    
+    for (int i = 0; i < tp->vma_count; i++) {
+        vma_put(&tp->vmas[i]);
     }
+    tp->vma_count = 0;
     
     /* Free page directory and tables */
     if (tp->page_directory) {
-        /* Free all page tables first */
+        /* Drop frame references, then free all page tables */
         for (int i = 0; i < PAGE_TABLES_PER_DIR; i++) {
-            if (tp->page_directory[i] & PTE_PRESENT) {
+            if ((tp->page_directory[i] & PTE_PRESENT) && !(tp->page_directory[i] & PAGE_LARGE)) {
                 uint32_t *pt = (uint32_t *)(tp->page_directory[i] & ~0xFFF);
-                kfree(pt);
+                for (int j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+                    if (pt[j] & PTE_REF) pmem_free_page(PTE_FRAME(pt[j]));
+                }
+                kmem_cache_free(pgtable_cache, pt);
             }
         }
-        kfree(tp->page_directory);
+        kmem_cache_free(pgtable_cache, tp->page_directory);
     }
     
-    /* Remove from task list */
-    for (int i = 0; i < paging_task_count; i++) {
-        if (task_paging[i].task_id == task_id) {
-            for (int j = i; j < paging_task_count - 1; j++) {
-                task_paging[j] = task_paging[j + 1];
-            }
-            paging_task_count--;
-            break;
-        }
+    /* Unlink from the hash chain */
+    struct task_paging **link = &paging_hash[paging_hash_index(task_id)];
+    while (*link != tp) {
+        link = &(*link)->hash_next;
+    }
+    *link = tp->hash_next;
+    kmem_cache_free(task_paging_cache, tp);
+    
+    return 0;
+}
+
+int paging_replace_task(uint32_t task_id, uint32_t staging_id)
+{
+    struct task_paging *tp = paging_find_task(staging_id);
+    if (!tp || task_id == staging_id) return -1;
+    
+    /* The old space may not exist (a task that never had one) */
+    paging_cleanup_task(task_id);
+    
+    struct task_paging **link = &paging_hash[paging_hash_index(staging_id)];
+    while (*link != tp) {
+        link = &(*link)->hash_next;
     }
+    *link = tp->hash_next;
     
+    tp->task_id = task_id;
+    uint32_t bucket = paging_hash_index(task_id);
+    tp->hash_next = paging_hash[bucket];
+    paging_hash[bucket] = tp;
     return 0;
 }
 
+uint32_t paging_user_base(void)
+{
+    /* paging_init() maps at least 16 MB, then whole 4 MB slots up to max_pfn */
+    uint32_t dirs = (pmem_get_max_pfn() + PAGE_TABLE_ENTRIES - 1) / PAGE_TABLE_ENTRIES;
+    if (dirs < 4) dirs = 4;
+    if (dirs >= PAGE_DIR_ENTRIES) return 0xFFFFFFFF;
+    return dirs * LARGE_PAGE_SIZE;
+}
+
 uint32_t paging_get_page_directory(uint32_t task_id)
 {
     struct task_paging *tp = paging_find_task(task_id);
     return tp ? tp->page_dir_physical : 0;
 }
+
+/*
+ * Copy-on-write fork.  The child gets its own page tables whose entries
+ * point at the parent's frames.  Writable pages backed by pmem frames are
+ * made read-only and marked PTE_COW in both tasks, and each side's entry
+ * holds a reference to the frame, so nothing is copied until one of them
+ * writes.  Shared-memory pages and frames pmem does not manage
+ * (identity-mapped kernel memory) are shared as they are.
+ */
+int paging_fork_task(uint32_t parent_id, uint32_t child_id)
+{
+    struct task_paging *parent = paging_find_task(parent_id);
+    struct task_paging *child = paging_find_task(child_id);
+    if (!parent || !child || parent == child) return -1;
+
+    int flush = 0;
+    for (int i = 0; i < PAGE_TABLES_PER_DIR; i++) {
+        if (!(parent->page_directory[i] & PTE_PRESENT)) continue;
+
+        /* 4 MB pages map caller-owned memory and are shared as is */
+        if (parent->page_directory[i] & PAGE_LARGE) {
+            child->page_directory[i] = parent->page_directory[i];
+            continue;
+        }
+
+        uint32_t *ppt = (uint32_t *)(parent->page_directory[i] & ~0xFFF);
+        uint32_t *cpt = (uint32_t *)kmem_cache_alloc(pgtable_cache);
+        if (!cpt) {
+            paging_cleanup_task(child_id);
+            return -1;
+        }
+        memset(cpt, 0, 4096);
+        child->page_directory[i] = (uint32_t)cpt | (parent->page_directory[i] & 0xFFF);
+
+        for (int j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+            uint32_t pte = ppt[j];
+            if (!(pte & PTE_PRESENT)) continue;
+
+            uint32_t frame = PTE_FRAME(pte);
+            if (pte & PTE_SHARED) {
+                pmem_page_ref(frame);
+                cpt[j] = pte;
+                continue;
+            }
+            if (!(pte & PTE_REF)) {
+                /* First share of a frame the caller owns: the parent's
+                   mapping takes its own reference too */
+                if (pmem_page_ref(frame) < 0) {
+                    cpt[j] = pte;
+                    continue;
+                }
+                pte |= PTE_REF;
+            }
+            pmem_page_ref(frame);
+
+            if (pte & (PTE_WRITE | PTE_COW)) {
+                pte = (pte & ~PTE_WRITE) | PTE_COW;
+                flush = 1;
+            }
+            ppt[j] = pte;
+            cpt[j] = pte;
+            cow_stats.pages_shared++;
+        }
+    }
+
+    /* The parent lost write access to its shared pages */
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (flush && cr3 == (uint32_t)parent->page_directory) {
+        __asm__ volatile("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    }
+
+    /* Pages not faulted in yet stay demand-paged in the child */
+    for (int i = 0; i < parent->vma_count; i++) {
+        child->vmas[i] = parent->vmas[i];
+        vma_get(&child->vmas[i]);
+    }
+    child->vma_count = parent->vma_count;
+
+    /* Shared-memory attachments are inherited, not copied */
+    for (struct shm_attachment *a = parent->attachments; a; a = a->next) {
+        struct shm_attachment *att = (struct shm_attachment *)kmalloc(sizeof(struct shm_attachment));
+        if (!att) {
+            paging_cleanup_task(child_id);
+            return -1;
+        }
+        att->obj = a->obj;
+        att->address = a->address;
+        att->next = child->attachments;
+        child->attachments = att;
+        a->obj->attach_count++;
+    }
+
+    cow_stats.forks++;
+    return 0;
+}
+
+/* Record a lazily mapped area; filled page by page by demand_fault() */
+int paging_add_vma(uint32_t task_id, uint32_t start, uint32_t size, uint32_t flags,
+                   const struct paging_backing *backing, void *ctx,
+                   uint32_t file_offset, uint32_t file_size)
+{
+    struct task_paging *tp = paging_find_task(task_id);
+    if (!tp || !size || tp->vma_count >= MAX_VMAS_PER_TASK) return -1;
+    if (file_size > size || start + size < start) return -1;
+
+    struct vm_area *vma = &tp->vmas[tp->vma_count++];
+    vma->start = start;
+    vma->end = start + size;
+    vma->flags = flags;
+    vma->backing = backing;
+    vma->ctx = ctx;
+    vma->file_offset = file_offset;
+    vma->file_size = file_size;
+    vma_get(vma);
+
+    /* Only file-backed areas are image; the anonymous stack would skew the ratio */
+    if (backing) {
+        uint32_t first = start & ~(PAGE_SIZE - 1);
+        cow_stats.image_pages += (vma->end - first + PAGE_SIZE - 1) / PAGE_SIZE;
+    }
+    return 0;
+}
+
+/* Does any demand-paged area of the task overlap the page at virt? */
+static int vma_covers_page(struct task_paging *tp, uint32_t virt)
+{
+    for (int i = 0; i < tp->vma_count; i++) {
+        if (tp->vmas[i].start < virt + PAGE_SIZE && tp->vmas[i].end > virt) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Bring in a not-present page of a demand-paged area.  Every area
+ * touching the page contributes its file bytes, so a page shared by the
+ * end of one ELF segment and the start of the next is filled once.
+ */
+static int demand_fault(struct task_paging *tp, uint32_t virt)
+{
+    if (!vma_covers_page(tp, virt)) return -1;
+
+    /* Already mapped: the fault was not against this directory */
+    uint32_t *entry = pte_lookup(tp, virt, 1);
+    if (!entry || (*entry & PTE_PRESENT)) return -1;
+
+    uint32_t frame = pmem_alloc_page();
+    if (!frame) {
+        serial_printf("[paging] Out of memory paging in 0x%x for task %d\n",
+                      virt, tp->task_id);
+        return -1;
+    }
+    memset((void *)frame, 0, PAGE_SIZE);
+
+    int from_file = 0, image = 0;
+    uint32_t flags = 0;
+    for (int i = 0; i < tp->vma_count; i++) {
+        struct vm_area *a = &tp->vmas[i];
+        if (a->end <= virt || a->start >= virt + PAGE_SIZE) continue;
+        flags |= a->flags;
+        if (!a->backing) continue;
+        image = 1;
+
+        uint32_t lo = a->start > virt ? a->start : virt;
+        uint32_t hi = a->start + a->file_size;
+        if (hi > virt + PAGE_SIZE) hi = virt + PAGE_SIZE;
+        if (lo >= hi) continue;
+
+        if (a->backing->fill(a->ctx, a->file_offset + (lo - a->start),
+                             (void *)(frame + (lo - virt)), hi - lo) < 0) {
+            pmem_free_page(frame);
+            return -1;
+        }
+        from_file = 1;
+    }
+
+    uint32_t pte = frame | PTE_PRESENT | PTE_REF;
+    if (flags & PAGING_WRITE) pte |= PTE_WRITE;
+    if (flags & PAGING_USER) pte |= PTE_USER;
+    *entry = pte;
+
+    cow_stats.demand_faults++;
+    if (image) cow_stats.image_faults++;
+    if (!from_file) cow_stats.demand_zero_fills++;
+    flush_tlb_page(tp->page_directory, virt);
+    return 0;
+}
+
+/*
+ * Resolve a page fault for a task.  Not-present faults inside a
+ * demand-paged area are filled in; write faults on present PTE_COW
+ * pages give the last sharer write access back and anyone else a
+ * private copy.  Returns 0 if the fault was handled and the access can
+ * be retried.
+ */
+int paging_handle_fault(uint32_t task_id, uint32_t fault_addr, uint32_t error_code)
+{
+    struct task_paging *tp = paging_find_task(task_id);
+    if (!tp) return -1;
+
+    /*
+     * Only a fault taken with this task's directory loaded is ours; any
+     * other would be "fixed" in a directory the CPU is not using and
+     * retried forever, whichever mode it came from.
+     */
+    uint32_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    if (cr3 != (uint32_t)tp->page_directory) return -1;
+
+    uint32_t virt = fault_addr & ~(PAGE_SIZE - 1);
+    if (!(error_code & PF_PRESENT)) {
+        return demand_fault(tp, virt);
+    }
+    if (!(error_code & PF_WRITE)) return -1;
+
+    uint32_t *entry = pte_lookup(tp, virt, 0);
+    if (!entry) return -1;
+    uint32_t pte = *entry;
+    if (!(pte & PTE_PRESENT) || !(pte & PTE_COW)) return -1;
+
+    cow_stats.cow_faults++;
+    uint32_t frame = PTE_FRAME(pte);
+    uint32_t flags = (pte & 0xFFF & ~PTE_COW) | PTE_WRITE | PTE_REF;
+
+    if (pmem_page_refcount(frame) == 1) {
+        *entry = frame | flags;
+        cow_stats.cow_reuses++;
+    } else {
+        uint32_t copy = pmem_alloc_page();
+        if (!copy) {
+            serial_printf("[paging] Out of memory copying page 0x%x for task %d\n",
+                          virt, task_id);
+            return -1;
+        }
+        memcpy((void *)copy, (void *)frame, PAGE_SIZE);
+        *entry = copy | flags;
+        pmem_free_page(frame);
+        cow_stats.cow_copies++;
+    }
+
+    flush_tlb_page(tp->page_directory, virt);
+    return 0;
+}
+
+void paging_get_stats(struct paging_stats *stats)
+{
+    if (stats) *stats = cow_stats;
+}
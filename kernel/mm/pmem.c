@@ -1,111 +1,474 @@
 #include "../../include/kernel/pmem.h"
+#include "../../include/kernel/kernel.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/spinlock.h"
 
-#define BITMAP_SIZE 1024
-static uint8_t page_bitmap[BITMAP_SIZE];
+#define PMEM_NIL 0xFFFFFFFF
+#define PMEM_MAX_REGIONS 32
+#define PMEM_LOW_RESERVED 0x100000       /* BIOS area, heap and below-1MB holes */
+#define PMEM_ADDR_LIMIT 0xFFFFF000ULL    /* Highest frame a 32-bit kernel can address */
+
+/* End of the kernel image, provided by linker.ld */
+extern uint8_t _kernel_end[];
+
+struct pmem_region {
+    uint32_t start_pfn;
+    uint32_t end_pfn;
+};
+
+/*
+ * Per-order free maps.  Bit i of order k is set while the 2^k-page block
+ * starting at frame (i << k) is free.  Every 64-bit word of a map has a
+ * matching bit in its summary, set while that word has any free block,
+ * so a search skips 64 full blocks per summary bit instead of testing
+ * one bit at a time.  Buddy checks are a single bit test in the map.
+ */
+struct free_map {
+    uint64_t *words;
+    uint64_t *summary;
+    uint32_t nwords;
+    uint32_t nsummary;
+    uint32_t hint;          /* No summary word below this one is non-zero */
+    uint32_t count;         /* Free blocks of this order */
+};
+
+static struct free_map free_maps[PMEM_MAX_ORDER];
+
+/*
+ * Allocation state: one bit per frame, set only while the frame is handed
+ * out.  Reserved frames and holes are neither free nor allocated, so a
+ * stray free of one is ignored.
+ */
+static uint64_t *alloc_map;
+
+/*
+ * Reference counts for allocated frames.  An allocation holds the first
+ * reference; pmem_page_ref adds sharers (copy-on-write mappings) and
+ * every free drops one, so a frame only returns to the buddy maps when
+ * its last user lets go.
+ */
+static uint16_t *ref_counts;
+
+/* Guards the maps, bitmap and counts; allocations come from any CPU and IRQ */
+static spinlock_t pmem_lock = SPINLOCK_INIT;
+
+static uint32_t max_pfn = 0;
 static uint32_t total_pages = 0;
 static uint32_t free_pages = 0;
+static uint32_t meta_start = 0;
+static uint32_t meta_end = 0;
 
-void pmem_init(uint32_t total_memory_bytes)
+static inline uint32_t words_for(uint32_t bits)
+{
+    return (bits + 63) / 64;
+}
+
+/* Index of the lowest set bit; split so i386 needs no libgcc helper */
+static inline uint32_t ctz64(uint64_t w)
+{
+    uint32_t lo = (uint32_t)w;
+    if (lo) return (uint32_t)__builtin_ctz(lo);
+    return 32 + (uint32_t)__builtin_ctz((uint32_t)(w >> 32));
+}
+
+static inline int alloc_test(uint32_t pfn)
+{
+    return (alloc_map[pfn / 64] >> (pfn % 64)) & 1;
+}
+
+static inline void alloc_set(uint32_t pfn)
+{
+    alloc_map[pfn / 64] |= 1ULL << (pfn % 64);
+}
+
+static inline void alloc_clear(uint32_t pfn)
+{
+    alloc_map[pfn / 64] &= ~(1ULL << (pfn % 64));
+}
+
+static inline int map_test(int order, uint32_t idx)
+{
+    struct free_map *m = &free_maps[order];
+    if (idx / 64 >= m->nwords) return 0;
+    return (m->words[idx / 64] >> (idx % 64)) & 1;
+}
+
+static void map_set(int order, uint32_t idx)
+{
+    struct free_map *m = &free_maps[order];
+    uint32_t w = idx / 64;
+    m->words[w] |= 1ULL << (idx % 64);
+    m->summary[w / 64] |= 1ULL << (w % 64);
+    if (w / 64 < m->hint) m->hint = w / 64;
+    m->count++;
+}
+
+static void map_clear(int order, uint32_t idx)
+{
+    struct free_map *m = &free_maps[order];
+    uint32_t w = idx / 64;
+    m->words[w] &= ~(1ULL << (idx % 64));
+    if (m->words[w] == 0) {
+        m->summary[w / 64] &= ~(1ULL << (w % 64));
+    }
+    m->count--;
+}
+
+/* Lowest free block of the given order, or PMEM_NIL */
+static uint32_t map_find(int order)
 {
-    total_pages = total_memory_bytes / PAGE_SIZE;
-    if (total_pages > BITMAP_SIZE * 8) {
-        total_pages = BITMAP_SIZE * 8;
+    struct free_map *m = &free_maps[order];
+    if (m->count == 0) return PMEM_NIL;
+
+    for (uint32_t s = m->hint; s < m->nsummary; s++) {
+        if (m->summary[s]) {
+            m->hint = s;
+            uint32_t w = s * 64 + ctz64(m->summary[s]);
+            return w * 64 + ctz64(m->words[w]);
+        }
     }
-    free_pages = total_pages;
-    
-    for (int i = 0; i < BITMAP_SIZE; i++) {
-        page_bitmap[i] = 0;
+    m->hint = m->nsummary;
+    return PMEM_NIL;
+}
+
+/* Return a 2^order block to the free maps, merging with free buddies */
+static void buddy_release(uint32_t pfn, int order)
+{
+    uint32_t idx = pfn >> order;
+    while (order < PMEM_MAX_ORDER - 1 && map_test(order, idx ^ 1)) {
+        map_clear(order, idx ^ 1);
+        idx >>= 1;
+        order++;
     }
-    
-    serial_printf("[OK] Physical memory manager: %u pages (%u MB)\n",
-                  total_pages,
-                  (total_pages * PAGE_SIZE) / (1024 * 1024));
+    map_set(order, idx);
 }
 
-static void set_bit(uint32_t page_num)
+/* Free an arbitrary frame range by splitting it into aligned buddy blocks */
+static void buddy_release_range(uint32_t pfn, uint32_t count)
 {
-    uint32_t byte_idx = page_num / 8;
-    uint32_t bit_idx = page_num % 8;
-    if (byte_idx < BITMAP_SIZE) {
-        page_bitmap[byte_idx] |= (1 << bit_idx);
+    while (count > 0) {
+        int order = 0;
+        while (order < PMEM_MAX_ORDER - 1 &&
+               (pfn & ((2u << order) - 1)) == 0 &&
+               (2u << order) <= count) {
+            order++;
+        }
+        buddy_release(pfn, order);
+        pfn += 1u << order;
+        count -= 1u << order;
     }
 }
 
-static void clear_bit(uint32_t page_num)
+static int order_for(uint32_t num_pages)
 {
-    uint32_t byte_idx = page_num / 8;
-    uint32_t bit_idx = page_num % 8;
-    if (byte_idx < BITMAP_SIZE) {
-        page_bitmap[byte_idx] &= ~(1 << bit_idx);
+    int order = 0;
+    while ((1u << order) < num_pages) order++;
+    return order;
+}
+
+static uint32_t metadata_bytes(uint32_t frames)
+{
+    uint32_t words = words_for(frames) + (frames + 3) / 4;
+    for (int k = 0; k < PMEM_MAX_ORDER; k++) {
+        uint32_t nwords = words_for((frames >> k) + 1);
+        words += nwords + words_for(nwords);
     }
+    return words * sizeof(uint64_t);
 }
 
-static int get_bit(uint32_t page_num)
+/* Carve the allocation bitmap, reference counts and free maps out of [base, ...) */
+static void metadata_layout(uint32_t base)
 {
-    uint32_t byte_idx = page_num / 8;
-    uint32_t bit_idx = page_num % 8;
-    if (byte_idx < BITMAP_SIZE) {
-        return (page_bitmap[byte_idx] >> bit_idx) & 1;
+    uint64_t *p = (uint64_t *)base;
+
+    alloc_map = p;
+    p += words_for(max_pfn);
+    ref_counts = (uint16_t *)p;
+    p += (max_pfn + 3) / 4;
+
+    for (int k = 0; k < PMEM_MAX_ORDER; k++) {
+        struct free_map *m = &free_maps[k];
+        m->nwords = words_for((max_pfn >> k) + 1);
+        m->nsummary = words_for(m->nwords);
+        m->words = p;
+        p += m->nwords;
+        m->summary = p;
+        p += m->nsummary;
+        m->hint = 0;
+        m->count = 0;
     }
-    return 1;
+
+    meta_start = base / PAGE_SIZE;
+    meta_end = ((uint32_t)p + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    for (uint64_t *q = alloc_map; q < p; q++) *q = 0;
 }
 
-uint32_t pmem_alloc_page(void)
+/* First frame above low memory and the kernel image */
+static uint32_t reserved_floor(void)
 {
-    for (uint32_t i = 0; i < total_pages; i++) {
-        if (!get_bit(i)) {
-            set_bit(i);
-            free_pages--;
-            return i * PAGE_SIZE;
+    uint32_t floor = ((uint32_t)_kernel_end + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (floor < PMEM_LOW_RESERVED / PAGE_SIZE) {
+        floor = PMEM_LOW_RESERVED / PAGE_SIZE;
+    }
+    return floor;
+}
+
+/* Release the usable part of a region, skipping the kernel and metadata */
+static void release_region(uint32_t start, uint32_t end)
+{
+    uint32_t floor = reserved_floor();
+    if (start < floor) start = floor;
+
+    uint32_t pieces[2][2] = { { start, end }, { 0, 0 } };
+    if (meta_start < end && meta_end > start) {
+        pieces[0][1] = meta_start;
+        pieces[1][0] = meta_end;
+        pieces[1][1] = end;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        uint32_t s = pieces[i][0];
+        uint32_t e = pieces[i][1];
+        if (s >= e) continue;
+        buddy_release_range(s, e - s);
+        free_pages += e - s;
+    }
+}
+
+static void pmem_setup(struct pmem_region *regions, int count)
+{
+    max_pfn = 0;
+    total_pages = 0;
+    free_pages = 0;
+    for (int i = 0; i < count; i++) {
+        if (regions[i].end_pfn > max_pfn) max_pfn = regions[i].end_pfn;
+        total_pages += regions[i].end_pfn - regions[i].start_pfn;
+    }
+
+    /* Metadata goes in the first usable region with room above the kernel */
+    uint32_t need = (metadata_bytes(max_pfn) + PAGE_SIZE - 1) / PAGE_SIZE;
+    uint32_t floor = reserved_floor();
+
+    uint32_t base = 0;
+    for (int i = 0; i < count && !base; i++) {
+        uint32_t s = regions[i].start_pfn > floor ? regions[i].start_pfn : floor;
+        if (s < regions[i].end_pfn && regions[i].end_pfn - s >= need) {
+            base = s;
         }
     }
-    return 0;
+    if (!base) {
+        serial_puts("[pmem] No usable region large enough for allocator metadata\n");
+        max_pfn = 0;
+        total_pages = 0;
+        return;
+    }
+
+    metadata_layout(base * PAGE_SIZE);
+    for (int i = 0; i < count; i++) {
+        release_region(regions[i].start_pfn, regions[i].end_pfn);
+    }
+
+    serial_printf("[OK] Physical memory manager: %u pages (%u MB) free of %u usable, "
+                  "metadata %u KB at 0x%x\n",
+                  free_pages, free_pages / 256, total_pages,
+                  (meta_end - meta_start) * 4, meta_start * PAGE_SIZE);
 }
 
-void pmem_free_page(uint32_t page_addr)
+void pmem_init(uint32_t total_memory_bytes)
 {
-    uint32_t page_num = page_addr / PAGE_SIZE;
-    if (page_num < total_pages && get_bit(page_num)) {
-        clear_bit(page_num);
-        free_pages++;
+    struct pmem_region region;
+    region.start_pfn = 0;
+    region.end_pfn = total_memory_bytes / PAGE_SIZE;
+    pmem_setup(&region, 1);
+}
+
+void pmem_init_mmap(struct multiboot_info *mbi)
+{
+    struct pmem_region regions[PMEM_MAX_REGIONS];
+    int count = 0;
+
+    uint32_t addr = mbi->mmap_addr;
+    uint32_t end = mbi->mmap_addr + mbi->mmap_length;
+    while (addr < end && count < PMEM_MAX_REGIONS) {
+        struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry *)addr;
+        addr += e->size + sizeof(e->size);
+
+        if (e->type != MULTIBOOT_MEMORY_AVAILABLE || e->addr >= PMEM_ADDR_LIMIT) {
+            continue;
+        }
+        uint64_t top = e->addr + e->len;
+        if (top > PMEM_ADDR_LIMIT) top = PMEM_ADDR_LIMIT;
+
+        /* Only whole frames inside the region are usable */
+        uint32_t start_pfn = (uint32_t)((e->addr + PAGE_SIZE - 1) / PAGE_SIZE);
+        uint32_t end_pfn = (uint32_t)(top / PAGE_SIZE);
+        if (start_pfn >= end_pfn) continue;
+
+        serial_printf("[pmem] usable 0x%x-0x%x\n",
+                      start_pfn * PAGE_SIZE, end_pfn * PAGE_SIZE - 1);
+        regions[count].start_pfn = start_pfn;
+        regions[count].end_pfn = end_pfn;
+        count++;
+    }
+
+    if (count == 0) {
+        serial_puts("[pmem] Empty memory map, assuming 128 MB\n");
+        pmem_init(128 * 1024 * 1024);
+        return;
     }
+    pmem_setup(regions, count);
 }
 
-uint32_t pmem_alloc_pages(int num_pages)
+uint32_t pmem_alloc_page(void)
 {
-    if (num_pages <= 0 || free_pages < (uint32_t)num_pages) {
-        return 0;
+    return pmem_alloc_pages(1);
+}
+
+void pmem_free_page(uint32_t page_addr)
+{
+    pmem_free_pages(page_addr, 1);
+}
+
+/* Mark an allocated run and give each frame its first reference */
+static void claim_frames(uint32_t pfn, uint32_t num_pages)
+{
+    for (uint32_t i = 0; i < num_pages; i++) {
+        alloc_set(pfn + i);
+        ref_counts[pfn + i] = 1;
     }
-    
-    for (uint32_t i = 0; i <= total_pages - num_pages; i++) {
-        int found = 1;
-        for (int j = 0; j < num_pages; j++) {
-            if (get_bit(i + j)) {
-                found = 0;
-                break;
-            }
+    free_pages -= num_pages;
+}
+
+/*
+ * Runs longer than the largest buddy block: the lowest stretch of
+ * consecutive free max-order blocks that covers the request.  A linear
+ * scan, but of one bit per 4 MB, and only for these rare requests.
+ */
+static uint32_t alloc_large(uint32_t num_pages)
+{
+    const int top = PMEM_MAX_ORDER - 1;
+    uint32_t need = (num_pages + (1u << top) - 1) >> top;
+    uint32_t nblocks = free_maps[top].nwords * 64;
+    if (free_maps[top].count < need) return 0;
+
+    uint32_t run = 0;
+    for (uint32_t idx = 0; idx < nblocks; idx++) {
+        if (!map_test(top, idx)) {
+            run = 0;
+            continue;
         }
-        if (found) {
-            for (int j = 0; j < num_pages; j++) {
-                set_bit(i + j);
-            }
-            free_pages -= num_pages;
-            return i * PAGE_SIZE;
+        if (++run < need) continue;
+
+        uint32_t first = idx + 1 - need;
+        for (uint32_t b = first; b <= idx; b++) map_clear(top, b);
+
+        uint32_t pfn = first << top;
+        uint32_t span = need << top;
+        if (num_pages < span) {
+            buddy_release_range(pfn + num_pages, span - num_pages);
         }
+        claim_frames(pfn, num_pages);
+        return pfn * PAGE_SIZE;
     }
     return 0;
 }
 
+static uint32_t buddy_alloc(int num_pages)
+{
+    if (free_pages < (uint32_t)num_pages) {
+        return 0;
+    }
+
+    int order = order_for((uint32_t)num_pages);
+    if (order >= PMEM_MAX_ORDER) {
+        return alloc_large((uint32_t)num_pages);
+    }
+
+    int k = order;
+    uint32_t idx = PMEM_NIL;
+    while (k < PMEM_MAX_ORDER && (idx = map_find(k)) == PMEM_NIL) k++;
+    if (idx == PMEM_NIL) {
+        return 0;
+    }
+    map_clear(k, idx);
+
+    /* Split down to the requested order, keeping the lower half */
+    while (k > order) {
+        k--;
+        idx <<= 1;
+        map_set(k, idx + 1);
+    }
+
+    uint32_t pfn = idx << order;
+
+    /* Hand back the unused tail of a non power-of-two request */
+    uint32_t block = 1u << order;
+    if ((uint32_t)num_pages < block) {
+        buddy_release_range(pfn + num_pages, block - num_pages);
+    }
+
+    claim_frames(pfn, (uint32_t)num_pages);
+    return pfn * PAGE_SIZE;
+}
+
+uint32_t pmem_alloc_pages(int num_pages)
+{
+    if (num_pages <= 0) return 0;
+
+    uint32_t flags = spin_lock_irqsave(&pmem_lock);
+    uint32_t addr = buddy_alloc(num_pages);
+    spin_unlock_irqrestore(&pmem_lock, flags);
+    return addr;
+}
+
 void pmem_free_pages(uint32_t page_addr, int num_pages)
 {
+    uint32_t flags = spin_lock_irqsave(&pmem_lock);
     uint32_t page_num = page_addr / PAGE_SIZE;
+    uint32_t run_start = 0;
+    uint32_t run_len = 0;
+
+    /* Drop one reference per frame and release maximal runs of frames
+       whose last reference went away */
     for (int i = 0; i < num_pages; i++) {
-        if (page_num + i < total_pages && get_bit(page_num + i)) {
-            clear_bit(page_num + i);
+        uint32_t pfn = page_num + i;
+        if (pfn < max_pfn && alloc_test(pfn) && --ref_counts[pfn] == 0) {
+            alloc_clear(pfn);
             free_pages++;
+            if (run_len == 0) run_start = pfn;
+            run_len++;
+        } else if (run_len > 0) {
+            buddy_release_range(run_start, run_len);
+            run_len = 0;
         }
     }
+    if (run_len > 0) {
+        buddy_release_range(run_start, run_len);
+    }
+    spin_unlock_irqrestore(&pmem_lock, flags);
+}
+
+int pmem_page_ref(uint32_t page_addr)
+{
+    uint32_t pfn = page_addr / PAGE_SIZE;
+    int count = -1;
+    uint32_t flags = spin_lock_irqsave(&pmem_lock);
+    if (pfn < max_pfn && alloc_test(pfn) && ref_counts[pfn] != 0xFFFF) {
+        count = ++ref_counts[pfn];
+    }
+    spin_unlock_irqrestore(&pmem_lock, flags);
+    return count;
+}
+
+int pmem_page_refcount(uint32_t page_addr)
+{
+    uint32_t pfn = page_addr / PAGE_SIZE;
+    int count = 0;
+    uint32_t flags = spin_lock_irqsave(&pmem_lock);
+    if (pfn < max_pfn && alloc_test(pfn)) count = ref_counts[pfn];
+    spin_unlock_irqrestore(&pmem_lock, flags);
+    return count;
 }
 
 uint32_t pmem_get_free_pages(void)
@@ -117,3 +480,14 @@ uint32_t pmem_get_total_pages(void)
 {
     return total_pages;
 }
+
+uint32_t pmem_get_max_pfn(void)
+{
+    return max_pfn;
+}
+
+uint32_t pmem_get_free_blocks(int order)
+{
+    if (order < 0 || order >= PMEM_MAX_ORDER) return 0;
+    return free_maps[order].count;
+}
@@ -0,0 +1,285 @@
+#include "../../include/kernel/slab.h"
+#include "../../include/kernel/pmem.h"
+#include "../../include/kernel/serial.h"
+#include "../../include/kernel/spinlock.h"
+#include <stddef.h>
+
+/*
+ * Slab allocator for fixed-size kernel objects.
+ *
+ * A slab is a naturally aligned block of 2^order pages from pmem (buddy
+ * blocks are aligned to their size), so the slab owning an object is
+ * found by masking the object address.  The slab descriptor lives at the
+ * end of the block, which keeps the first object page-aligned for caches
+ * such as page tables.  Free objects are chained through a link word,
+ * placed after the object when the cache has a constructor so that the
+ * constructed state survives a free/alloc cycle.
+ */
+
+struct slab {
+    struct kmem_cache *cache;
+    struct slab *next;
+    struct slab *prev;
+    void *free_list;
+    uint32_t inuse;
+};
+
+struct kmem_cache {
+    const char *name;
+    uint32_t object_size;
+    uint32_t stride;
+    uint32_t link_offset;
+    uint32_t objects_per_slab;
+    int order;
+    kmem_ctor_t ctor;
+    struct slab *partial;
+    struct slab *full;
+    struct slab *empty;             /* At most one slab kept for reuse */
+    kmem_cache_stats_t stats;
+    spinlock_t lock;                /* Slab lists and stats, irqsave */
+    int in_use;
+};
+
+static struct kmem_cache caches[KMEM_MAX_CACHES];
+static spinlock_t cache_table_lock = SPINLOCK_INIT;
+
+static inline uint32_t slab_bytes(struct kmem_cache *cache)
+{
+    return PAGE_SIZE << cache->order;
+}
+
+static inline struct slab *slab_of(struct kmem_cache *cache, void *obj)
+{
+    uint32_t base = (uint32_t)obj & ~(slab_bytes(cache) - 1);
+    return (struct slab *)(base + slab_bytes(cache) - sizeof(struct slab));
+}
+
+static inline uint32_t slab_base(struct kmem_cache *cache, struct slab *slab)
+{
+    return (uint32_t)slab + sizeof(struct slab) - slab_bytes(cache);
+}
+
+static inline void **obj_link(struct kmem_cache *cache, void *obj)
+{
+    return (void **)((uint32_t)obj + cache->link_offset);
+}
+
+static void slab_list_add(struct slab **head, struct slab *slab)
+{
+    slab->prev = NULL;
+    slab->next = *head;
+    if (*head) (*head)->prev = slab;
+    *head = slab;
+}
+
+static void slab_list_del(struct slab **head, struct slab *slab)
+{
+    if (slab->prev) slab->prev->next = slab->next;
+    else *head = slab->next;
+    if (slab->next) slab->next->prev = slab->prev;
+    slab->next = NULL;
+    slab->prev = NULL;
+}
+
+static struct slab *slab_create(struct kmem_cache *cache)
+{
+    uint32_t base = pmem_alloc_pages(1 << cache->order);
+    if (!base) return NULL;
+
+    struct slab *slab = (struct slab *)(base + slab_bytes(cache) - sizeof(struct slab));
+    slab->cache = cache;
+    slab->next = NULL;
+    slab->prev = NULL;
+    slab->inuse = 0;
+    slab->free_list = NULL;
+
+    /* Chain objects so the lowest address is handed out first */
+    for (int i = (int)cache->objects_per_slab - 1; i >= 0; i--) {
+        void *obj = (void *)(base + (uint32_t)i * cache->stride);
+        if (cache->ctor) cache->ctor(obj);
+        *obj_link(cache, obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->stats.slabs++;
+    return slab;
+}
+
+static void slab_destroy(struct kmem_cache *cache, struct slab *slab)
+{
+    pmem_free_pages(slab_base(cache, slab), 1 << cache->order);
+    cache->stats.slabs--;
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, uint32_t size, uint32_t align,
+                                kmem_ctor_t ctor)
+{
+    if (size == 0) return NULL;
+    if (align < sizeof(void *)) align = sizeof(void *);
+    if (align & (align - 1)) return NULL;
+
+    uint32_t link_offset = ctor ? size : 0;
+    uint32_t raw = ctor ? size + sizeof(void *) : size;
+    if (raw < sizeof(void *)) raw = sizeof(void *);
+    uint32_t stride = (raw + align - 1) & ~(align - 1);
+
+    /* Smallest slab that holds at least 8 objects, capped at the max order */
+    int order = 0;
+    uint32_t per_slab = 0;
+    for (order = 0; order <= KMEM_MAX_SLAB_ORDER; order++) {
+        per_slab = ((PAGE_SIZE << order) - sizeof(struct slab)) / stride;
+        if (per_slab >= 8) break;
+    }
+    if (order > KMEM_MAX_SLAB_ORDER) order = KMEM_MAX_SLAB_ORDER;
+    per_slab = ((PAGE_SIZE << order) - sizeof(struct slab)) / stride;
+    if (per_slab == 0) {
+        serial_printf("[slab] Object size %u too large for cache %s\n", size, name);
+        return NULL;
+    }
+
+    /* Claim and fill a slot under the table lock; in_use publishes it */
+    struct kmem_cache *cache = NULL;
+    uint32_t flags = spin_lock_irqsave(&cache_table_lock);
+    for (int i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!caches[i].in_use) {
+            cache = &caches[i];
+            break;
+        }
+    }
+    if (!cache) {
+        spin_unlock_irqrestore(&cache_table_lock, flags);
+        serial_puts("[slab] Cache table full\n");
+        return NULL;
+    }
+
+    cache->name = name;
+    cache->object_size = size;
+    cache->stride = stride;
+    cache->link_offset = link_offset;
+    cache->objects_per_slab = per_slab;
+    cache->order = order;
+    cache->ctor = ctor;
+    cache->partial = NULL;
+    cache->full = NULL;
+    cache->empty = NULL;
+
+    cache->stats.name = name;
+    cache->stats.object_size = size;
+    cache->stats.objects_per_slab = per_slab;
+    cache->stats.slab_pages = 1u << order;
+    cache->stats.slabs = 0;
+    cache->stats.active_objects = 0;
+    cache->stats.hits = 0;
+    cache->stats.misses = 0;
+    cache->stats.frees = 0;
+    cache->stats.failures = 0;
+    spin_lock_init(&cache->lock);
+    cache->in_use = 1;
+    spin_unlock_irqrestore(&cache_table_lock, flags);
+
+    serial_printf("[slab] Cache %s: %u-byte objects, %u per %u-page slab\n",
+                  name, size, per_slab, 1u << order);
+    return cache;
+}
+
+int kmem_cache_destroy(kmem_cache_t *cache)
+{
+    if (!cache || !cache->in_use) return -1;
+
+    /* Table lock first, so the slot cannot be reclaimed while still locked */
+    uint32_t flags = spin_lock_irqsave(&cache_table_lock);
+    spin_lock(&cache->lock);
+    int busy = cache->partial || cache->full;
+    if (!busy) {
+        if (cache->empty) {
+            slab_destroy(cache, cache->empty);
+            cache->empty = NULL;
+        }
+        cache->in_use = 0;
+    }
+    spin_unlock(&cache->lock);
+    spin_unlock_irqrestore(&cache_table_lock, flags);
+    return busy ? -1 : 0;
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    if (!cache || !cache->in_use) return NULL;
+
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    struct slab *slab = cache->partial;
+    if (slab) {
+        cache->stats.hits++;
+    } else if (cache->empty) {
+        slab = cache->empty;
+        cache->empty = NULL;
+        slab_list_add(&cache->partial, slab);
+        cache->stats.hits++;
+    } else {
+        slab = slab_create(cache);
+        if (!slab) {
+            cache->stats.failures++;
+            spin_unlock_irqrestore(&cache->lock, flags);
+            return NULL;
+        }
+        slab_list_add(&cache->partial, slab);
+        cache->stats.misses++;
+    }
+
+    void *obj = slab->free_list;
+    slab->free_list = *obj_link(cache, obj);
+    slab->inuse++;
+    cache->stats.active_objects++;
+
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_del(&cache->partial, slab);
+        slab_list_add(&cache->full, slab);
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+    if (!cache || !obj) return;
+
+    struct slab *slab = slab_of(cache, obj);
+    if (slab->cache != cache) {
+        serial_printf("[slab] %s: object 0x%x freed to wrong cache\n",
+                      cache->name, (uint32_t)obj);
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&cache->lock);
+    if (slab->inuse == cache->objects_per_slab) {
+        slab_list_del(&cache->full, slab);
+        slab_list_add(&cache->partial, slab);
+    }
+
+    *obj_link(cache, obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->inuse--;
+    cache->stats.active_objects--;
+    cache->stats.frees++;
+
+    if (slab->inuse == 0) {
+        slab_list_del(&cache->partial, slab);
+        if (cache->empty) {
+            slab_destroy(cache, slab);
+        } else {
+            cache->empty = slab;
+        }
+    }
+    spin_unlock_irqrestore(&cache->lock, flags);
+}
+
+int kmem_cache_get_stats(int index, kmem_cache_stats_t *out)
+{
+    if (index < 0 || index >= KMEM_MAX_CACHES || !out) return -1;
+    if (!caches[index].in_use) return -1;
+
+    uint32_t flags = spin_lock_irqsave(&caches[index].lock);
+    *out = caches[index].stats;
+    spin_unlock_irqrestore(&caches[index].lock, flags);
+    return 0;
+}
@@ -1,11 +1,13 @@
 #include "../../include/kernel/arp.h"
 #include "../../include/kernel/ethernet.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/sync.h"
 #include <stddef.h>
 
 /* ARP cache table */
 static struct arp_entry arp_cache[ARP_TABLE_SIZE];
 static int arp_cache_count = 0;
+static rwlock_t arp_cache_lock;     /* Every transmit reads, only replies write */
 
 /* Initialize ARP */
 void arp_init(void)
@@ -14,6 +16,7 @@ void arp_init(void)
         arp_cache[i].age = 0;
     }
     arp_cache_count = 0;
+    rwlock_init(&arp_cache_lock);
     serial_puts("[ARP] Cache initialized\n");
 }
 
@@ -22,11 +25,14 @@ static void arp_cache_add(const ipv4_addr_t *ip, const mac_addr_t *mac)
 {
     if (!ip || !mac) return;
     
+    rwlock_write_lock(&arp_cache_lock);
+    
     /* Check if already exists */
     for (int i = 0; i < arp_cache_count; i++) {
         if (ipv4_addr_equal(&arp_cache[i].ip, ip)) {
             eth_mac_copy(&arp_cache[i].mac, mac);
             arp_cache[i].age = 0;  /* Reset age */
+            rwlock_write_unlock(&arp_cache_lock);
             return;
         }
     }
@@ -38,6 +44,8 @@ static void arp_cache_add(const ipv4_addr_t *ip, const mac_addr_t *mac)
         arp_cache[arp_cache_count].age = 0;
         arp_cache_count++;
     }
+    
+    rwlock_write_unlock(&arp_cache_lock);
 }
 
 /* Look up ARP cache */
@@ -45,14 +53,18 @@ static int arp_cache_lookup(const ipv4_addr_t *ip, mac_addr_t *mac)
 {
     if (!ip || !mac) return -1;
     
+    int found = -1;
+    rwlock_read_lock(&arp_cache_lock);
     for (int i = 0; i < arp_cache_count; i++) {
         if (ipv4_addr_equal(&arp_cache[i].ip, ip)) {
             eth_mac_copy(mac, &arp_cache[i].mac);
-            return 0;  /* Found */
+            found = 0;
+            break;
         }
     }
+    rwlock_read_unlock(&arp_cache_lock);
     
-    return -1;  /* Not found */
+    return found;
 }
 
 /* Send ARP request */
@@ -184,8 +196,11 @@ int arp_resolve(struct netdev *dev, const ipv4_addr_t *ip, mac_addr_t *mac)
 {
     if (!dev || !ip || !mac) return -1;
     
+    ipv4_addr_t local, netmask, gateway;
+    netdev_get_ipv4(dev, &local, &netmask, &gateway);
+    
     /* Check if it's our own IP */
-    if (ipv4_addr_equal(ip, &dev->ip_addr)) {
+    if (ipv4_addr_equal(ip, &local)) {
         eth_mac_copy(mac, &dev->mac_addr);
         return 0;
     }
@@ -199,6 +214,15 @@ int arp_resolve(struct netdev *dev, const ipv4_addr_t *ip, mac_addr_t *mac)
         return 0;
     }
     
+    /* Off-link destinations go through the gateway */
+    int off_link = 0;
+    for (int i = 0; i < 4; i++) {
+        if ((ip->addr[i] ^ local.addr[i]) & netmask.addr[i]) off_link = 1;
+    }
+    if (off_link && gateway.addr[0] != 0) {
+        ip = &gateway;
+    }
+    
     /* Try cache first */
     if (arp_cache_lookup(ip, mac) == 0) {
         return 0;  /* Found in cache */
@@ -1,19 +1,34 @@
 #include "../../include/kernel/netdev.h"
-#include "../../include/kernel/heap.h"
+#include "../../include/kernel/slab.h"
 #include "../../include/kernel/serial.h"
+#include "../../include/kernel/rcu.h"
 #include <stddef.h>
+#include <string.h>
 
-/* Global device table */
+/*
+ * Global device table.  Lookups are lock-free under RCU; register and
+ * unregister serialize on netdev_lock, and unregister waits out a grace
+ * period so the caller may free the device as soon as it returns.
+ */
 static struct netdev *netdev_table[MAX_NETDEVS];
 static int netdev_count = 0;
+static spinlock_t netdev_lock = SPINLOCK_INIT;
 
 /* Forward declaration */
 static int string_equal(const char *a, const char *b);
 
-/* Packet buffer pool (32 buffers) */
-#define PACKET_POOL_SIZE 32
-static struct net_packet packet_pool[PACKET_POOL_SIZE];
-static uint8_t packet_pool_alloc[PACKET_POOL_SIZE];
+/* Object caches for device structures and packet buffers */
+static kmem_cache_t *netdev_cache = NULL;
+static kmem_cache_t *packet_cache = NULL;
+
+/* Packets are kept with empty metadata while on the free list */
+static void packet_ctor(void *obj)
+{
+    struct net_packet *pkt = (struct net_packet *)obj;
+    pkt->len = 0;
+    pkt->offset = 0;
+    pkt->flags = 0;
+}
 
 /* Initialize networking */
 void netdev_init(void)
@@ -23,24 +38,72 @@ void netdev_init(void)
     }
     netdev_count = 0;
     
-    /* Initialize packet pool */
-    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
-        packet_pool_alloc[i] = 0;
-    }
+    netdev_cache = kmem_cache_create("netdev", sizeof(struct netdev), 0, NULL);
+    packet_cache = kmem_cache_create("net_packet", sizeof(struct net_packet), 0, packet_ctor);
     
     serial_puts("[NET] Device layer initialized\n");
 }
 
+/* Allocate a zeroed device structure */
+struct netdev *netdev_alloc(void)
+{
+    struct netdev *dev = (struct netdev *)kmem_cache_alloc(netdev_cache);
+    if (dev) {
+        memset(dev, 0, sizeof(struct netdev));
+    }
+    return dev;
+}
+
+/* Consistent snapshot of the device's routing record */
+void netdev_get_ipv4(struct netdev *dev, ipv4_addr_t *ip, ipv4_addr_t *netmask,
+                     ipv4_addr_t *gateway)
+{
+    if (!dev) return;
+    
+    uint32_t seq;
+    do {
+        seq = read_seqbegin(&dev->addr_lock);
+        if (ip) *ip = dev->ip_addr;
+        if (netmask) *netmask = dev->netmask;
+        if (gateway) *gateway = dev->gateway;
+    } while (read_seqretry(&dev->addr_lock, seq));
+}
+
+void netdev_set_ipv4(struct netdev *dev, const ipv4_addr_t *ip,
+                     const ipv4_addr_t *netmask, const ipv4_addr_t *gateway)
+{
+    if (!dev) return;
+    
+    uint32_t flags = write_seqlock(&dev->addr_lock);
+    if (ip) dev->ip_addr = *ip;
+    if (netmask) dev->netmask = *netmask;
+    if (gateway) dev->gateway = *gateway;
+    write_sequnlock(&dev->addr_lock, flags);
+}
+
+/* Free a device structure (unregister it first) */
+void netdev_free(struct netdev *dev)
+{
+    if (dev) {
+        kmem_cache_free(netdev_cache, dev);
+    }
+}
+
 /* Register network device */
 int netdev_register(struct netdev *dev)
 {
-    if (!dev || netdev_count >= MAX_NETDEVS) {
+    if (!dev) return -1;
+    
+    uint32_t flags = spin_lock_irqsave(&netdev_lock);
+    if (netdev_count >= MAX_NETDEVS) {
+        spin_unlock_irqrestore(&netdev_lock, flags);
         return -1;
     }
     
     dev->dev_id = netdev_count;
-    netdev_table[netdev_count] = dev;
+    rcu_assign_pointer(netdev_table[netdev_count], dev);
     netdev_count++;
+    spin_unlock_irqrestore(&netdev_lock, flags);
     
     serial_printf("[NET] Registered device: %s (id=%d)\n", dev->name, dev->dev_id);
     return dev->dev_id;
@@ -51,20 +114,28 @@ void netdev_unregister(struct netdev *dev)
 {
     if (!dev) return;
     
+    int found = 0;
+    uint32_t flags = spin_lock_irqsave(&netdev_lock);
     for (int i = 0; i < MAX_NETDEVS; i++) {
         if (netdev_table[i] == dev) {
-            netdev_table[i] = NULL;
-            serial_printf("[NET] Unregistered device: %s\n", dev->name);
-            return;
+            rcu_assign_pointer(netdev_table[i], NULL);
+            found = 1;
+            break;
         }
     }
+    spin_unlock_irqrestore(&netdev_lock, flags);
+    
+    if (found) {
+        synchronize_rcu();
+        serial_printf("[NET] Unregistered device: %s\n", dev->name);
+    }
 }
 
 /* Get device by ID */
 struct netdev *netdev_get(uint32_t dev_id)
 {
     if (dev_id < MAX_NETDEVS) {
-        return netdev_table[dev_id];
+        return rcu_dereference(netdev_table[dev_id]);
     }
     return NULL;
 }
@@ -73,40 +144,27 @@ struct netdev *netdev_get(uint32_t dev_id)
 struct netdev *netdev_get_by_name(const char *name)
 {
     for (int i = 0; i < MAX_NETDEVS; i++) {
-        if (netdev_table[i] && string_equal(netdev_table[i]->name, name)) {
-            return netdev_table[i];
+        struct netdev *dev = rcu_dereference(netdev_table[i]);
+        if (dev && string_equal(dev->name, name)) {
+            return dev;
         }
     }
     return NULL;
 }
 
-/* Allocate packet from pool */
+/* Allocate packet from the packet cache */
 struct net_packet *netdev_alloc_packet(void)
 {
-    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
-        if (!packet_pool_alloc[i]) {
-            packet_pool_alloc[i] = 1;
-            struct net_packet *pkt = &packet_pool[i];
-            pkt->len = 0;
-            pkt->offset = 0;
-            pkt->flags = 0;
-            return pkt;
-        }
-    }
-    return NULL;  /* No free packets */
+    return (struct net_packet *)kmem_cache_alloc(packet_cache);
 }
 
-/* Free packet back to pool */
+/* Free packet back to the packet cache */
 void netdev_free_packet(struct net_packet *pkt)
 {
     if (!pkt) return;
     
-    for (int i = 0; i < PACKET_POOL_SIZE; i++) {
-        if (&packet_pool[i] == pkt) {
-            packet_pool_alloc[i] = 0;
-            return;
-        }
-    }
+    packet_ctor(pkt);
+    kmem_cache_free(packet_cache, pkt);
 }
 
 /* Send packet on device */
@@ -3,6 +3,14 @@
 #include "../../include/kernel/console.h"
 #include "../../include/kernel/timer.h"
 #include "../../include/kernel/pmem.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/heap.h"
+#include "../../include/kernel/scheduler.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/sync.h"
+#include "../../include/kernel/rcu.h"
+#include "../../include/kernel/device.h"
+#include "../../include/kernel/netdev.h"
 #include "../fs/vfs.h"
 #include "../fs/ramfs.h"
 #include "../../include/libc/string.h"
@@ -156,6 +164,395 @@ static void pkg_cmd_cpubench(int argc, char *argv[])
     console_printf("cpubench: 10M integer ops in %d ticks (acc=0x%x)\n", elapsed, acc);
 }
 
+/*
+ * shmbench: hand a 2 MB tensor from a producer to a consumer task, once
+ * by copying it through a file with vfs_write_file/vfs_read_file (in
+ * RAMFS_MAX_FILE_SIZE chunks) and once through a shared-memory region
+ * attached into both tasks.  Both sides fill and checksum the data.
+ */
+#define SHMBENCH_BYTES (2 * 1024 * 1024)
+#define SHMBENCH_ROUNDS 4
+#define SHMBENCH_PRODUCER 0xFFFF0001
+#define SHMBENCH_CONSUMER 0xFFFF0002
+#define SHMBENCH_VA_PRODUCER 0x40000000
+#define SHMBENCH_VA_CONSUMER 0x50000000
+
+static void shmbench_fill(uint8_t *p, uint32_t base, uint32_t len, int round)
+{
+    for (uint32_t i = 0; i < len; i++) p[i] = (uint8_t)((base + i) * 31 + round);
+}
+
+static uint32_t shmbench_sum(const uint8_t *p, uint32_t len)
+{
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < len; i++) sum += p[i];
+    return sum;
+}
+
+static void pkg_cmd_shmbench(int argc, char *argv[])
+{
+    (void)argc; (void)argv;
+    const uint32_t chunk = RAMFS_MAX_FILE_SIZE;
+    const char *path = "/tmp/shmbench";
+
+    uint8_t *src = (uint8_t *)kmalloc(SHMBENCH_BYTES);
+    uint8_t *dst = (uint8_t *)kmalloc(SHMBENCH_BYTES);
+    if (!src || !dst) {
+        console_puts("shmbench: out of memory\n");
+        kfree(src);
+        kfree(dst);
+        return;
+    }
+
+    uint32_t copy_sum = 0;
+    int start = timer_get_ticks();
+    for (int r = 0; r < SHMBENCH_ROUNDS; r++) {
+        shmbench_fill(src, 0, SHMBENCH_BYTES, r);
+        for (uint32_t off = 0; off < SHMBENCH_BYTES; off += chunk) {
+            vfs_write_file(path, src + off, chunk);
+            vfs_read_file(path, dst + off, chunk);
+        }
+        copy_sum += shmbench_sum(dst, SHMBENCH_BYTES);
+    }
+    int copy_ticks = timer_get_ticks() - start;
+    vfs_remove(path);
+    kfree(src);
+    kfree(dst);
+
+    if (paging_init_task(SHMBENCH_PRODUCER) != 0 || paging_init_task(SHMBENCH_CONSUMER) != 0) {
+        console_puts("shmbench: cannot create address spaces\n");
+        paging_cleanup_task(SHMBENCH_PRODUCER);
+        return;
+    }
+
+    uint32_t shm_sum = 0;
+    uint32_t pages = SHMBENCH_BYTES / PAGE_SIZE;
+    start = timer_get_ticks();
+    for (int r = 0; r < SHMBENCH_ROUNDS; r++) {
+        int id = paging_create_shared_region(SHMBENCH_PRODUCER, SHMBENCH_BYTES,
+                                             PAGING_WRITE | PAGING_USER);
+        if (id < 0 ||
+            paging_attach_shared_region(SHMBENCH_PRODUCER, id, SHMBENCH_VA_PRODUCER) != 0) {
+            console_puts("shmbench: shared region setup failed\n");
+            break;
+        }
+        for (uint32_t i = 0; i < pages; i++) {
+            shmbench_fill((uint8_t *)paging_shared_region_page(id, i), i * PAGE_SIZE, PAGE_SIZE, r);
+        }
+
+        paging_attach_shared_region(SHMBENCH_CONSUMER, id, SHMBENCH_VA_CONSUMER);
+        for (uint32_t i = 0; i < pages; i++) {
+            shm_sum += shmbench_sum((uint8_t *)paging_shared_region_page(id, i), PAGE_SIZE);
+        }
+
+        paging_detach_shared_region(SHMBENCH_PRODUCER, id);
+        paging_detach_shared_region(SHMBENCH_CONSUMER, id);
+        paging_destroy_shared_region(SHMBENCH_PRODUCER, id);
+    }
+    int shm_ticks = timer_get_ticks() - start;
+
+    paging_cleanup_task(SHMBENCH_PRODUCER);
+    paging_cleanup_task(SHMBENCH_CONSUMER);
+
+    console_printf("shmbench: %d x %u KB tensor\n", SHMBENCH_ROUNDS, SHMBENCH_BYTES / 1024);
+    console_printf("  vfs copy     : %d ticks\n", copy_ticks);
+    console_printf("  shared region: %d ticks\n", shm_ticks);
+    console_printf("  checksums %s (0x%x)\n", copy_sum == shm_sum ? "match" : "DIFFER", shm_sum);
+}
+
+/*
+ * schedbench: cycles per pick on a private run queue holding 4..1024
+ * synthetic READY tasks over eight priority levels.  Each pick pops the
+ * best task and requeues it, as a quantum expiry would; the linear scan
+ * over the same tasks is what scheduler_pick_next used to do.
+ */
+#define SCHEDBENCH_MAX_TASKS 1024
+#define SCHEDBENCH_PICKS 2000
+
+static void pkg_cmd_schedbench(int argc, char *argv[])
+{
+    (void)argc; (void)argv;
+    struct task *tasks = (struct task *)kmalloc(sizeof(struct task) * SCHEDBENCH_MAX_TASKS);
+    if (!tasks) {
+        console_puts("schedbench: out of memory\n");
+        return;
+    }
+    memset(tasks, 0, sizeof(struct task) * SCHEDBENCH_MAX_TASKS);
+
+    struct run_queue rq;
+    console_puts("tasks  rq cycles/pick  scan cycles/pick\n");
+    for (int n = 4; n <= SCHEDBENCH_MAX_TASKS; n *= 4) {
+        run_queue_init(&rq);
+        for (int i = 0; i < n; i++) {
+            tasks[i].id = (uint32_t)i + 1;
+            tasks[i].state = TASK_READY;
+            tasks[i].priority = i % 8;
+            tasks[i].on_rq = 0;
+            run_queue_enqueue(&rq, &tasks[i]);
+        }
+
+        uint64_t t0 = timer_rdtsc();
+        for (int k = 0; k < SCHEDBENCH_PICKS; k++) {
+            run_queue_enqueue(&rq, run_queue_pop(&rq));
+        }
+        uint32_t rq_cycles = (uint32_t)(timer_rdtsc() - t0);
+
+        volatile uint32_t picked = 0;
+        t0 = timer_rdtsc();
+        for (int k = 0; k < SCHEDBENCH_PICKS; k++) {
+            struct task *best = NULL;
+            for (int i = 0; i < n; i++) {
+                if (tasks[i].state != TASK_READY) continue;
+                if (!best || tasks[i].priority > best->priority) best = &tasks[i];
+            }
+            picked = best->id;
+        }
+        uint32_t scan_cycles = (uint32_t)(timer_rdtsc() - t0);
+        (void)picked;
+
+        console_printf("%d\t%u\t\t%u\n", n, rq_cycles / SCHEDBENCH_PICKS,
+                       scan_cycles / SCHEDBENCH_PICKS);
+    }
+    kfree(tasks);
+}
+
+/*
+ * smpbench: a fixed amount of integer work split evenly over 1, 2, 4...
+ * CPUs through smp_call; near-linear speedup means the per-CPU paths
+ * share nothing.
+ */
+#define SMPBENCH_ITERS 200000000u
+
+struct smpbench_job {
+    uint32_t iters;
+    volatile uint32_t result;
+};
+
+static void smpbench_work(void *arg)
+{
+    struct smpbench_job *job = (struct smpbench_job *)arg;
+    uint32_t acc = 0;
+    for (uint32_t i = 0; i < job->iters; i++) {
+        acc = (acc * 1664525u) + 1013904223u;
+    }
+    job->result = acc;
+}
+
+static int smpbench_run(int ncpu)
+{
+    struct smpbench_job jobs[SMP_MAX_CPUS];
+    int start = timer_get_ticks();
+    for (int i = 1; i < ncpu; i++) {
+        jobs[i].iters = SMPBENCH_ITERS / ncpu;
+        if (smp_call(i, smpbench_work, &jobs[i]) != 0) return -1;
+    }
+    jobs[0].iters = SMPBENCH_ITERS / ncpu;
+    smpbench_work(&jobs[0]);
+    for (int i = 1; i < ncpu; i++) smp_wait(i);
+    return timer_get_ticks() - start;
+}
+
+static void pkg_cmd_smpbench(int argc, char *argv[])
+{
+    (void)argc; (void)argv;
+    int cpus = smp_cpu_count();
+    int base = 0;
+    console_printf("smpbench: %u integer ops, %d CPU(s) online\n", SMPBENCH_ITERS, cpus);
+    for (int n = 1; n <= cpus; n = (n * 2 > cpus && n < cpus) ? cpus : n * 2) {
+        int ticks = smpbench_run(n);
+        if (ticks < 0) {
+            console_printf("  %d CPUs: CPU busy\n", n);
+            break;
+        }
+        if (ticks == 0) ticks = 1;
+        if (n == 1) base = ticks;
+        uint32_t speedup = (uint32_t)base * 100 / (uint32_t)ticks;
+        console_printf("  %d CPUs: %d ticks, speedup %u.%u%ux\n", n, ticks,
+                       speedup / 100, (speedup / 10) % 10, speedup % 10);
+    }
+}
+
+/*
+ * lockbench: 1, 2, 4 and 8 CPUs read a small shared record through a
+ * spinlock (how the old rwlock serialized its readers), the per-CPU
+ * rwlock and a seqlock.  The last two should cost the same per read no
+ * matter how many readers there are.
+ */
+#define LOCKBENCH_ITERS 100000u
+#define LOCKBENCH_MAX_READERS 8
+
+enum { LOCKBENCH_SPIN, LOCKBENCH_RWLOCK, LOCKBENCH_SEQLOCK, LOCKBENCH_KINDS };
+
+static struct {
+    uint32_t a, b, c, d;
+} lockbench_record;
+static spinlock_t lockbench_spin;
+static rwlock_t lockbench_rwlock;
+static seqlock_t lockbench_seqlock;
+
+struct lockbench_job {
+    int kind;
+    volatile uint32_t cycles;
+    volatile uint32_t sum;
+};
+
+static void lockbench_work(void *arg)
+{
+    struct lockbench_job *job = (struct lockbench_job *)arg;
+    uint32_t sum = 0;
+    uint64_t t0 = timer_rdtsc();
+    for (uint32_t i = 0; i < LOCKBENCH_ITERS; i++) {
+        if (job->kind == LOCKBENCH_SPIN) {
+            spin_lock(&lockbench_spin);
+            sum += lockbench_record.a + lockbench_record.d;
+            spin_unlock(&lockbench_spin);
+        } else if (job->kind == LOCKBENCH_RWLOCK) {
+            rwlock_read_lock(&lockbench_rwlock);
+            sum += lockbench_record.a + lockbench_record.d;
+            rwlock_read_unlock(&lockbench_rwlock);
+        } else {
+            uint32_t seq, value;
+            do {
+                seq = read_seqbegin(&lockbench_seqlock);
+                value = lockbench_record.a + lockbench_record.d;
+            } while (read_seqretry(&lockbench_seqlock, seq));
+            sum += value;
+        }
+    }
+    job->cycles = (uint32_t)(timer_rdtsc() - t0);
+    job->sum = sum;
+}
+
+/* Cycles per read for the slowest of 'readers' CPUs, or -1 if one is busy */
+static int lockbench_run(int kind, int readers)
+{
+    struct lockbench_job jobs[LOCKBENCH_MAX_READERS];
+    for (int i = 0; i < readers; i++) jobs[i].kind = kind;
+    for (int i = 1; i < readers; i++) {
+        if (smp_call(i, lockbench_work, &jobs[i]) != 0) {
+            while (--i > 0) smp_wait(i);
+            return -1;
+        }
+    }
+    lockbench_work(&jobs[0]);
+    
+    uint32_t worst = jobs[0].cycles;
+    for (int i = 1; i < readers; i++) {
+        smp_wait(i);
+        if (jobs[i].cycles > worst) worst = jobs[i].cycles;
+    }
+    return (int)(worst / LOCKBENCH_ITERS);
+}
+
+static void pkg_cmd_lockbench(int argc, char *argv[])
+{
+    (void)argc; (void)argv;
+    int cpus = smp_cpu_count();
+    spin_lock_init(&lockbench_spin);
+    rwlock_init(&lockbench_rwlock);
+    seqlock_init(&lockbench_seqlock);
+    
+    console_printf("lockbench: %u reads per CPU, cycles/read\n", LOCKBENCH_ITERS);
+    console_puts("readers  spinlock  rwlock  seqlock\n");
+    for (int n = 1; n <= LOCKBENCH_MAX_READERS && n <= cpus; n *= 2) {
+        int cost[LOCKBENCH_KINDS];
+        for (int kind = 0; kind < LOCKBENCH_KINDS; kind++) {
+            cost[kind] = lockbench_run(kind, n);
+        }
+        if (cost[LOCKBENCH_SPIN] < 0 || cost[LOCKBENCH_RWLOCK] < 0 || cost[LOCKBENCH_SEQLOCK] < 0) {
+            console_printf("%d\tCPU busy\n", n);
+            break;
+        }
+        console_printf("%d\t %d\t   %d\t   %d\n", n, cost[LOCKBENCH_SPIN],
+                       cost[LOCKBENCH_RWLOCK], cost[LOCKBENCH_SEQLOCK]);
+    }
+    if (cpus < LOCKBENCH_MAX_READERS) {
+        console_printf("(only %d CPU(s) online)\n", cpus);
+    }
+}
+
+/*
+ * rcubench: 1, 2, 4 and 8 CPUs look up a device and a netdev by name,
+ * once through the lock-free RCU registries and once with the same
+ * lookups wrapped in a read lock, as a locked registry would need.
+ */
+#define RCUBENCH_ITERS 20000u
+
+struct rcubench_job {
+    int locked;
+    volatile uint32_t cycles;
+    volatile uint32_t found;
+};
+
+static void rcubench_work(void *arg)
+{
+    struct rcubench_job *job = (struct rcubench_job *)arg;
+    uint32_t found = 0;
+    uint64_t t0 = timer_rdtsc();
+    for (uint32_t i = 0; i < RCUBENCH_ITERS; i++) {
+        if (job->locked) rwlock_read_lock(&lockbench_rwlock);
+        else rcu_read_lock();
+        if (device_get_by_name("rcubench")) found++;
+        if (netdev_get_by_name("lo0")) found++;
+        if (job->locked) rwlock_read_unlock(&lockbench_rwlock);
+        else rcu_read_unlock();
+    }
+    job->cycles = (uint32_t)(timer_rdtsc() - t0);
+    job->found = found;
+}
+
+static int rcubench_run(int locked, int readers)
+{
+    struct rcubench_job jobs[LOCKBENCH_MAX_READERS];
+    for (int i = 0; i < readers; i++) jobs[i].locked = locked;
+    for (int i = 1; i < readers; i++) {
+        if (smp_call(i, rcubench_work, &jobs[i]) != 0) {
+            while (--i > 0) smp_wait(i);
+            return -1;
+        }
+    }
+    rcubench_work(&jobs[0]);
+    
+    uint32_t worst = jobs[0].cycles;
+    for (int i = 1; i < readers; i++) {
+        smp_wait(i);
+        if (jobs[i].cycles > worst) worst = jobs[i].cycles;
+    }
+    return (int)(worst / RCUBENCH_ITERS);
+}
+
+static void pkg_cmd_rcubench(int argc, char *argv[])
+{
+    (void)argc; (void)argv;
+    int cpus = smp_cpu_count();
+    int device_id = device_register("rcubench", DEVICE_CLASS_MISC, NULL);
+    if (device_id < 0) {
+        console_puts("rcubench: cannot register test device\n");
+        return;
+    }
+    rwlock_init(&lockbench_rwlock);
+    
+    console_printf("rcubench: %u lookup pairs per CPU, cycles/pair\n", RCUBENCH_ITERS);
+    console_puts("readers  rcu  rwlock\n");
+    for (int n = 1; n <= LOCKBENCH_MAX_READERS && n <= cpus; n *= 2) {
+        int rcu = rcubench_run(0, n);
+        int locked = rcubench_run(1, n);
+        if (rcu < 0 || locked < 0) {
+            console_printf("%d\tCPU busy\n", n);
+            break;
+        }
+        console_printf("%d\t %d\t  %d\n", n, rcu, locked);
+    }
+    
+    device_unregister((uint32_t)device_id);
+    synchronize_rcu();
+    
+    struct rcu_stats stats;
+    rcu_get_stats(&stats);
+    console_printf("grace periods %u, last %u ticks, max %u ticks\n",
+                   stats.grace_periods, stats.last_gp_ticks, stats.max_gp_ticks);
+}
+
 /* editor package */
 static void pkg_cmd_edit(int argc, char *argv[])
 {
@@ -335,6 +732,11 @@ static int install_bench(void)
 {
     if (kshell_register_command("membench", "Memory write benchmark", pkg_cmd_membench) != 0) return -1;
     if (kshell_register_command("cpubench", "CPU integer benchmark", pkg_cmd_cpubench) != 0) return -1;
+    if (kshell_register_command("shmbench", "Shared memory vs vfs copy", pkg_cmd_shmbench) != 0) return -1;
+    if (kshell_register_command("schedbench", "Run queue pick latency", pkg_cmd_schedbench) != 0) return -1;
+    if (kshell_register_command("smpbench", "Parallel CPU speedup", pkg_cmd_smpbench) != 0) return -1;
+    if (kshell_register_command("lockbench", "Read-side lock scaling", pkg_cmd_lockbench) != 0) return -1;
+    if (kshell_register_command("rcubench", "RCU registry lookup scaling", pkg_cmd_rcubench) != 0) return -1;
     return 0;
 }
 
@@ -342,6 +744,11 @@ static int remove_bench(void)
 {
     kshell_unregister_command("membench");
     kshell_unregister_command("cpubench");
+    kshell_unregister_command("shmbench");
+    kshell_unregister_command("schedbench");
+    kshell_unregister_command("smpbench");
+    kshell_unregister_command("lockbench");
+    kshell_unregister_command("rcubench");
     return 0;
 }
 
@@ -3,6 +3,7 @@
 .section .text
 .global switch_to_task
 .global get_esp
+.global thread_switch
 
 # void switch_to_task(struct task *task)
 # esp+4 = task pointer
@@ -26,6 +27,34 @@ switch_to_task:
     pop %ebp
     ret
 
+# void thread_switch(struct registers *save, struct registers *load)
+# Saves the callee-saved state of the caller into 'save' so that a later
+# switch back returns from this call, then resumes 'load'.  Offsets follow
+# struct registers: ebx 4, esi 16, edi 20, ebp 24, esp 28, eip 32, eflags 36.
+thread_switch:
+    mov 4(%esp), %eax       # save
+    mov 8(%esp), %edx       # load
+    
+    mov %ebx, 4(%eax)
+    mov %esi, 16(%eax)
+    mov %edi, 20(%eax)
+    mov %ebp, 24(%eax)
+    pushfl
+    popl 36(%eax)
+    mov (%esp), %ecx        # Resume at our return address...
+    mov %ecx, 32(%eax)
+    lea 4(%esp), %ecx       # ...with the return address popped
+    mov %ecx, 28(%eax)
+    
+    mov 4(%edx), %ebx
+    mov 16(%edx), %esi
+    mov 20(%edx), %edi
+    mov 24(%edx), %ebp
+    mov 28(%edx), %esp
+    pushl 36(%edx)
+    popfl
+    jmp *32(%edx)
+
 # Get current ESP value
 get_esp:
     mov %esp, %eax
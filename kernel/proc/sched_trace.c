@@ -0,0 +1,160 @@
+#include "../../include/kernel/sched_trace.h"
+#include "../../include/kernel/task.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/timer.h"
+#include <stddef.h>
+#include <string.h>
+
+/* Where a task's time since trace_stamp is charged */
+enum {
+    PHASE_NONE,
+    PHASE_RUN,
+    PHASE_WAIT,
+    PHASE_SLEEP
+};
+
+struct trace_cpu {
+    volatile uint32_t head;         /* Records ever written; slot = head % size */
+    struct sched_trace_record ring[SCHED_TRACE_RING_SIZE];
+    uint32_t counts[SCHED_TRACE_BLOCK + 1];
+    uint32_t latency_hist[SCHED_TRACE_HIST_BUCKETS];
+    uint32_t switch_hist[SCHED_TRACE_HIST_BUCKETS];
+} __attribute__((aligned(64)));
+
+static struct trace_cpu trace_cpus[SMP_MAX_CPUS];
+
+/*
+ * Append a record to this CPU's ring.  Interrupts are off so a
+ * tracepoint in an IRQ cannot interleave with one it interrupted.
+ */
+static void trace_emit(uint8_t type, uint32_t task, uint32_t arg, uint64_t now)
+{
+    uint32_t flags = irq_save();
+    struct cpu *cpu = smp_this_cpu();
+    struct trace_cpu *tc = &trace_cpus[cpu->index];
+
+    struct sched_trace_record *rec = &tc->ring[tc->head & (SCHED_TRACE_RING_SIZE - 1)];
+    rec->tsc = now;
+    rec->task = task;
+    rec->arg = arg;
+    rec->type = type;
+    rec->cpu = (uint8_t)cpu->index;
+    rec->reserved = 0;
+    __asm__ volatile("" : : : "memory");
+    tc->head++;
+    tc->counts[type]++;
+    irq_restore(flags);
+}
+
+/* Charge the time since the last transition and enter a new phase */
+static uint64_t task_phase(struct task *task, int phase, uint64_t now)
+{
+    uint64_t elapsed = task->trace_stamp ? now - task->trace_stamp : 0;
+    switch (task->trace_phase) {
+    case PHASE_RUN:   task->run_cycles += elapsed; break;
+    case PHASE_WAIT:  task->wait_cycles += elapsed; break;
+    case PHASE_SLEEP: task->sleep_cycles += elapsed; break;
+    default: elapsed = 0; break;
+    }
+    task->trace_phase = phase;
+    task->trace_stamp = now;
+    return elapsed;
+}
+
+void sched_trace_wakeup(struct task *task)
+{
+    if (!task) return;
+    uint64_t now = timer_rdtsc();
+    task_phase(task, PHASE_WAIT, now);
+    trace_emit(SCHED_TRACE_WAKEUP, task->id, (uint32_t)task->cpu, now);
+}
+
+void sched_trace_block(struct task *task)
+{
+    if (!task) return;
+    uint64_t now = timer_rdtsc();
+    task_phase(task, PHASE_SLEEP, now);
+    trace_emit(SCHED_TRACE_BLOCK, task->id, 0, now);
+}
+
+void sched_trace_switch(struct task *prev, struct task *next)
+{
+    if (prev == next) return;
+    uint64_t now = timer_rdtsc();
+
+    if (prev) {
+        int phase = PHASE_NONE;
+        if (prev->state == TASK_READY || prev->state == TASK_RUNNING) phase = PHASE_WAIT;
+        else if (prev->state == TASK_BLOCKED) phase = PHASE_SLEEP;
+        task_phase(prev, phase, now);
+    }
+
+    if (next) {
+        int waited = next->trace_phase == PHASE_WAIT;
+        uint64_t latency = task_phase(next, PHASE_RUN, now);
+        next->nr_switches++;
+        if (waited) {
+            uint32_t cycles = latency > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)latency;
+            trace_cpus[smp_this_cpu()->index].latency_hist[timer_cycles_bucket(cycles, SCHED_TRACE_HIST_BUCKETS)]++;
+        }
+    }
+
+    trace_emit(SCHED_TRACE_SWITCH, prev ? prev->id : 0, next ? next->id : 0, now);
+}
+
+void sched_trace_migrate(struct task *task, int from_cpu)
+{
+    if (!task) return;
+    trace_emit(SCHED_TRACE_MIGRATE, task->id, (uint32_t)from_cpu, timer_rdtsc());
+}
+
+void sched_trace_switch_cost(uint32_t cycles)
+{
+    trace_cpus[smp_this_cpu()->index].switch_hist[timer_cycles_bucket(cycles, SCHED_TRACE_HIST_BUCKETS)]++;
+}
+
+int sched_trace_read(int cpu, struct sched_trace_record *records, int max)
+{
+    if (cpu < 0 || cpu >= SMP_MAX_CPUS || !records || max <= 0) return -1;
+    struct trace_cpu *tc = &trace_cpus[cpu];
+
+    uint32_t head = tc->head;
+    uint32_t count = head < SCHED_TRACE_RING_SIZE ? head : SCHED_TRACE_RING_SIZE;
+    if (count > (uint32_t)max) count = (uint32_t)max;
+    uint32_t first = head - count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        records[i] = tc->ring[(first + i) & (SCHED_TRACE_RING_SIZE - 1)];
+    }
+    __asm__ volatile("" : : : "memory");
+
+    /*
+     * Drop copies the writer may have overwritten while we read,
+     * counting the slot it could be filling right now.
+     */
+    uint32_t span = tc->head + 1 - first;
+    uint32_t stale = span > SCHED_TRACE_RING_SIZE ? span - SCHED_TRACE_RING_SIZE : 0;
+    if (stale >= count) return 0;
+    for (uint32_t i = stale; stale && i < count; i++) {
+        records[i - stale] = records[i];
+    }
+    return (int)(count - stale);
+}
+
+void sched_trace_get_summary(struct sched_trace_summary *summary)
+{
+    if (!summary) return;
+    memset(summary, 0, sizeof(*summary));
+
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        struct trace_cpu *tc = &trace_cpus[i];
+        summary->wakeups += tc->counts[SCHED_TRACE_WAKEUP];
+        summary->switches += tc->counts[SCHED_TRACE_SWITCH];
+        summary->migrations += tc->counts[SCHED_TRACE_MIGRATE];
+        summary->blocks += tc->counts[SCHED_TRACE_BLOCK];
+        for (int b = 0; b < SCHED_TRACE_HIST_BUCKETS; b++) {
+            summary->latency_hist[b] += tc->latency_hist[b];
+            summary->switch_hist[b] += tc->switch_hist[b];
+        }
+    }
+}
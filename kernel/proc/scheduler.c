@@ -1,66 +1,813 @@
 #include "../../include/kernel/scheduler.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/telemetry.h"
+#include "../../include/kernel/sched_trace.h"
 #include "../../include/kernel/serial.h"
 #include <stddef.h>
 
-static int current_index = 0;
+/*
+ * O(1) priority scheduler.
+ *
+ * Every READY task sits on the FIFO of its priority level; the running
+ * task is off the queue.  Picking takes the head of the highest set bit
+ * in the level bitmap, and a preempted task goes back on the tail of its
+ * level, so tasks of equal priority take turns.
+ *
+ * FAIR-class tasks only run when no PRIO task is ready.  They are kept
+ * in a min-heap by virtual runtime, which advances more slowly the
+ * higher a task's weight, and the task furthest behind runs next.
+ *
+ * DEADLINE-class tasks run ahead of both, earliest absolute deadline
+ * first.  Each holds a reservation of 'runtime' every 'period' that
+ * admission control keeps within the CPUs' capacity; a task that uses
+ * up its runtime is throttled until its next period, so it cannot
+ * starve the other classes.  The BSP's tick replenishes budgets and
+ * counts jobs still unfinished at their deadline.
+ *
+ * Each CPU has its own run queue under its own lock, and task->cpu names
+ * the queue a task belongs to.  A CPU whose queue is empty pulls a task
+ * from the busiest other queue.  Waking tasks return to their last CPU
+ * and thieves leave tasks alone unless the load gap passes the task's
+ * placement threshold, so tasks keep their caches; affinity masks bound
+ * both (see scheduler_select_cpu).
+ */
+
+#define STEAL_SCAN 8                    /* Candidates a thief looks past */
+
+static struct sched_place_stats place_stats;
+
+/* Fair-class tunables, see scheduler_set_fair_params() */
+static uint32_t fair_latency_us = SCHED_FAIR_LATENCY_US;
+static uint32_t fair_min_granularity_us = SCHED_FAIR_MIN_GRANULARITY_US;
+
+/*
+ * Load weight per priority level: each level is worth ~25% more CPU
+ * than the one below, with level 15 at the nominal 1024.
+ */
+static const uint32_t prio_to_weight[SCHED_PRIO_LEVELS] = {
+       36,    45,    56,    70,    87,   110,   137,   172,
+      215,   272,   335,   423,   526,   655,   820,  1024,
+     1277,  1586,  1991,  2501,  3121,  3906,  4904,  6100,
+     7620,  9548, 11916, 14949, 18705, 23254, 29154, 36291,
+};
+
+static inline int sched_level(const struct task *task)
+{
+    if (task->priority < 0) return 0;
+    if (task->priority >= SCHED_PRIO_LEVELS) return SCHED_PRIO_LEVELS - 1;
+    return task->priority;
+}
+
+uint32_t scheduler_weight(int priority)
+{
+    if (priority < 0) priority = 0;
+    if (priority >= SCHED_PRIO_LEVELS) priority = SCHED_PRIO_LEVELS - 1;
+    return prio_to_weight[priority];
+}
+
+static inline int time_before(uint64_t a, uint64_t b)
+{
+    return (int64_t)(a - b) < 0;
+}
+
+/* Deadline-class time base, finer than the tick once the clock has a rate */
+static inline uint64_t sched_now_us(void)
+{
+    return clock_div64(clock_now_ns(), 1000);
+}
+
+/* Task heaps, keyed by vruntime (FAIR) or absolute deadline (DEADLINE) */
+
+typedef uint64_t (*heap_key_t)(const struct task *task);
+
+static uint64_t fair_key(const struct task *task)
+{
+    return task->vruntime;
+}
+
+static uint64_t dl_key(const struct task *task)
+{
+    return task->dl_abs_deadline;
+}
+
+static void heap_set(struct task_heap *heap, uint32_t i, struct task *task)
+{
+    heap->slot[i] = task;
+    task->heap_index = (int)i;
+}
+
+static void heap_sift_up(struct task_heap *heap, uint32_t i, heap_key_t key)
+{
+    struct task *task = heap->slot[i];
+    while (i > 0) {
+        uint32_t parent = (i - 1) / 2;
+        if (!time_before(key(task), key(heap->slot[parent]))) break;
+        heap_set(heap, i, heap->slot[parent]);
+        i = parent;
+    }
+    heap_set(heap, i, task);
+}
+
+static void heap_sift_down(struct task_heap *heap, uint32_t i, heap_key_t key)
+{
+    struct task *task = heap->slot[i];
+    for (;;) {
+        uint32_t child = 2 * i + 1;
+        if (child >= heap->count) break;
+        if (child + 1 < heap->count &&
+            time_before(key(heap->slot[child + 1]), key(heap->slot[child]))) {
+            child++;
+        }
+        if (!time_before(key(heap->slot[child]), key(task))) break;
+        heap_set(heap, i, heap->slot[child]);
+        i = child;
+    }
+    heap_set(heap, i, task);
+}
+
+static void heap_insert(struct task_heap *heap, struct task *task, heap_key_t key)
+{
+    heap->slot[heap->count] = task;
+    heap_sift_up(heap, heap->count++, key);
+}
+
+static void heap_remove(struct task_heap *heap, struct task *task, heap_key_t key)
+{
+    uint32_t i = (uint32_t)task->heap_index;
+    struct task *last = heap->slot[--heap->count];
+    if (last != task) {
+        heap_set(heap, i, last);
+        heap_sift_down(heap, i, key);
+        heap_sift_up(heap, (uint32_t)last->heap_index, key);
+    }
+    heap->slot[heap->count] = NULL;
+    task->heap_index = -1;
+}
+
+static void fair_enqueue(struct run_queue *rq, struct task *task)
+{
+    /* Sleepers and newcomers start at the queue's floor, not at 0 */
+    if (time_before(task->vruntime, rq->min_vruntime)) {
+        task->vruntime = rq->min_vruntime;
+    }
+    heap_insert(&rq->fair, task, fair_key);
+    rq->fair_weight += scheduler_weight(task->priority);
+}
+
+static void fair_dequeue(struct run_queue *rq, struct task *task)
+{
+    heap_remove(&rq->fair, task, fair_key);
+    rq->fair_weight -= scheduler_weight(task->priority);
+}
+
+void run_queue_init(struct run_queue *rq)
+{
+    rq->bitmap = 0;
+    for (int i = 0; i < SCHED_PRIO_LEVELS; i++) {
+        rq->head[i] = NULL;
+        rq->tail[i] = NULL;
+    }
+    rq->nr_running = 0;
+    rq->fair.count = 0;
+    rq->fair_weight = 0;
+    rq->min_vruntime = 0;
+    rq->dl.count = 0;
+}
+
+void run_queue_enqueue(struct run_queue *rq, struct task *task)
+{
+    if (task->on_rq) return;
+    
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        heap_insert(&rq->dl, task, dl_key);
+    } else if (task->sched_class == SCHED_CLASS_FAIR) {
+        fair_enqueue(rq, task);
+    } else {
+        int level = sched_level(task);
+        task->rq_next = NULL;
+        task->rq_prev = rq->tail[level];
+        if (rq->tail[level]) rq->tail[level]->rq_next = task;
+        else rq->head[level] = task;
+        rq->tail[level] = task;
+        rq->bitmap |= 1u << level;
+    }
+    
+    rq->nr_running++;
+    task->on_rq = 1;
+}
+
+void run_queue_dequeue(struct run_queue *rq, struct task *task)
+{
+    if (!task->on_rq) return;
+    
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        heap_remove(&rq->dl, task, dl_key);
+    } else if (task->sched_class == SCHED_CLASS_FAIR) {
+        fair_dequeue(rq, task);
+    } else {
+        int level = sched_level(task);
+        if (task->rq_prev) task->rq_prev->rq_next = task->rq_next;
+        else rq->head[level] = task->rq_next;
+        if (task->rq_next) task->rq_next->rq_prev = task->rq_prev;
+        else rq->tail[level] = task->rq_prev;
+        if (!rq->head[level]) rq->bitmap &= ~(1u << level);
+        task->rq_next = NULL;
+        task->rq_prev = NULL;
+    }
+    
+    rq->nr_running--;
+    task->on_rq = 0;
+}
+
+struct task *run_queue_pop(struct run_queue *rq)
+{
+    struct task *task;
+    if (rq->dl.count) {
+        task = rq->dl.slot[0];
+    } else if (rq->bitmap) {
+        int level = 31 - __builtin_clz(rq->bitmap);
+        task = rq->head[level];
+    } else if (rq->fair.count) {
+        task = rq->fair.slot[0];
+    } else {
+        return NULL;
+    }
+    
+    run_queue_dequeue(rq, task);
+    if (task->sched_class == SCHED_CLASS_FAIR) task->slice_exec_us = 0;
+    if (task->sched_class == SCHED_CLASS_DEADLINE) task->dl_exec_start = sched_now_us();
+    return task;
+}
 
 void scheduler_init(void)
 {
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        struct cpu *cpu = smp_cpu(i);
+        run_queue_init(&cpu->rq);
+        spin_lock_init(&cpu->rq_lock);
+    }
     serial_puts("Scheduler initialized\n");
 }
 
-struct task *scheduler_pick_next(void)
+static uint32_t online_mask(void)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (smp_cpu(i)->online) mask |= 1u << i;
+    }
+    return mask;
+}
+
+/* Runnable tasks on a CPU, counting the one it is running */
+static uint32_t cpu_load(struct cpu *cpu)
+{
+    return cpu->rq.nr_running + (cpu->current ? 1 : 0);
+}
+
+/* Load gap that justifies moving a task off its last CPU */
+static uint32_t migrate_threshold(const struct task *task)
+{
+    switch (task->placement) {
+    case SCHED_PLACE_LATENCY:    return 1;
+    case SCHED_PLACE_THROUGHPUT: return SCHED_MIGRATE_IMBALANCE + 1;
+    default:                     return SCHED_MIGRATE_IMBALANCE;
+    }
+}
+
+/* Point an off-queue task at another CPU's queue */
+static void task_move_cpu(struct task *task, int to)
 {
-    if (task_get_count() == 0) return NULL;
-    
-    /* Priority-first selection */
-    struct task *best = NULL;
-    int best_idx = -1;
-    int best_prio = -2147483647;
-    
-    for (int i = 0; i < task_get_count(); i++) {
-        struct task *task = task_get(i);
-        if (!task) continue;
-        if (task->state != TASK_READY && task->state != TASK_RUNNING) continue;
-        if (task->priority > best_prio) {
-            best_prio = task->priority;
-            best = task;
-            best_idx = i;
+    int from = task->cpu;
+    if (from == to) return;
+    
+    /* Keep its lag relative to the new queue's floor */
+    if (task->sched_class == SCHED_CLASS_FAIR) {
+        task->vruntime = task->vruntime - smp_cpu(from)->rq.min_vruntime +
+                         smp_cpu(to)->rq.min_vruntime;
+    }
+    task->cpu = to;
+    task->nr_migrations++;
+    sched_trace_migrate(task, from);
+}
+
+int scheduler_select_cpu(struct task *task)
+{
+    uint32_t online = online_mask();
+    uint32_t allowed = task->cpus_allowed & online;
+    if (!allowed) allowed = online;
+    if (!allowed) return task->cpu;     /* Before smp_init() */
+    
+    int best = -1, idle = -1;
+    uint32_t best_load = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(allowed & (1u << i))) continue;
+        uint32_t load = cpu_load(smp_cpu(i));
+        if (best < 0 || load < best_load) {
+            best = i;
+            best_load = load;
         }
+        if (load == 0 && idle < 0) idle = i;
     }
     
-    if (best) {
-        current_index = (best_idx + 1) % task_get_count();
+    int prev = task->cpu;
+    if (!(allowed & (1u << prev))) {
+        place_stats.affinity_moves++;
         return best;
     }
     
-    /* Round-robin fallback */
-    int start = current_index;
-    do {
-        struct task *task = task_get(current_index);
-        current_index = (current_index + 1) % task_get_count();
-        if (task && (task->state == TASK_READY || task->state == TASK_RUNNING)) {
-            return task;
+    uint32_t prev_load = cpu_load(smp_cpu(prev));
+    if (prev_load == 0 || prev_load < best_load + migrate_threshold(task)) {
+        place_stats.wake_prev++;
+        return prev;
+    }
+    if (task->placement == SCHED_PLACE_LATENCY && idle >= 0) {
+        place_stats.wake_idle++;
+        return idle;
+    }
+    place_stats.wake_balanced++;
+    return best;
+}
+
+void scheduler_wakeup(struct task *task)
+{
+    if (!task) return;
+    task_move_cpu(task, scheduler_select_cpu(task));
+    scheduler_enqueue(task);
+}
+
+int scheduler_set_placement(struct task *task, int policy)
+{
+    if (!task || policy < SCHED_PLACE_DEFAULT || policy > SCHED_PLACE_THROUGHPUT) return -1;
+    task->placement = policy;
+    return 0;
+}
+
+void scheduler_get_place_stats(struct sched_place_stats *stats)
+{
+    if (stats) *stats = place_stats;
+}
+
+void scheduler_enqueue(struct task *task)
+{
+    if (!task) return;
+    /* A throttled deadline task is requeued when its budget is replenished */
+    if (task->sched_class == SCHED_CLASS_DEADLINE && task->dl_throttled) return;
+    
+    /* Its mask may have changed while it ran or slept */
+    if (!(task->cpus_allowed & (1u << task->cpu))) {
+        task_move_cpu(task, scheduler_select_cpu(task));
+    }
+    
+    struct cpu *cpu = smp_cpu(task->cpu);
+    uint32_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    run_queue_enqueue(&cpu->rq, task);
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+    
+    /*
+     * A CPU halted with its tick stopped would not look until its next
+     * event; if the owner is busy, wake an idle one that can steal it.
+     */
+    if (cpu->halted) {
+        smp_kick(task->cpu);
+    } else if (cpu->current) {
+        for (int i = 0; i < SMP_MAX_CPUS; i++) {
+            struct cpu *idle = smp_cpu(i);
+            if (!(task->cpus_allowed & (1u << i))) continue;
+            if (idle->online && idle->halted && !idle->current) {
+                smp_kick(i);
+                break;
+            }
         }
-    } while (current_index != start);
+    }
+}
+
+void scheduler_dequeue(struct task *task)
+{
+    if (!task) return;
     
-    return NULL;
+    /* Recheck the owner under its lock: a thief may have moved it */
+    for (;;) {
+        int owner = task->cpu;
+        struct cpu *cpu = smp_cpu(owner);
+        uint32_t flags = spin_lock_irqsave(&cpu->rq_lock);
+        if (task->cpu == owner) {
+            run_queue_dequeue(&cpu->rq, task);
+            spin_unlock_irqrestore(&cpu->rq_lock, flags);
+            return;
+        }
+        spin_unlock_irqrestore(&cpu->rq_lock, flags);
+    }
 }
 
-void scheduler_tick(void)
+int scheduler_set_affinity(struct task *task, uint32_t mask)
 {
-    struct task *current = task_get_current();
+    if (!task) return -1;
+    mask &= online_mask();
+    if (!mask) return -1;
+    task->cpus_allowed = mask;
+    
+    /*
+     * A queued task on a CPU it may no longer use moves now; a running or
+     * sleeping one moves when it is next enqueued.
+     */
+    for (;;) {
+        int owner = task->cpu;
+        if (mask & (1u << owner)) return 0;
+        struct cpu *cpu = smp_cpu(owner);
+        uint32_t flags = spin_lock_irqsave(&cpu->rq_lock);
+        if (task->cpu != owner) {
+            spin_unlock_irqrestore(&cpu->rq_lock, flags);
+            continue;
+        }
+        int queued = task->on_rq;
+        run_queue_dequeue(&cpu->rq, task);
+        spin_unlock_irqrestore(&cpu->rq_lock, flags);
+        
+        if (queued) scheduler_enqueue(task);
+        return 0;
+    }
+}
+
+/* Pop the best READY task, dropping any whose state changed behind the queue's back */
+static struct task *pop_ready(struct cpu *cpu)
+{
+    struct task *task;
+    uint32_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    while ((task = run_queue_pop(&cpu->rq)) != NULL) {
+        if (task->state == TASK_READY) break;
+    }
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+    return task;
+}
+
+/*
+ * Pull one task from the busiest other CPU: the best one this CPU is
+ * allowed to run whose placement threshold the load gap passes.  Tasks
+ * looked past go back on their queue, behind their equals.
+ */
+static struct task *steal_task(struct cpu *self)
+{
+    struct cpu *busiest = NULL;
+    for (int i = 0; i < smp_cpu_count(); i++) {
+        struct cpu *cpu = smp_cpu(i);
+        if (cpu == self || !cpu->online || cpu->rq.nr_running == 0) continue;
+        if (!busiest || cpu->rq.nr_running > busiest->rq.nr_running) {
+            busiest = cpu;
+        }
+    }
+    if (!busiest) return NULL;
+    
+    uint32_t self_load = cpu_load(self);
+    uint32_t bit = 1u << self->index;
+    struct task *skipped[STEAL_SCAN];
+    int nskipped = 0;
+    
+    struct task *task;
+    uint32_t flags = spin_lock_irqsave(&busiest->rq_lock);
+    uint32_t busiest_load = cpu_load(busiest);
+    uint32_t gap = busiest_load > self_load ? busiest_load - self_load : 0;
+    while ((task = run_queue_pop(&busiest->rq)) != NULL) {
+        if (task->state != TASK_READY) continue;
+        if ((task->cpus_allowed & bit) && gap >= migrate_threshold(task)) break;
+        skipped[nskipped++] = task;
+        if (nskipped == STEAL_SCAN) {
+            task = NULL;
+            break;
+        }
+    }
+    for (int i = 0; i < nskipped; i++) {
+        run_queue_enqueue(&busiest->rq, skipped[i]);
+    }
+    place_stats.steal_skipped += (uint32_t)nskipped;
+    if (task) task_move_cpu(task, (int)self->index);
+    spin_unlock_irqrestore(&busiest->rq_lock, flags);
+    
+    if (task) self->steals++;
+    return task;
+}
+
+struct task *scheduler_pick_next(void)
+{
+    struct cpu *self = smp_this_cpu();
+    struct task *task = pop_ready(self);
+    if (!task) task = steal_task(self);
+    return task;
+}
+
+void scheduler_idle(void)
+{
+    if (task_get_current()) return;
+    
+    struct task *next = scheduler_pick_next();
+    if (next) task_set_current(next);
+}
+
+/* Deadline class: every task holding a reservation, under dl_lock */
+static spinlock_t dl_lock = SPINLOCK_INIT;
+static struct task *dl_tasks = NULL;
+static struct sched_dl_stats dl_stats;
+
+int scheduler_needs_tick(struct cpu *cpu)
+{
+    if (cpu->current || cpu->rq.nr_running) return 1;
+    if (cpu->index == 0 && dl_tasks) return 1;
+    
+    /* An idle CPU keeps ticking while there is work it could steal */
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (smp_cpu(i)->online && smp_cpu(i)->rq.nr_running) return 1;
+    }
+    return 0;
+}
+
+static inline uint32_t dl_bw_limit(void)
+{
+    return SCHED_DL_BW_LIMIT * (uint32_t)smp_cpu_count();
+}
+
+/* Give back a task's reservation; dl_lock held */
+static void dl_release(struct task *task)
+{
+    for (struct task **link = &dl_tasks; *link; link = &(*link)->dl_next) {
+        if (*link == task) {
+            *link = task->dl_next;
+            break;
+        }
+    }
+    task->dl_next = NULL;
+    dl_stats.total_bw -= task->dl_bw;
+    dl_stats.active--;
+    task->dl_bw = 0;
+    task->dl_throttled = 0;
+}
+
+int scheduler_set_class(struct task *task, int sched_class)
+{
+    if (!task) return -1;
+    if (sched_class != SCHED_CLASS_PRIO && sched_class != SCHED_CLASS_FAIR) return -1;
+    if (task->sched_class == sched_class) return 0;
+    
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    int queued = task->on_rq;
+    if (queued) scheduler_dequeue(task);
+    if (task->sched_class == SCHED_CLASS_DEADLINE) {
+        dl_release(task);
+        queued = task->state == TASK_READY;
+    }
+    task->sched_class = sched_class;
+    task->slice_exec_us = 0;
+    if (queued) scheduler_enqueue(task);
+    spin_unlock_irqrestore(&dl_lock, flags);
+    return 0;
+}
+
+int scheduler_set_deadline(struct task *task, uint32_t runtime_us, uint32_t deadline_us,
+                           uint32_t period_us)
+{
+    if (!task || runtime_us == 0 || runtime_us > deadline_us || deadline_us > period_us) return -1;
+    if (runtime_us > SCHED_DL_MAX_RUNTIME_US || period_us > SCHED_DL_MAX_PERIOD_US) return -1;
+    
+    uint32_t bw = runtime_us * SCHED_DL_BW_UNIT / period_us;
+    if (bw == 0) bw = 1;
+    
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    uint32_t old_bw = task->sched_class == SCHED_CLASS_DEADLINE ? task->dl_bw : 0;
+    if (dl_stats.total_bw - old_bw + bw > dl_bw_limit()) {
+        dl_stats.rejected++;
+        spin_unlock_irqrestore(&dl_lock, flags);
+        serial_printf("[sched] Task %u: deadline reservation rejected (bw %u, in use %u of %u)\n",
+                      task->id, bw, dl_stats.total_bw, dl_bw_limit());
+        return -1;
+    }
     
-    if (current) {
-        current->ticks_remaining--;
-        if (current->ticks_remaining <= 0) {
-            current->state = TASK_READY;
-            current->ticks_remaining = 10;
+    int queued = task->on_rq;
+    if (queued) scheduler_dequeue(task);
+    if (!old_bw) {
+        task->dl_next = dl_tasks;
+        dl_tasks = task;
+        dl_stats.active++;
+    }
+    dl_stats.total_bw += bw - old_bw;
+    dl_stats.admitted++;
+    
+    uint64_t now = sched_now_us();
+    task->dl_runtime = runtime_us;
+    task->dl_deadline = deadline_us;
+    task->dl_period = period_us;
+    task->dl_bw = bw;
+    task->dl_remaining = (int32_t)runtime_us;
+    task->dl_exec_start = now;
+    task->dl_abs_deadline = now + deadline_us;
+    task->dl_period_end = now + period_us;
+    task->dl_throttled = 0;
+    task->sched_class = SCHED_CLASS_DEADLINE;
+    if (queued || task->state == TASK_READY) scheduler_enqueue(task);
+    spin_unlock_irqrestore(&dl_lock, flags);
+    return 0;
+}
+
+void scheduler_yield_deadline(struct task *task)
+{
+    if (!task || task->sched_class != SCHED_CLASS_DEADLINE) return;
+    
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    if (task->on_rq) scheduler_dequeue(task);
+    task->dl_remaining = 0;
+    task->dl_throttled = 1;
+    spin_unlock_irqrestore(&dl_lock, flags);
+}
+
+void scheduler_get_dl_stats(struct sched_dl_stats *stats)
+{
+    if (!stats) return;
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    *stats = dl_stats;
+    stats->bw_limit = dl_bw_limit();
+    spin_unlock_irqrestore(&dl_lock, flags);
+}
+
+/*
+ * Start new periods for throttled tasks and catch jobs that reached
+ * their deadline unfinished.  A miss pushes the deadline out by one
+ * period with a fresh budget, as if the job had been released late.
+ */
+static void dl_update(uint64_t now)
+{
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    for (struct task *task = dl_tasks; task; task = task->dl_next) {
+        if (task->dl_throttled) {
+            if (time_before(now, task->dl_period_end)) continue;
             
-            struct task *next = scheduler_pick_next();
-            if (next && next != current) {
-                task_set_current(next);
+            uint64_t start = task->dl_period_end;
+            if (time_before(start + task->dl_period, now)) start = now;
+            task->dl_abs_deadline = start + task->dl_deadline;
+            task->dl_period_end = start + task->dl_period;
+            task->dl_remaining = (int32_t)task->dl_runtime;
+            task->dl_throttled = 0;
+            dl_stats.replenishments++;
+            if (task->state == TASK_READY) scheduler_enqueue(task);
+        } else if (!time_before(now, task->dl_abs_deadline)) {
+            /* A blocked task has no job outstanding; just roll forward */
+            if (task->state == TASK_READY || task->state == TASK_RUNNING) {
+                task->dl_misses++;
+                dl_stats.misses++;
+                telemetry_log_event(TELEM_EVENT_DEADLINE_MISS, task->id, 0,
+                                    (uint32_t)(now - task->dl_abs_deadline), 0);
             }
+            int queued = task->on_rq;
+            if (queued) scheduler_dequeue(task);
+            task->dl_abs_deadline += task->dl_period;
+            task->dl_period_end += task->dl_period;
+            task->dl_remaining = (int32_t)task->dl_runtime;
+            if (queued) scheduler_enqueue(task);
+        }
+    }
+    spin_unlock_irqrestore(&dl_lock, flags);
+}
+
+/* Bill a DEADLINE task for the time it ran since its last charge; dl_lock held */
+static void dl_charge(struct task *task, uint64_t now)
+{
+    if (!time_before(task->dl_exec_start, now)) return;
+    
+    uint64_t ran = now - task->dl_exec_start;
+    task->dl_exec_start = now;
+    task->dl_remaining -= ran > task->dl_runtime ? (int32_t)task->dl_runtime : (int32_t)ran;
+}
+
+void scheduler_put_prev(struct task *prev)
+{
+    if (!prev || prev->sched_class != SCHED_CLASS_DEADLINE) return;
+    
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    dl_charge(prev, sched_now_us());
+    
+    /* Off the queue (blocked), so it can be throttled here; a requeued
+       one was just charged by dl_tick() */
+    if (!prev->on_rq && !prev->dl_throttled && prev->dl_remaining <= 0) {
+        prev->dl_throttled = 1;
+        dl_stats.throttles++;
+    }
+    spin_unlock_irqrestore(&dl_lock, flags);
+}
+
+/* Charge a running DEADLINE task at the tick; 1 if it should give up the CPU */
+static int dl_tick(struct cpu *cpu, struct task *current)
+{
+    int resched = 0;
+    uint32_t flags = spin_lock_irqsave(&dl_lock);
+    dl_charge(current, sched_now_us());
+    if (current->dl_throttled) {
+        resched = 1;
+    } else if (current->dl_remaining <= 0) {
+        current->dl_throttled = 1;
+        dl_stats.throttles++;
+        resched = 1;
+    } else {
+        spin_lock(&cpu->rq_lock);
+        if (cpu->rq.dl.count &&
+            time_before(cpu->rq.dl.slot[0]->dl_abs_deadline, current->dl_abs_deadline)) {
+            resched = 1;
         }
+        spin_unlock(&cpu->rq_lock);
+    }
+    spin_unlock_irqrestore(&dl_lock, flags);
+    return resched;
+}
+
+int scheduler_set_fair_params(uint32_t latency_us, uint32_t min_granularity_us)
+{
+    if (latency_us == 0 || latency_us > SCHED_FAIR_MAX_LATENCY_US) return -1;
+    if (min_granularity_us == 0 || min_granularity_us > latency_us) return -1;
+    
+    fair_latency_us = latency_us;
+    fair_min_granularity_us = min_granularity_us;
+    return 0;
+}
+
+/*
+ * Charge one tick to a running FAIR task.  Returns 1 when it should give
+ * up the CPU: a PRIO or DEADLINE task is waiting, or it has had its
+ * share of the target latency and another fair task is further behind.
+ */
+static int fair_tick(struct cpu *cpu, struct task *current)
+{
+    uint32_t weight = scheduler_weight(current->priority);
+    current->vruntime += (SCHED_TICK_US * 1024u) / weight;
+    current->slice_exec_us += SCHED_TICK_US;
+    
+    struct run_queue *rq = &cpu->rq;
+    uint32_t flags = spin_lock_irqsave(&cpu->rq_lock);
+    
+    uint64_t floor = current->vruntime;
+    if (rq->fair.count && time_before(rq->fair.slot[0]->vruntime, floor)) {
+        floor = rq->fair.slot[0]->vruntime;
+    }
+    if (time_before(rq->min_vruntime, floor)) rq->min_vruntime = floor;
+    
+    int resched = 0;
+    if (rq->bitmap || rq->dl.count) {
+        resched = 1;
+    } else if (rq->fair.count) {
+        uint32_t slice = fair_latency_us * weight / (rq->fair_weight + weight);
+        if (slice < fair_min_granularity_us) slice = fair_min_granularity_us;
+        if (current->slice_exec_us >= slice &&
+            time_before(rq->fair.slot[0]->vruntime, current->vruntime)) {
+            resched = 1;
+        }
+    }
+    
+    spin_unlock_irqrestore(&cpu->rq_lock, flags);
+    return resched;
+}
+
+void scheduler_tick(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    if (cpu->index == 0 && dl_tasks) dl_update(sched_now_us());
+    
+    struct task *current = task_get_current();
+    if (!current) return;
+    
+    int resched = current->state != TASK_RUNNING;
+    if (current->sched_class == SCHED_CLASS_DEADLINE) {
+        if (!resched) resched = dl_tick(cpu, current);
+    } else if (current->sched_class == SCHED_CLASS_FAIR) {
+        if (!resched) resched = fair_tick(cpu, current);
+    } else if (--current->ticks_remaining <= 0) {
+        current->ticks_remaining = SCHED_QUANTUM_TICKS;
+        resched = 1;
+    } else if (cpu->rq.dl.count) {
+        resched = 1;
+    }
+    if (!resched) return;
+    
+    uint64_t switch_start = timer_rdtsc();
+    
+    /*
+     * Requeue behind its equals, then take the best ready task.  The
+     * deadline class requeues under dl_lock so a throttle or replenish
+     * on the BSP cannot race with it.
+     */
+    if (current->state == TASK_RUNNING) {
+        current->state = TASK_READY;
+        if (current->sched_class == SCHED_CLASS_DEADLINE) {
+            uint32_t flags = spin_lock_irqsave(&dl_lock);
+            scheduler_enqueue(current);
+            spin_unlock_irqrestore(&dl_lock, flags);
+        } else {
+            scheduler_enqueue(current);
+        }
+    }
+    
+    struct task *next = scheduler_pick_next();
+    if (next && next != current) {
+        task_set_current(next);
+    } else if (next) {
+        current->state = TASK_RUNNING;
+    } else {
+        task_set_current(NULL);
     }
+    sched_trace_switch_cost((uint32_t)(timer_rdtsc() - switch_start));
 }
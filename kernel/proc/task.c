@@ -1,12 +1,18 @@
 #include "../../include/kernel/task.h"
+#include "../../include/kernel/scheduler.h"
+#include "../../include/kernel/sched_trace.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/clock.h"
 #include "../../include/kernel/serial.h"
 #include "../../include/kernel/heap.h"
 #include "../../include/kernel/pmem.h"
+#include "../../include/kernel/paging.h"
 #include <stddef.h>
 
 static struct task task_list[MAX_TASKS];
 static int task_count = 0;
-static struct task *current_task = NULL;
+static spinlock_t task_lock = SPINLOCK_INIT;
 
 void task_init(void)
 {
@@ -15,20 +21,57 @@ void task_init(void)
         task_list[i].state = TASK_DEAD;
     }
     task_count = 0;
-    current_task = NULL;
+    smp_this_cpu()->current = NULL;
     serial_puts("Task manager initialized\n");
 }
 
+/* Sleep timer callback: make a sleeping task runnable again */
+static void task_sleep_expired(void *arg)
+{
+    struct task *task = (struct task *)arg;
+    if (task->state == TASK_BLOCKED) {
+        task->state = TASK_READY;
+        sched_trace_wakeup(task);
+        scheduler_wakeup(task);
+    }
+}
+
 struct task *task_create(uint32_t entry_point, int priority)
 {
-    if (task_count >= MAX_TASKS) return NULL;
+    uint32_t flags = spin_lock_irqsave(&task_lock);
+    if (task_count >= MAX_TASKS) {
+        spin_unlock_irqrestore(&task_lock, flags);
+        return NULL;
+    }
     
     struct task *task = &task_list[task_count];
     task->id = task_count + 1;
     task->entry_point = entry_point;
     task->state = TASK_READY;
     task->priority = priority;
-    task->ticks_remaining = 10;
+    task->ticks_remaining = SCHED_QUANTUM_TICKS;
+    task->cpu = (int)smp_this_cpu()->index;
+    task->cpus_allowed = SCHED_CPUMASK_ALL;
+    task->placement = SCHED_PLACE_DEFAULT;
+    task->nr_migrations = 0;
+    task->rq_next = NULL;
+    task->rq_prev = NULL;
+    task->on_rq = 0;
+    task->sched_class = SCHED_CLASS_PRIO;
+    task->vruntime = 0;
+    task->slice_exec_us = 0;
+    task->heap_index = -1;
+    task->dl_bw = 0;
+    task->dl_throttled = 0;
+    task->dl_misses = 0;
+    task->dl_next = NULL;
+    task->trace_phase = 0;
+    task->trace_stamp = 0;
+    task->run_cycles = 0;
+    task->wait_cycles = 0;
+    task->sleep_cycles = 0;
+    task->nr_switches = 0;
+    hrtimer_init(&task->sleep_timer, task_sleep_expired, task);
     
     task->kernel_stack = pmem_alloc_page();
     task->user_stack = pmem_alloc_page();
@@ -64,27 +107,43 @@ struct task *task_create(uint32_t entry_point, int priority)
     task->exit_code = 0;
     
     task_count++;
+    spin_unlock_irqrestore(&task_lock, flags);
+    sched_trace_wakeup(task);
+    scheduler_wakeup(task);
     return task;
 }
 
 void task_destroy(struct task *task)
 {
     if (task) {
+        hrtimer_cancel(&task->sleep_timer);
+        scheduler_dequeue(task);
+        scheduler_set_class(task, SCHED_CLASS_PRIO);
         pmem_free_page(task->kernel_stack);
         pmem_free_page(task->user_stack);
+
+        /* Page tables, areas and shared frames; drops the parent's COW sharers */
+        paging_cleanup_task(task->id);
+        task->page_directory = 0;
         task->state = TASK_DEAD;
     }
 }
 
 struct task *task_get_current(void)
 {
-    return current_task;
+    return smp_this_cpu()->current;
 }
 
 void task_set_current(struct task *task)
 {
-    current_task = task;
-    if (task) task->state = TASK_RUNNING;
+    struct cpu *cpu = smp_this_cpu();
+    if (cpu->current != task) scheduler_put_prev(cpu->current);
+    sched_trace_switch(cpu->current, task);
+    cpu->current = task;
+    if (task) {
+        scheduler_dequeue(task);
+        task->state = TASK_RUNNING;
+    }
 }
 
 void task_yield(void)
@@ -94,9 +153,12 @@ void task_yield(void)
 
 void task_sleep(uint32_t ms)
 {
-    (void)ms;
-    if (current_task) {
-        current_task->state = TASK_BLOCKED;
+    struct task *current = task_get_current();
+    if (current) {
+        scheduler_dequeue(current);
+        current->state = TASK_BLOCKED;
+        sched_trace_block(current);
+        hrtimer_start(&current->sleep_timer, clock_now_ns() + (uint64_t)ms * 1000000);
     }
 }
 
@@ -112,3 +174,13 @@ struct task *task_get(int index)
     }
     return NULL;
 }
+
+struct task *task_find(uint32_t id)
+{
+    for (int i = 0; i < task_count; i++) {
+        if (task_list[i].id == id && task_list[i].state != TASK_DEAD) {
+            return &task_list[i];
+        }
+    }
+    return NULL;
+}
@@ -1,124 +1,550 @@
 #include "../../include/kernel/thread.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/scheduler.h"
+#include "../../include/kernel/sync.h"
+#include "../../include/kernel/rcu.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/clock.h"
+#include "../../include/kernel/clockevent.h"
 #include "../../include/kernel/serial.h"
 #include "../../include/kernel/heap.h"
+#include "../../include/kernel/slab.h"
 #include <string.h>
 
+/*
+ * Kernel threads.
+ *
+ * Each CPU runs one thread at a time (cpu->thread) and keeps its ready
+ * threads in priority order, FIFO among equals; a thread stays on the
+ * CPU that created it unless thread_set_affinity() moves it.  Switching
+ * is cooperative: a thread gives up the CPU when it yields, parks or
+ * exits.  Whatever was running when a CPU came up (kernel_main on the
+ * BSP, the idle loop on an AP) is adopted as that CPU's boot thread, and
+ * a per-CPU idle thread runs when every other thread is blocked.
+ *
+ * thread_lock covers the thread table, ready queues and thread states.
+ * It is held across thread_switch() and dropped by whichever thread
+ * resumes on the other side.
+ */
+
 /* Global thread table */
 static struct thread *thread_table[256];
 static uint32_t next_thread_id = 1;
+static kmem_cache_t *thread_cache = NULL;
+static spinlock_t thread_lock = SPINLOCK_INIT;
 
-/* Initialize thread subsystem */
-void thread_init(void)
+/* Per-CPU boot and idle threads, static so APs never allocate */
+static struct thread boot_threads[SMP_MAX_CPUS];
+static struct thread idle_threads[SMP_MAX_CPUS];
+static uint8_t idle_stacks[SMP_MAX_CPUS][THREAD_STACK_SIZE] __attribute__((aligned(16)));
+
+/* context.s */
+extern void thread_switch(struct registers *save, struct registers *load);
+
+static void thread_timeout(void *arg);
+static void thread_idle_loop(void *arg);
+
+/* Queue behind every ready thread of equal or higher priority */
+static void ready_push(struct cpu *cpu, struct thread *thread)
 {
-    memset(thread_table, 0, sizeof(thread_table));
-    serial_puts("[thread] Thread manager initialized\n");
+    struct thread *prev = NULL;
+    struct thread *pos = cpu->thread_head;
+    if (cpu->thread_tail && cpu->thread_tail->priority >= thread->priority) {
+        prev = cpu->thread_tail;
+        pos = NULL;
+    }
+    while (pos && pos->priority >= thread->priority) {
+        prev = pos;
+        pos = pos->next;
+    }
+    
+    thread->next = pos;
+    if (prev) {
+        prev->next = thread;
+    } else {
+        cpu->thread_head = thread;
+    }
+    if (!pos) cpu->thread_tail = thread;
 }
 
-/* Create a new thread within a task */
-int thread_create(struct task *task, void (*entry)(void *), void *arg)
+static void ready_remove(struct cpu *cpu, struct thread *thread)
 {
-    if (!task || !entry) return -1;
+    struct thread *prev = NULL;
+    for (struct thread *pos = cpu->thread_head; pos; prev = pos, pos = pos->next) {
+        if (pos != thread) continue;
+        if (prev) {
+            prev->next = thread->next;
+        } else {
+            cpu->thread_head = thread->next;
+        }
+        if (cpu->thread_tail == thread) cpu->thread_tail = prev;
+        thread->next = NULL;
+        return;
+    }
+}
+
+static struct thread *ready_pop(struct cpu *cpu)
+{
+    struct thread *thread = cpu->thread_head;
+    if (thread) {
+        cpu->thread_head = thread->next;
+        if (!cpu->thread_head) cpu->thread_tail = NULL;
+        thread->next = NULL;
+    }
+    return thread;
+}
+
+static void make_ready(struct thread *thread)
+{
+    struct cpu *cpu = smp_cpu(thread->cpu);
+    thread->state = THREAD_READY;
+    ready_push(cpu, thread);
+    
+    /* 'halted' is set under thread_lock, so a CPU about to halt is seen */
+    if (cpu->halted) smp_kick(thread->cpu);
+}
 
-    /* Find free thread slot */
-    int thread_idx = -1;
+/*
+ * Switch to the next ready thread, or the idle thread if there is none.
+ * thread_lock is held and the caller has already requeued or blocked the
+ * current thread; returns when it is next switched back in.
+ */
+static void schedule(struct cpu *cpu)
+{
+    rcu_note_qs();
+    
+    struct thread *prev = cpu->thread;
+    struct thread *next = ready_pop(cpu);
+    if (!next) next = cpu->idle_thread;
+    
+    next->state = THREAD_RUNNING;
+    if (next == prev) return;
+    
+    cpu->thread = next;
+    cpu->thread_switches++;
+    thread_switch(&prev->regs, &next->regs);
+}
+
+/* First code of every new thread: finish the switch that started it */
+static void thread_start(void)
+{
+    struct thread *self = smp_this_cpu()->thread;
+    spin_unlock(&thread_lock);
+    __asm__ volatile("sti");
+    
+    self->entry_point(self->arg);
+    thread_exit(0);
+}
+
+/* Prepare a thread's registers to enter thread_start() on its own stack */
+static void thread_setup_stack(struct thread *thread)
+{
+    uint32_t *sp = (uint32_t *)(thread->stack_base + thread->stack_size - 4);
+    *sp = 0;                                /* Return address of thread_start */
+    thread->regs.esp = (uint32_t)sp;
+    thread->regs.ebp = 0;
+    thread->regs.eip = (uint32_t)thread_start;
+    thread->regs.eflags = 0x002;            /* IF clear until thread_start */
+}
+
+static int table_insert(struct thread *thread)
+{
     for (int i = 0; i < 256; i++) {
         if (!thread_table[i]) {
-            thread_idx = i;
-            break;
+            thread->id = next_thread_id++;
+            thread->tls.thread_id = thread->id;
+            thread_table[i] = thread;
+            return 0;
         }
     }
+    return -1;
+}
 
-    if (thread_idx < 0) {
-        serial_puts("[thread] Thread table full\n");
-        return -1;
+static void table_remove(struct thread *thread)
+{
+    for (int i = 0; i < 256; i++) {
+        if (thread_table[i] == thread) {
+            thread_table[i] = NULL;
+            return;
+        }
     }
+}
+
+/* Boot and idle threads for the calling CPU */
+static void thread_cpu_setup(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    struct thread *boot = &boot_threads[cpu->index];
+    struct thread *idle = &idle_threads[cpu->index];
+    
+    memset(boot, 0, sizeof(*boot));
+    boot->state = THREAD_RUNNING;
+    boot->cpu = (int)cpu->index;
+    boot->cpus_allowed = 1u << cpu->index;
+    boot->refcount = 1;
+    boot->base_priority = THREAD_DEFAULT_PRIORITY;
+    boot->priority = THREAD_DEFAULT_PRIORITY;
+    hrtimer_init(&boot->wait_timer, thread_timeout, boot);
+    
+    memset(idle, 0, sizeof(*idle));
+    idle->state = THREAD_READY;
+    idle->cpu = (int)cpu->index;
+    idle->cpus_allowed = 1u << cpu->index;
+    idle->entry_point = thread_idle_loop;
+    idle->base_priority = 0;
+    idle->priority = 0;
+    idle->stack = (uint32_t *)idle_stacks[cpu->index];
+    idle->stack_base = (uint32_t)idle->stack;
+    idle->stack_size = THREAD_STACK_SIZE;
+    thread_setup_stack(idle);
+    
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    table_insert(boot);
+    cpu->thread_head = NULL;
+    cpu->thread_tail = NULL;
+    cpu->idle_thread = idle;
+    cpu->thread = boot;
+    spin_unlock_irqrestore(&thread_lock, flags);
+}
+
+/* Initialize thread subsystem */
+void thread_init(void)
+{
+    memset(thread_table, 0, sizeof(thread_table));
+    thread_cache = kmem_cache_create("thread", sizeof(struct thread), 0, NULL);
+    
+    /* The BSP's boot thread is the kernel's main thread, id 1 */
+    thread_cpu_setup();
+    serial_puts("[thread] Thread manager initialized\n");
+}
 
+void thread_cpu_init(void)
+{
+    thread_cpu_setup();
+}
+
+/* Create a thread on this CPU; task_id 0 is a kernel thread */
+static int thread_spawn(uint32_t task_id, int priority, void (*entry)(void *), void *arg)
+{
     /* Allocate thread control block */
-    struct thread *thread = (struct thread *)kmalloc(sizeof(struct thread));
+    struct thread *thread = (struct thread *)kmem_cache_alloc(thread_cache);
     if (!thread) return -1;
 
     memset(thread, 0, sizeof(struct thread));
 
     /* Initialize thread structure */
-    thread->id = next_thread_id++;
-    thread->task_id = task->id;
+    thread->task_id = task_id;
     thread->state = THREAD_READY;
     thread->entry_point = entry;
     thread->arg = arg;
     thread->refcount = 1;
+    thread->cpu = (int)smp_this_cpu()->index;
+    thread->cpus_allowed = SCHED_CPUMASK_ALL;
+    thread->base_priority = priority;
+    if (thread->base_priority < 0) thread->base_priority = 0;
+    if (thread->base_priority > THREAD_PRIO_MAX) thread->base_priority = THREAD_PRIO_MAX;
+    thread->priority = thread->base_priority;
+    hrtimer_init(&thread->wait_timer, thread_timeout, thread);
 
     /* Allocate stack */
     thread->stack_size = THREAD_STACK_SIZE;
     thread->stack = (uint32_t *)kmalloc(THREAD_STACK_SIZE);
     if (!thread->stack) {
-        kfree(thread);
+        kmem_cache_free(thread_cache, thread);
         return -1;
     }
 
     thread->stack_base = (uint32_t)thread->stack;
-
-    /* Initialize stack pointer to top of stack (grows downward) */
-    uint32_t *sp = (uint32_t *)(thread->stack_base + THREAD_STACK_SIZE - 4);
-    
-    /* Set up initial stack frame */
-    *sp = (uint32_t)arg;                    /* arg parameter */
-    thread->regs.esp = (uint32_t)(sp);
-    thread->regs.eip = (uint32_t)entry;
-    thread->regs.ebp = thread->regs.esp;
-    thread->regs.eflags = 0x202;            /* IF flag enabled, IOPL=0 */
+    thread_setup_stack(thread);
 
     /* Initialize TLS */
-    thread->tls.thread_id = thread->id;
     thread->tls.errno_val = 0;
 
-    /* Register thread */
-    thread_table[thread_idx] = thread;
+    /* Register thread and queue it on this CPU */
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    if (table_insert(thread) != 0) {
+        spin_unlock_irqrestore(&thread_lock, flags);
+        serial_puts("[thread] Thread table full\n");
+        kfree(thread->stack);
+        kmem_cache_free(thread_cache, thread);
+        return -1;
+    }
+    make_ready(thread);
+    spin_unlock_irqrestore(&thread_lock, flags);
 
-    serial_printf("[thread] Created thread %d for task %d\n", thread->id, task->id);
+    serial_printf("[thread] Created thread %d for task %d\n", thread->id, task_id);
     return thread->id;
 }
 
-/* Join a thread (wait for it to exit) */
+/* Create a new thread within a task */
+int thread_create(struct task *task, void (*entry)(void *), void *arg)
+{
+    if (!task || !entry) return -1;
+    return thread_spawn(task->id, task->priority, entry, arg);
+}
+
+int kthread_create(void (*entry)(void *), void *arg, int priority)
+{
+    if (!entry) return -1;
+    return thread_spawn(0, priority, entry, arg);
+}
+
+/* Block the current thread; thread_lock held.  Returns once woken. */
+static void park_locked(struct cpu *cpu, uint32_t timeout_us)
+{
+    struct thread *self = cpu->thread;
+    self->state = THREAD_BLOCKED;
+    self->timed_out = 0;
+    if (timeout_us) {
+        hrtimer_start(&self->wait_timer, clock_now_ns() + (uint64_t)timeout_us * 1000);
+    }
+    schedule(cpu);
+}
+
+static void thread_timeout(void *arg)
+{
+    struct thread *thread = (struct thread *)arg;
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    if (thread->state == THREAD_BLOCKED) {
+        thread->timed_out = 1;
+        make_ready(thread);
+    }
+    spin_unlock_irqrestore(&thread_lock, flags);
+}
+
+int thread_park(spinlock_t *held, uint32_t flags, uint32_t timeout_us)
+{
+    struct cpu *cpu = smp_this_cpu();
+    struct thread *self = cpu->thread;
+    
+    spin_lock(&thread_lock);
+    if (held) spin_unlock(held);
+    park_locked(cpu, timeout_us);
+    int timed_out = self->timed_out;
+    spin_unlock(&thread_lock);
+    
+    if (timeout_us) hrtimer_cancel(&self->wait_timer);
+    irq_restore(flags);
+    return timed_out ? -1 : 0;
+}
+
+int thread_unpark(struct thread *thread)
+{
+    if (!thread) return -1;
+    
+    int woken = 0;
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    if (thread->state == THREAD_BLOCKED) {
+        make_ready(thread);
+        woken = 1;
+    }
+    spin_unlock_irqrestore(&thread_lock, flags);
+    return woken ? 0 : -1;
+}
+
+void thread_yield(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    if (cpu->thread_head) {
+        if (cpu->thread != cpu->idle_thread) make_ready(cpu->thread);
+        schedule(cpu);
+    }
+    spin_unlock_irqrestore(&thread_lock, flags);
+}
+
+/*
+ * Halt until the next interrupt.  The clock event layer decides how far
+ * off that is: the next tick while there is work about, otherwise the
+ * next timer (tickless idle).  An AP without a timer of its own could
+ * halt forever, so it polls its ready queue instead.
+ */
+void thread_idle(void)
+{
+    struct cpu *cpu = smp_this_cpu();
+    rcu_note_qs();
+    
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    if (cpu->thread_head) {
+        if (cpu->thread != cpu->idle_thread) make_ready(cpu->thread);
+        schedule(cpu);
+        spin_unlock_irqrestore(&thread_lock, flags);
+        return;
+    }
+    cpu->halted = 1;
+    spin_unlock(&thread_lock);
+    __sync_synchronize();
+    
+    if (cpu->work || !clockevent_can_halt()) {
+        cpu->halted = 0;
+        __sync_synchronize();
+        irq_restore(flags);
+        __asm__ volatile("pause");
+        return;
+    }
+    
+    clockevent_idle_enter();
+    cpu->idle_halts++;
+    /* sti takes effect after hlt starts, so no wakeup slips between */
+    __asm__ volatile("sti; hlt; cli" : : : "memory");
+    cpu->halted = 0;
+    __sync_synchronize();
+    clockevent_idle_exit();
+    irq_restore(flags);
+}
+
+static void thread_idle_loop(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        thread_idle();
+    }
+}
+
+/* Join a thread (wait for it to exit) and release it */
 int thread_join(int thread_id, int *exit_code)
 {
+    struct cpu *cpu = smp_this_cpu();
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    
     struct thread *thread = thread_get(thread_id);
-    if (!thread) return -1;
+    struct thread *self = cpu->thread;
+    if (!thread || !self || thread == self || !thread->stack ||
+        (thread->join_waiter_id && thread->join_waiter_id != self->id)) {
+        spin_unlock_irqrestore(&thread_lock, flags);
+        return -1;
+    }
 
-    /* Wait for thread to exit */
+    /* Woken by thread_exit() */
     while (thread->state != THREAD_EXITED) {
-        /* Busy wait - in production would use condition variables */
-        for (volatile int i = 0; i < 100000; i++);
+        thread->join_waiter_id = self->id;
+        park_locked(cpu, 0);
     }
 
     if (exit_code) {
         *exit_code = thread->exit_code;
     }
+    table_remove(thread);
+    spin_unlock_irqrestore(&thread_lock, flags);
 
+    kfree(thread->stack);
+    kmem_cache_free(thread_cache, thread);
     return 0;
 }
 
 /* Exit current thread */
 int thread_exit(int exit_code)
 {
-    int thread_id = thread_self();
-    struct thread *thread = thread_get(thread_id);
+    struct cpu *cpu = smp_this_cpu();
+    struct thread *thread = cpu->thread;
     
-    if (!thread) return -1;
+    /* A CPU's boot thread is the code that brought it up and cannot exit */
+    if (!thread || thread == &boot_threads[cpu->index]) return -1;
+
+    serial_printf("[thread] Thread %d exited with code %d\n", thread->id, exit_code);
 
+    irq_save();
+    spin_lock(&thread_lock);
     thread->exit_code = exit_code;
     thread->state = THREAD_EXITED;
+    if (thread->join_waiter_id) {
+        struct thread *waiter = thread_get((int)thread->join_waiter_id);
+        if (waiter && waiter->state == THREAD_BLOCKED) make_ready(waiter);
+    }
+    schedule(cpu);
 
-    serial_printf("[thread] Thread %d exited with code %d\n", thread->id, exit_code);
+    /* Not reached: nothing switches back to an exited thread */
+    for (;;) __asm__ volatile("hlt");
+}
+
+struct thread *thread_current(void)
+{
+    return smp_this_cpu()->thread;
+}
 
+int thread_set_priority(struct thread *thread, int priority)
+{
+    if (!thread || priority < 0 || priority > THREAD_PRIO_MAX) return -1;
+    
+    thread->base_priority = priority;
+    mutex_pi_update(thread);
+    return 0;
+}
+
+void thread_set_effective_priority(struct thread *thread, int priority)
+{
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    if (thread->priority != priority) {
+        thread->priority = priority;
+        if (thread->state == THREAD_READY && thread != smp_cpu(thread->cpu)->idle_thread) {
+            struct cpu *cpu = smp_cpu(thread->cpu);
+            ready_remove(cpu, thread);
+            ready_push(cpu, thread);
+        }
+    }
+    spin_unlock_irqrestore(&thread_lock, flags);
+}
+
+/*
+ * Restrict a thread to the CPUs in 'mask'.  If its CPU is excluded it
+ * moves to an allowed one, preferring a CPU with nothing ready: a ready
+ * thread is requeued there, the caller itself switches over right away,
+ * and a blocked thread is woken there later.
+ */
+int thread_set_affinity(struct thread *thread, uint32_t mask)
+{
+    if (!thread) return -1;
+    
+    uint32_t online = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (smp_cpu(i)->online) online |= 1u << i;
+    }
+    mask &= online;
+    if (!mask) return -1;
+    
+    uint32_t flags = spin_lock_irqsave(&thread_lock);
+    struct cpu *old = smp_cpu(thread->cpu);
+    if (thread == &boot_threads[thread->cpu] || thread == old->idle_thread) {
+        spin_unlock_irqrestore(&thread_lock, flags);
+        return -1;
+    }
+    thread->cpus_allowed = mask;
+    if (mask & (1u << thread->cpu)) {
+        spin_unlock_irqrestore(&thread_lock, flags);
+        return 0;
+    }
+    
+    int target = -1;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (!(mask & (1u << i))) continue;
+        if (target < 0) target = i;
+        if (!smp_cpu(i)->thread_head) {
+            target = i;
+            break;
+        }
+    }
+    
+    if (thread->state == THREAD_READY) {
+        ready_remove(old, thread);
+        thread->cpu = target;
+        make_ready(thread);
+    } else if (thread == old->thread && old == smp_this_cpu()) {
+        thread->cpu = target;
+        make_ready(thread);
+        schedule(old);
+    } else {
+        thread->cpu = target;
+    }
+    spin_unlock_irqrestore(&thread_lock, flags);
     return 0;
 }
 
 /* Get current thread ID */
 int thread_self(void)
 {
-    /* In a full implementation, this would read from FS segment
-     * For now, return 1 (main thread ID) */
-    return 1;
+    /* Before thread_init() only the kernel's main thread exists */
+    struct thread *thread = smp_this_cpu()->thread;
+    return thread ? (int)thread->id : 1;
 }
 
 /* Get thread by ID */
@@ -139,22 +565,29 @@ struct thread *thread_get(int thread_id)
     return NULL;
 }
 
-/* Sleep thread for milliseconds */
-void thread_sleep_ms(uint32_t ms)
+/* Sleep for microseconds, parked on an hrtimer */
+void thread_sleep_us(uint32_t us)
 {
-    struct thread *thread = thread_get(thread_self());
-    if (!thread) return;
+    if (!smp_this_cpu()->thread || us == 0) return;
 
-    thread->state = THREAD_BLOCKED;
-    
-    /* Convert ms to timer ticks and block */
-    (void)((ms + 9) / 10);  /* ticks - used for future timer-based sleep */
-    
-    /* Busy sleep - in production would use timer */
-    uint32_t iterations = ms * 1000;
-    for (volatile uint32_t i = 0; i < iterations; i++);
+    uint64_t wake = clock_now_ns() + (uint64_t)us * 1000;
 
-    thread->state = THREAD_READY;
+    /* A stray thread_unpark() only cuts one park short */
+    for (;;) {
+        uint64_t now = clock_now_ns();
+        if (now >= wake) break;
+        uint32_t left = (uint32_t)clock_div64(wake - now + 999, 1000);
+        thread_park(NULL, irq_save(), left);
+    }
+}
+
+void thread_sleep_ms(uint32_t ms)
+{
+    while (ms > 1000) {
+        thread_sleep_us(1000000);
+        ms -= 1000;
+    }
+    thread_sleep_us(ms * 1000);
 }
 
 /* Get thread-local storage value */
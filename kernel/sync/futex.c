@@ -1,138 +1,268 @@
 #include "../../include/kernel/futex.h"
 #include "../../include/kernel/serial.h"
 #include "../../include/kernel/thread.h"
+#include "../../include/kernel/task.h"
+#include "../../include/kernel/paging.h"
+#include "../../include/kernel/clock.h"
 #include <stddef.h>
 #include <string.h>
 
-#define MAX_FUTEX_WAITERS 256
-#define MAX_FUTEX_QUEUES 64
+/*
+ * Futex wait queues.
+ *
+ * Waiters are hashed by key into FUTEX_HASH_SIZE buckets, each a FIFO
+ * under its own lock, so wait and wake touch one short chain.  A waiter
+ * lives on the sleeping thread's stack and blocks in thread_park(); the
+ * bucket lock is held from the value check until the thread is marked
+ * blocked, so a wake between the two cannot be lost.  futex_requeue()
+ * moves waiters between chains without waking them.
+ */
 
-struct futex_queue {
-    uint32_t *address;
-    uint32_t waiter_count;
-    uint32_t waiter_ids[MAX_FUTEX_WAITERS];
+#define FUTEX_HASH_BITS 7
+#define FUTEX_HASH_SIZE (1 << FUTEX_HASH_BITS)
+#define FUTEX_KEY_SHARED 0xFFFFFFFFu    /* Key space of physical addresses */
+
+struct futex_key {
+    uint32_t space;                     /* Task id, or FUTEX_KEY_SHARED */
+    uint32_t addr;
+};
+
+struct futex_bucket;
+
+struct futex_waiter {
+    struct futex_key key;
+    struct thread *thread;
+    struct futex_bucket *bucket;        /* Changes only under both bucket locks */
+    struct futex_waiter *next;
+    struct futex_waiter *prev;
+    volatile int woken;
 };
 
-static struct futex_queue futex_queues[MAX_FUTEX_QUEUES];
-static int queue_count = 0;
+struct futex_bucket {
+    spinlock_t lock;
+    struct futex_waiter *head;
+    struct futex_waiter *tail;
+};
+
+static struct futex_bucket futex_hash[FUTEX_HASH_SIZE];
+static struct futex_stats futex_stats;
 
-static struct futex_queue *futex_find_queue(uint32_t *addr)
+static int futex_make_key(uint32_t *addr, uint32_t flags, struct futex_key *key)
 {
-    for (int i = 0; i < queue_count; i++) {
-        if (futex_queues[i].address == addr) {
-            return &futex_queues[i];
-        }
+    if (!addr || ((uint32_t)addr & 3)) return -1;
+    
+    /* Kernel threads of a task share its address space */
+    struct thread *thread = thread_current();
+    struct task *task = task_get_current();
+    uint32_t space = (thread && thread->task_id) ? thread->task_id : (task ? task->id : 0);
+    
+    if (flags & FUTEX_SHARED) {
+        key->space = FUTEX_KEY_SHARED;
+        key->addr = paging_virt_to_phys(space, (uint32_t)addr);
+        if (!key->addr) return -1;
+    } else {
+        key->space = space;
+        key->addr = (uint32_t)addr;
     }
-    return NULL;
+    return 0;
+}
+
+static inline int key_equal(const struct futex_key *a, const struct futex_key *b)
+{
+    return a->space == b->space && a->addr == b->addr;
+}
+
+static struct futex_bucket *futex_bucket(const struct futex_key *key)
+{
+    uint32_t hash = (key->addr >> 2) ^ (key->space * 0x9E3779B1u);
+    return &futex_hash[(hash * 2654435761u) >> (32 - FUTEX_HASH_BITS)];
 }
 
-static struct futex_queue *futex_create_queue(uint32_t *addr)
+static void bucket_append(struct futex_bucket *bucket, struct futex_waiter *waiter)
 {
-    if (queue_count >= MAX_FUTEX_QUEUES) {
-        return NULL;
+    waiter->bucket = bucket;
+    waiter->next = NULL;
+    waiter->prev = bucket->tail;
+    if (bucket->tail) {
+        bucket->tail->next = waiter;
+    } else {
+        bucket->head = waiter;
     }
-    
-    struct futex_queue *queue = &futex_queues[queue_count++];
-    queue->address = addr;
-    queue->waiter_count = 0;
-    return queue;
+    bucket->tail = waiter;
 }
 
-int futex_wait(uint32_t *futex_addr, uint32_t expected_val, uint32_t timeout_ms)
+static void bucket_remove(struct futex_bucket *bucket, struct futex_waiter *waiter)
 {
-    if (!futex_addr) return FUTEX_INVAL;
-    
-    /* Check value hasn't changed */
-    if (*futex_addr != expected_val) {
-        return FUTEX_INVAL;
+    if (waiter->prev) {
+        waiter->prev->next = waiter->next;
+    } else {
+        bucket->head = waiter->next;
     }
-    
-    struct futex_queue *queue = futex_find_queue(futex_addr);
-    if (!queue) {
-        queue = futex_create_queue(futex_addr);
-        if (!queue) return FUTEX_INVAL;
+    if (waiter->next) {
+        waiter->next->prev = waiter->prev;
+    } else {
+        bucket->tail = waiter->prev;
     }
-    
-    /* Add this thread to queue */
-    if (queue->waiter_count >= MAX_FUTEX_WAITERS) {
-        return FUTEX_INVAL;
+    waiter->next = NULL;
+    waiter->prev = NULL;
+}
+
+/* Unlink and wake a waiter; its bucket lock is held */
+static void futex_wake_waiter(struct futex_bucket *bucket, struct futex_waiter *waiter)
+{
+    struct thread *thread = waiter->thread;
+    bucket_remove(bucket, waiter);
+    waiter->woken = 1;
+    thread_unpark(thread);
+    futex_stats.wakeups++;
+}
+
+/* Lock the bucket a waiter is on, following it if it is requeued meanwhile */
+static struct futex_bucket *lock_waiter_bucket(struct futex_waiter *waiter)
+{
+    for (;;) {
+        struct futex_bucket *bucket = waiter->bucket;
+        spin_lock(&bucket->lock);
+        if (waiter->bucket == bucket) return bucket;
+        spin_unlock(&bucket->lock);
     }
-    
-    int thread_id = thread_self();
-    queue->waiter_ids[queue->waiter_count++] = thread_id;
-    
-    /* Sleep until woken or timeout */
-    if (timeout_ms > 0) {
-        thread_sleep_ms(timeout_ms);
-        return FUTEX_TIMEOUT;
+}
+
+/* Take two bucket locks in address order */
+static void lock_pair(struct futex_bucket *a, struct futex_bucket *b)
+{
+    if (a == b) {
+        spin_lock(&a->lock);
+    } else if (a < b) {
+        spin_lock(&a->lock);
+        spin_lock(&b->lock);
     } else {
-        /* Infinite wait */
-        thread_sleep_ms(10);
-        return FUTEX_OK;
+        spin_lock(&b->lock);
+        spin_lock(&a->lock);
     }
 }
 
-int futex_wake(uint32_t *futex_addr, uint32_t num_waiters)
+static void unlock_pair(struct futex_bucket *a, struct futex_bucket *b)
 {
-    if (!futex_addr) return FUTEX_INVAL;
+    spin_unlock(&a->lock);
+    if (a != b) spin_unlock(&b->lock);
+}
+
+int futex_wait(uint32_t *futex_addr, uint32_t expected_val, uint32_t timeout_us, uint32_t flags)
+{
+    struct futex_waiter waiter;
+    struct thread *self = thread_current();
+    if (!self || futex_make_key(futex_addr, flags, &waiter.key) != 0) return FUTEX_INVAL;
     
-    struct futex_queue *queue = futex_find_queue(futex_addr);
-    if (!queue || queue->waiter_count == 0) {
-        return 0;
+    struct futex_bucket *bucket = futex_bucket(&waiter.key);
+    uint32_t irq_flags = spin_lock_irqsave(&bucket->lock);
+    
+    /* Check value hasn't changed */
+    if (*(volatile uint32_t *)futex_addr != expected_val) {
+        futex_stats.value_changed++;
+        spin_unlock_irqrestore(&bucket->lock, irq_flags);
+        return FUTEX_AGAIN;
     }
     
-    /* Wake up to num_waiters threads */
-    uint32_t woken = 0;
-    uint32_t to_wake = (num_waiters > queue->waiter_count) ? queue->waiter_count : num_waiters;
+    waiter.thread = self;
+    waiter.woken = 0;
+    bucket_append(bucket, &waiter);
+    futex_stats.waits++;
     
-    for (uint32_t i = 0; i < to_wake; i++) {
-        /* Thread with ID queue->waiter_ids[i] should be woken */
-        woken++;
-    }
+    uint64_t deadline = timeout_us ? clock_now_ns() + (uint64_t)timeout_us * 1000 : 0;
     
-    /* Remove woken threads from queue */
-    if (woken == queue->waiter_count) {
-        queue->waiter_count = 0;
-    } else {
-        /* Shift remaining waiters */
-        for (uint32_t i = woken; i < queue->waiter_count; i++) {
-            queue->waiter_ids[i - woken] = queue->waiter_ids[i];
+    for (;;) {
+        uint32_t left = 0;
+        if (timeout_us) {
+            uint64_t now = clock_now_ns();
+            left = now < deadline ? (uint32_t)clock_div64(deadline - now + 999, 1000) : 1;
+        }
+        int timed_out = thread_park(&bucket->lock, irq_flags, left) != 0;
+        if (waiter.woken) return FUTEX_OK;
+        
+        irq_flags = irq_save();
+        bucket = lock_waiter_bucket(&waiter);
+        if (waiter.woken) {
+            spin_unlock_irqrestore(&bucket->lock, irq_flags);
+            return FUTEX_OK;
         }
-        queue->waiter_count -= woken;
+        if (timed_out) {
+            bucket_remove(bucket, &waiter);
+            futex_stats.timeouts++;
+            spin_unlock_irqrestore(&bucket->lock, irq_flags);
+            return FUTEX_TIMEOUT;
+        }
+        /* Unparked by someone else: still queued, wait again */
     }
-    
-    return woken;
 }
 
-int futex_requeue(uint32_t *futex_addr1, uint32_t *futex_addr2, uint32_t num_wake, uint32_t num_requeue)
+int futex_wake(uint32_t *futex_addr, uint32_t num_waiters, uint32_t flags)
 {
-    if (!futex_addr1 || !futex_addr2) return FUTEX_INVAL;
+    struct futex_key key;
+    if (futex_make_key(futex_addr, flags, &key) != 0) return FUTEX_INVAL;
     
-    struct futex_queue *queue1 = futex_find_queue(futex_addr1);
-    if (!queue1) return 0;
+    struct futex_bucket *bucket = futex_bucket(&key);
+    uint32_t irq_flags = spin_lock_irqsave(&bucket->lock);
     
-    /* Wake first num_wake waiters from queue1 */
-    uint32_t woken = futex_wake(futex_addr1, num_wake);
+    int woken = 0;
+    struct futex_waiter *waiter = bucket->head;
+    while (waiter && (uint32_t)woken < num_waiters) {
+        struct futex_waiter *next = waiter->next;
+        if (key_equal(&waiter->key, &key)) {
+            futex_wake_waiter(bucket, waiter);
+            woken++;
+        }
+        waiter = next;
+    }
     
-    /* Move num_requeue waiters from queue1 to queue2 */
-    struct futex_queue *queue2 = futex_find_queue(futex_addr2);
-    if (!queue2) {
-        queue2 = futex_create_queue(futex_addr2);
-        if (!queue2) return woken;
+    spin_unlock_irqrestore(&bucket->lock, irq_flags);
+    return woken;
+}
+
+int futex_requeue(uint32_t *futex_addr1, uint32_t *futex_addr2, uint32_t num_wake,
+                  uint32_t num_requeue, uint32_t flags)
+{
+    struct futex_key key1, key2;
+    if (futex_make_key(futex_addr1, flags, &key1) != 0 ||
+        futex_make_key(futex_addr2, flags, &key2) != 0) {
+        return FUTEX_INVAL;
     }
     
-    uint32_t to_move = (num_requeue > queue1->waiter_count) ? queue1->waiter_count : num_requeue;
+    /* Requeueing onto the same futex changes nothing; moving would revisit */
+    if (key_equal(&key1, &key2)) num_requeue = 0;
     
-    /* Move waiters */
-    for (uint32_t i = 0; i < to_move && queue2->waiter_count < MAX_FUTEX_WAITERS; i++) {
-        queue2->waiter_ids[queue2->waiter_count++] = queue1->waiter_ids[i];
-    }
+    struct futex_bucket *bucket1 = futex_bucket(&key1);
+    struct futex_bucket *bucket2 = futex_bucket(&key2);
+    uint32_t irq_flags = irq_save();
+    lock_pair(bucket1, bucket2);
     
-    /* Remove moved waiters from queue1 */
-    for (uint32_t i = to_move; i < queue1->waiter_count; i++) {
-        queue1->waiter_ids[i - to_move] = queue1->waiter_ids[i];
+    /* Wake the first num_wake, then move the next num_requeue still asleep */
+    int woken = 0;
+    uint32_t moved = 0;
+    struct futex_waiter *waiter = bucket1->head;
+    while (waiter && ((uint32_t)woken < num_wake || moved < num_requeue)) {
+        struct futex_waiter *next = waiter->next;
+        if (key_equal(&waiter->key, &key1)) {
+            if ((uint32_t)woken < num_wake) {
+                futex_wake_waiter(bucket1, waiter);
+                woken++;
+            } else {
+                bucket_remove(bucket1, waiter);
+                waiter->key = key2;
+                bucket_append(bucket2, waiter);
+                moved++;
+            }
+        }
+        waiter = next;
     }
-    queue1->waiter_count -= to_move;
+    futex_stats.requeued += moved;
     
+    unlock_pair(bucket1, bucket2);
+    irq_restore(irq_flags);
     return woken;
 }
+
+void futex_get_stats(struct futex_stats *stats)
+{
+    if (stats) *stats = futex_stats;
+}
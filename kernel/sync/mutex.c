@@ -1,56 +1,132 @@
 #include "../../include/kernel/sync.h"
 #include "../../include/kernel/thread.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/smp.h"
 #include "../../include/kernel/serial.h"
 #include <string.h>
 
-/* Priority inheritance: track original priority when boosting */
-struct priority_entry {
-    uint32_t thread_id;
-    uint32_t original_priority;
-    uint32_t boosted_priority;
+/*
+ * Mutexes.
+ *
+ * The lock word holds the owner's thread id, so uncontended lock and
+ * unlock are one compare-and-swap each.  A contended locker spins for a
+ * while if the owner is running on another CPU, as it is likely to let
+ * go soon; otherwise it queues on the mutex by priority and parks.  A
+ * queued waiter sets MUTEX_WAITERS in the word, which sends the owner's
+ * unlock down the slow path to hand the mutex to the first waiter.
+ *
+ * Priority inheritance: a thread runs at the highest of its base
+ * priority and the top waiter priority of every mutex it holds.  When a
+ * thread blocks, the boost is pushed along the chain owner -> mutex that
+ * owner is blocked on -> its owner, and so on.  Wait queues, held lists
+ * and chains all change under the single pi_lock; fast paths never take
+ * it.
+ */
+
+#define MUTEX_SPIN_LIMIT 1000       /* pause iterations before parking */
+#define MUTEX_PI_MAX_DEPTH 16       /* Longer chains are treated as a deadlock */
+
+struct mutex_waiter {
+    struct thread *thread;
+    struct mutex_waiter *next;
+    volatile int acquired;          /* Set by the unlocker when it hands over */
 };
 
-static struct priority_entry priority_table[256];
-static int priority_table_count = 0;
+static spinlock_t pi_lock = SPINLOCK_INIT;
 
-static void priority_boost(uint32_t thread_id, uint32_t new_priority)
+static inline uint32_t owner_id(uint32_t word)
 {
-    /* Find or create priority entry */
-    for (int i = 0; i < priority_table_count; i++) {
-        if (priority_table[i].thread_id == thread_id) {
-            priority_table[i].boosted_priority = new_priority;
-            return;
-        }
+    return word & ~MUTEX_WAITERS;
+}
+
+/* Highest priority first, FIFO among equals */
+static void waiter_insert(mutex_t *mutex, struct mutex_waiter *waiter)
+{
+    struct mutex_waiter **link = &mutex->waiters;
+    while (*link && (*link)->thread->priority >= waiter->thread->priority) {
+        link = &(*link)->next;
     }
-    
-    if (priority_table_count < 256) {
-        priority_table[priority_table_count].thread_id = thread_id;
-        priority_table[priority_table_count].original_priority = thread_id % 4;  /* Simplified */
-        priority_table[priority_table_count].boosted_priority = new_priority;
-        priority_table_count++;
+    waiter->next = *link;
+    *link = waiter;
+}
+
+static struct mutex_waiter *waiter_remove(mutex_t *mutex, struct thread *thread)
+{
+    for (struct mutex_waiter **link = &mutex->waiters; *link; link = &(*link)->next) {
+        struct mutex_waiter *waiter = *link;
+        if (waiter->thread == thread) {
+            *link = waiter->next;
+            waiter->next = NULL;
+            return waiter;
+        }
     }
+    return NULL;
 }
 
-static void priority_restore(uint32_t thread_id)
+static void held_add(struct thread *owner, mutex_t *mutex)
 {
-    /* Restore original priority */
-    for (int i = 0; i < priority_table_count; i++) {
-        if (priority_table[i].thread_id == thread_id) {
-            priority_table[i].boosted_priority = priority_table[i].original_priority;
-            return;
+    if (mutex->on_held_list) return;
+    mutex->held_next = owner->held_mutexes;
+    owner->held_mutexes = mutex;
+    mutex->on_held_list = 1;
+}
+
+static void held_remove(struct thread *owner, mutex_t *mutex)
+{
+    if (!mutex->on_held_list) return;
+    for (mutex_t **link = &owner->held_mutexes; *link; link = &(*link)->held_next) {
+        if (*link == mutex) {
+            *link = mutex->held_next;
+            break;
         }
     }
+    mutex->held_next = NULL;
+    mutex->on_held_list = 0;
 }
 
-static uint32_t get_thread_priority(uint32_t thread_id)
+/* Base priority raised to the top waiter of each held mutex; pi_lock held */
+static int pi_priority(struct thread *thread)
 {
-    /* Get current priority (boosted or original) */
-    for (int i = 0; i < priority_table_count; i++) {
-        if (priority_table[i].thread_id == thread_id) {
-            return priority_table[i].boosted_priority;
+    int priority = thread->base_priority;
+    for (mutex_t *mutex = thread->held_mutexes; mutex; mutex = mutex->held_next) {
+        if (mutex->waiters && mutex->waiters->thread->priority > priority) {
+            priority = mutex->waiters->thread->priority;
         }
     }
-    return thread_id % 4;  /* Default based on ID */
+    return priority;
+}
+
+/*
+ * Bring 'thread' to its inherited priority and carry the change on to
+ * the owner of whatever it is blocked on, re-sorting it in that queue.
+ * pi_lock held; 'cause' is charged with the boosts.
+ */
+static void pi_propagate(struct thread *thread, mutex_t *cause)
+{
+    for (int depth = 0; thread && depth < MUTEX_PI_MAX_DEPTH; depth++) {
+        int priority = pi_priority(thread);
+        if (priority == thread->priority) return;
+        if (cause && priority > thread->priority) cause->stats.pi_boosts++;
+        thread_set_effective_priority(thread, priority);
+        
+        mutex_t *blocked = thread->blocked_on;
+        if (!blocked) return;
+        struct mutex_waiter *waiter = waiter_remove(blocked, thread);
+        if (waiter) waiter_insert(blocked, waiter);
+        thread = blocked->owner;
+    }
+    if (thread) {
+        serial_printf("[mutex] Priority chain deeper than %d, possible deadlock\n",
+                      MUTEX_PI_MAX_DEPTH);
+    }
+}
+
+/* Take a free mutex; the caller has just won the lock word */
+static inline void mutex_acquired(mutex_t *mutex, struct thread *self)
+{
+    mutex->owner = self;
+    mutex->count = 1;
+    mutex->stats.acquisitions++;
 }
 
 /* Mutex operations */
@@ -66,53 +142,123 @@ int mutex_init(mutex_t *mutex)
     return 0;
 }
 
+static int mutex_lock_slow(mutex_t *mutex, struct thread *self, uint32_t id)
+{
+    uint64_t start = timer_rdtsc();
+    __sync_fetch_and_add(&mutex->stats.contended, 1);
+    
+    /* Spin while the owner is running elsewhere and nobody is queued */
+    for (int spins = 0; spins < MUTEX_SPIN_LIMIT; spins++) {
+        uint32_t word = mutex->lock;
+        if (word == 0) {
+            if (__sync_bool_compare_and_swap(&mutex->lock, 0, id)) {
+                mutex_acquired(mutex, self);
+                mutex->stats.spin_acquired++;
+                mutex->stats.wait_cycles += timer_rdtsc() - start;
+                return 0;
+            }
+            continue;
+        }
+        if (word & MUTEX_WAITERS) break;
+        struct thread *owner = mutex->owner;
+        if (!self || !owner || owner->id != owner_id(word) || owner->state != THREAD_RUNNING) {
+            break;
+        }
+        __asm__ volatile("pause");
+    }
+    
+    uint32_t flags = spin_lock_irqsave(&pi_lock);
+    
+    /* Take it if it is free, else flag the owner that it has waiters */
+    for (;;) {
+        uint32_t word = mutex->lock;
+        if (owner_id(word) == 0) {
+            uint32_t claim = id | (mutex->waiters ? MUTEX_WAITERS : 0);
+            if (__sync_bool_compare_and_swap(&mutex->lock, word, claim)) {
+                mutex_acquired(mutex, self);
+                if (mutex->waiters) held_add(self, mutex);
+                spin_unlock_irqrestore(&pi_lock, flags);
+                mutex->stats.wait_cycles += timer_rdtsc() - start;
+                return 0;
+            }
+            continue;
+        }
+        if ((word & MUTEX_WAITERS) ||
+            __sync_bool_compare_and_swap(&mutex->lock, word, word | MUTEX_WAITERS)) {
+            break;
+        }
+    }
+    
+    /*
+     * The owner now has to come through pi_lock to unlock.  Its owner
+     * pointer may trail the lock word by a few instructions.
+     */
+    while (!mutex->owner || mutex->owner->id != owner_id(mutex->lock)) {
+        __asm__ volatile("pause");
+    }
+    
+    if (!self) {
+        /* No thread to park before thread_init(): nothing else can hold it */
+        spin_unlock_irqrestore(&pi_lock, flags);
+        return -1;
+    }
+    
+    struct mutex_waiter waiter;
+    waiter.thread = self;
+    waiter.acquired = 0;
+    waiter_insert(mutex, &waiter);
+    mutex->waiter_count++;
+    if (mutex->waiter_count > mutex->stats.max_waiters) {
+        mutex->stats.max_waiters = mutex->waiter_count;
+    }
+    mutex->stats.sleeps++;
+    self->blocked_on = mutex;
+    
+    struct thread *owner = mutex->owner;
+    held_add(owner, mutex);
+    pi_propagate(owner, mutex);
+    
+    /* mutex_unlock_slow() hands the mutex over and wakes us */
+    while (!waiter.acquired) {
+        thread_park(&pi_lock, flags, 0);
+        flags = spin_lock_irqsave(&pi_lock);
+    }
+    spin_unlock_irqrestore(&pi_lock, flags);
+    
+    mutex->stats.wait_cycles += timer_rdtsc() - start;
+    return 0;
+}
+
 int mutex_lock(mutex_t *mutex)
 {
     if (!mutex) return -1;
     
-    uint32_t thread_id = thread_self();
-    uint32_t owner_id = mutex->lock;
+    uint32_t thread_id = (uint32_t)thread_self();
     
-    /* Check if already locked by this thread (recursive mutex) */
-    if (mutex->lock == thread_id) {
-        mutex->count++;
+    /* Uncontended fast path */
+    if (__sync_bool_compare_and_swap(&mutex->lock, 0, thread_id)) {
+        mutex_acquired(mutex, thread_current());
         return 0;
     }
     
-    /* Wait for mutex to be unlocked with priority inheritance */
-    while (mutex->lock != 0) {
-        /* Boost owner's priority to match waiting thread's priority */
-        uint32_t waiting_priority = get_thread_priority(thread_id);
-        uint32_t owner_priority = get_thread_priority(owner_id);
-        
-        if (waiting_priority > owner_priority) {
-            priority_boost(owner_id, waiting_priority);
-        }
-        
-        mutex->waiter_count++;
-        thread_sleep_ms(1);  /* Simplified: busy wait */
-        mutex->waiter_count--;
-        
-        owner_id = mutex->lock;
+    /* Check if already locked by this thread (recursive mutex) */
+    if (owner_id(mutex->lock) == thread_id) {
+        mutex->count++;
+        return 0;
     }
     
-    /* Acquire the lock */
-    mutex->lock = thread_id;
-    mutex->count = 1;
-    
-    return 0;
+    return mutex_lock_slow(mutex, thread_current(), thread_id);
 }
 
 int mutex_trylock(mutex_t *mutex)
 {
     if (!mutex) return -1;
     
-    uint32_t thread_id = thread_self();
+    uint32_t thread_id = (uint32_t)thread_self();
     
     /* Try to acquire without blocking */
-    if (mutex->lock == 0) {
-        mutex->lock = thread_id;
-        mutex->count = 1;
+    if (__sync_bool_compare_and_swap(&mutex->lock, 0, thread_id)) {
+        mutex_acquired(mutex, thread_current());
         return 0;
     }
     
@@ -120,24 +266,57 @@ int mutex_trylock(mutex_t *mutex)
     return -1;
 }
 
+/* Hand the mutex to its first waiter and drop any boost it gave us */
+static void mutex_unlock_slow(mutex_t *mutex, struct thread *self)
+{
+    uint32_t flags = spin_lock_irqsave(&pi_lock);
+    if (self) held_remove(self, mutex);
+    
+    struct mutex_waiter *next = mutex->waiters;
+    if (!next) {
+        __sync_lock_release(&mutex->lock);
+    } else {
+        struct thread *thread = next->thread;
+        mutex->waiters = next->next;
+        mutex->waiter_count--;
+        thread->blocked_on = NULL;
+        mutex->owner = thread;
+        mutex->count = 1;
+        mutex->stats.acquisitions++;
+        __sync_synchronize();
+        mutex->lock = thread->id | (mutex->waiters ? MUTEX_WAITERS : 0);
+        if (mutex->waiters) held_add(thread, mutex);
+        
+        next->acquired = 1;
+        thread_set_effective_priority(thread, pi_priority(thread));
+        thread_unpark(thread);
+    }
+    
+    if (self) {
+        int priority = pi_priority(self);
+        if (priority != self->priority) thread_set_effective_priority(self, priority);
+    }
+    spin_unlock_irqrestore(&pi_lock, flags);
+}
+
 int mutex_unlock(mutex_t *mutex)
 {
     if (!mutex) return -1;
     
-    uint32_t thread_id = thread_self();
+    uint32_t thread_id = (uint32_t)thread_self();
     
     /* Check if owned by this thread */
-    if (mutex->lock != thread_id) {
+    if (owner_id(mutex->lock) != thread_id) {
         return -1;
     }
     
-    mutex->count--;
-    
     /* Only release if count reaches 0 (recursive mutex) */
-    if (mutex->count == 0) {
-        /* Restore original priority before releasing */
-        priority_restore(thread_id);
-        mutex->lock = 0;
+    if (--mutex->count > 0) {
+        return 0;
+    }
+    
+    if (!__sync_bool_compare_and_swap(&mutex->lock, thread_id, 0)) {
+        mutex_unlock_slow(mutex, thread_current());
     }
     
     return 0;
@@ -156,6 +335,21 @@ int mutex_destroy(mutex_t *mutex)
     return 0;
 }
 
+void mutex_get_stats(mutex_t *mutex, struct mutex_stats *stats)
+{
+    if (!mutex || !stats) return;
+    *stats = mutex->stats;
+}
+
+void mutex_pi_update(struct thread *thread)
+{
+    if (!thread) return;
+    
+    uint32_t flags = spin_lock_irqsave(&pi_lock);
+    pi_propagate(thread, NULL);
+    spin_unlock_irqrestore(&pi_lock, flags);
+}
+
 /* Semaphore operations */
 int semaphore_init(semaphore_t *sem, uint32_t initial_value)
 {
@@ -263,16 +457,77 @@ int cond_destroy(cond_t *cond)
     return 0;
 }
 
-/* Reader-writer lock operations */
+/*
+ * Reader-writer lock operations.
+ *
+ * A reader bumps its CPU's count and then checks 'writer'; a writer sets
+ * 'writer' and then sums the counts.  The locked add is a full barrier,
+ * so one of them always sees the other.  Readers that run into a writer
+ * back out and park until write unlock.  Counts are summed, so a reader
+ * may leave on a different CPU than it entered on.
+ */
+#define RWLOCK_SPIN_LIMIT 1000      /* pause iterations between yields */
+
+struct rwlock_waiter {
+    struct thread *thread;
+    struct rwlock_waiter *next;
+    volatile int woken;
+};
+
+static inline struct rwlock_cpu *rwlock_this_cpu(rwlock_t *rwlock)
+{
+    return &rwlock->cpu[smp_this_cpu()->index % RWLOCK_CPU_SLOTS];
+}
+
+static int32_t rwlock_readers(rwlock_t *rwlock)
+{
+    int32_t readers = 0;
+    for (int i = 0; i < RWLOCK_CPU_SLOTS; i++) {
+        readers += rwlock->cpu[i].readers;
+    }
+    return readers;
+}
+
+/* Park until the current writer is done; idle threads only spin */
+static void rwlock_wait_writer(rwlock_t *rwlock)
+{
+    struct thread *self = thread_current();
+    if (!self || self == smp_this_cpu()->idle_thread) {
+        while (rwlock->writer) {
+            __asm__ volatile("pause");
+        }
+        return;
+    }
+    
+    struct rwlock_waiter waiter;
+    waiter.thread = self;
+    waiter.woken = 0;
+    
+    uint32_t flags = spin_lock_irqsave(&rwlock->wait_lock);
+    if (!rwlock->writer) {
+        spin_unlock_irqrestore(&rwlock->wait_lock, flags);
+        return;
+    }
+    waiter.next = rwlock->read_waiters;
+    rwlock->read_waiters = &waiter;
+    rwlock->stats.reader_sleeps++;
+    
+    while (!waiter.woken) {
+        thread_park(&rwlock->wait_lock, flags, 0);
+        flags = spin_lock_irqsave(&rwlock->wait_lock);
+    }
+    spin_unlock_irqrestore(&rwlock->wait_lock, flags);
+}
+
 int rwlock_init(rwlock_t *rwlock)
 {
     if (!rwlock) return -1;
     
     memset(rwlock, 0, sizeof(rwlock_t));
-    rwlock->readers = 0;
-    rwlock->writers = 0;
-    rwlock->write_waiters = 0;
-    mutex_init(&rwlock->lock);
+    rwlock->writer = 0;
+    rwlock->read_waiters = NULL;
+    spin_lock_init(&rwlock->wait_lock);
+    mutex_init(&rwlock->write_lock);
     
     return 0;
 }
@@ -281,25 +536,26 @@ int rwlock_read_lock(rwlock_t *rwlock)
 {
     if (!rwlock) return -1;
     
-    /* Wait if writers are active or waiting */
-    while (rwlock->writers > 0 || rwlock->write_waiters > 0) {
-        thread_sleep_ms(1);
+    for (;;) {
+        struct rwlock_cpu *slot = rwlock_this_cpu(rwlock);
+        __sync_fetch_and_add(&slot->readers, 1);
+        if (!rwlock->writer) {
+            slot->acquisitions++;
+            return 0;
+        }
+        
+        /* A writer is in or draining: step aside so it can finish */
+        __sync_fetch_and_sub(&slot->readers, 1);
+        __sync_fetch_and_add(&rwlock->stats.reader_backoffs, 1);
+        rwlock_wait_writer(rwlock);
     }
-    
-    mutex_lock(&rwlock->lock);
-    rwlock->readers++;
-    mutex_unlock(&rwlock->lock);
-    
-    return 0;
 }
 
 int rwlock_read_unlock(rwlock_t *rwlock)
 {
     if (!rwlock) return -1;
     
-    mutex_lock(&rwlock->lock);
-    rwlock->readers--;
-    mutex_unlock(&rwlock->lock);
+    __sync_fetch_and_sub(&rwlock_this_cpu(rwlock)->readers, 1);
     
     return 0;
 }
@@ -308,19 +564,24 @@ int rwlock_write_lock(rwlock_t *rwlock)
 {
     if (!rwlock) return -1;
     
-    mutex_lock(&rwlock->lock);
-    rwlock->write_waiters++;
-    
-    /* Wait for all readers and writers */
-    while (rwlock->readers > 0 || rwlock->writers > 0) {
-        mutex_unlock(&rwlock->lock);
-        thread_sleep_ms(1);
-        mutex_lock(&rwlock->lock);
+    mutex_lock(&rwlock->write_lock);
+    __sync_lock_test_and_set(&rwlock->writer, 1);
+    
+    /* Wait for readers already inside; none can enter from here on */
+    uint64_t start = timer_rdtsc();
+    int spins = 0;
+    while (rwlock_readers(rwlock) != 0) {
+        if (++spins < RWLOCK_SPIN_LIMIT) {
+            __asm__ volatile("pause");
+        } else {
+            /* A reader on this CPU can only finish if we let it run */
+            spins = 0;
+            thread_yield();
+        }
     }
     
-    rwlock->write_waiters--;
-    rwlock->writers++;
-    mutex_unlock(&rwlock->lock);
+    rwlock->stats.writer_wait_cycles += timer_rdtsc() - start;
+    rwlock->stats.write_acquisitions++;
     
     return 0;
 }
@@ -329,9 +590,20 @@ int rwlock_write_unlock(rwlock_t *rwlock)
 {
     if (!rwlock) return -1;
     
-    mutex_lock(&rwlock->lock);
-    rwlock->writers--;
-    mutex_unlock(&rwlock->lock);
+    uint32_t flags = spin_lock_irqsave(&rwlock->wait_lock);
+    __sync_lock_release(&rwlock->writer);
+    
+    struct rwlock_waiter *waiter = rwlock->read_waiters;
+    rwlock->read_waiters = NULL;
+    while (waiter) {
+        struct rwlock_waiter *next = waiter->next;
+        waiter->woken = 1;
+        thread_unpark(waiter->thread);
+        waiter = next;
+    }
+    spin_unlock_irqrestore(&rwlock->wait_lock, flags);
+    
+    mutex_unlock(&rwlock->write_lock);
     
     return 0;
 }
@@ -340,16 +612,27 @@ int rwlock_destroy(rwlock_t *rwlock)
 {
     if (!rwlock) return -1;
     
-    if (rwlock->readers > 0 || rwlock->writers > 0 || rwlock->write_waiters > 0) {
+    if (rwlock_readers(rwlock) != 0 || rwlock->writer || rwlock->read_waiters) {
         return -1;
     }
     
-    mutex_destroy(&rwlock->lock);
+    mutex_destroy(&rwlock->write_lock);
     memset(rwlock, 0, sizeof(rwlock_t));
     
     return 0;
 }
 
+void rwlock_get_stats(rwlock_t *rwlock, struct rwlock_stats *stats)
+{
+    if (!rwlock || !stats) return;
+    
+    *stats = rwlock->stats;
+    stats->read_acquisitions = 0;
+    for (int i = 0; i < RWLOCK_CPU_SLOTS; i++) {
+        stats->read_acquisitions += rwlock->cpu[i].acquisitions;
+    }
+}
+
 /* Barrier operations */
 int barrier_init(barrier_t *barrier, uint32_t count)
 {
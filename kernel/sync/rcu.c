@@ -0,0 +1,200 @@
+#include "../../include/kernel/rcu.h"
+#include "../../include/kernel/thread.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/timer.h"
+#include "../../include/kernel/serial.h"
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Grace periods.
+ *
+ * Callbacks collect on 'next_list'.  The grace-period thread moves them
+ * to 'wait_list' and starts a grace period by setting one bit per online
+ * CPU in qs_pending; each CPU clears its bit at its next context switch
+ * or idle pass, and a halted CPU counts as quiescent.  When the mask is
+ * empty the wait list is invoked.  The quiescent-state hook runs inside
+ * schedule() with the thread lock held, so it cannot wake anyone: the
+ * thread instead polls every tick while a grace period is open and
+ * sleeps indefinitely when there is no work.
+ */
+
+#define RCU_POLL_US (1000000 / TIMER_HZ)
+
+static spinlock_t rcu_lock = SPINLOCK_INIT;
+static struct rcu_head *next_list;          /* Waiting for a grace period to start */
+static struct rcu_head **next_tail = &next_list;
+static struct rcu_head *wait_list;          /* Waiting for the current one to end */
+static volatile uint32_t qs_pending;        /* CPUs yet to pass a quiescent state */
+static int gp_active;
+static uint32_t gp_start;
+static struct thread *gp_thread;
+static struct rcu_stats rcu_stats;
+
+struct rcu_sync {
+    struct rcu_head head;                   /* First, so the callback can cast back */
+    struct thread *thread;
+    volatile int done;
+};
+
+void rcu_note_qs(void)
+{
+    uint32_t bit = 1u << smp_this_cpu()->index;
+    if (qs_pending & bit) {
+        __sync_fetch_and_and(&qs_pending, ~bit);
+    }
+}
+
+/*
+ * A CPU halted in the idle loop is outside any read-side section, and
+ * with its tick stopped it may not pass through schedule() for a long
+ * time: count it as quiescent.
+ */
+static void rcu_idle_qs(void)
+{
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        uint32_t bit = 1u << i;
+        if ((qs_pending & bit) && smp_cpu(i)->halted) {
+            __sync_fetch_and_and(&qs_pending, ~bit);
+        }
+    }
+}
+
+/* rcu_lock held */
+static void rcu_start_gp(void)
+{
+    uint32_t mask = 0;
+    for (int i = 0; i < SMP_MAX_CPUS; i++) {
+        if (smp_cpu(i)->online) mask |= 1u << i;
+    }
+
+    wait_list = next_list;
+    next_list = NULL;
+    next_tail = &next_list;
+    gp_start = (uint32_t)timer_get_ticks();
+    gp_active = 1;
+    __sync_lock_test_and_set(&qs_pending, mask);
+}
+
+/* rcu_lock held; returns the callbacks whose grace period just ended */
+static struct rcu_head *rcu_end_gp(void)
+{
+    struct rcu_head *done = wait_list;
+    uint32_t length = (uint32_t)timer_get_ticks() - gp_start;
+
+    wait_list = NULL;
+    gp_active = 0;
+    rcu_stats.grace_periods++;
+    rcu_stats.last_gp_ticks = length;
+    if (length > rcu_stats.max_gp_ticks) rcu_stats.max_gp_ticks = length;
+    return done;
+}
+
+static void rcu_invoke(struct rcu_head *list)
+{
+    uint32_t count = 0;
+    while (list) {
+        struct rcu_head *next = list->next;
+        list->func(list);
+        list = next;
+        count++;
+    }
+    __sync_fetch_and_add(&rcu_stats.callbacks_invoked, count);
+}
+
+static void rcu_gp_main(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        uint32_t flags = spin_lock_irqsave(&rcu_lock);
+        struct rcu_head *done = NULL;
+        if (gp_active) rcu_idle_qs();
+        if (gp_active && qs_pending == 0) {
+            done = rcu_end_gp();
+        }
+        if (!gp_active && next_list) {
+            rcu_start_gp();
+        }
+
+        if (!done) {
+            thread_park(&rcu_lock, flags, gp_active ? RCU_POLL_US : 0);
+            continue;
+        }
+        spin_unlock_irqrestore(&rcu_lock, flags);
+        rcu_invoke(done);
+    }
+}
+
+void rcu_init(void)
+{
+    int id = kthread_create(rcu_gp_main, NULL, THREAD_DEFAULT_PRIORITY);
+    if (id < 0) {
+        serial_puts("[rcu] Failed to start grace-period thread\n");
+        return;
+    }
+
+    uint32_t flags = spin_lock_irqsave(&rcu_lock);
+    gp_thread = thread_get(id);
+    spin_unlock_irqrestore(&rcu_lock, flags);
+    serial_puts("[rcu] Grace-period thread started\n");
+}
+
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head))
+{
+    if (!head || !func) return;
+
+    head->func = func;
+    head->next = NULL;
+
+    uint32_t flags = spin_lock_irqsave(&rcu_lock);
+    if (!gp_thread) {
+        /* Before rcu_init() the boot CPU is alone and holds no references */
+        spin_unlock_irqrestore(&rcu_lock, flags);
+        func(head);
+        return;
+    }
+
+    *next_tail = head;
+    next_tail = &head->next;
+    rcu_stats.callbacks_queued++;
+    if (!gp_active) thread_unpark(gp_thread);
+    spin_unlock_irqrestore(&rcu_lock, flags);
+}
+
+static void rcu_sync_done(struct rcu_head *head)
+{
+    struct rcu_sync *sync = (struct rcu_sync *)head;
+
+    uint32_t flags = spin_lock_irqsave(&rcu_lock);
+    sync->done = 1;
+    thread_unpark(sync->thread);
+    spin_unlock_irqrestore(&rcu_lock, flags);
+}
+
+void synchronize_rcu(void)
+{
+    struct thread *self = thread_current();
+    if (!gp_thread || !self) return;
+
+    struct rcu_sync sync;
+    sync.thread = self;
+    sync.done = 0;
+    __sync_fetch_and_add(&rcu_stats.synchronize_calls, 1);
+    call_rcu(&sync.head, rcu_sync_done);
+
+    uint32_t flags = spin_lock_irqsave(&rcu_lock);
+    while (!sync.done) {
+        thread_park(&rcu_lock, flags, 0);
+        flags = spin_lock_irqsave(&rcu_lock);
+    }
+    spin_unlock_irqrestore(&rcu_lock, flags);
+}
+
+void rcu_get_stats(struct rcu_stats *stats)
+{
+    if (!stats) return;
+
+    uint32_t flags = spin_lock_irqsave(&rcu_lock);
+    *stats = rcu_stats;
+    spin_unlock_irqrestore(&rcu_lock, flags);
+}
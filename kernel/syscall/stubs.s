@@ -4,6 +4,7 @@
  * Hardware IRQ entry (IRQ_STUB macro)
  * ------------------------------------
  * Each IRQ stub pushes its line number then jumps to irq_common_handler.
+ * Lines 0-15 are the 8259 PIC's; 16-63 are dynamic (irq_dyn_stubs).
  * Stack layout on arrival at irq_common_handler (offsets from ESP after
  * all saves):
  *
@@ -37,7 +38,7 @@
 .section .text
 
 /* ------------------------------------------------------------------ */
-/* IRQ stubs (IRQ 0-15 -> INT 32-47)                                  */
+/* IRQ stubs (IRQ 0-63 -> INT 32-95)                                  */
 /* ------------------------------------------------------------------ */
 
 .macro IRQ_STUB num
@@ -64,6 +65,35 @@ IRQ_STUB 13
 IRQ_STUB 14
 IRQ_STUB 15
 
+/* Lines 16-63 are handed out by irq_alloc_line() to the IOAPIC and MSI */
+.irp num, 16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63
+IRQ_STUB \num
+.endr
+
+.section .rodata
+.globl irq_dyn_stubs
+irq_dyn_stubs:
+.irp num, 16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31,32,33,34,35,36,37,38,39,40,41,42,43,44,45,46,47,48,49,50,51,52,53,54,55,56,57,58,59,60,61,62,63
+    .long irq\num
+.endr
+.section .text
+
+/* Local APIC vectors; the number pushed is the vector (see lapic.h) */
+.globl irq_lapic_timer
+irq_lapic_timer:
+    pushl $0xEF
+    jmp   irq_common_handler
+
+.globl irq_lapic_kick
+irq_lapic_kick:
+    pushl $0xEE
+    jmp   irq_common_handler
+
+/* Spurious local APIC interrupt: nothing is in service, so no EOI */
+.globl irq_lapic_spurious
+irq_lapic_spurious:
+    iret
+
 /* ------------------------------------------------------------------ */
 /* Common IRQ handler                                                  */
 /* ------------------------------------------------------------------ */
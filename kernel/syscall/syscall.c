@@ -8,6 +8,13 @@
 #include "../../include/kernel/sync.h"
 #include "../../include/kernel/futex.h"
 #include "../../include/kernel/paging.h"
+#include "../../include/kernel/scheduler.h"
+#include "../../include/kernel/smp.h"
+#include "../../include/kernel/sched_trace.h"
+#include "../../include/kernel/resource_scheduler.h"
+#include "../exec/elf.h"
+#include "../fs/vfs.h"
+#include <stddef.h>
 
 int32_t sys_exit(int code)
 {
@@ -69,8 +76,22 @@ int32_t sys_fork(void)
     struct task *child = task_create(current->entry_point, current->priority);
     if (!child) return -1;
     
+    /* Share the parent's address space copy-on-write */
+    if (paging_get_page_directory(current->id)) {
+        if (paging_init_task(child->id) != 0 ||
+            paging_fork_task(current->id, child->id) != 0) {
+            task_destroy(child);
+            return -1;
+        }
+        child->page_directory = (uint32_t *)paging_get_page_directory(child->id);
+    }
+    
     /* Copy parent's register state to child */
     child->regs = current->regs;
+    child->regs.eax = 0;
+    child->parent_id = current->id;
+    child->vruntime = current->vruntime;
+    scheduler_set_class(child, current->sched_class);
     
     /* Return child's task ID to parent, 0 to child */
     return child->id;
@@ -96,6 +117,7 @@ int32_t sys_wait(int *status)
     
     /* No dead children - block until one exits */
     current->state = TASK_BLOCKED;
+    sched_trace_block(current);
     return 0;
 }
 
@@ -104,12 +126,8 @@ int32_t sys_sleep(uint32_t ms)
     struct task *task = task_get_current();
     if (!task) return -1;
     
-    /* Convert ms to timer ticks (100 Hz = 10ms per tick) */
-    uint32_t ticks = (ms + 9) / 10;  /* Round up */
-    
-    /* Save wake-up time in task (simplified: just block) */
-    task->state = TASK_BLOCKED;
-    task->ticks_remaining = ticks;
+    /* Blocks until its sleep timer wakes it */
+    task_sleep(ms);
     
     return 0;
 }
@@ -193,13 +211,39 @@ int32_t sys_lseek(int fd, int32_t offset, int whence)
     return task->fd_table[fd].offset;
 }
 
+/* Page tables of an exec in progress; task ids never reach this range */
+#define EXEC_STAGING_ID(task_id) (0x80000000u | (task_id))
+
 int32_t sys_exec(const char *filename, char *const argv[])
 {
-    /* exec syscall deferred to Phase 5.2 */
-    /* For now, stub that returns error */
-    (void)filename;
-    (void)argv;
-    return -1;
+    (void)argv;  /* Argument passing not implemented yet */
+    
+    struct task *task = task_get_current();
+    if (!task || !filename || !vfs_resolve(filename)) return -1;
+    
+    /*
+     * Build the demand-paged image in a staging space first: a bad or
+     * truncated ELF must leave the caller's address space intact so the
+     * error can be returned to it.
+     */
+    uint32_t staging_id = EXEC_STAGING_ID(task->id);
+    if (paging_init_task(staging_id) != 0) return -1;
+    
+    uint32_t entry, stack_top;
+    if (elf_map(staging_id, filename, &entry, &stack_top) != 0) {
+        paging_cleanup_task(staging_id);
+        return -1;
+    }
+    if (paging_replace_task(task->id, staging_id) != 0) {
+        paging_cleanup_task(staging_id);
+        return -1;
+    }
+    
+    task->page_directory = (uint32_t *)paging_get_page_directory(task->id);
+    task->entry_point = entry;
+    task->regs.eip = entry;
+    task->regs.esp = stack_top - 4;
+    return 0;
 }
 
 int32_t sys_signal(int signum, uint32_t handler)
@@ -211,6 +255,95 @@ int32_t sys_signal(int signum, uint32_t handler)
     return 0;
 }
 
+/* Shared-memory syscalls */
+int32_t sys_shm_create(uint32_t size, uint32_t flags)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    
+    /* Regions are always user-accessible; only PAGING_WRITE is honoured */
+    return paging_create_shared_region(task->id, size, (flags & PAGING_WRITE) | PAGING_USER);
+}
+
+int32_t sys_shm_attach(int shm_id, uint32_t address)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    return paging_attach_shared_region(task->id, shm_id, address);
+}
+
+int32_t sys_shm_detach(int shm_id)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    return paging_detach_shared_region(task->id, shm_id);
+}
+
+int32_t sys_shm_destroy(int shm_id)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    return paging_destroy_shared_region(task->id, shm_id);
+}
+
+/* Switch the calling task between the priority and fair classes */
+int32_t sys_sched_setclass(int sched_class)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    return scheduler_set_class(task, sched_class);
+}
+
+/* A thread of the calling task; id 0 is the calling thread */
+static struct thread *affinity_thread(struct task *task, uint32_t id)
+{
+    struct thread *thread = id ? thread_get((int)id) : thread_current();
+    if (!thread || thread->task_id != task->id) return NULL;
+    return thread;
+}
+
+int32_t sys_sched_setaffinity(int which, uint32_t id, uint32_t mask)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    
+    if (which == SCHED_AFFINITY_TASK) {
+        if (id && id != task->id) return -1;
+        return scheduler_set_affinity(task, mask);
+    }
+    if (which == SCHED_AFFINITY_THREAD) {
+        return thread_set_affinity(affinity_thread(task, id), mask);
+    }
+    return -1;
+}
+
+/* Returns the mask, limited to CPUs that can exist so it stays positive */
+int32_t sys_sched_getaffinity(int which, uint32_t id)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    
+    uint32_t mask;
+    if (which == SCHED_AFFINITY_TASK) {
+        if (id && id != task->id) return -1;
+        mask = task->cpus_allowed;
+    } else if (which == SCHED_AFFINITY_THREAD) {
+        struct thread *thread = affinity_thread(task, id);
+        if (!thread) return -1;
+        mask = thread->cpus_allowed;
+    } else {
+        return -1;
+    }
+    return (int32_t)(mask & ((1u << SMP_MAX_CPUS) - 1));
+}
+
+int32_t sys_sched_sethint(int hint)
+{
+    struct task *task = task_get_current();
+    if (!task) return -1;
+    return sched_set_task_hint(task->id, (sched_hint_t)hint);
+}
+
 /* Socket syscalls */
 int32_t sys_socket(int domain, int type, int protocol)
 {
@@ -421,25 +554,26 @@ int32_t sys_mutex_unlock(void *mutex_addr)
 }
 
 /* Futex syscalls */
-int32_t sys_futex_wait(uint32_t *futex_addr, uint32_t expected_val, uint32_t timeout_ms)
+int32_t sys_futex_wait(uint32_t *futex_addr, uint32_t expected_val, uint32_t timeout_us, uint32_t flags)
 {
     if (!futex_addr) return -1;
     
-    return futex_wait(futex_addr, expected_val, timeout_ms);
+    return futex_wait(futex_addr, expected_val, timeout_us, flags);
 }
 
-int32_t sys_futex_wake(uint32_t *futex_addr, uint32_t num_waiters)
+int32_t sys_futex_wake(uint32_t *futex_addr, uint32_t num_waiters, uint32_t flags)
 {
     if (!futex_addr) return -1;
     
-    return futex_wake(futex_addr, num_waiters);
+    return futex_wake(futex_addr, num_waiters, flags);
 }
 
-int32_t sys_futex_requeue(uint32_t *futex_addr1, uint32_t *futex_addr2, uint32_t num_wake, uint32_t num_requeue)
+int32_t sys_futex_requeue(uint32_t *futex_addr1, uint32_t *futex_addr2, uint32_t num_wake,
+                          uint32_t num_requeue, uint32_t flags)
 {
     if (!futex_addr1 || !futex_addr2) return -1;
     
-    return futex_requeue(futex_addr1, futex_addr2, num_wake, num_requeue);
+    return futex_requeue(futex_addr1, futex_addr2, num_wake, num_requeue, flags);
 }
 
 int32_t syscall_dispatch(uint32_t num, struct syscall_args *args)
@@ -494,11 +628,28 @@ int32_t syscall_dispatch(uint32_t num, struct syscall_args *args)
         case SYSCALL_MUTEX_UNLOCK:
             return sys_mutex_unlock((void *)args->ebx);
         case SYSCALL_FUTEX_WAIT:
-            return sys_futex_wait((uint32_t *)args->ebx, args->ecx, args->edx);
+            return sys_futex_wait((uint32_t *)args->ebx, args->ecx, args->edx, args->esi);
         case SYSCALL_FUTEX_WAKE:
-            return sys_futex_wake((uint32_t *)args->ebx, args->ecx);
+            return sys_futex_wake((uint32_t *)args->ebx, args->ecx, args->edx);
         case SYSCALL_FUTEX_REQUEUE:
-            return sys_futex_requeue((uint32_t *)args->ebx, (uint32_t *)args->ecx, args->edx, args->esi);
+            return sys_futex_requeue((uint32_t *)args->ebx, (uint32_t *)args->ecx, args->edx, args->esi,
+                                     args->edi);
+        case SYSCALL_SHM_CREATE:
+            return sys_shm_create(args->ebx, args->ecx);
+        case SYSCALL_SHM_ATTACH:
+            return sys_shm_attach(args->ebx, args->ecx);
+        case SYSCALL_SHM_DETACH:
+            return sys_shm_detach(args->ebx);
+        case SYSCALL_SHM_DESTROY:
+            return sys_shm_destroy(args->ebx);
+        case SYSCALL_SCHED_SETCLASS:
+            return sys_sched_setclass((int)args->ebx);
+        case SYSCALL_SCHED_SETAFFINITY:
+            return sys_sched_setaffinity((int)args->ebx, args->ecx, args->edx);
+        case SYSCALL_SCHED_GETAFFINITY:
+            return sys_sched_getaffinity((int)args->ebx, args->ecx);
+        case SYSCALL_SCHED_SETHINT:
+            return sys_sched_sethint((int)args->ebx);
         default:
             return -1;
     }
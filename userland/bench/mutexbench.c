@@ -0,0 +1,197 @@
+#include "../lib/libc.h"
+
+/*
+ * Contended-mutex benchmark.
+ *
+ * A futex mutex (0 = free, 1 = locked, 2 = locked with waiters) is
+ * hammered by 1, 2, 4 and 8 threads.  Uncontended operations never
+ * enter the kernel; the report shows how often the slow path had to
+ * block and wake, and the cost per lock/unlock pair.  A second phase
+ * broadcasts a condition to every thread with FUTEX_REQUEUE, waking
+ * one and moving the rest onto the mutex instead of waking them all
+ * to fight over it.
+ */
+
+#define ITERATIONS 20000
+#define MAX_THREADS 8
+
+struct futex_mutex {
+    volatile uint32_t word;
+};
+
+struct worker {
+    struct futex_mutex *mutex;
+    volatile uint32_t *counter;
+    uint32_t waits;
+    uint32_t wakes;
+};
+
+static struct futex_mutex bench_mutex;
+static volatile uint32_t bench_counter;
+static struct worker workers[MAX_THREADS];
+
+static void mutex_lock(struct futex_mutex *m, struct worker *w)
+{
+    uint32_t c = __sync_val_compare_and_swap(&m->word, 0, 1);
+    if (c == 0) return;
+    
+    /* Mark contended, then sleep until we take it as contended */
+    if (c != 2) c = __sync_lock_test_and_set(&m->word, 2);
+    while (c != 0) {
+        w->waits++;
+        futex_wait(&m->word, 2, 0, FUTEX_PRIVATE);
+        c = __sync_lock_test_and_set(&m->word, 2);
+    }
+}
+
+static void mutex_unlock(struct futex_mutex *m, struct worker *w)
+{
+    if (__sync_fetch_and_sub(&m->word, 1) != 1) {
+        m->word = 0;
+        w->wakes++;
+        futex_wake(&m->word, 1, FUTEX_PRIVATE);
+    }
+}
+
+static int worker_main(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    for (int i = 0; i < ITERATIONS; i++) {
+        mutex_lock(w->mutex, w);
+        (*w->counter)++;
+        mutex_unlock(w->mutex, w);
+    }
+    return 0;
+}
+
+/* 64-by-32 division without libgcc */
+static uint32_t div64(uint64_t n, uint32_t d)
+{
+    uint64_t q = 0, r = 0;
+    for (int i = 63; i >= 0; i--) {
+        r = (r << 1) | ((n >> i) & 1);
+        if (r >= d) {
+            r -= d;
+            q |= (uint64_t)1 << i;
+        }
+    }
+    return (uint32_t)q;
+}
+
+static void run_mutex(int nthreads)
+{
+    int ids[MAX_THREADS];
+    bench_mutex.word = 0;
+    bench_counter = 0;
+    
+    uint64_t start = rdtsc();
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].mutex = &bench_mutex;
+        workers[i].counter = &bench_counter;
+        workers[i].waits = 0;
+        workers[i].wakes = 0;
+        ids[i] = thread_create(worker_main, &workers[i]);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        if (ids[i] > 0) thread_join(ids[i], NULL);
+    }
+    uint64_t cycles = rdtsc() - start;
+    
+    uint32_t waits = 0, wakes = 0;
+    for (int i = 0; i < nthreads; i++) {
+        waits += workers[i].waits;
+        wakes += workers[i].wakes;
+    }
+    uint32_t ops = (uint32_t)nthreads * ITERATIONS;
+    printf("  %d threads: %d ops, %d cycles/op, %d futex waits, %d wakes%s\n",
+           nthreads, ops, div64(cycles, ops), waits, wakes,
+           bench_counter == ops ? "" : "  COUNTER MISMATCH");
+}
+
+/* Lock after a requeue: always leave the word contended so unlock passes it on */
+static void mutex_lock_contended(struct futex_mutex *m, struct worker *w)
+{
+    while (__sync_lock_test_and_set(&m->word, 2) != 0) {
+        w->waits++;
+        futex_wait(&m->word, 2, 0, FUTEX_PRIVATE);
+    }
+}
+
+/* Condition broadcast: waiters sleep on 'seq', then take the mutex */
+static volatile uint32_t cond_seq;
+static volatile uint32_t cond_ready;
+static volatile uint32_t cond_done;
+
+static int cond_waiter(void *arg)
+{
+    struct worker *w = (struct worker *)arg;
+    uint32_t seq = cond_seq;
+    
+    __sync_fetch_and_add(&cond_ready, 1);
+    futex_wake(&cond_ready, 1, FUTEX_PRIVATE);
+    while (cond_seq == seq) {
+        futex_wait(&cond_seq, seq, 0, FUTEX_PRIVATE);
+    }
+    
+    /* Requeued waiters are woken one at a time by each unlock */
+    mutex_lock_contended(w->mutex, w);
+    cond_done++;
+    mutex_unlock(w->mutex, w);
+    return 0;
+}
+
+static void run_broadcast(int nthreads)
+{
+    int ids[MAX_THREADS];
+    struct worker self = { &bench_mutex, NULL, 0, 0 };
+    bench_mutex.word = 0;
+    cond_seq = 0;
+    cond_ready = 0;
+    cond_done = 0;
+    
+    for (int i = 0; i < nthreads; i++) {
+        workers[i].mutex = &bench_mutex;
+        workers[i].waits = 0;
+        workers[i].wakes = 0;
+        ids[i] = thread_create(cond_waiter, &workers[i]);
+    }
+    uint32_t ready;
+    while ((ready = cond_ready) < (uint32_t)nthreads) {
+        futex_wait(&cond_ready, ready, 0, FUTEX_PRIVATE);
+    }
+    
+    /* Wake one waiter and move the rest onto the mutex we hold */
+    uint64_t start = rdtsc();
+    mutex_lock(&bench_mutex, &self);
+    cond_seq++;
+    int woken = futex_requeue(&cond_seq, &bench_mutex.word, 1, MAX_THREADS, FUTEX_PRIVATE);
+    bench_mutex.word = 2;
+    mutex_unlock(&bench_mutex, &self);
+    for (int i = 0; i < nthreads; i++) {
+        if (ids[i] > 0) thread_join(ids[i], NULL);
+    }
+    uint64_t cycles = rdtsc() - start;
+    
+    uint32_t waits = 0;
+    for (int i = 0; i < nthreads; i++) {
+        waits += workers[i].waits;
+    }
+    printf("  %d waiters: %d woken by the broadcast, %d mutex sleeps, %d done, %d cycles\n",
+           nthreads, woken, waits, cond_done, (uint32_t)cycles);
+}
+
+int main(void)
+{
+    static const int counts[] = { 1, 2, 4, 8 };
+    
+    printf("===== Futex mutex benchmark =====\n");
+    for (int i = 0; i < 4; i++) {
+        run_mutex(counts[i]);
+    }
+    
+    printf("Condition broadcast with FUTEX_REQUEUE:\n");
+    for (int i = 1; i < 4; i++) {
+        run_broadcast(counts[i]);
+    }
+    return 0;
+}
@@ -55,6 +55,19 @@ static inline int32_t _syscall0(uint32_t num)
 #define SYS_LSEEK  11
 #define SYS_EXEC   12
 #define SYS_SIGNAL 13
+#define SYS_CLONE  21
+#define SYS_THREAD_JOIN 22
+#define SYS_FUTEX_WAIT  25
+#define SYS_FUTEX_WAKE  26
+#define SYS_FUTEX_REQUEUE 27
+#define SYS_SHM_CREATE  28
+#define SYS_SHM_ATTACH  29
+#define SYS_SHM_DETACH  30
+#define SYS_SHM_DESTROY 31
+#define SYS_SCHED_SETCLASS 32
+#define SYS_SCHED_SETAFFINITY 33
+#define SYS_SCHED_GETAFFINITY 34
+#define SYS_SCHED_SETHINT 35
 
 void exit(int code)
 {
@@ -122,6 +135,73 @@ int signal(int signum, uint32_t handler)
     return _syscall2(SYS_SIGNAL, signum, handler);
 }
 
+int shm_create(uint32_t size, uint32_t flags)
+{
+    return _syscall2(SYS_SHM_CREATE, size, flags);
+}
+
+void *shm_attach(int shm_id, void *addr)
+{
+    if (_syscall2(SYS_SHM_ATTACH, shm_id, (uint32_t)addr) != 0) return NULL;
+    return addr;
+}
+
+int shm_detach(int shm_id)
+{
+    return _syscall1(SYS_SHM_DETACH, shm_id);
+}
+
+int shm_destroy(int shm_id)
+{
+    return _syscall1(SYS_SHM_DESTROY, shm_id);
+}
+
+int sched_setclass(int sched_class)
+{
+    return _syscall1(SYS_SCHED_SETCLASS, sched_class);
+}
+
+int sched_setaffinity(int which, int id, uint32_t mask)
+{
+    return _syscall3(SYS_SCHED_SETAFFINITY, which, id, mask);
+}
+
+int sched_getaffinity(int which, int id)
+{
+    return _syscall2(SYS_SCHED_GETAFFINITY, which, id);
+}
+
+int sched_sethint(int hint)
+{
+    return _syscall1(SYS_SCHED_SETHINT, hint);
+}
+
+int thread_create(int (*fn)(void *), void *arg)
+{
+    return _syscall5(SYS_CLONE, 0, 0, (uint32_t)fn, (uint32_t)arg, 0);
+}
+
+int thread_join(int thread_id, int *exit_code)
+{
+    return _syscall2(SYS_THREAD_JOIN, thread_id, (uint32_t)exit_code);
+}
+
+int futex_wait(volatile uint32_t *addr, uint32_t val, uint32_t timeout_us, int flags)
+{
+    return _syscall4(SYS_FUTEX_WAIT, (uint32_t)addr, val, timeout_us, flags);
+}
+
+int futex_wake(volatile uint32_t *addr, uint32_t count, int flags)
+{
+    return _syscall3(SYS_FUTEX_WAKE, (uint32_t)addr, count, flags);
+}
+
+int futex_requeue(volatile uint32_t *addr, volatile uint32_t *addr2, uint32_t wake,
+                  uint32_t requeue, int flags)
+{
+    return _syscall5(SYS_FUTEX_REQUEUE, (uint32_t)addr, (uint32_t)addr2, wake, requeue, flags);
+}
+
 /* ===== Standard I/O ===== */
 
 int putchar(int c)
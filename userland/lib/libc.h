@@ -40,6 +40,55 @@ int lseek(int fd, int offset, int whence);
 int exec(const char *filename, char *const argv[]);
 int signal(int signum, uint32_t handler);
 
+/* Shared memory: attach maps the region at the page-aligned address given */
+#define SHM_WRITE 0x2
+int shm_create(uint32_t size, uint32_t flags);
+void *shm_attach(int shm_id, void *addr);
+int shm_detach(int shm_id);
+int shm_destroy(int shm_id);
+
+/* Scheduling class of the calling task */
+#define SCHED_PRIO 0                /* Strict priority, runs first */
+#define SCHED_FAIR 1                /* Proportional share weighted by priority */
+int sched_setclass(int sched_class);
+
+/* CPUs a task or thread may run on (bit n = CPU n); id 0 is the caller */
+#define SCHED_AFFINITY_TASK   0
+#define SCHED_AFFINITY_THREAD 1
+int sched_setaffinity(int which, int id, uint32_t mask);
+int sched_getaffinity(int which, int id);      /* Returns the mask */
+
+/* Workload hint for CPU placement; values match the kernel's sched_hint_t */
+#define SCHED_HINT_NONE       0
+#define SCHED_HINT_GPU        1
+#define SCHED_HINT_MEMORY     2             /* Keep near a warm cache */
+#define SCHED_HINT_IO         3             /* Run as soon as woken */
+#define SCHED_HINT_CPU        4
+#define SCHED_HINT_LATENCY    5
+int sched_sethint(int hint);
+
+/* Threads sharing the calling task's address space */
+int thread_create(int (*fn)(void *), void *arg);
+int thread_join(int thread_id, int *exit_code);
+
+/* Futexes: wait blocks while *addr == val (timeout in microseconds, 0 waits forever) */
+#define FUTEX_PRIVATE 0x00
+#define FUTEX_SHARED  0x80              /* Address is in shared memory */
+#define FUTEX_TIMEDOUT -1
+#define FUTEX_AGAIN   -3                /* *addr already differed from val */
+int futex_wait(volatile uint32_t *addr, uint32_t val, uint32_t timeout_us, int flags);
+int futex_wake(volatile uint32_t *addr, uint32_t count, int flags);
+int futex_requeue(volatile uint32_t *addr, volatile uint32_t *addr2, uint32_t wake,
+                  uint32_t requeue, int flags);
+
+/* CPU timestamp counter */
+static inline uint64_t rdtsc(void)
+{
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 /* Utilities */
 int atoi(const char *s);
 void abort(void);